@@ -107,6 +107,7 @@ struct statx {
 #define lstat64 lstat
 #define fstat64 fstat
 #define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
 #endif
 
 #ifdef __APPLE__
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "firebuild/alt_hasher.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xxhash.h>
+
+#include <cctype>
+#include <cstring>
+
+#include "firebuild/debug.h"
+
+namespace firebuild {
+
+/* singleton */
+AltHasher* alt_hasher = nullptr;
+
+/* Normalizing larger files is likely not worth it. */
+static const off_t kMaxNormalizedFileSize = 16 * 1024 * 1024;
+
+static bool is_ident_char(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+/**
+ * Blanks out the comments in C and C++ sources.
+ *
+ * The characters of the comments are replaced by spaces, except for the tabs and the line breaks,
+ * which are kept. This keeps __LINE__ and the line and column numbers in the diagnostics and the
+ * debug information intact. The string and character literals, including the raw string literals,
+ * are kept as they are.
+ */
+class CSourceNormalizer : public Normalizer {
+ public:
+  const char* name() const override {return "c_source";}
+  uint64_t id() const override {return 3;}
+  void normalize(const char* data, size_t len, std::string* out) const override {
+    size_t i = 0;
+    while (i < len) {
+      const char c = data[i];
+      const char next = i + 1 < len ? data[i + 1] : '\0';
+      if (c == '/' && next == '/') {
+        /* A line comment, which is continued in the next line after a backslash. */
+        size_t end = i + 2;
+        while (end < len && data[end] != '\n') {
+          end += (data[end] == '\\' && end + 1 < len && data[end + 1] == '\n') ? 2 : 1;
+        }
+        blank_out(data + i, end - i, out);
+        i = end;
+      } else if (c == '/' && next == '*') {
+        const char* end = static_cast<const char*>(memmem(data + i + 2, len - i - 2, "*/", 2));
+        const size_t comment_end = end ? end - data + 2 : len;
+        blank_out(data + i, comment_end - i, out);
+        i = comment_end;
+      } else {
+        const size_t literal_end = (c == '"' || c == '\'') ? literal_length(data, len, i) : 0;
+        if (literal_end > 0) {
+          out->append(data + i, literal_end - i);
+          i = literal_end;
+        } else {
+          out->push_back(c);
+          i++;
+        }
+      }
+    }
+  }
+
+ private:
+  /** Append the comment with its characters other than tabs and line breaks replaced by spaces. */
+  static void blank_out(const char* comment, size_t len, std::string* out) {
+    for (size_t i = 0; i < len; i++) {
+      out->push_back(comment[i] == '\t' || comment[i] == '\n' ? comment[i] : ' ');
+    }
+  }
+
+  /**
+   * Find the end of the string or character literal starting with the quote at data[start].
+   * @return the position after the literal, or 0 if the quote does not start a literal
+   */
+  static size_t literal_length(const char* data, size_t len, size_t start) {
+    /* The identifier or number the quote is attached to. */
+    size_t prefix_start = start;
+    while (prefix_start > 0 && (is_ident_char(data[prefix_start - 1])
+                                || data[prefix_start - 1] == '\'')) {
+      prefix_start--;
+    }
+    const std::string prefix(data + prefix_start, start - prefix_start);
+    if (data[start] == '\'' && prefix.size() > 0
+        && isdigit(static_cast<unsigned char>(prefix[0]))) {
+      /* Digit separator, like in 1'000'000. */
+      return 0;
+    }
+    if (data[start] == '"' && (prefix == "R" || prefix == "u8R" || prefix == "uR"
+                               || prefix == "UR" || prefix == "LR")) {
+      /* Raw string literal: R"delimiter( ... )delimiter" */
+      const char* open_paren =
+          static_cast<const char*>(memchr(data + start, '(', std::min(len - start, size_t(18))));
+      if (open_paren) {
+        const std::string terminator =
+            ")" + std::string(data + start + 1, open_paren - data - start - 1) + "\"";
+        const char* end = static_cast<const char*>(
+            memmem(open_paren, data + len - open_paren, terminator.c_str(), terminator.size()));
+        return end ? end - data + terminator.size() : len;
+      }
+    }
+    const char quote = data[start];
+    size_t i = start + 1;
+    while (i < len && data[i] != quote && data[i] != '\n') {
+      i += (data[i] == '\\' && i + 1 < len) ? 2 : 1;
+    }
+    return i < len && data[i] == quote ? i + 1 : i;
+  }
+};
+
+/**
+ * Replaces the dates and times with fixed ones, to let the headers generated with the build's
+ * timestamp match.
+ *
+ * Recognized formats are YYYY-MM-DD, [h]h:mm:ss and __DATE__'s "Mmm dd yyyy".
+ */
+class TimestampNormalizer : public Normalizer {
+ public:
+  const char* name() const override {return "timestamps";}
+  uint64_t id() const override {return 2;}
+  void normalize(const char* data, size_t len, std::string* out) const override {
+    size_t i = 0;
+    while (i < len) {
+      size_t matched = 0;
+      const char* replacement = nullptr;
+      if (i == 0 || !isdigit(static_cast<unsigned char>(data[i - 1]))) {
+        if ((matched = match(data, len, i, "dddd-dd-dd"))) {
+          replacement = "1970-01-01";
+        } else if ((matched = match(data, len, i, "dd:dd:dd"))
+                   || (matched = match(data, len, i, "d:dd:dd"))) {
+          replacement = "00:00:00";
+        } else if ((matched = match_c_date(data, len, i))) {
+          replacement = "Jan  1 1970";
+        }
+      }
+      if (matched) {
+        out->append(replacement);
+        i += matched;
+      } else {
+        out->push_back(data[i++]);
+      }
+    }
+  }
+
+ private:
+  /**
+   * Match a pattern where 'd' stands for a digit, not followed by an other digit.
+   * @return the length of the match or 0
+   */
+  static size_t match(const char* data, size_t len, size_t start, const char* pattern) {
+    const size_t pattern_len = strlen(pattern);
+    if (len - start < pattern_len) {
+      return 0;
+    }
+    for (size_t j = 0; j < pattern_len; j++) {
+      const char c = data[start + j];
+      if (pattern[j] == 'd' ? !isdigit(static_cast<unsigned char>(c)) : c != pattern[j]) {
+        return 0;
+      }
+    }
+    if (start + pattern_len < len
+        && isdigit(static_cast<unsigned char>(data[start + pattern_len]))) {
+      return 0;
+    }
+    return pattern_len;
+  }
+  static size_t match_c_date(const char* data, size_t len, size_t start) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (len - start < 11 || (start > 0 && is_ident_char(data[start - 1]))) {
+      return 0;
+    }
+    for (size_t m = 0; m < 12; m++) {
+      if (memcmp(data + start, months + 3 * m, 3) == 0) {
+        return (data[start + 3] == ' '
+                && (data[start + 4] == ' ' || isdigit(static_cast<unsigned char>(data[start + 4])))
+                && match(data, len, start + 5, "d dddd")) ? 11 : 0;
+      }
+    }
+    return 0;
+  }
+};
+
+static const CSourceNormalizer c_source_normalizer;
+static const TimestampNormalizer timestamp_normalizer;
+static const Normalizer* const kNormalizers[] = {&c_source_normalizer, &timestamp_normalizer};
+
+AltHasher::AltHasher(const libconfig::Setting& normalizers_cfg) {
+  for (int i = 0; i < normalizers_cfg.getLength(); i++) {
+    const libconfig::Setting& suffixes_cfg = normalizers_cfg[i];
+    const Normalizer* normalizer = nullptr;
+    for (const Normalizer* candidate : kNormalizers) {
+      if (strcmp(candidate->name(), suffixes_cfg.getName()) == 0) {
+        normalizer = candidate;
+      }
+    }
+    if (!normalizer) {
+      fb_error(std::string("Unknown normalizer in alt_hash_normalizers: ")
+               + suffixes_cfg.getName());
+      continue;
+    }
+    for (int j = 0; j < suffixes_cfg.getLength(); j++) {
+      suffixes_.emplace_back(suffixes_cfg[j].c_str(), normalizer);
+    }
+  }
+}
+
+const Normalizer* AltHasher::find_normalizer(const FileName* path) const {
+  for (const auto& [suffix, normalizer] : suffixes_) {
+    if (path->length() >= suffix.length()
+        && memcmp(path->c_str() + path->length() - suffix.length(), suffix.c_str(),
+                  suffix.length()) == 0) {
+      return normalizer;
+    }
+  }
+  return nullptr;
+}
+
+bool AltHasher::get_alt_hash(const FileName* path, const Hash& hash, Hash* alt_hash_out) {
+  const Normalizer* normalizer = find_normalizer(path);
+  if (!normalizer) {
+    return false;
+  }
+  auto it = alt_hashes_.find(path);
+  if (it != alt_hashes_.end() && it->second.first == hash) {
+    *alt_hash_out = it->second.second;
+    return true;
+  }
+
+  int fd = open(path->c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat64 st;
+  if (fstat64(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > kMaxNormalizedFileSize) {
+    close(fd);
+    return false;
+  }
+  std::string content(st.st_size, '\0');
+  size_t content_len = 0;
+  ssize_t ret;
+  while (content_len < content.size()
+         && (ret = fb_read(fd, content.data() + content_len, content.size() - content_len)) > 0) {
+    content_len += ret;
+  }
+  close(fd);
+  content.resize(content_len);
+
+  /* Normalize only the content the expected hash belongs to. */
+  Hash content_hash;
+  content_hash.set_from_data(content.data(), content.size());
+  if (content_hash != hash) {
+    FB_DEBUG(FB_DEBUG_HASH, "File changed before computing its alternate hash: " + d(path));
+    return false;
+  }
+  std::string normalized;
+  normalized.reserve(content.size());
+  normalizer->normalize(content.data(), content.size(), &normalized);
+  const Hash alt_hash(XXH3_128bits_withSeed(normalized.data(), normalized.size(),
+                                            normalizer->id()));
+  alt_hashes_[path] = {hash, alt_hash};
+  *alt_hash_out = alt_hash;
+  return true;
+}
+
+}  /* namespace firebuild */
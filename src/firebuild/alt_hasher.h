@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef FIREBUILD_ALT_HASHER_H_
+#define FIREBUILD_ALT_HASHER_H_
+
+#include <libconfig.h++>
+#include <tsl/hopscotch_map.h>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/file_name.h"
+#include "firebuild/hash.h"
+
+namespace firebuild {
+
+/**
+ * A normalizer transforms a file's content to a form that keeps only what matters for the
+ * processes reading it, for example by dropping the comments from C sources.
+ */
+class Normalizer {
+ public:
+  virtual ~Normalizer() {}
+  /** The name used in the configuration. */
+  virtual const char* name() const = 0;
+  /**
+   * Seed of the alternate hashes computed with this normalizer. Must be changed whenever the
+   * normalized form changes, to not match the alternate hashes computed by the previous version.
+   */
+  virtual uint64_t id() const = 0;
+  /** Append the normalized form of the data to out. */
+  virtual void normalize(const char* data, size_t len, std::string* out) const = 0;
+};
+
+/**
+ * Computes the alternate hashes of the inputs, which are the hashes of their normalized content.
+ *
+ * The inputs of a cache entry match the file system when either the hashes or the alternate hashes
+ * of the files match, the latter only for the processes in processes.alt_hash_allow_list, which
+ * are known to not depend on what the normalizers drop. The normalizer applied to a file is
+ * selected by the end of the file's path, as set in the "alt_hash_normalizers" configuration group.
+ */
+class AltHasher {
+ public:
+  explicit AltHasher(const libconfig::Setting& normalizers_cfg);
+
+  /**
+   * Compute the alternate hash of a file.
+   *
+   * @param path The file
+   * @param hash The expected hash of the file's content, used for validating the result
+   * @param[out] alt_hash_out The alternate hash
+   * @return Whether succeeded, i.e. a normalizer is configured for the file and the file's content
+   *         still matches hash
+   */
+  bool get_alt_hash(const FileName* path, const Hash& hash, Hash* alt_hash_out);
+
+ private:
+  const Normalizer* find_normalizer(const FileName* path) const;
+
+  /** Path suffixes and the normalizers to use for them, in the order of the configuration. */
+  std::vector<std::pair<std::string, const Normalizer*>> suffixes_ {};
+  /** Already computed alternate hashes with the hash of the content they were computed from. */
+  tsl::hopscotch_map<const FileName*, std::pair<Hash, Hash>> alt_hashes_ {};
+  DISALLOW_COPY_AND_ASSIGN(AltHasher);
+};
+
+/* singleton, or nullptr when no normalizer is configured */
+extern AltHasher* alt_hasher;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_ALT_HASHER_H_
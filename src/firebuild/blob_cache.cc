@@ -40,6 +40,8 @@
 #include "firebuild/debug.h"
 #include "firebuild/file_name.h"
 #include "firebuild/hash.h"
+#include "firebuild/metrics.h"
+#include "firebuild/trace_events.h"
 #include "firebuild/utils.h"
 
 namespace firebuild {
@@ -47,14 +49,69 @@ namespace firebuild {
 /* singleton */
 BlobCache *blob_cache;
 
-BlobCache::BlobCache(const std::string &base_dir) : base_dir_(base_dir) {
+BlobCache::BlobCache(const std::string &base_dir) : base_dir_(base_dir), blksize_(0) {
   mkdir(base_dir_.c_str(), 0700);
+  struct stat64 st;
+  if (stat64(base_dir_.c_str(), &st) == 0) {
+    blksize_ = st.st_blksize;
+  }
 }
 
+#ifdef __linux__
+/*
+ * Share the extents of the source file's range with the destination file using FICLONERANGE.
+ *
+ * FICLONERANGE needs block aligned offsets on both sides, and a block aligned length unless the
+ * range ends at the source's EOF. If the two offsets are congruent modulo the block size the
+ * unaligned head is copied byte by byte, the rest is cloned. If cloning up to EOF is refused the
+ * aligned part is cloned and the tail is left for the caller.
+ *
+ * The offsets and the remaining length are advanced by the number of bytes transferred, so the
+ * caller can complete the copy with copy_file_range() regardless of the outcome.
+ */
+static void clone_file_range(int fd_src, loff_t *src_off, int fd_dst, loff_t *dst_off,
+                             off_t *len, blksize_t blksize) {
+  if (blksize <= 0) {
+    blksize = 4096;
+  }
+  if (*len < blksize || *src_off % blksize != *dst_off % blksize) {
+    /* Cloning is not possible or not worth it. */
+    return;
+  }
+
+  const off_t head_len = (blksize - *src_off % blksize) % blksize;
+  if (head_len > 0) {
+    if (fb_copy_file_range(fd_src, src_off, fd_dst, dst_off, head_len, 0) != head_len) {
+      return;
+    }
+    *len -= head_len;
+  }
+
+  struct file_clone_range range;
+  range.src_fd = fd_src;
+  range.src_offset = *src_off;
+  range.src_length = *len;
+  range.dest_offset = *dst_off;
+  if (ioctl(fd_dst, FICLONERANGE, &range) == -1) {
+    /* The unaligned tail may be rejected, try again without it. */
+    range.src_length = *len - *len % blksize;
+    if (range.src_length == 0 || range.src_length == static_cast<uint64_t>(*len)
+        || ioctl(fd_dst, FICLONERANGE, &range) == -1) {
+      return;
+    }
+  }
+  /* The destination is extended by FICLONERANGE, but the file offset is not moved. */
+  *src_off += range.src_length;
+  *dst_off += range.src_length;
+  *len -= range.src_length;
+}
+#endif
+
 /*
  * Copy the contents from an open file descriptor to another,
  * preferring advanced technologies like copy on write.
- * Might skip the beginning of the input file.
+ * Might skip the beginning of the input file, in which case the block aligned part is still
+ * shared with the source when the file system supports it.
  * Might append to the target file instead of replacing its contents. O_APPEND should _not_ be set
  * on fd_dst because then the fast copy_file_range() method doesn't work.
  */
@@ -70,12 +127,10 @@ static bool copy_file(int fd_src, loff_t src_skip_bytes, int fd_dst, bool append
       /* CoW succeeded. Moo! */
       return true;
     }
-  } else {
-    // FIXME try FICLONERANGE
   }
 
-  /* Try copy_file_range(). Gotta get the source file's size, and in append mode also the
-   * destination file's size */
+  /* Try FICLONERANGE, then copy_file_range() for the rest. Gotta get the source file's size, and
+   * in append mode also the destination file's size */
   struct stat64 src_st_local;
   if (!src_stat_ptr && fstat64(fd_src, &src_st_local) == -1) {
     fb_perror("fstat");
@@ -105,6 +160,16 @@ static bool copy_file(int fd_src, loff_t src_skip_bytes, int fd_dst, bool append
 
   off_t len = src_st->st_size >= src_skip_bytes ? src_st->st_size - src_skip_bytes : 0;
   loff_t dst_skip_bytes = append ? dst_st->st_size : 0;
+#ifdef __linux__
+  if (src_skip_bytes != 0 || append) {
+    clone_file_range(fd_src, &src_skip_bytes, fd_dst, &dst_skip_bytes, &len,
+                     src_st->st_blksize);
+    if (len == 0) {
+      /* CoW succeeded. Moo! */
+      return true;
+    }
+  }
+#endif
   return fb_copy_file_range(fd_src, &src_skip_bytes, fd_dst, &dst_skip_bytes, len, 0) == len;
 }
 
@@ -155,6 +220,8 @@ bool BlobCache::store_file(const FileName *path,
                            Hash *key_out) {
   TRACK(FB_DEBUG_CACHING, "path=%s, max_writers=%d, fd_src=%d, skip=%" PRIloff ", size=%" PRIloff,
       D(path), max_writers, fd_src, src_skip_bytes, size);
+  TraceSpan span("blob store");
+  OpTimer timer(Metrics::OP_BLOB_STORE);
 
   FB_DEBUG(FB_DEBUG_CACHING, "BlobCache: storing blob " + d(path));
 
@@ -176,10 +243,12 @@ bool BlobCache::store_file(const FileName *path,
   }
 
   /* In order to save an fstat64() call in copy_file() and set_from_fd(), create a "fake" stat
-   * result here. We know it's a regular file, we know its size, and the rest are irrelevant. */
-  struct stat64 src_st;
+   * result here. We know it's a regular file, we know its size, and the destination's block size
+   * is the one that matters for cloning. The rest are irrelevant. */
+  struct stat64 src_st {};
   src_st.st_mode = S_IFREG;
   src_st.st_size = size;
+  src_st.st_blksize = blksize_;
 
   /* Copy the file to a temporary one under the cache */
   char *tmpfile;
@@ -442,6 +511,8 @@ bool BlobCache::retrieve_file(int blob_fd,
                               bool append,
                               bool decompress) {
   TRACK(FB_DEBUG_CACHING, "blob_fd=%d, path_dst=%s, append=%s", blob_fd, D(path_dst), D(append));
+  TraceSpan span("blob retrieve");
+  OpTimer timer(Metrics::OP_BLOB_RETRIEVE);
 
   int flags = append ? O_WRONLY : (O_WRONLY|O_CREAT|O_TRUNC);
   int fd_dst = open(path_dst->c_str(), flags, 0666);
@@ -497,6 +568,20 @@ int BlobCache::get_fd_for_file(const Hash &key) {
   return open(path_src, O_RDONLY);
 }
 
+void BlobCache::prefetch(const Hash &key) {
+  char* path = reinterpret_cast<char*>(alloca(base_dir_.length() + kBlobCachePathLength + 1));
+  construct_cached_file_name(base_dir_, key, false, path);
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+  close(fd);
+}
+
 void BlobCache::delete_entries(const std::string& path,
                                const std::vector<std::string>& entries,
                                const std::string& debug_postfix,
@@ -111,6 +111,11 @@ class BlobCache {
    * @return A read-only fd, or -1
    */
   int get_fd_for_file(const Hash &key);
+  /**
+   * Ask the kernel to read the blob into the page cache in the background.
+   * Missing blobs are silently ignored. Thread safe.
+   */
+  void prefetch(const Hash &key);
   /**
    * Garbage collect the blob cache
    * @param referenced_blobs blobs referenced from the object cache, they won't be deleted
@@ -150,6 +155,8 @@ class BlobCache {
                          off_t* unexpected_file_bytes);
   /* Including the "blobs" subdir. */
   std::string base_dir_;
+  /* Block size of the cache's file system, for aligning the cloned ranges. */
+  blksize_t blksize_;
   static constexpr char kDebugPostfix[] = "_debug.txt";
 };
 
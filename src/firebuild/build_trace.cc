@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/build_trace.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+
+#include "firebuild/blob_cache.h"
+#include "firebuild/debug.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/fbbstore.h"
+#include "firebuild/obj_cache.h"
+
+namespace firebuild {
+
+/* singleton */
+BuildTrace *build_trace = nullptr;
+
+static const char kTraceMagic[8] = {'F', 'B', 'T', 'R', 'A', 'C', 'E', '1'};
+/* Don't let the prefetcher run too far ahead to not evict the pages from the page cache that are
+ * still to be used. */
+static const size_t kPrefetchWindow = 64;
+/* Limit the trace size for extremely large builds. */
+static const size_t kMaxTraceEntries = 256 * 1024;
+
+BuildTrace::BuildTrace(const std::string &base_dir, const Hash &project_key)
+    : base_dir_(base_dir), path_(base_dir + "/" + project_key.to_ascii()) {
+  mkdir(base_dir_.c_str(), 0700);
+  load();
+}
+
+BuildTrace::~BuildTrace() {
+  stop_prefetching();
+}
+
+void BuildTrace::load() {
+  FILE* f = fopen(path_.c_str(), "r");
+  if (!f) {
+    return;
+  }
+  char magic[sizeof(kTraceMagic)];
+  if (fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, kTraceMagic, sizeof(magic)) == 0) {
+    Entry entry;
+    while (prev_entries_.size() < kMaxTraceEntries && fread(&entry, sizeof(entry), 1, f) == 1) {
+      entry.subkey[Subkey::kAsciiLength] = '\0';
+      if (!Subkey::valid_ascii(entry.subkey)) {
+        break;
+      }
+      prev_positions_.emplace(Hash(entry.fingerprint), prev_entries_.size());
+      prev_entries_.push_back(entry);
+    }
+  }
+  fclose(f);
+  FB_DEBUG(FB_DEBUG_CACHING, "Loaded build trace with " + d(prev_entries_.size()) + " entries");
+}
+
+void BuildTrace::start_prefetching() {
+  if (prev_entries_.empty() || prefetcher_.joinable()) {
+    return;
+  }
+  prefetcher_ = std::thread(&BuildTrace::prefetch_entries, this);
+}
+
+void BuildTrace::stop_prefetching() {
+  if (!prefetcher_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  prefetcher_.join();
+}
+
+void BuildTrace::seen(const Hash &fingerprint) {
+  if (!prefetcher_.joinable()) {
+    return;
+  }
+  auto it = prev_positions_.find(fingerprint);
+  if (it == prev_positions_.end()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (it->second + 1 <= seen_pos_) {
+      return;
+    }
+    seen_pos_ = it->second + 1;
+  }
+  cond_.notify_one();
+}
+
+void BuildTrace::record(const Hash &fingerprint, const Subkey &subkey) {
+  if (entries_.size() >= kMaxTraceEntries || !recorded_fingerprints_.insert(fingerprint).second) {
+    return;
+  }
+  Entry entry;
+  entry.fingerprint = fingerprint.get();
+  memcpy(entry.subkey, subkey.c_str(), sizeof(entry.subkey));
+  entries_.push_back(entry);
+}
+
+void BuildTrace::save() {
+  if (entries_.empty()) {
+    return;
+  }
+  const std::string tmp_path = path_ + "." + std::to_string(getpid());
+  FILE* f = fopen(tmp_path.c_str(), "w");
+  if (!f) {
+    fb_perror("Failed saving build trace");
+    return;
+  }
+  bool success = fwrite(kTraceMagic, sizeof(kTraceMagic), 1, f) == 1
+      && fwrite(entries_.data(), sizeof(Entry), entries_.size(), f) == entries_.size();
+  if (fclose(f) != 0 || !success
+      || !execed_process_cacher->replace_metadata_file(tmp_path, path_)) {
+    fb_perror("Failed saving build trace");
+    unlink(tmp_path.c_str());
+  }
+}
+
+bool BuildTrace::has_cached_entry(const std::string &path) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  bool ret = false;
+  char magic[sizeof(kTraceMagic)];
+  if (fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, kTraceMagic, sizeof(magic)) == 0) {
+    Entry entry;
+    while (!ret && fread(&entry, sizeof(entry), 1, f) == 1) {
+      entry.subkey[Subkey::kAsciiLength] = '\0';
+      if (!Subkey::valid_ascii(entry.subkey)) {
+        break;
+      }
+      ret = obj_cache->contains(Hash(entry.fingerprint), entry.subkey);
+    }
+  }
+  fclose(f);
+  return ret;
+}
+
+void BuildTrace::prefetch_entries() {
+  for (size_t i = 0; i < prev_entries_.size(); i++) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this, i] { return stop_ || i < seen_pos_ + kPrefetchWindow; });
+      if (stop_) {
+        return;
+      }
+    }
+    prefetch_entry(prev_entries_[i]);
+  }
+}
+
+/**
+ * Read the cache entry and the blobs it references into the page cache.
+ *
+ * This runs on the prefetcher thread, thus it must not touch the FileName db or the hash cache.
+ */
+void BuildTrace::prefetch_entry(const Entry &entry) {
+  uint8_t *entry_buf;
+  size_t entry_len;
+  bool munmap_entry = false;
+  if (!obj_cache->prefetch(Hash(entry.fingerprint), entry.subkey, &entry_buf, &entry_len,
+                           &munmap_entry)) {
+    return;
+  }
+  auto inouts_fbb = reinterpret_cast<const FBBSTORE_Serialized *>(entry_buf);
+  if (inouts_fbb->get_tag() == FBBSTORE_TAG_process_inputs_outputs) {
+    auto inouts =
+        reinterpret_cast<const FBBSTORE_Serialized_process_inputs_outputs *>(inouts_fbb);
+    auto outputs =
+        reinterpret_cast<const FBBSTORE_Serialized_process_outputs *>(inouts->get_outputs());
+    for (size_t i = 0; i < outputs->get_path_isreg_count(); i++) {
+      auto file =
+          reinterpret_cast<const FBBSTORE_Serialized_file *>(outputs->get_path_isreg_at(i));
+      if (file->get_type() == ISREG && file->get_inline_data_count() == 0 && file->has_hash()) {
+        blob_cache->prefetch(Hash(file->has_compressed_hash() ? file->get_compressed_hash()
+                                  : file->get_hash()));
+      }
+    }
+    for (size_t i = 0; i < outputs->get_append_to_fd_count(); i++) {
+      auto append_to_fd = reinterpret_cast<const FBBSTORE_Serialized_append_to_fd *>
+          (outputs->get_append_to_fd_at(i));
+      if (append_to_fd->get_inline_data_count() == 0 && append_to_fd->has_hash()) {
+        blob_cache->prefetch(Hash(append_to_fd->has_compressed_hash()
+                                  ? append_to_fd->get_compressed_hash()
+                                  : append_to_fd->get_hash()));
+      }
+    }
+  }
+  ObjCache::free_entry(entry_buf, entry_len, munmap_entry);
+}
+
+}  /* namespace firebuild */
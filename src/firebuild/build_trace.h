@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_BUILD_TRACE_H_
+#define FIREBUILD_BUILD_TRACE_H_
+
+#include <tsl/hopscotch_map.h>
+#include <tsl/hopscotch_set.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/hash.h"
+#include "firebuild/subkey.h"
+
+namespace firebuild {
+
+/**
+ * The build trace is the sequence of the cache entries a build used or created, in the order the
+ * processes showed up.
+ *
+ * Builds are repetitive, the same processes run in the same order every time. The trace of the
+ * previous run of the same build command (the "project") is used to read the upcoming cache
+ * entries and the referenced blobs into the page cache on a background thread, ahead of the
+ * supervisor looking them up.
+ *
+ * The traces are stored in the "traces" directory of the cache, named after the hash of the
+ * build command and its working directory.
+ */
+class BuildTrace {
+ public:
+  BuildTrace(const std::string &base_dir, const Hash &project_key);
+  ~BuildTrace();
+
+  /** Start the background thread prefetching the entries of the previous run's trace. */
+  void start_prefetching();
+  /** Stop and wait for the prefetching thread. */
+  void stop_prefetching();
+  /**
+   * Report that a process with the given fingerprint showed up, letting the prefetcher continue
+   * with the entries after it.
+   */
+  void seen(const Hash &fingerprint);
+  /** Record the cache entry used or created by a process for the next run. */
+  void record(const Hash &fingerprint, const Subkey &subkey);
+  /** Save the trace of the current run, replacing the previous one. */
+  void save();
+  /** Whether gc should keep the saved trace, i.e. any of its entries is still in the cache. */
+  static bool has_cached_entry(const std::string &path);
+
+ private:
+  struct Entry {
+    XXH128_hash_t fingerprint;
+    char subkey[Subkey::kAsciiLength + 1];
+  };
+  void load();
+  void prefetch_entries();
+  void prefetch_entry(const Entry &entry);
+
+  std::string base_dir_;
+  std::string path_;
+  /** The previous run's trace, read-only after load(). */
+  std::vector<Entry> prev_entries_ {};
+  /** The first position of each fingerprint in prev_entries_. */
+  tsl::hopscotch_map<Hash, size_t> prev_positions_ {};
+  /** The current run's trace. */
+  std::vector<Entry> entries_ {};
+  tsl::hopscotch_set<Hash> recorded_fingerprints_ {};
+
+  std::thread prefetcher_ {};
+  std::mutex mutex_ {};
+  std::condition_variable cond_ {};
+  /* The position after the last seen entry of prev_entries_, guarded by mutex_. */
+  size_t seen_pos_ {0};
+  bool stop_ {false};
+  DISALLOW_COPY_AND_ASSIGN(BuildTrace);
+};
+
+/* singleton, or nullptr when prefetching is disabled */
+extern BuildTrace *build_trace;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_BUILD_TRACE_H_
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "firebuild/caching_policy.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "firebuild/debug.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/hash.h"
+
+namespace firebuild {
+
+/* singleton */
+CachingPolicy *caching_policy = nullptr;
+
+static const char kStatsMagic[8] = {'F', 'B', 'P', 'O', 'L', 'I', 'C', '3'};
+/* Don't decide based on fewer events than this. */
+static const uint32_t kMinSamples = 8;
+/* Don't conclude that the entries are not used based on fewer builds than this, since the first
+ * build of a project only stores them. */
+static const uint32_t kMinRuns = 3;
+/* Handle the process normally after this many decisions against caching it. */
+static const uint32_t kExploreInterval = 16;
+/* The statistics of executables that did not run for this long are removed by gc. */
+static const time_t kMaxUnusedSeconds = 30 * 24 * 3600;
+/* Halve the statistics when they reach this many events. */
+static const uint32_t kMaxSamples = 1024;
+/* Don't store the entries taking more bytes than this for each millisecond of CPU time the hits
+ * saved. */
+static const int64_t kMaxStoredBytesPerSavedMs = 1024 * 1024;
+
+CachingPolicy::CachingPolicy(const std::string& base_dir) : base_dir_(base_dir) {}
+
+CachingPolicy::Key CachingPolicy::key(const ExecedProcess* proc) {
+  const ExecedProcess* parent = proc->parent_exec_point();
+  return {proc->executable(), parent ? parent->executable() : nullptr};
+}
+
+std::string CachingPolicy::path(const Key& key, bool create_dirs) const {
+  std::string names(key.first->c_str(), key.first->length());
+  if (key.second) {
+    /* Separate the names with a character that can't be part of them. */
+    names += '\0';
+    names.append(key.second->c_str(), key.second->length());
+  }
+  Hash hash;
+  hash.set_from_data(names.data(), names.size());
+  const std::string ascii = hash.to_ascii();
+  const std::string dir = base_dir_ + "/" + ascii[0];
+  if (create_dirs) {
+    mkdir(base_dir_.c_str(), 0700);
+    mkdir(dir.c_str(), 0700);
+  }
+  return dir + "/" + ascii;
+}
+
+bool CachingPolicy::load(const Key& key, Stats* stats) const {
+  FILE* f = fopen(path(key, false).c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  char magic[sizeof(kStatsMagic)];
+  const bool ret = fread(magic, sizeof(magic), 1, f) == 1
+      && memcmp(magic, kStatsMagic, sizeof(magic)) == 0
+      && fread(stats, sizeof(*stats), 1, f) == 1;
+  fclose(f);
+  return ret;
+}
+
+CachingPolicy::Entry& CachingPolicy::get(const ExecedProcess* proc) {
+  const Key proc_key = key(proc);
+  auto it = entries_.find(proc_key);
+  if (it == entries_.end()) {
+    Entry entry {};
+    if (!load(proc_key, &entry.prev)) {
+      entry.prev = {};
+    }
+    entry.stats = entry.prev;
+    it = entries_.emplace(proc_key, entry).first;
+  }
+  return it.value();
+}
+
+void CachingPolicy::maybe_decay(Stats* stats) {
+  if (stats->stores + stats->hits + stats->misses < kMaxSamples) {
+    return;
+  }
+  stats->stores /= 2;
+  stats->hits /= 2;
+  stats->misses /= 2;
+  stats->stored_bytes /= 2;
+  stats->store_ns /= 2;
+  stats->saved_cpu_time_ms /= 2;
+  stats->shortcut_ns /= 2;
+  stats->lookup_ns /= 2;
+}
+
+bool CachingPolicy::skip(Entry* entry, uint32_t* skipped) {
+  entry->dirty = true;
+  if (++*skipped >= kExploreInterval) {
+    *skipped = 0;
+    return false;
+  }
+  return true;
+}
+
+bool CachingPolicy::worth_shortcutting(const ExecedProcess* proc) {
+  Entry& entry = get(proc);
+  const Stats& stats = entry.prev;
+  const int64_t saved_ms = stats.saved_cpu_time_ms, shortcut_ms = stats.shortcut_ns / 1000000;
+  const char* reason = nullptr;
+  if (stats.hits == 0 && stats.runs >= kMinRuns && stats.misses >= kMinSamples * 4) {
+    reason = "the entries never match";
+  } else if (stats.hits >= kMinSamples && shortcut_ms >= saved_ms) {
+    reason = "running it is faster";
+  } else if (stats.hits >= kMinSamples && stats.misses >= kMinSamples
+             && stats.lookup_ns / 1000000 >= saved_ms - shortcut_ms) {
+    reason = "the failed lookups take more time than the hits save";
+  }
+  if (!reason || !skip(&entry, &entry.stats.skipped)) {
+    return true;
+  }
+  FB_DEBUG(FB_DEBUG_CACHING, "Not shortcutting " + d(proc->executable()) + ", " + reason);
+  return false;
+}
+
+bool CachingPolicy::worth_storing(const ExecedProcess* proc) {
+  Entry& entry = get(proc);
+  const Stats& stats = entry.prev;
+  if (stats.runs < kMinRuns || stats.stores < kMinSamples
+      || stats.stored_bytes <= stats.saved_cpu_time_ms * kMaxStoredBytesPerSavedMs
+      || !skip(&entry, &entry.stats.store_skipped)) {
+    return true;
+  }
+  FB_DEBUG(FB_DEBUG_CACHING, "Not storing " + d(proc->executable())
+           + ", the entries take more space than the hits save");
+  return false;
+}
+
+void CachingPolicy::stored(const ExecedProcess* proc, off_t bytes, int64_t store_ns) {
+  Entry& entry = get(proc);
+  entry.stats.stores++;
+  entry.stats.stored_bytes += bytes;
+  entry.stats.store_ns += store_ns;
+  maybe_decay(&entry.stats);
+  entry.dirty = true;
+}
+
+void CachingPolicy::shortcut(const ExecedProcess* proc, int64_t cpu_time_ms, int64_t shortcut_ns) {
+  Entry& entry = get(proc);
+  entry.stats.hits++;
+  entry.stats.saved_cpu_time_ms += cpu_time_ms;
+  entry.stats.shortcut_ns += shortcut_ns;
+  maybe_decay(&entry.stats);
+  entry.dirty = true;
+}
+
+void CachingPolicy::missed(const ExecedProcess* proc, int64_t lookup_ns) {
+  Entry& entry = get(proc);
+  entry.stats.misses++;
+  entry.stats.lookup_ns += lookup_ns;
+  maybe_decay(&entry.stats);
+  entry.dirty = true;
+}
+
+bool CachingPolicy::is_stats_file_current(const std::string& path, time_t now) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  struct stat st;
+  char magic[sizeof(kStatsMagic)];
+  const bool ret = fstat(fileno(f), &st) == 0 && now - st.st_mtime < kMaxUnusedSeconds
+      && fread(magic, sizeof(magic), 1, f) == 1
+      && memcmp(magic, kStatsMagic, sizeof(magic)) == 0;
+  fclose(f);
+  return ret;
+}
+
+void CachingPolicy::save() {
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (!it->second.dirty) {
+      continue;
+    }
+    Stats& stats = it.value().stats;
+    stats.runs++;
+    const std::string stats_path = path(it->first, true);
+    const std::string tmp_path = stats_path + "." + std::to_string(getpid());
+    FILE* f = fopen(tmp_path.c_str(), "w");
+    if (!f) {
+      fb_perror("Failed saving caching statistics");
+      return;
+    }
+    bool success = fwrite(kStatsMagic, sizeof(kStatsMagic), 1, f) == 1
+        && fwrite(&stats, sizeof(Stats), 1, f) == 1;
+    if (fclose(f) != 0 || !success
+        || !execed_process_cacher->replace_metadata_file(tmp_path, stats_path)) {
+      fb_perror("Failed saving caching statistics");
+      unlink(tmp_path.c_str());
+    }
+    it.value().dirty = false;
+  }
+}
+
+}  /* namespace firebuild */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef FIREBUILD_CACHING_POLICY_H_
+#define FIREBUILD_CACHING_POLICY_H_
+
+#include <sys/types.h>
+#include <time.h>
+#include <tsl/hopscotch_map.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/execed_process.h"
+#include "firebuild/file_name.h"
+
+namespace firebuild {
+
+/**
+ * Decides whether looking up and storing a process in the cache is worth it, based on how the cache
+ * served the processes of the same executable, started by the same parent executable, in the
+ * previous runs.
+ *
+ * For each such pair of executables it is recorded how many bytes the stored entries took, how
+ * often they were used, the CPU time the hits saved, the time spent replaying the hits and the time
+ * spent on the lookups that did not find a usable entry. The processes whose entries never match,
+ * or which are faster to run than to shortcut, are not looked up, but they are still fingerprinted
+ * and stored, so the statistics can tell when they become worth shortcutting again. The processes
+ * whose entries take more space than the CPU time their hits save justifies are not stored.
+ * Every few decisions the process is handled normally anyway.
+ *
+ * The statistics are stored in the "policy" directory of the cache, one file per executable pair.
+ */
+class CachingPolicy {
+ public:
+  explicit CachingPolicy(const std::string& base_dir);
+
+  /** Whether looking up and replaying the cache entries of the process is expected to pay off. */
+  bool worth_shortcutting(const ExecedProcess* proc);
+  /** Whether storing the process is expected to pay off for the cache space it takes. */
+  bool worth_storing(const ExecedProcess* proc);
+  /** Record that the process was stored, taking bytes of blobs in store_ns time. */
+  void stored(const ExecedProcess* proc, off_t bytes, int64_t store_ns);
+  /** Record that the process was shortcut saving cpu_time_ms, taking shortcut_ns time. */
+  void shortcut(const ExecedProcess* proc, int64_t cpu_time_ms, int64_t shortcut_ns);
+  /** Record that no usable cache entry was found for the process in lookup_ns time. */
+  void missed(const ExecedProcess* proc, int64_t lookup_ns);
+
+  /** Save the statistics changed in this run. */
+  void save();
+  /**
+   * Whether gc should keep the saved statistics, i.e. they are in the current format and the
+   * executables ran recently.
+   */
+  static bool is_stats_file_current(const std::string& path, time_t now);
+
+ private:
+  struct Stats {
+    /** Number of builds the executable was run in. */
+    uint32_t runs;
+    uint32_t stores;
+    uint32_t hits;
+    uint32_t misses;
+    /** Decisions against looking up since the last time the process was looked up. */
+    uint32_t skipped;
+    /** Decisions against storing since the last time the process was stored. */
+    uint32_t store_skipped;
+    int64_t stored_bytes;
+    int64_t store_ns;
+    int64_t saved_cpu_time_ms;
+    /** Time spent on looking up and applying the entries for the hits. */
+    int64_t shortcut_ns;
+    /** Time spent on the lookups for the misses. */
+    int64_t lookup_ns;
+  };
+  /**
+   * The process' executable and its parent's executable, or nullptr for the root process.
+   * FileNames are unique, thus they can be compared and hashed by their address.
+   */
+  typedef std::pair<const FileName*, const FileName*> Key;
+  struct KeyHasher {
+    size_t operator()(const Key& key) const noexcept {
+      return std::hash<const FileName*>()(key.first) * 31
+          + std::hash<const FileName*>()(key.second);
+    }
+  };
+  struct Entry {
+    /** The statistics of the previous runs, the decisions are based on these. */
+    Stats prev;
+    /** The statistics including this run. */
+    Stats stats;
+    bool dirty;
+  };
+  static Key key(const ExecedProcess* proc);
+  Entry& get(const ExecedProcess* proc);
+  bool load(const Key& key, Stats* stats) const;
+  std::string path(const Key& key, bool create_dirs) const;
+  /** Let the older runs count less, and keep the counters from overflowing. */
+  static void maybe_decay(Stats* stats);
+  /**
+   * Apply a decision against looking up or storing, but not every time, to keep collecting
+   * statistics.
+   * @param skipped the counter of the previous decisions of the same kind
+   * @return whether to skip looking up or storing the process
+   */
+  static bool skip(Entry* entry, uint32_t* skipped);
+
+  std::string base_dir_;
+  tsl::hopscotch_map<Key, Entry, KeyHasher> entries_ {};
+  DISALLOW_COPY_AND_ASSIGN(CachingPolicy);
+};
+
+/* singleton, or nullptr when adaptive caching is disabled */
+extern CachingPolicy *caching_policy;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_CACHING_POLICY_H_
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/change_journal.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <xxhash.h>
+
+#include <algorithm>
+#include <string>
+
+#include "firebuild/debug.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+ChangeJournal *change_journal = nullptr;
+
+static const size_t kSlotCount = 1 << 20;
+/* Keep the probe sequences short. */
+static const size_t kMaxUsedSlots = kSlotCount / 4 * 3;
+static const size_t kHeaderSize = 64;
+static const uint64_t kNotWatched = UINT64_MAX;
+
+#ifdef __linux__
+static const uint32_t kEntryChangeEvents = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+static const uint32_t kSelfGoneEvents = IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_IGNORED;
+static const uint32_t kWatchMask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | kEntryChangeEvents
+    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+#endif
+
+static XXH128_hash_t dir_key(const char *dir, size_t len) {
+  XXH128_hash_t key = XXH3_128bits(dir, len);
+  if (key.low64 == 0) {
+    key.low64 = 1;
+  }
+  return key;
+}
+
+/** Length of the path's parent directory's prefix, or 0 if it has no parent. */
+static size_t parent_len(const char *path, size_t len) {
+  if (len <= 1) {
+    return 0;
+  }
+  size_t slash = len - 1;
+  while (slash > 0 && path[slash] != '/') {
+    slash--;
+  }
+  if (path[slash] != '/') {
+    return 0;
+  }
+  return slash == 0 ? 1 : slash;
+}
+
+ChangeJournal::ChangeJournal(int inotify_fd, void *shared, size_t shared_size)
+    : inotify_fd_(inotify_fd), shared_(shared), shared_size_(shared_size),
+      header_(reinterpret_cast<Header *>(shared)),
+      slots_(reinterpret_cast<Slot *>(static_cast<char *>(shared) + kHeaderSize)) {
+  static_assert(sizeof(Header) <= kHeaderSize);
+  /* The memory is zeroed, thus all slots are empty. The instance id tells apart the sequence
+   * numbers of different daemons. */
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  header_->instance_id = ((static_cast<uint64_t>(now.tv_sec) << 32) ^ now.tv_nsec
+                          ^ (static_cast<uint64_t>(getpid()) << 12)) | 1;
+}
+
+ChangeJournal::~ChangeJournal() {
+  if (inotify_fd_ != -1) {
+    close(inotify_fd_);
+  }
+  for (int fd : client_fds_) {
+    close(fd);
+  }
+  if (fd_ != -1) {
+    close(fd_);
+  }
+  munmap(shared_, shared_size_);
+}
+
+ChangeJournal *ChangeJournal::create() {
+#ifdef __linux__
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1) {
+    fb_perror("inotify_init1");
+    return nullptr;
+  }
+  const size_t size = kHeaderSize + kSlotCount * sizeof(Slot);
+  void *shared = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (shared == MAP_FAILED) {
+    fb_perror("mmap");
+    close(fd);
+    return nullptr;
+  }
+  return new ChangeJournal(fd, shared, size);
+#else
+  return nullptr;
+#endif
+}
+
+const ChangeJournal::Slot *ChangeJournal::find(const char *dir, size_t len) const {
+  const XXH128_hash_t key = dir_key(dir, len);
+  for (size_t i = 0, idx = key.low64 & (kSlotCount - 1); i < kSlotCount;
+       i++, idx = (idx + 1) & (kSlotCount - 1)) {
+    const uint64_t slot_key = slots_[idx].key.load(std::memory_order_acquire);
+    if (slot_key == key.low64) {
+      if (slots_[idx].key_high.load(std::memory_order_relaxed) == key.high64) {
+        return &slots_[idx];
+      }
+    } else if (slot_key == 0) {
+      return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+ChangeJournal::Slot *ChangeJournal::find_or_insert(const char *dir, size_t len) {
+  const XXH128_hash_t key = dir_key(dir, len);
+  for (size_t i = 0, idx = key.low64 & (kSlotCount - 1); i < kSlotCount;
+       i++, idx = (idx + 1) & (kSlotCount - 1)) {
+    const uint64_t slot_key = slots_[idx].key.load(std::memory_order_relaxed);
+    if (slot_key == key.low64) {
+      if (slots_[idx].key_high.load(std::memory_order_relaxed) == key.high64) {
+        return &slots_[idx];
+      }
+    } else if (slot_key == 0) {
+      if (used_slots_ >= kMaxUsedSlots) {
+        return nullptr;
+      }
+      slots_[idx].watched_since.store(kNotWatched);
+      slots_[idx].key_high.store(key.high64, std::memory_order_relaxed);
+      slots_[idx].key.store(key.low64, std::memory_order_release);
+      used_slots_++;
+      return &slots_[idx];
+    }
+  }
+  return nullptr;
+}
+
+int ChangeJournal::add_client() {
+  int fds[2];
+#ifdef __linux__
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+    fb_perror("socketpair");
+    return -1;
+  }
+#else
+  return -1;
+#endif
+  client_fds_.push_back(fds[0]);
+  return fds[1];
+}
+
+void ChangeJournal::process_events() {
+#ifdef __linux__
+  alignas(struct inotify_event) char buf[64 * 1024];
+  ssize_t n;
+  while ((n = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *event = reinterpret_cast<struct inotify_event *>(p);
+      p += sizeof(struct inotify_event) + event->len;
+      const uint64_t seq = header_->seq.fetch_add(1) + 1;
+      if (event->mask & IN_Q_OVERFLOW) {
+        FB_DEBUG(FB_DEBUG_FS, "inotify queue overflowed, forgetting the journal");
+        header_->valid_since.store(seq);
+        continue;
+      }
+      auto it = watches_.find(event->wd);
+      if (it == watches_.end()) {
+        continue;
+      }
+      Slot *slot = it->second;
+      if (event->mask & (kEntryChangeEvents | kSelfGoneEvents)) {
+        slot->entries_changed_at.store(seq);
+      }
+      slot->changed_at.store(seq);
+      if (event->mask & kSelfGoneEvents) {
+        slot->watched_since.store(kNotWatched);
+        if (event->mask & IN_IGNORED) {
+          watches_.erase(it);
+        } else {
+          /* The watch stays on the moved directory, stop following it. */
+          inotify_rm_watch(inotify_fd_, event->wd);
+        }
+      }
+    }
+  }
+#endif
+}
+
+void ChangeJournal::add_watch(const std::string &dir) {
+#ifdef __linux__
+  /* The watches follow the inodes, thus only paths without symlinks can be watched reliably. */
+  char real_path[PATH_MAX];
+  if (!realpath(dir.c_str(), real_path) || dir != real_path) {
+    return;
+  }
+  /* Watch the ancestors, too, to notice when the path starts to refer to another directory. */
+  for (size_t len = dir.length(); len > 0; len = parent_len(dir.c_str(), len)) {
+    Slot *slot = find_or_insert(dir.c_str(), len);
+    if (!slot) {
+      return;
+    }
+    if (slot->watched_since.load() != kNotWatched) {
+      continue;
+    }
+    const int wd = inotify_add_watch(inotify_fd_, dir.substr(0, len).c_str(), kWatchMask);
+    if (wd == -1) {
+      FB_DEBUG(FB_DEBUG_FS, "Could not watch " + dir.substr(0, len) + ": " + strerror(errno));
+      return;
+    }
+    auto it = watches_.find(wd);
+    if (it != watches_.end() && it->second != slot) {
+      /* The same directory is reachable on an other path, too. Stop tracking that one. */
+      it->second->watched_since.store(kNotWatched);
+    }
+    watches_[wd] = slot;
+    slot->watched_since.store(header_->seq.load());
+  }
+#else
+  (void)dir;
+#endif
+}
+
+void ChangeJournal::handle_client_request(int fd) {
+  char buf[PATH_MAX + 1];
+  const ssize_t n = TEMP_FAILURE_RETRY(recv(fd, buf, sizeof(buf), 0));
+  if (n <= 0) {
+    /* The supervisor exited. */
+    close(fd);
+    client_fds_.erase(std::find(client_fds_.begin(), client_fds_.end(), fd));
+    return;
+  }
+  switch (buf[0]) {
+    case 'S': {
+      /* The events of the changes made before the request are already queued. */
+      process_events();
+      const uint64_t seq = header_->seq.load();
+      if (TEMP_FAILURE_RETRY(send(fd, &seq, sizeof(seq), MSG_NOSIGNAL)) != sizeof(seq)) {
+        fb_perror("send");
+      }
+      break;
+    }
+    case 'W':
+      add_watch(std::string(buf + 1, n - 1));
+      break;
+    default:
+      break;
+  }
+}
+
+void ChangeJournal::attach(int fd) {
+  close(inotify_fd_);
+  inotify_fd_ = -1;
+  for (int client_fd : client_fds_) {
+    close(client_fd);
+  }
+  client_fds_.clear();
+  watches_.clear();
+  fd_ = fd;
+}
+
+bool ChangeJournal::sync(uint64_t *seq) {
+  if (fd_ == -1) {
+    return false;
+  }
+  const char request = 'S';
+  if (TEMP_FAILURE_RETRY(send(fd_, &request, sizeof(request), MSG_NOSIGNAL)) != sizeof(request)
+      || TEMP_FAILURE_RETRY(recv(fd_, seq, sizeof(*seq), 0)) != sizeof(*seq)) {
+    /* The daemon is gone. */
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+void ChangeJournal::watch(const char *path, size_t len, bool is_dir) {
+  const size_t dir_len = is_dir ? len : parent_len(path, len);
+  if (fd_ == -1 || dir_len == 0 || dir_len > PATH_MAX) {
+    return;
+  }
+  std::string request("W");
+  request.append(path, dir_len);
+  if (requested_dirs_.insert(request).second) {
+    TEMP_FAILURE_RETRY(send(fd_, request.c_str(), request.length(), MSG_NOSIGNAL));
+  }
+}
+
+bool ChangeJournal::dir_unchanged(const char *dir, size_t len, bool check_entries_only,
+                                  uint64_t seq) const {
+  const Slot *slot = find(dir, len);
+  return slot && slot->watched_since.load() <= seq
+      && (check_entries_only ? slot->entries_changed_at.load() : slot->changed_at.load()) <= seq;
+}
+
+bool ChangeJournal::unchanged_since(const char *path, size_t len, bool is_dir,
+                                    uint64_t seq) const {
+  if (header_->valid_since.load() > seq) {
+    return false;
+  }
+  /* Any change in the directory or among its entries can affect the path. */
+  const size_t dir_len = is_dir ? len : parent_len(path, len);
+  if (dir_len == 0 || !dir_unchanged(path, dir_len, false, seq)) {
+    return false;
+  }
+  /* Only renaming or replacing the ancestors can. */
+  for (size_t ancestor_len = parent_len(path, dir_len); ancestor_len > 0;
+       ancestor_len = parent_len(path, ancestor_len)) {
+    if (!dir_unchanged(path, ancestor_len, true, seq)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  /* namespace firebuild */
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_CHANGE_JOURNAL_H_
+#define FIREBUILD_CHANGE_JOURNAL_H_
+
+#include <stdint.h>
+
+#include <tsl/hopscotch_map.h>
+#include <tsl/hopscotch_set.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+
+namespace firebuild {
+
+/**
+ * Journal of the changes in the watched directories, kept by the daemon using inotify.
+ *
+ * The journal is a table in shared memory mapping each watched directory to the sequence numbers
+ * of its last change and of its last directory entry change. The supervisors forked by the daemon
+ * read the table directly and talk to the daemon over a socket only to request watching new
+ * directories and to make sure that the events queued so far are processed (sync).
+ *
+ * A path is unchanged since sequence number N if its parent directory had no change after N and
+ * none of the other ancestors had their entries changed after N, all of them watched since N.
+ *
+ * Changes done through hard links in other directories, through shared writable mappings and
+ * changes on network file systems made by other hosts are not reported by inotify.
+ */
+class ChangeJournal {
+ public:
+  ~ChangeJournal();
+  /** Set up the journal in the daemon, or return nullptr if that's not possible. */
+  static ChangeJournal *create();
+
+  /* In the daemon */
+  int inotify_fd() const {return inotify_fd_;}
+  const std::vector<int>& client_fds() const {return client_fds_;}
+  /**
+   * Create the connection for a supervisor to be forked.
+   * @return the supervisor's end of the connection, to be passed to attach() in the supervisor
+   */
+  int add_client();
+  /** Update the table with the queued inotify events. */
+  void process_events();
+  /** Process one request of a supervisor, closing the connection when the supervisor exited. */
+  void handle_client_request(int fd);
+
+  /* In the supervisor */
+  /** Switch to the supervisor's role after fork(). */
+  void attach(int fd);
+  uint64_t instance_id() const {return header_->instance_id;}
+  /**
+   * Make sure that the changes made so far are in the table.
+   * @param[out] seq the current sequence number
+   */
+  bool sync(uint64_t *seq);
+  /** Request watching the directory of the path, or the path itself if it is a directory. */
+  void watch(const char *path, size_t len, bool is_dir);
+  /** Check if the path did not change since seq according to the journal. */
+  bool unchanged_since(const char *path, size_t len, bool is_dir, uint64_t seq) const;
+
+ private:
+  struct Header {
+    uint64_t instance_id;
+    /** Incremented for every change. */
+    std::atomic<uint64_t> seq;
+    /** Nothing is known about changes before this, e.g. after an inotify queue overflow. */
+    std::atomic<uint64_t> valid_since;
+  };
+  struct Slot {
+    /**
+     * The low half of the XXH128 hash of the directory's path, 0 for empty slots. It is written
+     * last, when the slot is ready.
+     */
+    std::atomic<uint64_t> key;
+    /** The high half of the hash, a 64 bit hash alone could make a changed directory match. */
+    std::atomic<uint64_t> key_high;
+    /** kNotWatched if the directory is not watched. */
+    std::atomic<uint64_t> watched_since;
+    std::atomic<uint64_t> changed_at;
+    std::atomic<uint64_t> entries_changed_at;
+  };
+  ChangeJournal(int inotify_fd, void *shared, size_t shared_size);
+  const Slot *find(const char *dir, size_t len) const;
+  Slot *find_or_insert(const char *dir, size_t len);
+  bool dir_unchanged(const char *dir, size_t len, bool check_entries_only, uint64_t seq) const;
+  void add_watch(const std::string &dir);
+
+  int inotify_fd_;
+  void *shared_;
+  size_t shared_size_;
+  Header *header_;
+  Slot *slots_;
+  size_t used_slots_ {0};
+  /** Watch descriptors to the watched directories' slots, in the daemon. */
+  tsl::hopscotch_map<int, Slot *> watches_ {};
+  /** The daemon's ends of the connections to the supervisors. */
+  std::vector<int> client_fds_ {};
+  /** The supervisor's end of its connection to the daemon. */
+  int fd_ {-1};
+  /** Directories already requested to be watched by this supervisor. */
+  tsl::hopscotch_set<std::string> requested_dirs_ {};
+  DISALLOW_COPY_AND_ASSIGN(ChangeJournal);
+};
+
+/* singleton, available in the daemon and in the supervisors forked by it when enabled */
+extern ChangeJournal *change_journal;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_CHANGE_JOURNAL_H_
@@ -18,6 +18,7 @@
 
 #include "firebuild/config.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #ifdef __APPLE__
@@ -40,6 +41,7 @@
 #include "common/config.h"
 #include "common/firebuild_common.h"
 #include "common/platform.h"
+#include "firebuild/alt_hasher.h"
 #include "firebuild/debug.h"
 #include "firebuild/exe_matcher.h"
 #include "firebuild/file_name.h"
@@ -60,6 +62,7 @@ ExeMatcher* shortcut_allow_list_matcher = nullptr;
 ExeMatcher* dont_shortcut_matcher = nullptr;
 ExeMatcher* dont_intercept_matcher = nullptr;
 ExeMatcher* skip_cache_matcher = nullptr;
+ExeMatcher* alt_hash_allow_list_matcher = nullptr;
 tsl::hopscotch_set<std::string>* shells = nullptr;
 bool ccache_disabled = false;
 /** Store results of processes consuming more CPU time (system + user) in microseconds than this. */
@@ -70,20 +73,23 @@ off_t max_entry_size = 0;
 off_t max_inline_blob_size = 4096;  /* Default 4KB */
 bool compress_cache = false;  /* Default: compression disabled */
 int compression_level = 1;  /* Default: level 1 */
+bool prefetch_cache = true;
+bool watch_inputs = false;
+int max_lent_jobserver_tokens = 0;
+bool pre_exec_shortcutting = false;
+int64_t uncacheable_expiry = 168 * 3600;
+bool adaptive_caching = false;
+bool lazy_outputs = false;
+std::string base_dir;
+std::string metrics_file;
+int metrics_update_interval_ms = 0;
 int quirks = 0;
 
 #ifndef __APPLE__
 const FileName* qemu_user = nullptr;
 #endif
 
-/**
- * Parse configuration file
- *
- * If custom_cfg_file is non-NULL, use that.
- * Otherwise try ./firebuild.conf, ~/.firebuild.conf, $XDG_CONFIG_HOME/firebuild/firebuild.conf,
- * SYSCONFDIR/firebuild.conf in that order.
- */
-static void parse_cfg_file(libconfig::Config *cfg, const char *custom_cfg_file) {
+std::vector<std::string> config_file_candidates(const char *custom_cfg_file) {
   std::vector<std::string> cfg_files;
   if (custom_cfg_file != NULL) {
     cfg_files = {custom_cfg_file};
@@ -101,6 +107,18 @@ static void parse_cfg_file(libconfig::Config *cfg, const char *custom_cfg_file)
     }
     cfg_files.push_back(GLOBAL_CONFIG);
   }
+  return cfg_files;
+}
+
+/**
+ * Parse configuration file
+ *
+ * If custom_cfg_file is non-NULL, use that.
+ * Otherwise try ./firebuild.conf, ~/.firebuild.conf, $XDG_CONFIG_HOME/firebuild/firebuild.conf,
+ * SYSCONFDIR/firebuild.conf in that order.
+ */
+static void parse_cfg_file(libconfig::Config *cfg, const char *custom_cfg_file) {
+  const std::vector<std::string> cfg_files = config_file_candidates(custom_cfg_file);
   for (size_t i = 0; i < cfg_files.size(); i++) {
     try {
       cfg->readFile(cfg_files[i].c_str());
@@ -382,6 +400,90 @@ void read_config(libconfig::Config *cfg, const char *custom_cfg_file,
     }
   }
 
+  if (cfg->exists("prefetch_cache")) {
+    libconfig::Setting& prefetch_cache_cfg = cfg->getRoot()["prefetch_cache"];
+    if (prefetch_cache_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      prefetch_cache = prefetch_cache_cfg;
+    }
+  }
+
+  if (cfg->exists("watch_inputs")) {
+    libconfig::Setting& watch_inputs_cfg = cfg->getRoot()["watch_inputs"];
+    if (watch_inputs_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      watch_inputs = watch_inputs_cfg;
+    }
+  }
+
+  if (cfg->exists("max_lent_jobserver_tokens")) {
+    libconfig::Setting& max_lent_jobserver_tokens_cfg =
+        cfg->getRoot()["max_lent_jobserver_tokens"];
+    if (max_lent_jobserver_tokens_cfg.isNumber()) {
+      max_lent_jobserver_tokens = max_lent_jobserver_tokens_cfg;
+    }
+  }
+
+  if (cfg->exists("pre_exec_shortcutting")) {
+    libconfig::Setting& pre_exec_shortcutting_cfg = cfg->getRoot()["pre_exec_shortcutting"];
+    if (pre_exec_shortcutting_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      pre_exec_shortcutting = pre_exec_shortcutting_cfg;
+    }
+  }
+
+  if (cfg->exists("uncacheable_expiry")) {
+    libconfig::Setting& uncacheable_expiry_cfg = cfg->getRoot()["uncacheable_expiry"];
+    if (uncacheable_expiry_cfg.isNumber()) {
+      float uncacheable_expiry_h = uncacheable_expiry_cfg;
+      uncacheable_expiry = 3600.0 * uncacheable_expiry_h;
+    }
+  }
+
+  if (cfg->exists("adaptive_caching")) {
+    libconfig::Setting& adaptive_caching_cfg = cfg->getRoot()["adaptive_caching"];
+    if (adaptive_caching_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      adaptive_caching = adaptive_caching_cfg;
+    }
+  }
+
+  if (cfg->exists("lazy_outputs")) {
+    libconfig::Setting& lazy_outputs_cfg = cfg->getRoot()["lazy_outputs"];
+    if (lazy_outputs_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      lazy_outputs = lazy_outputs_cfg;
+    }
+  }
+
+  if (cfg->exists("base_dir")) {
+    libconfig::Setting& base_dir_cfg = cfg->getRoot()["base_dir"];
+    if (base_dir_cfg.getType() == libconfig::Setting::TypeString
+        && strlen(base_dir_cfg.c_str()) > 0) {
+      char* real_base_dir = realpath(base_dir_cfg.c_str(), nullptr);
+      if (!real_base_dir) {
+        std::cerr << "Invalid base_dir: " << base_dir_cfg.c_str() << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      /* With "/" every path would be relative to it, which would not make the entries any more
+       * reusable. */
+      if (strcmp(real_base_dir, "/") != 0) {
+        base_dir = real_base_dir;
+      }
+      free(real_base_dir);
+    }
+  }
+
+  if (cfg->exists("metrics_file")) {
+    libconfig::Setting& metrics_file_cfg = cfg->getRoot()["metrics_file"];
+    if (metrics_file_cfg.getType() == libconfig::Setting::TypeString) {
+      metrics_file = metrics_file_cfg.c_str();
+    }
+  }
+
+  if (cfg->exists("metrics_update_interval")) {
+    libconfig::Setting& metrics_update_interval_cfg = cfg->getRoot()["metrics_update_interval"];
+    if (metrics_update_interval_cfg.isNumber()) {
+      double metrics_update_interval_s = metrics_update_interval_cfg;
+      metrics_update_interval_ms = metrics_update_interval_s * 1000;
+    }
+  }
+
   assert(FileName::isDbEmpty());
 
 #ifndef __APPLE__
@@ -404,6 +506,13 @@ void read_config(libconfig::Config *cfg, const char *custom_cfg_file,
     /* Configuration setting may be missing. This is OK. */
   }
 
+  if (cfg->exists("alt_hash_normalizers")) {
+    const libconfig::Setting& normalizers_cfg = cfg->getRoot()["alt_hash_normalizers"];
+    if (normalizers_cfg.getLength() > 0) {
+      alt_hasher = new AltHasher(normalizers_cfg);
+    }
+  }
+
   init_matcher(&shortcut_allow_list_matcher, cfg, "shortcut_allow_list");
   if (shortcut_allow_list_matcher->empty()) {
     delete(shortcut_allow_list_matcher);
@@ -412,6 +521,7 @@ void read_config(libconfig::Config *cfg, const char *custom_cfg_file,
   init_matcher(&dont_shortcut_matcher, cfg, "dont_shortcut");
   init_matcher(&dont_intercept_matcher, cfg, "dont_intercept");
   init_matcher(&skip_cache_matcher, cfg, "skip_cache");
+  init_matcher(&alt_hash_allow_list_matcher, cfg, "alt_hash_allow_list");
 
   shells = new tsl::hopscotch_set<std::string>();
   try {
@@ -40,6 +40,8 @@ extern ExeMatcher* shortcut_allow_list_matcher;
 extern ExeMatcher* dont_shortcut_matcher;
 extern ExeMatcher* dont_intercept_matcher;
 extern ExeMatcher* skip_cache_matcher;
+/** The processes whose inputs may match by their alternate hashes. */
+extern ExeMatcher* alt_hash_allow_list_matcher;
 extern tsl::hopscotch_set<std::string>* shells;
 extern bool ccache_disabled;
 
@@ -85,6 +87,60 @@ extern bool compress_cache;
  */
 extern int compression_level;
 
+/**
+ * Whether to read the cache entries expected to be used by the build into the page cache in the
+ * background, based on the previous run of the same build command.
+ */
+extern bool prefetch_cache;
+
+/**
+ * Whether the daemon should watch the directories of the inputs to let the supervisors skip
+ * checking inputs in unchanged directories.
+ */
+extern bool watch_inputs;
+
+/**
+ * Maximum number of GNU Make jobserver tokens lent to make while shortcut processes hold their job
+ * slots.
+ */
+extern int max_lent_jobserver_tokens;
+
+/**
+ * Whether to try shortcutting the processes to be started by exec*() already in the exec*() call,
+ * without letting the new program start.
+ */
+extern bool pre_exec_shortcutting;
+
+/**
+ * Seconds to skip fingerprinting and recording the processes that were found not to be cacheable
+ * in the previous runs, 0 to always check them.
+ */
+extern int64_t uncacheable_expiry;
+
+/**
+ * Whether to decide about looking up and storing the processes in the cache based on how the cache
+ * served the same executable in the previous runs.
+ */
+extern bool adaptive_caching;
+
+/**
+ * Whether to restore the regular files created by the shortcut processes only in the hash cache
+ * and write them when a process that is not shortcut starts or at the end of the build.
+ */
+extern bool lazy_outputs;
+
+/**
+ * The checkout directory of the build, replaced with a placeholder in the fingerprints and in the
+ * paths stored in the cache entries, or empty.
+ */
+extern std::string base_dir;
+
+/** Save the supervisor's metrics as JSON to this file at the end of the build, if not empty. */
+extern std::string metrics_file;
+
+/** Also save the metrics every this many milliseconds during the build, if positive. */
+extern int metrics_update_interval_ms;
+
 /** Enabled quirks represented as flags. See "quirks" in etc/firebuild.conf. */
 extern int quirks;
 #define FB_QUIRK_IGNORE_TMP_LISTING  0x01
@@ -96,6 +152,9 @@ extern int quirks;
 void read_config(libconfig::Config *cfg, const char *custom_cfg_file,
                  const std::list<std::string>& config_strings);
 
+/** The configuration files read_config() tries, the first one found is used. */
+std::vector<std::string> config_file_candidates(const char *custom_cfg_file);
+
 /**
  * Construct a NULL-terminated array of "NAME=VALUE" environment variables
  * for the build command. The returned stings and array must be free()-d.
@@ -31,7 +31,9 @@
 #include "firebuild/debug.h"
 #include "firebuild/epoll.h"
 #include "firebuild/execed_process.h"
+#include "firebuild/message_log.h"
 #include "firebuild/message_processor.h"
+#include "firebuild/metrics.h"
 #include "firebuild/linear_buffer.h"
 #include "firebuild/process.h"
 #include "firebuild/process_tree.h"
@@ -45,6 +47,11 @@ class ConnectionContext {
   explicit ConnectionContext(int conn)
       : buffer_(), conn_(conn) {}
   ~ConnectionContext() {
+    if (message_log) {
+      message_log->conn_closed(conn_);
+    }
+    /* The process exited or closed the connection, it won't wait for the ACKs anymore. */
+    metrics->conn_closed(conn_);
     if (proc) {
       auto exec_child_sock = proc_tree->Pid2ExecChildSock(proc->pid());
       if (exec_child_sock) {
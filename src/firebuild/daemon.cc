@@ -0,0 +1,702 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/daemon.h"
+
+#ifdef __APPLE__
+#include <crt_externs.h>
+#endif
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/firebuild_common.h"
+#include "firebuild/change_journal.h"
+#include "firebuild/config.h"
+#include "firebuild/debug.h"
+#include "firebuild/file_name.h"
+#include "firebuild/hash_cache.h"
+#include "firebuild/options.h"
+#include "firebuild/utils.h"
+
+extern char **environ;
+
+namespace firebuild {
+
+int Daemon::client_fd_ = -1;
+pid_t Daemon::client_pgid_ = 0;
+int Daemon::learned_fd_ = -1;
+
+namespace {
+
+enum daemon_reply_type : int32_t {
+  /** The daemon did not accept the build, the client should run it. */
+  DAEMON_REPLY_REFUSED,
+  /** The build command started, the value is its process group id. */
+  DAEMON_REPLY_STARTED,
+  /** The build finished, the value is the exit status. */
+  DAEMON_REPLY_EXITED,
+};
+
+struct daemon_reply {
+  int32_t type;
+  int32_t value;
+};
+
+/** Bumped when the request's layout changes, to not misinterpret a different version's client. */
+const uint32_t kProtocolVersion = 2;
+
+/** The resource limits the build command gets from the client. */
+const int kForwardedRlimits[] = {
+  RLIMIT_AS, RLIMIT_CORE, RLIMIT_CPU, RLIMIT_DATA, RLIMIT_FSIZE, RLIMIT_NOFILE, RLIMIT_STACK,
+};
+#define FORWARDED_RLIMITS_COUNT (sizeof(kForwardedRlimits) / sizeof(kForwardedRlimits[0]))
+
+/**
+ * The fixed size part of the request, followed by the working directory, the arguments and the
+ * environment as '\0' terminated strings.
+ */
+struct daemon_request {
+  uint32_t version;
+  uint32_t argc;
+  uint32_t envc;
+  int32_t pgid;
+  uint32_t umask;
+  uint32_t padding;
+  uint64_t rlimits[FORWARDED_RLIMITS_COUNT][2];
+};
+
+/**
+ * Environment variables affecting the initialization done by the daemon. A build started with
+ * different values is refused.
+ */
+const char * const kInitEnvVars[] = {
+  "FIREBUILD_CACHE_DIR", "FIREBUILD_READONLY", "FIREBUILD_RECACHE",
+  "HOME", "XDG_CACHE_HOME", "XDG_CONFIG_HOME",
+};
+
+/**
+ * The number of interned file names the daemon restarts at. The file names and the hash cache
+ * entries imported from the supervisors are never freed, restarting frees the ones of the files
+ * not used anymore.
+ */
+const size_t kMaxFileNames = 2 * 1000 * 1000;
+
+/** Process group of the build command supervised by the daemon, in the client. */
+volatile sig_atomic_t build_pgid = 0;
+/** The daemon's socket, to remove it at exit. */
+char *listener_path = nullptr;
+
+bool peer_is_same_user(int fd) {
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+bool fill_sockaddr(const std::string &path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.length() >= sizeof(addr->sun_path)) {
+    return false;
+  }
+  memcpy(addr->sun_path, path.c_str(), path.length());
+  return true;
+}
+
+void send_reply(int fd, daemon_reply_type type, int32_t value) {
+  const daemon_reply reply = {type, value};
+  if (fb_write(fd, &reply, sizeof(reply)) != sizeof(reply)) {
+    fb_perror("Failed replying to firebuild client");
+  }
+}
+
+/**
+ * Refuse the client's build. The request is read and dropped, because closing the connection while
+ * the client is still writing it would kill the client with SIGPIPE.
+ */
+void refuse_client(int conn) {
+  send_reply(conn, DAEMON_REPLY_REFUSED, 0);
+  shutdown(conn, SHUT_WR);
+  const struct timeval timeout = {1, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char buf[4096];
+  /* The passed fds are closed by the kernel when reading without a control buffer. */
+  while (read(conn, buf, sizeof(buf)) > 0) {}
+  close(conn);
+}
+
+void append_string(std::string *buf, const char *str) {
+  buf->append(str, strlen(str) + 1);
+}
+
+const char *find_env(char * const *env, const char *name) {
+  const size_t name_len = strlen(name);
+  for (; *env; env++) {
+    if (strncmp(*env, name, name_len) == 0 && (*env)[name_len] == '=') {
+      return *env + name_len + 1;
+    }
+  }
+  return nullptr;
+}
+
+void daemon_exit_handler(int signum) {
+  if (listener_path) {
+    unlink(listener_path);
+  }
+  _exit(128 + signum);
+}
+
+void forward_signal_handler(int signum) {
+  if (build_pgid > 0) {
+    kill(-build_pgid, signum);
+  }
+}
+
+void stop_signal_handler(int signum) {
+  forward_signal_handler(signum);
+  /* Stop with the build, to let the shell take back the terminal. SIGCONT is forwarded. */
+  raise(SIGSTOP);
+}
+
+/** The contents of the configuration files the daemon may have read, to notice their changes. */
+std::string config_files_state() {
+  std::string state;
+  for (const std::string& path : config_file_candidates(Options::config_file())) {
+    state += path;
+    FILE* f = fopen(path.c_str(), "r");
+    if (f) {
+      char buf[4096];
+      size_t len;
+      state += '\1';
+      while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+        state.append(buf, len);
+      }
+      fclose(f);
+    }
+    state += '\0';
+  }
+  return state;
+}
+
+/**
+ * Read the state a supervisor learned, importing it when the supervisor closed the pipe.
+ * @return whether the pipe got closed
+ */
+bool read_learned_state(int fd, std::string* state) {
+  char buf[65536];
+  while (true) {
+    ssize_t ret = read(fd, buf, sizeof(buf));
+    if (ret > 0) {
+      state->append(buf, ret);
+    } else if (ret == -1 && (errno == EINTR || errno == EAGAIN)) {
+      return false;
+    } else {
+      if (ret == 0) {
+        hash_cache->import_entries(state->data(), state->size());
+      }
+      close(fd);
+      return true;
+    }
+  }
+}
+
+}  /* namespace */
+
+std::string Daemon::socket_path() {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir && runtime_dir[0] != '\0') {
+    return std::string(runtime_dir) + "/firebuild.sock";
+  } else {
+    return "/tmp/firebuild-" + std::to_string(getuid()) + ".sock";
+  }
+}
+
+void Daemon::serve(char *argv[]) {
+  const std::string path = socket_path();
+  struct sockaddr_un addr;
+  if (!fill_sockaddr(path, &addr)) {
+    fb_error("Daemon socket path is too long: " + path);
+    exit(EXIT_FAILURE);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener == -1) {
+    fb_perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  fcntl(listener, F_SETFD, FD_CLOEXEC);
+  if (connect(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0) {
+    fb_error("Another firebuild daemon is already listening on " + path);
+    exit(EXIT_FAILURE);
+  }
+  /* Remove the socket left behind by a daemon that did not exit cleanly. */
+  unlink(path.c_str());
+  if (bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1
+      || chmod(path.c_str(), 0600) == -1 || listen(listener, 64) == -1) {
+    fb_perror("Setting up the daemon socket failed");
+    exit(EXIT_FAILURE);
+  }
+  listener_path = strdup(path.c_str());
+
+  /* Let the kernel reap the forked supervisors. */
+  signal(SIGCHLD, SIG_IGN);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = daemon_exit_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGQUIT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (watch_inputs) {
+    change_journal = ChangeJournal::create();
+  }
+
+  const std::string config_state = config_files_state();
+  if (!Options::quiet()) {
+    fprintf(stderr, "FIREBUILD: Daemon is listening on %s\n", path.c_str());
+  }
+  /* The state being passed back by the supervisors, by the pipes' fds. */
+  std::map<int, std::string> learned_states;
+  std::vector<struct pollfd> pfds;
+  /* When restarting the daemon stops listening, but it keeps serving the running supervisors until
+   * they pass back their learned state. */
+  const char* restart_reason = nullptr;
+  while (true) {
+    if (!restart_reason && FileName::db_size() > kMaxFileNames) {
+      restart_reason = "Too many files are known";
+    }
+    if (restart_reason && listener != -1) {
+      /* Let the clients that already connected run their builds themselves. */
+      unlink(path.c_str());
+      fcntl(listener, F_SETFL, O_NONBLOCK);
+      int conn;
+      while ((conn = accept(listener, NULL, NULL)) != -1 || errno == EINTR) {
+        if (conn != -1) {
+          refuse_client(conn);
+        }
+      }
+      close(listener);
+      listener = -1;
+      if (!Options::quiet()) {
+        fprintf(stderr, "FIREBUILD: %s, restarting the daemon\n", restart_reason);
+      }
+    }
+    if (restart_reason && learned_states.empty()) {
+      execvp(argv[0], argv);
+      fb_perror("Restarting the daemon failed");
+      exit(EXIT_FAILURE);
+    }
+    pfds.clear();
+    /* poll() ignores the negative fd after the listener is closed. */
+    pfds.push_back({listener, POLLIN, 0});
+    for (const auto& [fd, state] : learned_states) {
+      pfds.push_back({fd, POLLIN, 0});
+    }
+    const size_t journal_start = pfds.size();
+    if (change_journal) {
+      pfds.push_back({change_journal->inotify_fd(), POLLIN, 0});
+      for (int fd : change_journal->client_fds()) {
+        pfds.push_back({fd, POLLIN, 0});
+      }
+    }
+    if (poll(pfds.data(), pfds.size(), -1) == -1) {
+      if (errno != EINTR) {
+        fb_perror("poll");
+      }
+      continue;
+    }
+    for (size_t i = 1; i < journal_start; i++) {
+      if (pfds[i].revents && read_learned_state(pfds[i].fd, &learned_states[pfds[i].fd])) {
+        learned_states.erase(pfds[i].fd);
+      }
+    }
+    if (change_journal) {
+      if (pfds[journal_start].revents) {
+        change_journal->process_events();
+      }
+      for (size_t i = journal_start + 1; i < pfds.size(); i++) {
+        if (pfds[i].revents) {
+          change_journal->handle_client_request(pfds[i].fd);
+        }
+      }
+    }
+    if (!(pfds[0].revents & POLLIN)) {
+      continue;
+    }
+
+    int conn = accept(listener, NULL, NULL);
+    if (conn == -1) {
+      if (errno != EINTR) {
+        fb_perror("accept");
+      }
+      continue;
+    }
+    if (!peer_is_same_user(conn)) {
+      close(conn);
+      continue;
+    }
+    if (config_files_state() != config_state) {
+      /* Let the client run the build with the new configuration, and restart to read it. */
+      refuse_client(conn);
+      restart_reason = "Configuration changed";
+      continue;
+    }
+    const int journal_fd = change_journal ? change_journal->add_client() : -1;
+    int learned_pipe[2];
+    if (fb_pipe2(learned_pipe, O_CLOEXEC) != 0) {
+      learned_pipe[0] = learned_pipe[1] = -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      /* Supervisor for this client. */
+      close(listener);
+      for (const auto& [fd, state] : learned_states) {
+        close(fd);
+      }
+      if (learned_pipe[0] != -1) {
+        close(learned_pipe[0]);
+      }
+      learned_fd_ = learned_pipe[1];
+      if (change_journal) {
+        change_journal->attach(journal_fd);
+      }
+      free(listener_path);
+      listener_path = nullptr;
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGQUIT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      if (accept_client(conn)) {
+        return;
+      }
+      exit(EXIT_SUCCESS);
+    } else if (pid == -1) {
+      fb_perror("fork");
+    }
+    if (journal_fd != -1) {
+      close(journal_fd);
+    }
+    if (learned_pipe[0] != -1) {
+      close(learned_pipe[1]);
+      if (pid == -1) {
+        close(learned_pipe[0]);
+      } else {
+        fcntl(learned_pipe[0], F_SETFL, O_NONBLOCK);
+        learned_states[learned_pipe[0]] = "";
+      }
+    }
+    close(conn);
+  }
+}
+
+bool Daemon::accept_client(int conn) {
+  fcntl(conn, F_SETFD, FD_CLOEXEC);
+
+  /* The payload's length comes with the client's stdin, stdout and stderr. */
+  uint32_t payload_len = 0;
+  struct iovec iov = {&payload_len, sizeof(payload_len)};
+  char cmsg_buf[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+  if (TEMP_FAILURE_RETRY(recvmsg(conn, &msg, 0)) != sizeof(payload_len)) {
+    return false;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+    return false;
+  }
+  int std_fds[3];
+  memcpy(std_fds, CMSG_DATA(cmsg), sizeof(std_fds));
+
+  /* The arguments and the environment are referenced from the Options and environ, they are kept
+   * for the whole life of the process. */
+  char *payload = reinterpret_cast<char *>(malloc(payload_len + 1));
+  daemon_request request;
+  if (payload_len < sizeof(request)
+      || fb_read(conn, payload, payload_len) != static_cast<ssize_t>(payload_len)) {
+    return false;
+  }
+  payload[payload_len] = '\0';
+  memcpy(&request, payload, sizeof(request));
+  if (request.version != kProtocolVersion) {
+    send_reply(conn, DAEMON_REPLY_REFUSED, 0);
+    return false;
+  }
+  const uint32_t argc = request.argc, envc = request.envc;
+  char *p = payload + sizeof(request);
+  char * const end = payload + payload_len;
+  char *cwd = p;
+  std::vector<char *> strings;
+  for (p += strlen(p) + 1; p < end && strings.size() < argc + envc; p += strlen(p) + 1) {
+    strings.push_back(p);
+  }
+  if (strings.size() != argc + envc) {
+    send_reply(conn, DAEMON_REPLY_REFUSED, 0);
+    return false;
+  }
+  char **client_argv = new char *[argc + 1];
+  std::copy(strings.begin(), strings.begin() + argc, client_argv);
+  client_argv[argc] = nullptr;
+  char **client_env = new char *[envc + 1];
+  std::copy(strings.begin() + argc, strings.end(), client_env);
+  client_env[envc] = nullptr;
+
+  /* Check if the build would be initialized the same way the daemon is. */
+  bool compatible = true;
+  for (const char *name : kInitEnvVars) {
+    const char *daemon_value = getenv(name);
+    const char *client_value = find_env(client_env, name);
+    if ((daemon_value == nullptr) != (client_value == nullptr)
+        || (daemon_value && strcmp(daemon_value, client_value) != 0)) {
+      FB_DEBUG(FB_DEBUG_PROC, std::string("Refusing build, ") + name + " differs");
+      compatible = false;
+    }
+  }
+  const std::string daemon_cwd = std::filesystem::current_path();
+  if (daemon_cwd != cwd && (access(".firebuild.conf", F_OK) == 0
+                            || access((std::string(cwd) + "/.firebuild.conf").c_str(),
+                                      F_OK) == 0)) {
+    /* The configuration file is looked up in the current directory first. */
+    compatible = false;
+  }
+  if (compatible) {
+    Options::reparse(argc, client_argv);
+    if (Options::config_file() || !Options::config_strings().empty()
+        || !Options::build_cmd()) {
+      compatible = false;
+    }
+  }
+  if (!compatible || chdir(cwd) != 0) {
+    send_reply(conn, DAEMON_REPLY_REFUSED, 0);
+    return false;
+  }
+  /* The build command inherits these, like it would from a firebuild started by the client. */
+  umask(request.umask);
+  for (size_t i = 0; i < FORWARDED_RLIMITS_COUNT; i++) {
+    const struct rlimit rlim = {static_cast<rlim_t>(request.rlimits[i][0]),
+                                static_cast<rlim_t>(request.rlimits[i][1])};
+    if (setrlimit(kForwardedRlimits[i], &rlim) != 0) {
+      /* The client's hard limit may be higher than the daemon's. */
+      FB_DEBUG(FB_DEBUG_PROC, "Refusing build, could not set resource limit "
+               + d(kForwardedRlimits[i]));
+      send_reply(conn, DAEMON_REPLY_REFUSED, 0);
+      return false;
+    }
+  }
+  client_pgid_ = request.pgid;
+
+  for (int fd = 0; fd < 3; fd++) {
+    if (dup2(std_fds[fd], fd) == -1) {
+      fb_perror("dup2");
+      exit(EXIT_FAILURE);
+    }
+    if (std_fds[fd] > 2) {
+      close(std_fds[fd]);
+    }
+  }
+#ifdef __APPLE__
+  *_NSGetEnviron() = client_env;
+#else
+  environ = client_env;
+#endif
+  client_fd_ = conn;
+  return true;
+}
+
+void Daemon::set_build_process_group(pid_t pid) {
+  /* Joining the client's process group keeps the build in the terminal's foreground job, but it is
+   * possible only when the daemon was started in the client's session. */
+  if (client_pgid_ <= 0 || setpgid(pid, client_pgid_) != 0) {
+    setpgid(pid, pid);
+  }
+}
+
+void Daemon::report_build_started(pid_t pid) {
+  const pid_t pgid = getpgid(pid);
+  send_reply(client_fd_, DAEMON_REPLY_STARTED, pgid > 0 ? pgid : pid);
+}
+
+void Daemon::report_build_exited(int status) {
+  send_reply(client_fd_, DAEMON_REPLY_EXITED, status);
+  close(client_fd_);
+  client_fd_ = -1;
+}
+
+void Daemon::report_learned_state() {
+  if (learned_fd_ == -1) {
+    return;
+  }
+  std::string state;
+  hash_cache->export_entries(&state);
+  if (fb_write(learned_fd_, state.data(), state.size()) != static_cast<ssize_t>(state.size())) {
+    fb_perror("Passing the learned file hashes to the daemon");
+  }
+  close(learned_fd_);
+  learned_fd_ = -1;
+}
+
+bool Daemon::run_build(int argc, char *argv[], int *exit_status) {
+  for (int fd = 0; fd < 3; fd++) {
+    if (fcntl(fd, F_GETFD) == -1) {
+      /* Can't pass a closed fd. */
+      return false;
+    }
+  }
+  struct sockaddr_un addr;
+  if (!fill_sockaddr(socket_path(), &addr)) {
+    return false;
+  }
+  int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (conn == -1) {
+    return false;
+  }
+  if (connect(conn, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1
+      || !peer_is_same_user(conn)) {
+    close(conn);
+    return false;
+  }
+
+  daemon_request request {};
+  request.version = kProtocolVersion;
+  request.argc = argc;
+  while (environ[request.envc]) {
+    request.envc++;
+  }
+  request.pgid = getpgrp();
+  request.umask = umask(0);
+  umask(request.umask);
+  for (size_t i = 0; i < FORWARDED_RLIMITS_COUNT; i++) {
+    struct rlimit rlim;
+    if (getrlimit(kForwardedRlimits[i], &rlim) != 0) {
+      close(conn);
+      return false;
+    }
+    request.rlimits[i][0] = rlim.rlim_cur;
+    request.rlimits[i][1] = rlim.rlim_max;
+  }
+  std::string payload(reinterpret_cast<const char *>(&request), sizeof(request));
+  append_string(&payload, std::filesystem::current_path().c_str());
+  for (int i = 0; i < argc; i++) {
+    append_string(&payload, argv[i]);
+  }
+  for (uint32_t i = 0; i < request.envc; i++) {
+    append_string(&payload, environ[i]);
+  }
+
+  uint32_t payload_len = payload.length();
+  struct iovec iov = {&payload_len, sizeof(payload_len)};
+  const int std_fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char cmsg_buf[CMSG_SPACE(sizeof(std_fds))];
+  memset(cmsg_buf, 0, sizeof(cmsg_buf));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(std_fds));
+  memcpy(CMSG_DATA(cmsg), std_fds, sizeof(std_fds));
+  if (TEMP_FAILURE_RETRY(sendmsg(conn, &msg, 0)) != sizeof(payload_len)
+      || fb_write(conn, payload.c_str(), payload_len) != static_cast<ssize_t>(payload_len)) {
+    close(conn);
+    return false;
+  }
+
+  bool started = false;
+  daemon_reply reply;
+  while (fb_read(conn, &reply, sizeof(reply)) == sizeof(reply)) {
+    switch (reply.type) {
+      case DAEMON_REPLY_REFUSED:
+        close(conn);
+        return false;
+      case DAEMON_REPLY_STARTED: {
+        started = true;
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_flags = SA_RESTART;
+        if (reply.value == getpgrp()) {
+          /* The build is in our process group, it gets the terminal's signals, too. Wait for its
+           * exit status instead of exiting earlier. */
+          sa.sa_handler = SIG_IGN;
+          sigaction(SIGINT, &sa, NULL);
+          sigaction(SIGQUIT, &sa, NULL);
+          break;
+        }
+        build_pgid = reply.value;
+        /* The build command is not in the terminal's foreground process group, forward the
+         * signals the terminal would have sent to it. */
+        sa.sa_handler = forward_signal_handler;
+        sigaction(SIGHUP, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGQUIT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGCONT, &sa, NULL);
+        sigaction(SIGWINCH, &sa, NULL);
+        sa.sa_handler = stop_signal_handler;
+        sigaction(SIGTSTP, &sa, NULL);
+        sigaction(SIGTTIN, &sa, NULL);
+        sigaction(SIGTTOU, &sa, NULL);
+        break;
+      }
+      case DAEMON_REPLY_EXITED:
+        *exit_status = reply.value;
+        close(conn);
+        return true;
+      default:
+        break;
+    }
+  }
+  close(conn);
+  if (!started) {
+    /* The daemon went away before starting the build. */
+    return false;
+  }
+  fb_error("The firebuild daemon's supervisor exited unexpectedly");
+  *exit_status = EXIT_FAILURE;
+  return true;
+}
+
+}  /* namespace firebuild */
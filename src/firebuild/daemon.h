@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_DAEMON_H_
+#define FIREBUILD_DAEMON_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+namespace firebuild {
+
+/**
+ * The daemon reads the configuration and initializes the caches once, then serves builds started
+ * by other firebuild invocations of the same user.
+ *
+ * The client passes its standard file descriptors, working directory, arguments, environment,
+ * umask, resource limits and process group over a Unix socket. The daemon forks a supervisor for
+ * each build that continues as if it was started by the client, reporting the build command's
+ * process group and exit status back to the client. When the supervisor finishes it passes the file
+ * hashes it learned back to the daemon, thus the next builds start with them.
+ *
+ * The build command joins the client's process group when the daemon runs in the client's session,
+ * keeping the terminal's job control working. Otherwise it gets its own process group and the
+ * client forwards the terminal's signals to it.
+ *
+ * Builds that would need a different configuration or cache directory are refused and the client
+ * runs the build itself. When the configuration files change, or the daemon knows too many files,
+ * it stops accepting builds, waits for the running supervisors to pass back their learned state
+ * and restarts itself.
+ */
+class Daemon {
+ public:
+  /** The socket the daemon listens on. */
+  static std::string socket_path();
+  /**
+   * Serve the clients.
+   *
+   * Returns only in the forked supervisors, after the client's options have been parsed and its
+   * environment, working directory and standard file descriptors have been set up.
+   *
+   * @param argv the daemon's argv, to restart it
+   */
+  static void serve(char *argv[]);
+  /**
+   * Let a running daemon supervise the build.
+   *
+   * @param argc the client's argc
+   * @param argv the client's argv
+   * @param[out] exit_status the build command's exit status
+   * @return whether the daemon supervised the build
+   */
+  static bool run_build(int argc, char *argv[], int *exit_status);
+  /** Whether this process is a supervisor forked by the daemon. */
+  static bool is_serving() {
+    return client_fd_ != -1;
+  }
+  /**
+   * Move the build command to the client's process group if possible, or to a new one.
+   * Called both in the build command and in the supervisor to not race with exec().
+   */
+  static void set_build_process_group(pid_t pid);
+  /** Let the client know the build command's process group, to forward signals to it. */
+  static void report_build_started(pid_t pid);
+  /** Let the client know the build command's exit status. */
+  static void report_build_exited(int status);
+  /** Pass the file hashes learned during the build to the daemon. */
+  static void report_learned_state();
+
+ private:
+  static bool accept_client(int conn);
+  static int client_fd_;
+  /** The client's process group, to run the build command in. */
+  static pid_t client_pgid_;
+  /** The pipe to pass the learned state to the daemon on. */
+  static int learned_fd_;
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_DAEMON_H_
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "firebuild/dir_hash_cache.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "firebuild/debug.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+DirHashCache *dir_hash_cache = nullptr;
+
+static const char kDirHashesMagic[8] = {'F', 'B', 'D', 'I', 'R', 'H', 'S', '2'};
+/* Keep the file small enough to be read quickly at startup. */
+static const size_t kMaxEntries = 64 * 1024;
+
+DirHashCache::DirHashCache(const std::string &path) : path_(path) {
+  FILE* f = fopen(path_.c_str(), "r");
+  if (f) {
+    load(f);
+    fclose(f);
+  }
+  FB_DEBUG(FB_DEBUG_HASH, "Loaded " + d(entries_.size()) + " directory hashes");
+}
+
+DirHashCache::Key DirHashCache::make_key(dev_t device, ino_t inode, const struct timespec &mtime,
+                                         const struct timespec &ctime) {
+  return {static_cast<uint64_t>(device), static_cast<uint64_t>(inode), mtime.tv_sec,
+          mtime.tv_nsec, ctime.tv_sec, ctime.tv_nsec};
+}
+
+bool DirHashCache::is_file_current(const std::string &path) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  char magic[sizeof(kDirHashesMagic)];
+  const bool ret = fread(magic, sizeof(magic), 1, f) == 1
+      && memcmp(magic, kDirHashesMagic, sizeof(magic)) == 0;
+  fclose(f);
+  return ret;
+}
+
+void DirHashCache::load(FILE* f) {
+  char magic[sizeof(kDirHashesMagic)];
+  if (fread(magic, sizeof(magic), 1, f) == 1
+      && memcmp(magic, kDirHashesMagic, sizeof(magic)) == 0) {
+    Record record;
+    while (entries_.size() < kMaxEntries && fread(&record, sizeof(record), 1, f) == 1) {
+      entries_.insert({record.key, {record.hash, false}});
+    }
+  }
+}
+
+bool DirHashCache::get(dev_t device, ino_t inode, const struct timespec &mtime,
+                       const struct timespec &ctime, Hash *hash) {
+  auto it = entries_.find(make_key(device, inode, mtime, ctime));
+  if (it == entries_.end()) {
+    return false;
+  }
+  it.value().used = true;
+  hash->set(it->second.hash);
+  return true;
+}
+
+void DirHashCache::add(dev_t device, ino_t inode, const struct timespec &mtime,
+                       const struct timespec &ctime, const Hash &hash) {
+  /* A directory modified in the same second after listing it could keep its timestamps on file
+   * systems with coarse timestamps. Remember only the directories that settled. */
+  if (std::max(mtime.tv_sec, ctime.tv_sec) >= time(nullptr) - 1) {
+    return;
+  }
+  entries_[make_key(device, inode, mtime, ctime)] = {hash.get(), true};
+  dirty_ = true;
+}
+
+void DirHashCache::save() {
+  if (!dirty_) {
+    return;
+  }
+  /* Serialize the concurrent builds' updates and merge the hashes they added. */
+  const std::string lock_path = path_ + ".lock";
+  int lock_fd = open(lock_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1) {
+    fb_perror("Failed locking directory hashes");
+    if (lock_fd != -1) {
+      close(lock_fd);
+    }
+    return;
+  }
+  FILE* saved = fopen(path_.c_str(), "r");
+  if (saved) {
+    load(saved);
+    fclose(saved);
+  }
+  /* Keep the entries used in this run when there are too many, the others are likely stale. */
+  std::vector<Record> records;
+  records.reserve(std::min(entries_.size(), kMaxEntries));
+  for (int pass = 0; pass < 2; pass++) {
+    for (const auto& pair : entries_) {
+      if (records.size() < kMaxEntries && pair.second.used == (pass == 0)) {
+        records.push_back({pair.first, pair.second.hash});
+      }
+    }
+  }
+  const std::string tmp_path = path_ + "." + std::to_string(getpid());
+  FILE* f = fopen(tmp_path.c_str(), "w");
+  if (!f) {
+    fb_perror("Failed saving directory hashes");
+  } else {
+    bool success = fwrite(kDirHashesMagic, sizeof(kDirHashesMagic), 1, f) == 1
+        && fwrite(records.data(), sizeof(Record), records.size(), f) == records.size();
+    if (fclose(f) != 0 || !success
+        || !execed_process_cacher->replace_metadata_file(tmp_path, path_)) {
+      fb_perror("Failed saving directory hashes");
+      unlink(tmp_path.c_str());
+    }
+  }
+  /* Closing the fd releases the lock. */
+  close(lock_fd);
+  dirty_ = false;
+}
+
+}  /* namespace firebuild */
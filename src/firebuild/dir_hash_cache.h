@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef FIREBUILD_DIR_HASH_CACHE_H_
+#define FIREBUILD_DIR_HASH_CACHE_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <tsl/hopscotch_map.h>
+#include <xxhash.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/hash.h"
+
+namespace firebuild {
+
+/**
+ * Remembers the hashes of the directory listings across runs.
+ *
+ * Hashing a directory needs reading and sorting its whole listing, which is slow for big
+ * directories, like the ones of plugins or of Java classes. Creating, removing or renaming an
+ * entry updates the directory's mtime and ctime, thus the hash of the listing is kept for
+ * (device, inode, mtime, ctime) and reused while they match.
+ *
+ * The hashes are saved to the "dir-hashes" file of the cache, merged with the ones saved by
+ * concurrent builds.
+ */
+class DirHashCache {
+ public:
+  explicit DirHashCache(const std::string &path);
+
+  /** Look up the listing's hash of the directory with the given stat information. */
+  bool get(dev_t device, ino_t inode, const struct timespec &mtime,
+           const struct timespec &ctime, Hash *hash);
+  /** Remember the listing's hash of the directory with the given stat information. */
+  void add(dev_t device, ino_t inode, const struct timespec &mtime,
+           const struct timespec &ctime, const Hash &hash);
+  /** Save the hashes if new ones were added in this run, replacing the saved ones. */
+  void save();
+  /** Whether gc should keep the saved hashes, i.e. they are in the current format. */
+  static bool is_file_current(const std::string &path);
+
+ private:
+  struct Key {
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    bool operator==(const Key& other) const {
+      return memcmp(this, &other, sizeof(Key)) == 0;
+    }
+  };
+  struct KeyHasher {
+    size_t operator()(const Key& key) const noexcept {
+      return XXH3_64bits(&key, sizeof(key));
+    }
+  };
+  struct Record {
+    Key key;
+    XXH128_hash_t hash;
+  };
+  struct Entry {
+    XXH128_hash_t hash;
+    /** Used or added in this run. */
+    bool used;
+  };
+  static Key make_key(dev_t device, ino_t inode, const struct timespec &mtime,
+                      const struct timespec &ctime);
+  /** Read the saved hashes, not overriding the ones already known. */
+  void load(FILE* f);
+
+  std::string path_;
+  tsl::hopscotch_map<Key, Entry, KeyHasher> entries_ {};
+  bool dirty_ {false};
+  DISALLOW_COPY_AND_ASSIGN(DirHashCache);
+};
+
+/* singleton, or nullptr when there is no cache */
+extern DirHashCache *dir_hash_cache;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_DIR_HASH_CACHE_H_
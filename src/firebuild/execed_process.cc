@@ -31,9 +31,11 @@
 #ifdef __APPLE__
 #include "firebuild/hash_cache.h"
 #endif
+#include "firebuild/jobserver.h"
 #include "firebuild/options.h"
 #include "firebuild/process_debug_suppressor.h"
 #include "firebuild/process_tree.h"
+#include "firebuild/trace_events.h"
 #include "firebuild/utils.h"
 
 namespace firebuild {
@@ -181,7 +183,7 @@ void ExecedProcess::initialize() {
   for (inherited_file_t& inherited_file : inherited_files) {
     if (inherited_file.type == FD_FILE) {
       /* Remember the file size and seek offset. */
-      FileFD *file_fd = (*fds())[inherited_file.fds[0]].get();
+      const FileFD *file_fd = get_fd(inherited_file.fds[0]);
       struct stat64 st;
       if (stat64(file_fd->filename()->c_str(), &st) < 0) {
         disable_shortcutting_only_this("Failed to stat inherited file");
@@ -239,11 +241,23 @@ void ExecedProcess::do_finalize() {
 
   close_fds();
 
+  if (jobserver_token_lent()) {
+    Jobserver* jobserver = Jobserver::Get(this);
+    if (jobserver) {
+      jobserver->reclaim();
+    }
+    set_jobserver_token_lent(false);
+  }
+
   /* store data for shortcutting */
   if (!was_shortcut() && can_shortcut() && fork_point()->exit_status() != -1
       && aggr_cpu_time_u() >= min_cpu_time_u) {
+    TraceSpan span(fb_pid(), "store");
     execed_process_cacher->store(this);
   }
+  if (!was_shortcut()) {
+    execed_process_cacher->update_uncacheable(this);
+  }
 
   /* Propagate resource usage. */
   if (parent_exec_point()) {
@@ -257,6 +271,9 @@ void ExecedProcess::do_finalize() {
   for (const auto& pipe : created_pipes_) {
     pipe->finish();
   }
+  if (trace_events) {
+    trace_events->end(fb_pid());
+  }
   proc_tree->QueueExecProcForGC(this);
 }
 
@@ -42,6 +42,7 @@
 namespace firebuild {
 
 class ExecedProcessCacher;
+class Jobserver;
 
 /**
  * Represents one open file description that this process inherited, along with the list of
@@ -107,6 +108,12 @@ class ExecedProcess : public Process {
   int jobserver_fd_w() const {return jobserver_fd_w_;}
   void set_jobserver_fifo(const char *fifo) {jobserver_fifo_ = FileName::Get(fifo);}
   const FileName* jobserver_fifo() const {return jobserver_fifo_;}
+  /** The jobserver opened using this process's jobserver fifo or fds, see Jobserver::Get(). */
+  Jobserver* jobserver() const {return jobserver_;}
+  void set_jobserver(Jobserver* jobserver) const {jobserver_ = jobserver;}
+  /** Whether a jobserver token was lent for the time the process is shortcut. */
+  bool jobserver_token_lent() const {return jobserver_token_lent_;}
+  void set_jobserver_token_lent(bool value) {jobserver_token_lent_ = value;}
   bool been_waited_for() const;
   void set_been_waited_for();
   void add_utime_u(int64_t t) {utime_u_ += t;}
@@ -253,6 +260,10 @@ class ExecedProcess : public Process {
   void set_qemu_user_used(bool value) {qemu_user_used_ = value;}
   bool qemu_user_used() const {return qemu_user_used_;}
 
+  /** The process can be cached, but it is not looked up in the cache. */
+  bool skip_cache_lookup() const {return skip_cache_lookup_;}
+  void set_skip_cache_lookup(bool value) {skip_cache_lookup_ = value;}
+
   /** For debugging, a short imprecise reminder of the command line. Omits the path to the
    * executable, and strips off the middle. Does not escape or quote. */
   std::string args_to_short_string() const;
@@ -265,6 +276,8 @@ class ExecedProcess : public Process {
   bool can_shortcut_:1 = true;
   bool was_shortcut_:1 = false;
   bool qemu_user_used_:1 = false;
+  bool skip_cache_lookup_:1 = false;
+  bool jobserver_token_lent_:1 = false;
   int16_t jobserver_fd_r_ = -1;
   int16_t jobserver_fd_w_ = -1;
   /** If points to this (self), the process can be shortcut.
@@ -351,6 +364,8 @@ class ExecedProcess : public Process {
   const Process *cant_shortcut_proc_ = NULL;
   /** Make jobserver FIFO */
   const FileName* jobserver_fifo_ = nullptr;
+  /** The jobserver opened using this process's fifo or fds, cached for the next shortcuts. */
+  mutable Jobserver* jobserver_ = nullptr;
   DISALLOW_COPY_AND_ASSIGN(ExecedProcess);
 };
 
@@ -17,29 +17,42 @@
  */
 
 #include "firebuild/execed_process_cacher.h"
+#include <dirent.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cinttypes>
 #include <cstdio>
+#include <ctime>
+#include <filesystem>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "firebuild/alt_hasher.h"
+#include "firebuild/build_trace.h"
+#include "firebuild/caching_policy.h"
 #include "firebuild/config.h"
 #include "firebuild/debug.h"
+#include "firebuild/dir_hash_cache.h"
 #include "firebuild/execed_process.h"
 #include "firebuild/forked_process.h"
 #include "firebuild/file_name.h"
 #include "firebuild/hash_cache.h"
+#include "firebuild/input_match_cache.h"
+#include "firebuild/jobserver.h"
+#include "firebuild/metrics.h"
 #include "firebuild/options.h"
 #include "firebuild/fbbfp.h"
 #include "firebuild/fbbstore.h"
 #include "firebuild/process_tree.h"
+#include "firebuild/trace_events.h"
 
 namespace firebuild {
 
@@ -62,10 +75,16 @@ class InlineDataMapCleaner {
   tsl::hopscotch_map<const FileName*, std::pair<char*, size_t>>* map_;
 };
 
-static const XXH64_hash_t kFingerprintVersion = 0;
-static const unsigned int kCacheFormatVersion = 3;
+/* Changed when the fingerprint is computed differently or the cache entries' format changes. */
+static const XXH64_hash_t kFingerprintVersion = 1;
+static const unsigned int kCacheFormatVersion = 4;
 static const char kCacheStatsFile[] = "stats";
 static const char kCacheSizeFile[] = "size";
+/* Restore the outputs of a shortcut on multiple threads only when there are enough of them. */
+static const size_t kMinFilesForParallelRestore = 4;
+static const unsigned int kMaxRestoreThreads = 8;
+/* Each lazily restored file keeps its blob open until it is written. */
+static const size_t kMaxVirtualFiles = 1024;
 
 unsigned int ExecedProcessCacher::cache_format_ = 0;
 
@@ -97,6 +116,12 @@ void ExecedProcessCacher::init(const libconfig::Config* cfg) {
   bool no_fetch {getenv("FIREBUILD_RECACHE") != NULL};
   /* Like CCACHE_READONLY: Don't store new results in the cache. */
   bool no_store = getenv("FIREBUILD_READONLY") != NULL;
+  if (Options::replay_messages_file()) {
+    /* The replayed processes don't exist, the cache must neither be used to shortcut them nor be
+     * filled with their made-up results. */
+    no_fetch = true;
+    no_store = true;
+  }
 
   struct stat st;
   if (stat(cache_dir.c_str(), &st) == 0) {
@@ -127,6 +152,19 @@ void ExecedProcessCacher::init(const libconfig::Config* cfg) {
         no_store = true;
       } else if (cache_format() == kCacheFormatVersion) {
         /* Current format, we can use the cache. */
+      } else if (cache_format() == 3 && !no_store) {
+        /* Format 4 hashes the big files as a tree. The entries referring to big files' plain
+         * hashes are not hit anymore, but they are still valid, thus the cache is upgraded in
+         * place to not let earlier versions mix in plain hashes again. */
+        const std::string tmp_file =
+            std::string(cache_format_file) + "." + std::to_string(getpid());
+        FILE* tmp_f = fopen(tmp_file.c_str(), "w");
+        if (!tmp_f || fprintf(tmp_f, "%d\n", kCacheFormatVersion) <= 0 || fclose(tmp_f) != 0
+            || rename(tmp_file.c_str(), cache_format_file) != 0) {
+          fb_perror("upgrading cache-format file failed");
+          exit(EXIT_FAILURE);
+        }
+        cache_format_ = kCacheFormatVersion;
       } else {
         /* Cache is in a prior format. Either use it considering the differences where needed
          * or upgrade it. */
@@ -151,8 +189,35 @@ void ExecedProcessCacher::init(const libconfig::Config* cfg) {
   obj_cache = new ObjCache(cache_dir + "/objs");
   PipeRecorder::set_base_dir((cache_dir + "/tmp").c_str());
   hash_cache = new HashCache();
+  dir_hash_cache = new DirHashCache(cache_dir + "/dir-hashes");
+  input_match_cache = new InputMatchCache(cache_dir + "/matches");
+  if (adaptive_caching) {
+    caching_policy = new CachingPolicy(cache_dir + "/policy");
+  }
 
   execed_process_cacher = new ExecedProcessCacher(no_store, no_fetch, cache_dir, cfg);
+  if (Options::build_cmd()) {
+    execed_process_cacher->init_build_trace();
+  }
+}
+
+void ExecedProcessCacher::init_build_trace() {
+  if (!prefetch_cache) {
+    return;
+  }
+  /* Identify the project by the build command and the directory it is started in. */
+  XXH3_state_t state;
+  XXH3_128bits_reset(&state);
+  std::filesystem::path wd = std::filesystem::current_path();
+  if (Options::directory()) {
+    wd /= Options::directory();
+  }
+  const std::string wd_str = wd.lexically_normal().string();
+  XXH3_128bits_update(&state, wd_str.c_str(), wd_str.length() + 1);
+  for (size_t i = 0; i < Options::build_cmd_argc(); i++) {
+    XXH3_128bits_update(&state, Options::build_cmd()[i], strlen(Options::build_cmd()[i]) + 1);
+  }
+  build_trace = new BuildTrace(cache_dir_ + "/traces", Hash(XXH3_128bits_digest(&state)));
 }
 
 /**
@@ -206,6 +271,104 @@ static void add_to_hash_state(XXH3_state_t* state, const int i) {
   }
 }
 
+/**
+ * Replace the occurrences of base_dir in str with kBaseDirMarker.
+ *
+ * base_dir may appear anywhere in the arguments and environment variables, like in
+ * "-I/path/to/checkout/include" or in "PWD=/path/to/checkout".
+ *
+ * @return whether there was any occurrence, i.e. marked is set
+ */
+static bool mark_base_dir(std::string_view str, std::string* marked) {
+  if (base_dir.empty()) {
+    return false;
+  }
+  size_t pos = 0, found;
+  while ((found = str.find(base_dir, pos)) != std::string_view::npos) {
+    const size_t end = found + base_dir.length();
+    if (pos == 0) {
+      marked->clear();
+    }
+    if (end == str.length() || !continues_file_name(str[end])) {
+      marked->append(str.substr(pos, found - pos));
+      marked->append(FileName::kBaseDirMarker, FileName::kBaseDirMarkerLen);
+    } else {
+      marked->append(str.substr(pos, end - pos));
+    }
+    pos = end;
+  }
+  if (pos == 0) {
+    return false;
+  }
+  marked->append(str.substr(pos));
+  return true;
+}
+
+/**
+ * Whether the outputs of the process refer to base_dir, which would not be correct when they are
+ * replayed in a different directory.
+ */
+static bool outputs_contain_base_dir(const ExecedProcess *proc) {
+  for (const auto& [filename, fu] : proc->file_usages()) {
+    /* The result is kept in the hash cache, thus the parents don't scan the same files again. */
+    bool refers;
+    if (fu->written() && hash_cache->get_refers_to_base_dir(filename, &refers) && refers) {
+      FB_DEBUG(FB_DEBUG_CACHING, d(filename) + " refers to base_dir");
+      return true;
+    }
+  }
+  for (const inherited_file_t& inherited_file : proc->inherited_files()) {
+    if (!is_write(inherited_file.flags)) {
+      continue;
+    }
+    if (inherited_file.type == FD_PIPE_OUT && inherited_file.recorder) {
+      const PipeRecorder* recorder = inherited_file.recorder.get();
+      if (contains_dir(recorder->recorded_buffer(), base_dir)
+          || (recorder->recorded_fd() >= 0
+              && file_contains_dir(recorder->recorded_fd(), base_dir, 0,
+                                   recorder->recorded_size()))) {
+        FB_DEBUG(FB_DEBUG_CACHING, "Pipe output refers to base_dir");
+        return true;
+      }
+    } else if (inherited_file.type == FD_FILE) {
+      struct stat64 st;
+      int fd = open(inherited_file.filename->c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        const bool found = fstat64(fd, &st) == 0
+            && file_contains_dir(fd, base_dir, inherited_file.start_offset, st.st_size);
+        close(fd);
+        if (found) {
+          FB_DEBUG(FB_DEBUG_CACHING, d(inherited_file.filename) + " refers to base_dir");
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Add string to fingerprint with the occurrences of base_dir replaced by kBaseDirMarker,
+ * including the ending '\0'.
+ */
+static void add_to_hash_state_base_dir_marked(XXH3_state_t* state, const char* str,
+                                              size_t length) {
+  std::string marked;
+  if (mark_base_dir(std::string_view(str, length), &marked)) {
+    add_to_hash_state(state, marked);
+  } else {
+    add_to_hash_state(state, str, length);
+  }
+}
+
+static void add_to_hash_state_base_dir_marked(XXH3_state_t* state, const std::string& str) {
+  add_to_hash_state_base_dir_marked(state, str.c_str(), str.length());
+}
+
+static void add_to_hash_state_base_dir_marked(XXH3_state_t* state, const FileName* file_name) {
+  add_to_hash_state_base_dir_marked(state, file_name->c_str(), file_name->length());
+}
+
 static Hash state_to_hash(XXH3_state_t* state) {
   const XXH128_hash_t digest = XXH3_128bits_digest(state);
   return Hash(digest);
@@ -226,7 +389,8 @@ ExecedProcessCacher::ExecedProcessCacher(bool no_store,
                                          const libconfig::Config* cfg) :
     no_store_(no_store), no_fetch_(no_fetch),
     envs_skip_(), ignore_locations_hash_(), fingerprints_(), fingerprint_msgs_(),
-    cache_dir_(cache_dir) {
+    cache_dir_(cache_dir), libs_dir_(cache_dir + "/libs"),
+    uncacheable_dir_(cache_dir + "/uncacheable") {
   try {
     const libconfig::Setting& envs_skip = cfg->getRoot()["env_vars"]["fingerprint_skip"];
     for (int i = 0; i < envs_skip.getLength(); i++) {
@@ -316,7 +480,11 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
     abort();
   }
   add_to_hash_state(state, ignore_locations_hash_);
-  add_to_hash_state(state, proc->initial_wd());
+  if (!base_dir.empty()) {
+    /* Keep the entries storing paths relative to base_dir apart from the others. */
+    add_to_hash_state(state, FileName::kBaseDirMarker, FileName::kBaseDirMarkerLen);
+  }
+  add_to_hash_state_base_dir_marked(state, proc->initial_wd());
   /* Size is added to not allow collisions between elements of different containers.
    * Otherwise "cmd foo BAR=1" would collide with "env BAR=1 cmd foo". */
   add_to_hash_state(state, proc->args().size());
@@ -325,7 +493,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
   std::string found_param_file;
   Hash found_param_file_hash;
   for (const auto& arg : args) {
-    add_to_hash_state(state, arg);
+    add_to_hash_state_base_dir_marked(state, arg);
     /* Since we are already iterating over the args let's find a hint for hash_param_files(). */
     if (guess_file_params && (arg == "conftest.c" || arg == "objs/autotest.c")) {
       found_param_file = arg;
@@ -347,12 +515,12 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
   add_to_hash_state(state, proc->env_vars().size());
   for (const auto& env : proc->env_vars()) {
     if (env_fingerprintable(env)) {
-      add_to_hash_state(state, env);
+      add_to_hash_state_base_dir_marked(state, env);
     }
   }
 
   /* The executable and its hash */
-  add_to_hash_state(state, proc->executable());
+  add_to_hash_state_base_dir_marked(state, proc->executable());
   Hash hash;
   if (!hash_cache->get_hash(proc->executable(), 0, &hash)) {
     FB_DEBUG(FB_DEBUG_PROC, "Could not get hash of executable: " + d(proc->executable()));
@@ -363,10 +531,10 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
 
   if (proc->executable() == proc->executed_path()) {
     /* Those often match. Don't calculate the same hash twice then. */
-    add_to_hash_state(state, proc->executable());
+    add_to_hash_state_base_dir_marked(state, proc->executable());
     add_to_hash_state(state, hash);
   } else {
-    add_to_hash_state(state, proc->executed_path());
+    add_to_hash_state_base_dir_marked(state, proc->executed_path());
     if (!hash_cache->get_hash(proc->executed_path(), 0, &hash)) {
       FB_DEBUG(FB_DEBUG_PROC, "Could not get hash of executed path: " + d(proc->executed_path()));
       maybe_XXH3_freeState(state);
@@ -375,7 +543,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
     add_to_hash_state(state, hash);
   }
 
-  add_to_hash_state(state, proc->original_executed_path());
+  add_to_hash_state_base_dir_marked(state, proc->original_executed_path());
 
   add_to_hash_state(state, proc->libs().size());
   for (const auto lib : proc->libs()) {
@@ -390,7 +558,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
       return false;
 #endif
     }
-    add_to_hash_state(state, lib);
+    add_to_hash_state_base_dir_marked(state, lib);
     add_to_hash_state(state, hash);
   }
 
@@ -410,6 +578,9 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
   }
 
   fingerprints_[proc] = state_to_hash(state);
+  if (build_trace) {
+    build_trace->seen(fingerprints_[proc]);
+  }
 
   if (FB_DEBUGGING(FB_DEBUG_CACHE)) {
     /* Only when debugging: add an entry to fingerprint_msgs_.
@@ -424,8 +595,26 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
     }
     fp.set_ignore_locations(ignore_locations_vec);
 
-    fp.set_wd(proc->initial_wd()->c_str());
-    fp.set_args(proc->args());
+    /* The builder keeps pointers to the strings, reserve the space to not move them. */
+    std::vector<std::string> marked_strings;
+    marked_strings.reserve(proc->env_vars().size() + proc->libs().size() + 4);
+    auto marked = [&marked_strings](std::string_view str) {
+      std::string& ret = marked_strings.emplace_back();
+      if (!mark_base_dir(str, &ret)) {
+        ret = str;
+      }
+      return ret.c_str();
+    };
+    fp.set_wd(marked(proc->initial_wd()->c_str()));
+    std::vector<std::string> args_marked;
+    args_marked.reserve(proc->args().size());
+    for (const auto& arg : proc->args()) {
+      std::string& arg_marked = args_marked.emplace_back();
+      if (!mark_base_dir(arg, &arg_marked)) {
+        arg_marked = arg;
+      }
+    }
+    fp.set_args(args_marked);
 
     if (guess_file_params && found_param_file.size() > 0) {
       fp.set_param_file_hash(found_param_file_hash.get());
@@ -436,7 +625,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
     c_env.reserve(proc->env_vars().size());  /* likely minor optimization */
     for (const auto& env : proc->env_vars()) {
       if (env_fingerprintable(env)) {
-        c_env.push_back(env.c_str());
+        c_env.push_back(marked(env));
       }
     }
     fp.set_env_with_count(c_env.data(), c_env.size());
@@ -448,7 +637,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
       maybe_XXH3_freeState(state);
       return false;
     }
-    executable.set_path(proc->executable()->c_str());
+    executable.set_path(marked(proc->executable()->c_str()));
     executable.set_hash(hash.get());
     fp.set_executable(reinterpret_cast<FBBFP_Builder *>(&executable));
 
@@ -462,12 +651,12 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
         maybe_XXH3_freeState(state);
         return false;
       }
-      executed_path.set_path(proc->executed_path()->c_str());
+      executed_path.set_path(marked(proc->executed_path()->c_str()));
       executed_path.set_hash(hash.get());
       fp.set_executed_path(reinterpret_cast<FBBFP_Builder *>(&executed_path));
     }
 
-    fp.set_original_executed_path(proc->original_executed_path());
+    fp.set_original_executed_path(marked(proc->original_executed_path()));
 
     /* The linked libraries */
     std::vector<FBBFP_Builder_file> lib_builders;
@@ -486,7 +675,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
 #endif
       }
       FBBFP_Builder_file& lib_builder = lib_builders.emplace_back();
-      lib_builder.set_path(lib->c_str());
+      lib_builder.set_path(marked(lib->c_str()));
       lib_builder.set_hash(hash.get());
     }
     fp.set_libs_item_fn(lib_builders.size(), fbbfp_builder_file_vector_item_fn, &lib_builders);
@@ -526,7 +715,8 @@ static void add_file(std::vector<FBBSTORE_Builder_file>* files, const FileName*
                      const FileInfo& fi, bool output_file, const FileUsage* fu = nullptr,
                      const char* inline_data = nullptr, size_t inline_data_len = 0) {
   FBBSTORE_Builder_file& new_file = files->emplace_back();
-  new_file.set_path_with_length(file_name->c_str(), file_name->length());
+  const cstring_view path = file_name->stored_path();
+  new_file.set_path_with_length(path.c_str, path.length);
   new_file.set_type(fi.type());
   if (fi.size_known()) {
     new_file.set_size(fi.size());
@@ -550,8 +740,8 @@ static void add_file(std::vector<FBBSTORE_Builder_file>* files, const FileName*
   }
   /* Only store timestamp_source if the file still exists (wasn't deleted/temporary) */
   if (output_file && fu && fu->timestamp_source() && fi.type() != NOTEXIST) {
-    const FileName* ts_src = fu->timestamp_source();
-    new_file.set_timestamp_source_with_length(ts_src->c_str(), ts_src->length());
+    const cstring_view ts_src = fu->timestamp_source()->stored_path();
+    new_file.set_timestamp_source_with_length(ts_src.c_str, ts_src.length);
   }
 }
 
@@ -603,7 +793,8 @@ static bool consistent_implicit_parent_dirs(
   /* If the parent dir must not exist when shortcutting and the shortcut does not create it
    * either, then creating the new regular file would fail. */
   for (const FBBSTORE_Builder_file& file : out_path_isreg) {
-    if (!dir_created_or_could_exist(file.get_path(), file.get_path_len(),
+    const FileName* file_name = FileName::GetStored(file.get_path(), file.get_path_len());
+    if (!dir_created_or_could_exist(file_name->c_str(), file_name->length(),
                                     out_path_isdir_filename_ptrs, file_usages)) {
       return false;
     }
@@ -657,6 +848,28 @@ static bool rustc_ignored_dir(const ExecedProcess* const proc, const FileName* c
 }
 
 
+/**
+ * Whether the inputs of the process may match by their alternate hashes.
+ *
+ * Only the listed processes, like the compilers, are known to not depend on the parts of the files
+ * the normalizers drop, and only when they are not asked to look at the comments. GCC's
+ * -Wimplicit-fallthrough (enabled by -Wextra) reads the fall through comments, Clang's
+ * -Wdocumentation parses the doc comments and the preprocessor keeps the comments with -C and -CC.
+ */
+static bool alt_hash_allowed(const ExecedProcess* proc) {
+  if (!alt_hasher || !alt_hash_allow_list_matcher->match(proc)) {
+    return false;
+  }
+  for (const std::string& arg : proc->args()) {
+    if (arg == "-E" || arg == "-C" || arg == "-CC" || arg == "-W" || arg == "-Wextra"
+        || arg == "-Weverything" || arg.starts_with("-Wimplicit-fallthrough")
+        || arg.starts_with("-Wdocumentation")) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void ExecedProcessCacher::store(ExecedProcess *proc) {
   TRACK(FB_DEBUG_PROC, "proc=%s", D(proc));
 
@@ -674,6 +887,18 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
     return;
   }
 
+  if (!base_dir.empty() && outputs_contain_base_dir(proc)) {
+    /* The entry would be found in other directories, too, by the fingerprint relative to base_dir.
+     * The parent's outputs include the same, thus it won't be stored, either. */
+    FB_DEBUG(FB_DEBUG_CACHING, "Not storing cache entry because its outputs refer to base_dir");
+    return;
+  }
+
+  if (caching_policy && !caching_policy->worth_storing(proc)) {
+    return;
+  }
+
+  const int64_t start_ns = Metrics::now_ns();
   bool parent_may_be_just_sh_c_this = false;
   const ExecedProcess* const parent_exec_point = proc->parent_exec_point();
   if (parent_exec_point) {
@@ -729,6 +954,10 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
   size_t in_path_non_system_count {0},
       in_path_notexist_non_system_count {0};
 
+  /* The alternate hashes are checked only for the processes allowed to use them, and only if the
+   * process succeeded. */
+  const bool store_alt_hashes = alt_hash_allowed(proc)
+      && proc->fork_point()->exit_status() == 0;
   /* Construct in_path_* in 2 passes. First collect the non-system paths and then the system paths,
    * for better performance. */
   for (int pass = 0; pass < 2; pass++) {
@@ -760,7 +989,7 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
           break;
         case NOTEXIST:
           /* NOTEXIST is handled specially to save space in the FBB. */
-          in_path_notexist.push_back({filename->c_str(), filename->length()});
+          in_path_notexist.push_back(filename->stored_path());
           break;
         case ISDIR:
           if (fu->initial_state().hash_known()
@@ -780,6 +1009,13 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
             return;
           }
           add_file(&in_path, filename, fu->initial_state(), false);
+          if (store_alt_hashes && fu->initial_state().type() == ISREG
+              && fu->initial_state().hash_known()) {
+            Hash alt_hash;
+            if (alt_hasher->get_alt_hash(filename, fu->initial_state().hash(), &alt_hash)) {
+              in_path.back().set_alt_hash(alt_hash.get());
+            }
+          }
           break;
       }
     }
@@ -907,7 +1143,7 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
         break;
       case NOTEXIST:
         if (fu->initial_type() != NOTEXIST) {
-          out_path_notexist.push_back(filename->c_str());
+          out_path_notexist.push_back(filename->stored_path().c_str);
         }
         break;
       default:
@@ -1084,15 +1320,23 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
 
   /* Store in the cache everything about this process. */
   const Hash fingerprint = fingerprints_[proc];
-  obj_cache->store(fingerprint, reinterpret_cast<FBBSTORE_Builder *>(&pio), stored_blob_bytes,
-                   debug_msg);
+  Subkey subkey;
+  if (obj_cache->store(fingerprint, reinterpret_cast<FBBSTORE_Builder *>(&pio), stored_blob_bytes,
+                       debug_msg, &subkey)) {
+    if (build_trace) {
+      build_trace->record(fingerprint, subkey);
+    }
+    if (caching_policy) {
+      caching_policy->stored(proc, stored_blob_bytes, Metrics::now_ns() - start_ns);
+    }
+  }
 }
 
 void ExecedProcessCacher::update_cached_bytes(off_t bytes) {
   this_runs_cached_bytes_ += bytes;
 #ifdef FB_EXTRA_DEBUG
   off_t total = obj_cache->gc_collect_total_objects_size()
-      + blob_cache->gc_collect_total_blobs_size();
+      + blob_cache->gc_collect_total_blobs_size() + metadata_total_size();
   off_t stored = get_stored_bytes_from_cache();
   FB_DEBUG(FB_DEBUG_CACHING, " Cache-size real: " + d(total)
            + " calculated: " + d(stored + this_runs_cached_bytes_)
@@ -1101,6 +1345,28 @@ void ExecedProcessCacher::update_cached_bytes(off_t bytes) {
 #endif
 }
 
+bool ExecedProcessCacher::replace_metadata_file(const std::string& tmp_path,
+                                                const std::string& path) {
+  struct stat st;
+  if (stat(tmp_path.c_str(), &st) != 0) {
+    return false;
+  }
+  const off_t new_size = st.st_size;
+  const off_t old_size = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return false;
+  }
+  update_cached_bytes(new_size - old_size);
+  return true;
+}
+
+void ExecedProcessCacher::remove_metadata_file(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && unlink(path.c_str()) == 0) {
+    update_cached_bytes(-st.st_size);
+  }
+}
+
 /**
  * Create a FileInfo object based on an FBB's File entry.
  */
@@ -1131,11 +1397,14 @@ static FileUsageUpdate file_to_file_usage_update(const FileName *filename,
   return update;
 }
 
+/** Find the input file with the same stored path as the output file. */
 static const FBBSTORE_Serialized_file* find_input_file(const FBBSTORE_Serialized_process_inputs *pi,
-                                                       const FileName* path) {
+                                                       const FBBSTORE_Serialized_file *output) {
   for (size_t i = 0; i < pi->get_path_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(pi->get_path_at(i));
-    if (FileName::Get(file->get_path(), file->get_path_len()) == path) {
+    /* Compare the bytes to not touch the FileName db, this is also called from worker threads. */
+    if (file->get_path_len() == output->get_path_len()
+        && memcmp(file->get_path(), output->get_path(), output->get_path_len()) == 0) {
       return file;
     }
   }
@@ -1143,25 +1412,36 @@ static const FBBSTORE_Serialized_file* find_input_file(const FBBSTORE_Serialized
 }
 
 /**
- * Check whether the given process inputs match the file system's current contents
- * and the outputs are likely applicable.
+ * Check whether the file's current content has the same alternate hash as the input file had.
  */
-static bool pio_matches_fs(const FBBSTORE_Serialized_process_inputs_outputs *candidate_inouts,
-                           const char* const subkey, ExecedProcess* proc) {
-  TRACK(FB_DEBUG_PROC, "subkey=%s", D(subkey));
-
-  const FBBSTORE_Serialized *inputs_fbb = candidate_inouts->get_inputs();
-  assert_cmp(inputs_fbb->get_tag(), ==, FBBSTORE_TAG_process_inputs);
-  auto inputs =
-      reinterpret_cast<const FBBSTORE_Serialized_process_inputs *>(inputs_fbb);
+static bool alt_hash_matches(const FileName* path, const FBBSTORE_Serialized_file *file) {
+  if (!file->has_alt_hash() || file->get_type() != ISREG) {
+    return false;
+  }
+  /* Everything but the content must match. */
+  FileInfo query(ISREG);
+  query.set_mode_bits(file->get_mode_with_fallback(0), file->get_mode_mask_with_fallback(0));
+  Hash hash, alt_hash;
+  return hash_cache->file_info_matches(path, query)
+      && hash_cache->get_hash(path, 0, &hash)
+      && alt_hasher->get_alt_hash(path, hash, &alt_hash)
+      && alt_hash == Hash(file->get_alt_hash());
+}
 
+/**
+ * Check whether the given process inputs match the file system's current contents.
+ */
+static bool inputs_match_fs(const FBBSTORE_Serialized_process_inputs *inputs,
+                            const char* const subkey, ExecedProcess* proc,
+                            bool alt_hash_allowed) {
   size_t i;
 
   for (i = 0; i < inputs->get_path_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(inputs->get_path_at(i));
-    const auto path = FileName::Get(file->get_path(), file->get_path_len());
+    const auto path = FileName::GetStored(file->get_path(), file->get_path_len());
     const FileInfo query = file_to_file_info(file);
-    if (!hash_cache->file_info_matches(path, query)) {
+    if (!hash_cache->file_info_matches(path, query)
+        && !(alt_hash_allowed && alt_hash_matches(path, file))) {
       FB_DEBUG(FB_DEBUG_SHORTCUT, "│   " + d(subkey) + " mismatches e.g. at " + d(path));
       /* Store only the first mismatch. */
       if (Options::generate_report() && !proc->shortcut_result()) {
@@ -1173,8 +1453,8 @@ static bool pio_matches_fs(const FBBSTORE_Serialized_process_inputs_outputs *can
   }
 
   for (i = 0; i < inputs->get_path_notexist_count(); i++) {
-    const auto path = FileName::Get(inputs->get_path_notexist_at(i),
-                                    inputs->get_path_notexist_len_at(i));
+    const auto path = FileName::GetStored(inputs->get_path_notexist_at(i),
+                                          inputs->get_path_notexist_len_at(i));
     const FileInfo query(NOTEXIST);
     if (!hash_cache->file_info_matches(path, query)) {
       /* Store only the first mismatch. */
@@ -1190,27 +1470,58 @@ static bool pio_matches_fs(const FBBSTORE_Serialized_process_inputs_outputs *can
       return false;
     }
   }
+  return true;
+}
+
+/**
+ * Check whether the given process inputs match the file system's current contents
+ * and the outputs are likely applicable.
+ */
+static bool pio_matches_fs(const FBBSTORE_Serialized_process_inputs_outputs *candidate_inouts,
+                           const Hash& fingerprint, const char* const subkey,
+                           ExecedProcess* proc) {
+  TRACK(FB_DEBUG_PROC, "subkey=%s", D(subkey));
 
+  const FBBSTORE_Serialized *inputs_fbb = candidate_inouts->get_inputs();
+  assert_cmp(inputs_fbb->get_tag(), ==, FBBSTORE_TAG_process_inputs);
+  auto inputs =
+      reinterpret_cast<const FBBSTORE_Serialized_process_inputs *>(inputs_fbb);
   const FBBSTORE_Serialized_process_outputs *outputs =
       reinterpret_cast<const FBBSTORE_Serialized_process_outputs *>
       (candidate_inouts->get_outputs());
 
+  /* Checking the inputs may need hashing files, which can be skipped if they did not change since
+   * they last matched. */
+  if (!input_match_cache->matches(fingerprint, subkey, inputs)) {
+    /* The diagnostics and the exit status could depend on the dropped parts, e.g. on the comments.
+     * Match by the alternate hashes only if there were none. */
+    const bool alt_hash_ok = alt_hash_allowed(proc) && outputs->get_exit_status() == 0
+        && outputs->get_append_to_fd_count() == 0;
+    if (!inputs_match_fs(inputs, subkey, proc, alt_hash_ok)) {
+      return false;
+    }
+    input_match_cache->store(fingerprint, subkey, inputs);
+  }
+
   /* Check if shortcut is applicable, i.e. outputs can be created/can be written, etc. */
   // TODO(rbalint) extend these checks
-  for (i = 0; i < outputs->get_path_isreg_count(); i++) {
+  for (size_t i = 0; i < outputs->get_path_isreg_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(outputs->get_path_isreg_at(i));
-    if (file->get_type() == ISREG && access(file->get_path(), W_OK) == -1) {
+    if (file->get_type() != ISREG) {
+      continue;
+    }
+    const auto path = FileName::GetStored(file->get_path(), file->get_path_len());
+    if (access(path->c_str(), W_OK) == -1) {
       if (errno == EACCES) {
         /* The regular file can't be written, let's see if that was expected. */
-        const auto path = FileName::Get(file->get_path(), file->get_path_len());
-        const FBBSTORE_Serialized_file* input_file = find_input_file(inputs, path);
+        const FBBSTORE_Serialized_file* input_file = find_input_file(inputs, file);
         if (input_file && (file_to_file_info(file).mode_mask() & 0200)) {
           /* The file has already been checked to be not writable and will be replaced while
            * applying the shortcut. */
         } else {
           if (Options::generate_report() && !proc->shortcut_result()) {
             proc->set_shortcut_result(deduplicated_string(
-                std::string("file to be written is not writable: ") + file->get_path()).c_str());
+                std::string("file to be written is not writable: ") + path->c_str()).c_str());
           }
           return false;
         }
@@ -1220,6 +1531,37 @@ static bool pio_matches_fs(const FBBSTORE_Serialized_process_inputs_outputs *can
   return true;
 }
 
+const FBBSTORE_Serialized_process_inputs_outputs * ExecedProcessCacher::try_candidate(
+    ExecedProcess *proc,
+    const Hash& fingerprint,
+    const Subkey& subkey,
+    uint8_t **inouts_buf,
+    size_t *inouts_buf_len,
+    bool *munmap_entry) {
+  if (!obj_cache->retrieve(fingerprint, subkey.c_str(), inouts_buf, inouts_buf_len, nullptr,
+                           munmap_entry)) {
+    if (Options::generate_report()) {
+      proc->set_shortcut_result(deduplicated_string(
+          "could not retrieve " + d(subkey) + " from objcache").c_str());
+    }
+    FB_DEBUG(FB_DEBUG_SHORTCUT,
+             "│   Cannot retrieve " + d(subkey) + " from objcache, ignoring");
+    return nullptr;
+  }
+  auto candidate_inouts_fbb = reinterpret_cast<const FBBSTORE_Serialized *>(*inouts_buf);
+  assert_cmp(candidate_inouts_fbb->get_tag(), ==, FBBSTORE_TAG_process_inputs_outputs);
+  auto candidate_inouts =
+      reinterpret_cast<const FBBSTORE_Serialized_process_inputs_outputs *>(candidate_inouts_fbb);
+
+  if (pio_matches_fs(candidate_inouts, fingerprint, subkey.c_str(), proc)) {
+    FB_DEBUG(FB_DEBUG_SHORTCUT, "│   " + d(subkey) + " matches the file system");
+    return candidate_inouts;
+  } else {
+    ObjCache::free_entry(*inouts_buf, *inouts_buf_len, *munmap_entry);
+    return nullptr;
+  }
+}
+
 const FBBSTORE_Serialized_process_inputs_outputs * ExecedProcessCacher::find_shortcut(
     ExecedProcess *proc,
     uint8_t **inouts_buf,
@@ -1252,24 +1594,10 @@ const FBBSTORE_Serialized_process_inputs_outputs * ExecedProcessCacher::find_sho
                "│  Maximum shortcutting attempts (" + d(shortcut_tries) + ") exceeded, giving up");
       break;
     }
-    if (!obj_cache->retrieve(fingerprint, subkey.c_str(),
-                             &candidate_inouts_buf, &candidate_inouts_buf_len, nullptr,
-                             &candidate_munmap_entry)) {
-      if (Options::generate_report()) {
-        proc->set_shortcut_result(deduplicated_string(
-            "could not retrieve " + d(subkey) + " from objcache").c_str());
-      }
-      FB_DEBUG(FB_DEBUG_SHORTCUT,
-               "│   Cannot retrieve " + d(subkey) + " from objcache, ignoring");
-      continue;
-    }
-    auto candidate_inouts_fbb = reinterpret_cast<const FBBSTORE_Serialized *>(candidate_inouts_buf);
-    assert_cmp(candidate_inouts_fbb->get_tag(), ==, FBBSTORE_TAG_process_inputs_outputs);
-    auto candidate_inouts =
-        reinterpret_cast<const FBBSTORE_Serialized_process_inputs_outputs *>(candidate_inouts_fbb);
-
-    if (pio_matches_fs(candidate_inouts, subkey.c_str(), proc)) {
-      FB_DEBUG(FB_DEBUG_SHORTCUT, "│   " + d(subkey) + " matches the file system");
+    const FBBSTORE_Serialized_process_inputs_outputs *candidate_inouts =
+        try_candidate(proc, fingerprint, subkey, &candidate_inouts_buf, &candidate_inouts_buf_len,
+                      &candidate_munmap_entry);
+    if (candidate_inouts) {
 #ifdef FB_EXTRA_DEBUG
       count++;
       if (count == 1) {
@@ -1299,8 +1627,6 @@ const FBBSTORE_Serialized_process_inputs_outputs * ExecedProcessCacher::find_sho
        * cache files with identical content. */
       break;
 #endif
-    } else {
-      ObjCache::free_entry(candidate_inouts_buf, candidate_inouts_buf_len, candidate_munmap_entry);
     }
   }
   /* The retval is currently the same as the memory address to unmap (i.e. *inouts_buf).
@@ -1342,7 +1668,7 @@ static bool restore_dirs(
     const FBBSTORE_Serialized *dir_generic = outputs->get_path_isdir_at(indices[i]);
     assert_cmp(dir_generic->get_tag(), ==, FBBSTORE_TAG_file);
     auto dir = reinterpret_cast<const FBBSTORE_Serialized_file *>(dir_generic);
-    const auto path = FileName::Get(dir->get_path(), dir->get_path_len());
+    const auto path = FileName::GetStored(dir->get_path(), dir->get_path_len());
     assert(dir->has_mode());
     mode_t mode = dir->get_mode();
     FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Creating directory: " + d(path));
@@ -1411,9 +1737,10 @@ static void remove_files_and_dirs(
   std::sort(indices.begin(), indices.end(), pathname_length_greater);
   /* Process the directory names in descending order of their lengths */
   for (i = 0; i < outputs->get_path_notexist_count(); i++) {
-    const auto path = FileName::Get(outputs->get_path_notexist_at(indices[i]),
-                                    outputs->get_path_notexist_len_at(indices[i]));
+    const auto path = FileName::GetStored(outputs->get_path_notexist_at(indices[i]),
+                                          outputs->get_path_notexist_len_at(indices[i]));
     FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Deleting file or directory: " + d(path));
+    hash_cache->forget_virtual_file(path);
     if (unlink(path->c_str()) < 0 && errno == EISDIR) {
       rmdir(path->c_str());
     }
@@ -1425,6 +1752,112 @@ static void remove_files_and_dirs(
   }
 }
 
+/* The mode of the files created by the supervisor without setting the mode explicitly. */
+static mode_t default_file_mode() {
+  static const mode_t mode = [] {
+    const mode_t mask = umask(0);
+    umask(mask);
+    return 0666 & ~mask;
+  }();
+  return mode;
+}
+
+/**
+ * Check if a regular file of the shortcut process can be restored only in the hash cache, to be
+ * written later, when it's needed.
+ *
+ * Executables are written immediately, because they may be exec()-ed without the supervisor
+ * knowing in advance. Existing files are overwritten immediately, too, not to leave their old
+ * content visible.
+ */
+static bool can_restore_lazily(const FBBSTORE_Serialized_file *file, const FileName *path) {
+  if (!lazy_outputs || !file->has_hash() || !file->has_size() || file->has_timestamp_source()
+      || hash_cache->virtual_files_count() >= kMaxVirtualFiles
+      || path->is_in_ignore_location()) {
+    return false;
+  }
+  const mode_t mode = file->has_mode() ? file->get_mode() : default_file_mode();
+  if (mode & 0111) {
+    return false;
+  }
+  struct stat64 st;
+  return lstat64(path->c_str(), &st) == -1 && errno == ENOENT;
+}
+
+/**
+ * Check if the regular file to be restored is already present with the same content, e.g. because
+ * the build is repeated. If so, just update its modification time like rewriting it would do.
+ */
+static bool keep_identical_file(const FBBSTORE_Serialized_file *file, const FileName *path) {
+  if (!file->has_hash() || !file->has_size() || file->has_timestamp_source()) {
+    return false;
+  }
+  /* Hashing a file that most likely differs would cost more than rewriting it. */
+  const Hash hash(file->get_hash());
+  if (!hash_cache->known_hash_matches(path, hash, file->get_size())) {
+    return false;
+  }
+  if (utimensat(AT_FDCWD, path->c_str(), nullptr, 0) == -1) {
+    /* A file restored lazily is not there yet and needs no touching. */
+    return errno == ENOENT && hash_cache->virtual_files_count() > 0;
+  }
+  hash_cache->update_written_file(path, hash, file->get_size(),
+                                  file->get_inline_data_count() == 0);
+  return true;
+}
+
+/**
+ * Restore a regular file's contents from inline data or from the blob cache.
+ *
+ * Called from worker threads, thus it must not touch the FileName db or the process tree.
+ */
+static bool restore_file_contents(const FBBSTORE_Serialized_file *file, const FileName *path,
+                                  int blob_fd, const FBBSTORE_Serialized_process_inputs *inputs) {
+  /* Check if data is inlined */
+  fbb_size_t inline_data_len = file->get_inline_data_count();
+  if (inline_data_len > 0) {
+    const char *inline_data = file->get_inline_data();
+
+    /* Write inline data to file */
+    int fd = open(path->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Could not open file for writing: " + d(path));
+      return false;
+    }
+    ssize_t written = 0;
+    while (std::cmp_less(written, inline_data_len)) {
+      ssize_t n = write(fd, inline_data + written, inline_data_len - written);
+      if (n <= 0) {
+        close(fd);
+        FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Could not write inline data to file: " + d(path));
+        return false;
+      }
+      written += n;
+    }
+    close(fd);
+  } else if (!blob_cache->retrieve_file(blob_fd, path, false, file->has_compressed_hash())) {
+    /* The file may not be writable but it may be expected and already checked. */
+    const FBBSTORE_Serialized_file* input_file = find_input_file(inputs, file);
+    if (errno == EACCES && input_file && (file_to_file_info(file).mode_mask() & 0200)) {
+      /* The file has already been checked to be not writable and should be completely
+       *  replaced from the cache. Let's remove it and try again. */
+      if (unlink(path->c_str()) == -1) {
+        fb_perror("Failed removing file to be replaced from cache");
+        assert(0);
+      }
+      /* Try retrieving the same file again. */
+      if (!blob_cache->retrieve_file(blob_fd, path, false, file->has_compressed_hash())) {
+        fb_perror("Failed creating file from cache");
+        assert(0);
+      }
+    } else {
+      fb_perror("Failed opening file to be recreated from cache");
+      assert(0);
+    }
+  }
+  return true;
+}
+
 /**
  * Applies the given shortcut.
  *
@@ -1441,7 +1874,9 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
    public:
     ~BlobFds() {
       for (int fd : *this) {
-        close(fd);
+        if (fd >= 0) {
+          close(fd);
+        }
       }
     }
     bool add_from_hash(const XXH128_hash_t& fbb_hash) {
@@ -1494,13 +1929,24 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
 
     for (i = 0; i < inputs->get_path_count(); i++) {
       auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(inputs->get_path_at(i));
-      const auto path = FileName::Get(file->get_path(), file->get_path_len());
+      const auto path = FileName::GetStored(file->get_path(), file->get_path_len());
       FileInfo info = file_to_file_info(file);
+      if (file->has_alt_hash()) {
+        /* The input may have matched only by its alternate hash, register the actual content. */
+        Hash hash;
+        bool is_dir;
+        ssize_t size;
+        if (hash_cache->get_hash(path, 0, &hash) && hash != info.hash()
+            && hash_cache->get_statinfo(path, &is_dir, &size)) {
+          info.set_hash(hash);
+          info.set_size(size);
+        }
+      }
       registration_point->register_file_usage_update(path, FileUsageUpdate(path, info));
     }
     for (i = 0; i < inputs->get_path_notexist_count(); i++) {
-      const auto path = FileName::Get(inputs->get_path_notexist_at(i),
-                                      inputs->get_path_notexist_len_at(i));
+      const auto path = FileName::GetStored(inputs->get_path_notexist_at(i),
+                                            inputs->get_path_notexist_len_at(i));
       registration_point->register_file_usage_update(path, FileUsageUpdate(path, NOTEXIST));
     }
   }
@@ -1509,69 +1955,77 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
     return false;
   }
 
+  /* Restore the regular files' contents in parallel, they are independent of each other and the
+   * directories are already in place. Paths and blob fds are resolved upfront on this thread. */
+  struct RestoreJob {
+    const FBBSTORE_Serialized_file *file;
+    const FileName *path;
+    int blob_fd;
+  };
+  std::vector<RestoreJob> restore_jobs;
   size_t next_blob_fd_idx = 0;
   for (i = 0; i < outputs->get_path_isreg_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(outputs->get_path_isreg_at(i));
-    const auto path = FileName::Get(file->get_path(), file->get_path_len());
+    if (file->get_type() != ISREG) {
+      continue;
+    }
+    const auto path = FileName::GetStored(file->get_path(), file->get_path_len());
+    if (keep_identical_file(file, path)) {
+      FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Keeping identical file: " + d(path));
+      if (file->get_inline_data_count() == 0) {
+        next_blob_fd_idx++;
+      }
+    } else if (file->get_inline_data_count() > 0) {
+      FB_DEBUG(FB_DEBUG_SHORTCUT,
+               "│   Restoring file from inline data: "
+               + d(path) + " size=" + d(file->get_inline_data_count()));
+      hash_cache->forget_virtual_file(path);
+      restore_jobs.push_back({file, path, -1});
+    } else if (can_restore_lazily(file, path)) {
+      FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Restoring file lazily: " + d(path));
+      FileInfo info = file_to_file_info(file);
+      info.set_mode_bits((file->has_mode() ? file->get_mode() : default_file_mode()) & 0777,
+                         07777);
+      /* The hash cache closes the blob fd after writing the file. */
+      hash_cache->add_virtual_file(path, info, blob_fds[next_blob_fd_idx],
+                                   file->has_compressed_hash(), file->has_mode());
+      blob_fds[next_blob_fd_idx++] = -1;
+    } else {
+      FB_DEBUG(FB_DEBUG_SHORTCUT,
+               "│   Fetching file from blobs cache: "
+               + d(path));
+      hash_cache->forget_virtual_file(path);
+      restore_jobs.push_back({file, path, blob_fds[next_blob_fd_idx++]});
+    }
+  }
+  const auto inputs =
+      reinterpret_cast<const FBBSTORE_Serialized_process_inputs *>(inouts->get_inputs());
+  std::atomic<bool> restore_failed {false};
+  /* Keep the method tracker's output in order when debugging. */
+  const unsigned int restore_threads =
+      (restore_jobs.size() < kMinFilesForParallelRestore || FB_DEBUGGING(FB_DEBUG_FUNC)) ? 1
+      : std::min(kMaxRestoreThreads, std::thread::hardware_concurrency());
+  parallel_for(restore_jobs.size(), restore_threads, [&](size_t job_idx) {
+    const RestoreJob& job = restore_jobs[job_idx];
+    if (!restore_file_contents(job.file, job.path, job.blob_fd, inputs)) {
+      restore_failed = true;
+    }
+  });
+  if (restore_failed) {
+    return false;
+  }
+
+  for (i = 0; i < outputs->get_path_isreg_count(); i++) {
+    auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(outputs->get_path_isreg_at(i));
+    const auto path = FileName::GetStored(file->get_path(), file->get_path_len());
+    if (file->get_type() == EXIST) {
+      /* Only the mode is changed, the file has to be there. */
+      hash_cache->materialize(path);
+    }
     switch (file->get_type()) {
       case ISREG:
-        {
-          /* Check if data is inlined */
-          fbb_size_t inline_data_len = file->get_inline_data_count();
-          if (inline_data_len > 0) {
-            FB_DEBUG(FB_DEBUG_SHORTCUT,
-                     "│   Restoring file from inline data: "
-                     + d(path) + " size=" + d(inline_data_len));
-            const char *inline_data = file->get_inline_data();
-
-            /* Write inline data to file */
-            int fd = open(path->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-              FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Could not open file for writing: " + d(path));
-              return false;
-            }
-            ssize_t written = 0;
-            while (std::cmp_less(written, inline_data_len)) {
-              ssize_t n = write(fd, inline_data + written, inline_data_len - written);
-              if (n <= 0) {
-                close(fd);
-                FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Could not write inline data to file: " + d(path));
-                return false;
-              }
-              written += n;
-            }
-            close(fd);
-          } else {
-            FB_DEBUG(FB_DEBUG_SHORTCUT,
-                     "│   Fetching file from blobs cache: "
-                     + d(path));
-            if (!blob_cache->retrieve_file(blob_fds[next_blob_fd_idx++], path, false,
-                                           file->has_compressed_hash())) {
-              /* The file may not be writable but it may be expected and already checked. */
-              const FBBSTORE_Serialized_file* input_file =
-                  find_input_file(
-                      reinterpret_cast<const FBBSTORE_Serialized_process_inputs *>(
-                          inouts->get_inputs()), path);
-              if (errno == EACCES && input_file && (file_to_file_info(file).mode_mask() & 0200)) {
-                /* The file has already been checked to be not writable and should be completely
-                 *  replaced from the cache. Let's remove it and try again. */
-                if (unlink(path->c_str()) == -1) {
-                  fb_perror("Failed removing file to be replaced from cache");
-                  assert(0);
-                }
-                /* Try retrieving the same file again. */
-                if (!blob_cache->retrieve_file(blob_fds[next_blob_fd_idx - 1], path, false,
-                                               file->has_compressed_hash())) {
-                  fb_perror("Failed creating file from cache");
-                  assert(0);
-                }
-              } else {
-                fb_perror("Failed opening file to be recreated from cache");
-                assert(0);
-              }
-            }
-          }
-        }
+        /* The contents are already restored above, or will be written with the right mode when
+         * restored lazily. */
         [[fallthrough]];
       case EXIST:
         {
@@ -1583,7 +2037,8 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
           /* Apply timestamp from source file if this was a touch -r operation */
           if (file->has_timestamp_source()) {
             const FileName* source_file =
-                FileName::Get(file->get_timestamp_source(), file->get_timestamp_source_len());
+                FileName::GetStored(file->get_timestamp_source(),
+                                    file->get_timestamp_source_len());
             struct stat64 st;
             if (stat64(source_file->c_str(), &st) == 0) {
               struct timespec times[2];
@@ -1623,7 +2078,7 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
     auto serialized_append_to_fd = reinterpret_cast<const FBBSTORE_Serialized_append_to_fd *>
         (outputs->get_append_to_fd_at(i));
     const int append_to_fd = serialized_append_to_fd->get_fd();
-    FileFD *ffd = proc->get_fd(append_to_fd);
+    const FileFD *ffd = proc->get_fd(append_to_fd);
     assert(ffd);
 
     if (ffd->type() == FD_PIPE_OUT) {
@@ -1763,22 +2218,49 @@ bool ExecedProcessCacher::shortcut(ExecedProcess *proc, std::vector<int> *fds_ap
 
   Subkey subkey;
   bool munmap_entry = false;
-  if (proc->can_shortcut()) {
+  const int64_t start_ns = Metrics::now_ns();
+  const bool look_up = proc->can_shortcut() && !proc->skip_cache_lookup();
+  if (look_up) {
+    TraceSpan span(proc->fb_pid(), "find_shortcut");
     inouts = find_shortcut(proc, &inouts_buf, &inouts_buf_len, &munmap_entry, &subkey);
+  } else if (proc->skip_cache_lookup()) {
+    FB_DEBUG(FB_DEBUG_SHORTCUT, "│ Lookup skipped, shortcutting is not worth it based on "
+             "previous runs");
   }
 
   FB_DEBUG(FB_DEBUG_SHORTCUT, inouts ? "│ Shortcutting:" : "│ Not shortcutting.");
 
   if (inouts) {
-    ret = apply_shortcut(proc, inouts, fds_appended_to);
+    /* The process does no work from now on, let make start an other job in its job slot until
+     * it exits. */
+    Jobserver* jobserver = max_lent_jobserver_tokens > 0 ? Jobserver::Get(proc) : nullptr;
+    if (jobserver && jobserver->lend()) {
+      proc->set_jobserver_token_lent(true);
+    }
+    {
+      TraceSpan span(proc->fb_pid(), "apply_shortcut");
+      ret = apply_shortcut(proc, inouts, fds_appended_to);
+    }
+    if (!ret && proc->jobserver_token_lent()) {
+      /* The process will be run, using the job slot. */
+      jobserver->reclaim();
+      proc->set_jobserver_token_lent(false);
+    }
     FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Exiting with " + d(proc->fork_point()->exit_status()));
     if (ret) {
       Hash fp = fingerprints_[proc];
       obj_cache->mark_as_used(fp, subkey.c_str());
-      shortcut_hits_++;
+      if (build_trace) {
+        build_trace->record(fp, subkey);
+      }
+        shortcut_hits_++;
       if (inouts->has_cpu_time_ms()) {
         proc->add_shortcut_cpu_time_ms(inouts->get_cpu_time_ms());
       }
+      if (caching_policy) {
+        caching_policy->shortcut(proc, inouts->has_cpu_time_ms() ? inouts->get_cpu_time_ms() : 0,
+                                 Metrics::now_ns() - start_ns);
+      }
     } else if (Options::generate_report()) {
       proc->set_shortcut_result("applying shortcut failed");
     }
@@ -1788,10 +2270,316 @@ bool ExecedProcessCacher::shortcut(ExecedProcess *proc, std::vector<int> *fds_ap
   }
   FB_DEBUG(FB_DEBUG_SHORTCUT, "└─");
 
+  if (!ret && caching_policy && look_up) {
+    caching_policy->missed(proc, Metrics::now_ns() - start_ns);
+  }
   proc->set_was_shortcut(ret);
   return ret;
 }
 
+/* /x/<ascii key> */
+static std::string metadata_path(const std::string& base, const Hash& key, bool create_dirs) {
+  const std::string ascii = key.to_ascii();
+  const std::string dir = base + "/" + ascii[0];
+  if (create_dirs) {
+    mkdir(base.c_str(), 0700);
+    mkdir(dir.c_str(), 0700);
+  }
+  return dir + "/" + ascii;
+}
+
+/**
+ * Read a whole FBB file.
+ * @return the data to be free()-d by the caller, or nullptr if the file could not be read
+ */
+static uint8_t* load_fbb(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat64 st;
+  if (fstat64(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  /* FBB needs aligned data, malloc() guarantees that. */
+  uint8_t* buf = reinterpret_cast<uint8_t*>(malloc(st.st_size));
+  if (fb_read(fd, buf, st.st_size) != st.st_size) {
+    free(buf);
+    close(fd);
+    return nullptr;
+  }
+  close(fd);
+  return buf;
+}
+
+/** Atomically replace the file at path with the serialized FBB. */
+static void store_fbb(const std::string& path, const FBBSTORE_Builder* builder,
+                      const char* error_msg) {
+  const size_t len = builder->measure();
+  char* buf = reinterpret_cast<char*>(malloc(len));
+  builder->serialize(buf);
+  const std::string tmp_path = path + "." + std::to_string(getpid());
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    fb_perror(error_msg);
+  } else {
+    const bool written = fb_write(fd, buf, len) == static_cast<ssize_t>(len);
+    close(fd);
+    if (!written || !execed_process_cacher->replace_metadata_file(tmp_path, path)) {
+      fb_perror(error_msg);
+      unlink(tmp_path.c_str());
+    }
+  }
+  free(buf);
+}
+
+/**
+ * Add the paths and the listings' hashes of the colon separated directories the dynamic linker
+ * searches, to notice libraries showing up in an earlier directory.
+ */
+static void add_lib_dirs_to_hash_state(XXH3_state_t* state, std::string_view dirs,
+                                       const FileName* origin) {
+  while (!dirs.empty()) {
+    const size_t colon = dirs.find(':');
+    std::string dir(dirs.substr(0, colon));
+    dirs.remove_prefix(colon == std::string_view::npos ? dirs.size() : colon + 1);
+    for (const char* origin_var : {"${ORIGIN}", "$ORIGIN"}) {
+      const size_t pos = dir.find(origin_var);
+      if (pos != std::string::npos && origin) {
+        dir.replace(pos, strlen(origin_var), origin->c_str());
+      }
+    }
+    add_to_hash_state_base_dir_marked(state, dir);
+    Hash hash;
+    bool is_dir;
+    if (path_is_absolute(dir.c_str())
+        && hash_cache->get_hash(FileName::GetCanonicalized(dir.c_str(), dir.size(),
+                                                           FileName::Get("/", 1)),
+                                0, &hash, &is_dir) && is_dir) {
+      add_to_hash_state(state, hash);
+    } else {
+      add_to_hash_state(state, -1);
+    }
+  }
+}
+
+/**
+ * Compute the key of the shared libraries loaded by the executable, from the executable's path
+ * and content, the environment variables affecting the dynamic linker, the dynamic linker's cache
+ * and the directories searched before it.
+ */
+static bool libs_key(const FileName* executable, const std::vector<std::string>& env_vars,
+                     Hash* key) {
+  Hash hash;
+  if (!hash_cache->get_hash(executable, 0, &hash)) {
+    return false;
+  }
+  XXH3_state_t state;
+  if (XXH3_128bits_reset_withSeed(&state, kFingerprintVersion) == XXH_ERROR) {
+    abort();
+  }
+  if (!base_dir.empty()) {
+    add_to_hash_state(&state, FileName::kBaseDirMarker, FileName::kBaseDirMarkerLen);
+  }
+  add_to_hash_state_base_dir_marked(&state, executable);
+  add_to_hash_state(&state, hash);
+  for (const auto& env : env_vars) {
+    if (env.starts_with("LD_") || env.starts_with("DYLD_")) {
+      add_to_hash_state_base_dir_marked(&state, env);
+    }
+    if (env.starts_with("LD_LIBRARY_PATH=")) {
+      add_lib_dirs_to_hash_state(&state, std::string_view(env).substr(strlen("LD_LIBRARY_PATH=")),
+                                 nullptr);
+    }
+  }
+#ifndef __APPLE__
+  /* The search path is the same while the executable's content is the same. */
+  static tsl::hopscotch_map<Hash, std::string> search_paths;
+  auto it = search_paths.find(hash);
+  if (it == search_paths.end()) {
+    std::string search_path;
+    get_elf_search_path(executable->c_str(), &search_path);
+    it = search_paths.insert({hash, std::move(search_path)}).first;
+  }
+  add_lib_dirs_to_hash_state(&state, it->second, executable->parent_dir());
+  Hash ld_so_cache_hash;
+  if (hash_cache->get_hash(FileName::Get("/etc/ld.so.cache", -1), 0, &ld_so_cache_hash)) {
+    add_to_hash_state(&state, ld_so_cache_hash);
+  } else {
+    add_to_hash_state(&state, -1);
+  }
+#endif
+  *key = state_to_hash(&state);
+  return true;
+}
+
+bool ExecedProcessCacher::load_libs(const Hash& key, std::vector<const FileName*>* libs) const {
+  uint8_t* buf = load_fbb(metadata_path(libs_dir_, key, false));
+  if (!buf) {
+    return false;
+  }
+  auto libs_fbb = reinterpret_cast<const FBBSTORE_Serialized *>(buf);
+  const bool ret = libs_fbb->get_tag() == FBBSTORE_TAG_libs;
+  if (ret) {
+    auto libs_msg = reinterpret_cast<const FBBSTORE_Serialized_libs *>(libs_fbb);
+    libs->clear();
+    for (size_t i = 0; i < libs_msg->get_lib_count(); i++) {
+      libs->push_back(FileName::GetStored(libs_msg->get_lib_at(i), libs_msg->get_lib_len_at(i)));
+    }
+  }
+  free(buf);
+  return ret;
+}
+
+bool ExecedProcessCacher::predict_libs(const FileName* executable,
+                                       const std::vector<std::string>& env_vars,
+                                       std::vector<const FileName*>* libs) {
+  if (no_fetch_) {
+    return false;
+  }
+  Hash key;
+  if (!libs_key(executable, env_vars, &key)) {
+    return false;
+  }
+  auto it = libs_.find(key);
+  if (it != libs_.end()) {
+    *libs = it->second;
+    return true;
+  }
+  if (!load_libs(key, libs)) {
+    return false;
+  }
+  libs_[key] = *libs;
+  return true;
+}
+
+void ExecedProcessCacher::learn_libs(const ExecedProcess *proc) {
+  if (no_store_) {
+    return;
+  }
+  Hash key;
+  if (!libs_key(proc->executable(), proc->env_vars(), &key)) {
+    return;
+  }
+  auto it = libs_.find(key);
+  if (it != libs_.end() && it->second == proc->libs()) {
+    return;
+  }
+  std::vector<const FileName*> stored_libs;
+  if (it == libs_.end() && load_libs(key, &stored_libs) && stored_libs == proc->libs()) {
+    libs_[key] = std::move(stored_libs);
+    return;
+  }
+  FB_DEBUG(FB_DEBUG_CACHING, "Storing the shared libraries of " + d(proc->executable()));
+  std::vector<const char*> lib_names;
+  lib_names.reserve(proc->libs().size());
+  for (const FileName* lib : proc->libs()) {
+    lib_names.push_back(lib->stored_path().c_str);
+  }
+  FBBSTORE_Builder_libs libs_msg;
+  libs_msg.set_lib_with_count(lib_names.data(), lib_names.size());
+  store_fbb(metadata_path(libs_dir_, key, true),
+            reinterpret_cast<const FBBSTORE_Builder *>(&libs_msg),
+            "Failed storing shared libraries");
+  libs_[key] = proc->libs();
+}
+
+/** Compute the key of the uncacheable verdicts from the command line, without hashing any file. */
+static Hash uncacheable_key(const ExecedProcess *proc) {
+  XXH3_state_t state;
+  if (XXH3_128bits_reset_withSeed(&state, kFingerprintVersion) == XXH_ERROR) {
+    abort();
+  }
+  add_to_hash_state_base_dir_marked(&state, proc->executable());
+  add_to_hash_state_base_dir_marked(&state, proc->initial_wd());
+  add_to_hash_state(&state, proc->args().size());
+  for (const auto& arg : proc->args()) {
+    add_to_hash_state_base_dir_marked(&state, arg);
+  }
+  return state_to_hash(&state);
+}
+
+bool ExecedProcessCacher::load_uncacheable(const Hash& key, UncacheableVerdict* verdict) const {
+  uint8_t* buf = load_fbb(metadata_path(uncacheable_dir_, key, false));
+  if (!buf) {
+    return false;
+  }
+  auto verdict_fbb = reinterpret_cast<const FBBSTORE_Serialized *>(buf);
+  const bool ret = verdict_fbb->get_tag() == FBBSTORE_TAG_uncacheable;
+  if (ret) {
+    auto verdict_msg = reinterpret_cast<const FBBSTORE_Serialized_uncacheable *>(verdict_fbb);
+    verdict->runs = verdict_msg->get_runs();
+    verdict->expires = verdict_msg->get_expires();
+    verdict->reason = deduplicated_string(
+        std::string("Not cacheable in the previous runs: ")
+        + std::string(verdict_msg->get_reason(), verdict_msg->get_reason_len())).c_str();
+  }
+  free(buf);
+  return ret;
+}
+
+/* A single run may have been disturbed by something unusual, require the process to be found not
+ * cacheable in this many consecutive runs. */
+static const int kUncacheableRunsToSkip = 2;
+
+const char* ExecedProcessCacher::uncacheable_reason(const ExecedProcess *proc) {
+  if (no_fetch_ || uncacheable_expiry <= 0) {
+    return nullptr;
+  }
+  const Hash key = uncacheable_key(proc);
+  auto it = uncacheable_.find(key);
+  if (it == uncacheable_.end()) {
+    UncacheableVerdict verdict {0, 0, nullptr, false, false};
+    load_uncacheable(key, &verdict);
+    it = uncacheable_.emplace(key, verdict).first;
+  }
+  UncacheableVerdict& verdict = it.value();
+  if (verdict.runs < kUncacheableRunsToSkip || verdict.expires <= time(nullptr)) {
+    return nullptr;
+  }
+  verdict.applied = true;
+  return verdict.reason;
+}
+
+void ExecedProcessCacher::update_uncacheable(const ExecedProcess *proc) {
+  if (no_store_ || uncacheable_expiry <= 0) {
+    return;
+  }
+  const Hash key = uncacheable_key(proc);
+  auto it = uncacheable_.find(key);
+  if (it == uncacheable_.end() || it->second.applied || it->second.updated) {
+    /* The process was not checked, e.g. because it matched dont_shortcut, or it was not
+     * fingerprinted due to the verdict, or an earlier process of this run updated the verdict. */
+    return;
+  }
+  UncacheableVerdict& verdict = it.value();
+  verdict.updated = true;
+  if (proc->can_shortcut()) {
+    if (verdict.runs > 0) {
+      FB_DEBUG(FB_DEBUG_CACHING, "Forgetting that " + d(proc) + " could not be cached");
+      remove_metadata_file(metadata_path(uncacheable_dir_, key, false));
+      verdict.runs = 0;
+    }
+    return;
+  }
+  if (proc->cant_shortcut_proc() != proc) {
+    /* The reason is in a descendant, which gets its own verdict. */
+    return;
+  }
+  verdict.runs++;
+  verdict.expires = time(nullptr) + uncacheable_expiry;
+  FB_DEBUG(FB_DEBUG_CACHING, "Storing that " + d(proc) + " could not be cached in "
+           + d(verdict.runs) + " runs");
+  FBBSTORE_Builder_uncacheable verdict_msg;
+  verdict_msg.set_reason(proc->cant_shortcut_reason());
+  verdict_msg.set_runs(verdict.runs);
+  verdict_msg.set_expires(verdict.expires);
+  store_fbb(metadata_path(uncacheable_dir_, key, true),
+            reinterpret_cast<const FBBSTORE_Builder *>(&verdict_msg),
+            "Failed storing uncacheable verdict");
+}
+
 /**
  * Checks if the blob is present in the blob cache and saves existing blobs' hash to
  * referenced_blobs. */
@@ -1836,6 +2624,10 @@ bool ExecedProcessCacher::is_entry_usable(uint8_t* entry_buf,
    */
   for (size_t i = 0; i < inputs->get_path_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(inputs->get_path_at(i));
+    if (FileName::isStoredInBaseDir(file->get_path(), file->get_path_len())) {
+      /* Not a system file and base_dir may not even be set when collecting garbage. */
+      continue;
+    }
     const auto path {FileName::Get(file->get_path(), file->get_path_len())};
     const FileInfo query {file_to_file_info(file)};
     if (query.type() == ISREG && path->is_in_read_only_location() &&
@@ -2029,7 +2821,8 @@ off_t ExecedProcessCacher::fix_stored_bytes() const {
   // same time making the file content inaccurate.
   const std::string size_file = cache_dir_ + "/" + kCacheSizeFile;
   off_t starting_cached_bytes =  obj_cache->gc_collect_total_objects_size()
-      + blob_cache->gc_collect_total_blobs_size() - this_runs_cached_bytes_;
+      + blob_cache->gc_collect_total_blobs_size() + metadata_total_size()
+      - this_runs_cached_bytes_;
   if (file_overwrite_printf(size_file, "%ld\n", starting_cached_bytes) < 0) {
     fb_error("writing cache size file failed");
     exit(EXIT_FAILURE);
@@ -2037,6 +2830,167 @@ off_t ExecedProcessCacher::fix_stored_bytes() const {
   return starting_cached_bytes;
 }
 
+/* Temporary files of the stores left behind by a crashed firebuild are removed after this time. */
+static const time_t kStaleTmpFileSeconds = 24 * 3600;
+
+/** Whether gc should keep the file of a metadata store, called with the path, name and time. */
+typedef bool (*metadata_keep_fn_t)(const std::string& path, const char* name, time_t now);
+
+/**
+ * Garbage collect a directory of stored metadata recursively, removing the files keep() rejects.
+ *
+ * The temporary files, named with a '.', are kept until they get stale, a parallel build may be
+ * about to rename them.
+ *
+ * @param path the directory
+ * @param[in,out] cache_bytes increased by the kept files' sizes
+ * @param keep returns whether to keep the file
+ * @param now the time gc started
+ */
+static void gc_metadata_dir(const std::string& path, off_t* cache_bytes, metadata_keep_fn_t keep,
+                            time_t now) {
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent* dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    const char* name = dirent->d_name;
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue;
+    }
+    const std::string file_path = path + "/" + name;
+    switch (fixed_dirent_type(dirent, dir, path)) {
+      case DT_DIR:
+        gc_metadata_dir(file_path, cache_bytes, keep, now);
+        break;
+      case DT_REG: {
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, 0) != 0) {
+          break;
+        }
+        const bool is_tmp = strchr(name, '.') != nullptr;
+        if (is_tmp ? now - st.st_mtime < kStaleTmpFileSeconds : keep(file_path, name, now)) {
+          *cache_bytes += st.st_size;
+        } else {
+          FB_DEBUG(FB_DEBUG_CACHING, "Removing " + file_path);
+          if (unlink(file_path.c_str()) != 0) {
+            fb_perror(("unlink " + file_path).c_str());
+            *cache_bytes += st.st_size;
+          } else {
+            execed_process_cacher->update_cached_bytes(-st.st_size);
+          }
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  closedir(dir);
+}
+
+/** Whether the cache entry of the input match record named "<fingerprint>_<subkey>" exists. */
+static bool match_record_has_entry(const char* name) {
+  if (strlen(name) != Hash::kAsciiLength + 1 + Subkey::kAsciiLength
+      || name[Hash::kAsciiLength] != '_' || !Subkey::valid_ascii(name + Hash::kAsciiLength + 1)) {
+    return false;
+  }
+  char fingerprint[Hash::kAsciiLength + 1];
+  memcpy(fingerprint, name, Hash::kAsciiLength);
+  fingerprint[Hash::kAsciiLength] = '\0';
+  return Hash::valid_ascii(fingerprint)
+      && obj_cache->contains(fingerprint, name + Hash::kAsciiLength + 1);
+}
+
+/** Whether all the shared libraries in the prediction still exist. */
+static bool libs_exist(const std::string& path) {
+  uint8_t* buf = load_fbb(path);
+  if (!buf) {
+    return false;
+  }
+  bool ret = false;
+  auto libs_fbb = reinterpret_cast<const FBBSTORE_Serialized *>(buf);
+  if (libs_fbb->get_tag() == FBBSTORE_TAG_libs) {
+    auto libs_msg = reinterpret_cast<const FBBSTORE_Serialized_libs *>(libs_fbb);
+    ret = true;
+    for (size_t i = 0; i < libs_msg->get_lib_count() && ret; i++) {
+      const FileName* lib = FileName::GetStored(libs_msg->get_lib_at(i),
+                                                libs_msg->get_lib_len_at(i));
+      ret = access(lib->c_str(), F_OK) == 0;
+    }
+  }
+  free(buf);
+  return ret;
+}
+
+/** Whether the uncacheable verdict is still in effect. */
+static bool verdict_is_valid(const std::string& path, time_t now) {
+  uint8_t* buf = load_fbb(path);
+  if (!buf) {
+    return false;
+  }
+  auto verdict_fbb = reinterpret_cast<const FBBSTORE_Serialized *>(buf);
+  bool ret = false;
+  if (verdict_fbb->get_tag() == FBBSTORE_TAG_uncacheable) {
+    auto verdict_msg = reinterpret_cast<const FBBSTORE_Serialized_uncacheable *>(verdict_fbb);
+    ret = verdict_msg->get_expires() > now;
+  }
+  free(buf);
+  return ret;
+}
+
+/** The directories of the metadata stores in the cache, and which of their files gc keeps. */
+static const struct {
+  const char* subdir;
+  metadata_keep_fn_t keep;
+} kMetadataDirs[] = {
+  {"matches", [](const std::string&, const char* name, time_t) {
+    return match_record_has_entry(name);
+  }},
+  {"libs", [](const std::string& path, const char* name, time_t) {
+    return Hash::valid_ascii(name) && libs_exist(path);
+  }},
+  {"uncacheable", [](const std::string& path, const char* name, time_t now) {
+    return Hash::valid_ascii(name) && verdict_is_valid(path, now);
+  }},
+  {"policy", [](const std::string& path, const char* name, time_t now) {
+    return Hash::valid_ascii(name) && CachingPolicy::is_stats_file_current(path, now);
+  }},
+  {"traces", [](const std::string& path, const char* name, time_t) {
+    return Hash::valid_ascii(name) && BuildTrace::has_cached_entry(path);
+  }},
+};
+
+void ExecedProcessCacher::gc_metadata(off_t* cache_bytes) const {
+  const time_t now = time(nullptr);
+  for (const auto& metadata_dir : kMetadataDirs) {
+    gc_metadata_dir(cache_dir_ + "/" + metadata_dir.subdir, cache_bytes, metadata_dir.keep, now);
+  }
+  /* The directory hashes are kept in a single file of limited size. */
+  const std::string dir_hashes_path = cache_dir_ + "/dir-hashes";
+  struct stat st;
+  if (stat(dir_hashes_path.c_str(), &st) == 0) {
+    if (DirHashCache::is_file_current(dir_hashes_path)) {
+      *cache_bytes += st.st_size;
+    } else if (unlink(dir_hashes_path.c_str()) != 0) {
+      fb_perror(("unlink " + dir_hashes_path).c_str());
+      *cache_bytes += st.st_size;
+    } else {
+      execed_process_cacher->update_cached_bytes(-st.st_size);
+    }
+  }
+}
+
+off_t ExecedProcessCacher::metadata_total_size() const {
+  struct stat st;
+  off_t total = stat((cache_dir_ + "/dir-hashes").c_str(), &st) == 0 ? st.st_size : 0;
+  for (const auto& metadata_dir : kMetadataDirs) {
+    total += recursive_total_file_size(cache_dir_ + "/" + metadata_dir.subdir);
+  }
+  return total;
+}
+
 bool ExecedProcessCacher::is_gc_needed() const {
   return (get_stored_bytes_from_cache() + this_runs_cached_bytes_) > max_cache_size;
 }
@@ -2048,6 +3002,7 @@ void ExecedProcessCacher::gc() {
   off_t cache_bytes = 0, debug_bytes = 0, unexpected_file_bytes = 0;
   obj_cache->gc(&referenced_blobs, &cache_bytes, &debug_bytes, &unexpected_file_bytes);
   blob_cache->gc(referenced_blobs, &cache_bytes, &debug_bytes, &unexpected_file_bytes);
+  gc_metadata(&cache_bytes);
   if (unexpected_file_bytes > 0) {
     fb_error("There are " + d(unexpected_file_bytes) + " bytes in the cache stored in files "
              "with unexpected name.");
@@ -2099,6 +3054,7 @@ void ExecedProcessCacher::gc() {
       cache_bytes = debug_bytes = unexpected_file_bytes = 0;
       obj_cache->gc(&referenced_blobs, &cache_bytes, &debug_bytes, &unexpected_file_bytes);
       blob_cache->gc(referenced_blobs, &cache_bytes, &debug_bytes, &unexpected_file_bytes);
+      gc_metadata(&cache_bytes);
 
       round++;
     }
@@ -23,6 +23,7 @@
 #include <tsl/hopscotch_set.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 #include <libconfig.h++>
 
@@ -50,6 +51,8 @@ class ExecedProcessCacher {
    */
   static void init(const libconfig::Config* cfg);
   static unsigned int cache_format() {return cache_format_;}
+  /** Set up recording and prefetching the build trace of the current build command. */
+  void init_build_trace();
   /**
    * Compute the fingerprint, store it keyed by the process in fingerprints_.
    * Also store fingerprint_msgs_ if debugging is enabled.
@@ -78,6 +81,26 @@ class ExecedProcessCacher {
                       const FBBSTORE_Serialized_process_inputs_outputs *inouts,
                       std::vector<int> *fds_appended_to);
   bool shortcut(ExecedProcess *proc, std::vector<int> *fds_appended_to);
+  /**
+   * Predict the shared libraries the executable will load from what it loaded the last time with
+   * the same dynamic linker related environment variables.
+   * @return whether there is a prediction
+   */
+  bool predict_libs(const FileName* executable, const std::vector<std::string>& env_vars,
+                    std::vector<const FileName*>* libs);
+  /** Remember the shared libraries the process loaded for predict_libs(). */
+  void learn_libs(const ExecedProcess *proc);
+  /**
+   * Check if the process with the same command line was found not to be cacheable in the previous
+   * runs, and thus it is not worth fingerprinting and recording it.
+   * @return the reason to be used for disabling shortcutting, or nullptr
+   */
+  const char* uncacheable_reason(const ExecedProcess *proc);
+  /**
+   * Remember that the finished process could not be cached, or forget it if it could, for
+   * uncacheable_reason() in the next runs.
+   */
+  void update_uncacheable(const ExecedProcess *proc);
   void not_shortcutting() {if (!no_fetch_) not_shortcutting_++;}
   /** Add stored hit statistics and cache size to current run's counters. */
   void add_stored_stats();
@@ -104,9 +127,24 @@ class ExecedProcessCacher {
   off_t fix_stored_bytes() const;
   /** Register cache size change occurred in the current run. */
   void update_cached_bytes(off_t bytes);
+  /**
+   * Atomically replace a file of the metadata stores, like a libs prediction, with tmp_path, and
+   * register the cache size change.
+   * @return whether the file was replaced
+   */
+  bool replace_metadata_file(const std::string& tmp_path, const std::string& path);
+  /** Remove a file of the metadata stores and register the cache size change. */
+  void remove_metadata_file(const std::string& path);
   /* A garbage collection run is needed, e.g. because the cache is too big. */
   bool is_gc_needed() const;
   void gc();
+  /**
+   * Remove the stored metadata that refers to missing cache entries or became stale.
+   * @param[in,out] cache_bytes increased by the kept files' sizes
+   */
+  void gc_metadata(off_t* cache_bytes) const;
+  /** Returns the total size of the stored metadata, the caches besides the objs and blobs. */
+  off_t metadata_total_size() const;
   /**
    * Checks if the object cache entry can be used for shortcutting, i.e. all the referenced
    * blobs are present in the blob cache and all the referenced system files on the system
@@ -124,6 +162,29 @@ class ExecedProcessCacher {
    * Helper for fingerprint() to decide which env vars matter
    */
   bool env_fingerprintable(const std::string& name_and_value) const;
+  bool load_libs(const Hash& key, std::vector<const FileName*>* libs) const;
+  struct UncacheableVerdict {
+    /** Number of consecutive runs the process was found not to be cacheable in, 0 if none. */
+    int runs;
+    /** When to check again if the process is cacheable, in seconds since the epoch. */
+    int64_t expires;
+    const char* reason;
+    /** The verdict was used for not fingerprinting the process in this run. */
+    bool applied;
+    /** The verdict was already updated with the outcome of this run. */
+    bool updated;
+  };
+  bool load_uncacheable(const Hash& key, UncacheableVerdict* verdict) const;
+  /**
+   * Try shortcutting from one cache entry.
+   * @return the entry if it matches the file system, nullptr otherwise
+   */
+  const FBBSTORE_Serialized_process_inputs_outputs *try_candidate(ExecedProcess *proc,
+                                                                  const Hash& fingerprint,
+                                                                  const Subkey& subkey,
+                                                                  uint8_t **inouts_buf,
+                                                                  size_t *inouts_buf_len,
+                                                                  bool *munmap_entry);
 
   bool no_store_;
   bool no_fetch_;
@@ -152,9 +213,15 @@ class ExecedProcessCacher {
   /* The entire fingerprint of the processes handled by this cacher, for debugging
    * purposes, only if debugging is enabled. In serialized FBBFP format. */
   tsl::hopscotch_map<const ExecedProcess*, std::vector<char>> fingerprint_msgs_;
+  /* The shared libraries loaded by the executables, as stored in or loaded from libs_dir_. */
+  tsl::hopscotch_map<Hash, std::vector<const FileName*>> libs_ {};
+  /* The verdicts looked up for the processes of this run, as stored in uncacheable_dir_. */
+  tsl::hopscotch_map<Hash, UncacheableVerdict> uncacheable_ {};
 
   static unsigned int cache_format_;
   std::string cache_dir_;
+  std::string libs_dir_;
+  std::string uncacheable_dir_;
   DISALLOW_COPY_AND_ASSIGN(ExecedProcessCacher);
 };
 
@@ -153,7 +153,7 @@ class FileFD {
   void set_flags(int flags) {ofd_->set_flags(flags);}
   /* Note: This method does NOT report the O_CLOEXEC flag, use cloexec() for that. */
   int flags() const {return ofd_->flags();}
-  Process *opened_by() {return ofd_->opened_by();}
+  Process *opened_by() const {return ofd_->opened_by();}
   void set_cloexec(bool cloexec) {cloexec_ = cloexec;}
   bool cloexec() const {return cloexec_;}
   bool close_on_popen() const {return close_on_popen_;}
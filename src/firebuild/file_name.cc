@@ -16,39 +16,82 @@
  * SOFTWARE.
  */
 
-#include <tsl/hopscotch_map.h>
+#include <tsl/hopscotch_set.h>
 
+#include <cstdlib>
 #include <cstring>
-#include <unordered_set>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include "firebuild/file_name.h"
 
 #include "common/firebuild_common.h"
+#include "firebuild/config.h"
 #include "firebuild/execed_process.h"
 #include "firebuild/utils.h"
 
 namespace firebuild {
 
-std::unordered_set<FileName, FileNameHasher>* FileName::db_;
-tsl::hopscotch_map<const FileName*, XXH128_hash_t>* FileName::hash_db_;
-tsl::hopscotch_map<const FileName*, std::pair<int, ExecedProcess*>>* FileName::write_ofds_db_;
-tsl::hopscotch_map<const FileName*, file_generation_t>* FileName::generation_db_;
+tsl::hopscotch_set<const FileName*, FileNameHasher, FileNameEqual>* FileName::db_;
+std::thread::id FileName::main_thread_;
 
 const FileName* FileName::default_tmpdir;
 
 FileName::DbInitializer::DbInitializer() {
-  db_ = new std::unordered_set<FileName, FileNameHasher>();
-  hash_db_ = new tsl::hopscotch_map<const FileName*, XXH128_hash_t>();
-  write_ofds_db_ = new tsl::hopscotch_map<const FileName*, std::pair<int, ExecedProcess*>>();
-  generation_db_ = new tsl::hopscotch_map<const FileName*, file_generation_t>();
+  db_ = new tsl::hopscotch_set<const FileName*, FileNameHasher, FileNameEqual>();
+  main_thread_ = std::this_thread::get_id();
+}
+
+/* The arena the FileName objects and their names are allocated from. */
+static const size_t kArenaChunkSize = 1024 * 1024;
+static char* arena_next = nullptr;
+static size_t arena_left = 0;
+
+static void* arena_alloc(size_t size) {
+  /* Keep the next FileName aligned. */
+  size = (size + alignof(FileName) - 1) & ~(alignof(FileName) - 1);
+  if (size > arena_left) {
+    if (size > kArenaChunkSize / 4) {
+      /* Don't waste the rest of the current chunk for a huge name. */
+      return malloc(size);
+    }
+    arena_next = reinterpret_cast<char*>(malloc(kArenaChunkSize));
+    arena_left = kArenaChunkSize;
+  }
+  void* ret = arena_next;
+  arena_next += size;
+  arena_left -= size;
+  return ret;
+}
+
+const FileName* FileName::Insert(const char * const name, size_t length) {
+  assert_main_thread();
+  /* Interning the parent first keeps the parents' chain complete for parent_dir(). */
+  const FileName* parent = GetParentDir(name, length);
+  char* mem = reinterpret_cast<char*>(arena_alloc(sizeof(FileName) + length + 1));
+  char* name_copy = mem + sizeof(FileName);
+  memcpy(name_copy, name, length);
+  name_copy[length] = '\0';
+  const FileName* file_name =
+      new (mem) FileName(name_copy, length, parent,
+                         is_path_at_locations(name_copy, length, &ignore_locations),
+                         is_path_at_locations(name_copy, length, &read_only_locations));
+  db_->insert(file_name);
+  return file_name;
 }
 
 bool FileName::isDbEmpty() {
   return !db_ || db_->empty();
 }
 
+size_t FileName::db_size() {
+  return db_ ? db_->size() : 0;
+}
+
 FileName::DbInitializer FileName::db_initializer_;
 
 void FileName::open_for_writing(ExecedProcess* proc) const {
@@ -58,16 +101,14 @@ void FileName::open_for_writing(ExecedProcess* proc) const {
     return;
   }
   assert(proc);
-  auto it = write_ofds_db_->find(this);
-  if (it != write_ofds_db_->end()) {
-    auto& pair = it.value();
-    assert(pair.first > 0);
-    pair.first++;
-    if (proc != pair.second && this != proc->jobserver_fifo()) {
+  assert_main_thread();
+  if (writers_count_ > 0) {
+    writers_count_++;
+    if (proc != writer_ && this != proc->jobserver_fifo()) {
       /* A different process opened the file for writing. */
       ExecedProcess* common_ancestor =
-          proc->common_exec_ancestor(pair.second);
-      const ExecedProcess* other_proc = pair.second;
+          proc->common_exec_ancestor(writer_);
+      const ExecedProcess* other_proc = writer_;
       if (common_ancestor != proc) {
         proc->disable_shortcutting_bubble_up_to_excl(
             common_ancestor, deduplicated_string(
@@ -76,26 +117,26 @@ void FileName::open_for_writing(ExecedProcess* proc) const {
                 + d(other_proc->pid()) + "] \"" +  other_proc->args_to_short_string()
                 + "\"").c_str());
       }
-      if (common_ancestor != pair.second) {
-        pair.second->disable_shortcutting_bubble_up_to_excl(
+      if (common_ancestor != writer_) {
+        writer_->disable_shortcutting_bubble_up_to_excl(
             common_ancestor, deduplicated_string(
                 "An other process opened " + this->to_string()
                 + " for writing which file is already opened for writing by ["
                 + d(other_proc->pid()) + "] \"" +  other_proc->args_to_short_string()
                 + "\"").c_str());
-        pair.second = common_ancestor;
+        writer_ = common_ancestor;
       }
     }
   } else {
-    write_ofds_db_->insert({this, {1, proc}});
-    auto it2 = generation_db_->find(this);
-    if (it2 != generation_db_->end()) {
-      assert(it2->second < UINT32_MAX);
-      it2.value()++;
+    writers_count_ = 1;
+    writer_ = proc;
+    if (generation_ > 0) {
+      assert(generation_ < UINT32_MAX);
+      generation_++;
       /* Bubble up the generation change */
       proc->register_file_usage_update(this, FileUsageUpdate(this));
     } else {
-      generation_db_->insert({this, 1});
+      generation_ = 1;
     }
   }
 }
@@ -106,13 +147,10 @@ void FileName::close_for_writing() const {
     /* Ignored locations can be ignored here, too. */
     return;
   }
-  auto it = write_ofds_db_->find(this);
-  assert(it != write_ofds_db_->end());
-  assert(it->second.first > 0);
-  if (it->second.first > 1) {
-    it.value().first--;
-  } else {
-    write_ofds_db_->erase(it);
+  assert_main_thread();
+  assert(writers_count_ > 0);
+  if (--writers_count_ == 0) {
+    writer_ = nullptr;
   }
 }
 
@@ -141,12 +179,36 @@ const FileName* FileName::GetParentDir(const char * const name, ssize_t length)
   }
 }
 
-std::string FileName::without_dirs() const {
-  return base_name(name_);
+cstring_view FileName::stored_path() const {
+  const size_t len = base_dir.length();
+  if (len == 0 || length_ < len || memcmp(name_, base_dir.c_str(), len) != 0
+      || (name_[len] != '/' && name_[len] != '\0')) {
+    return {name_, length_};
+  }
+  /* The nodes of std::map don't move, keeping the returned pointers valid. The lock keeps it
+   * safe to call from the worker threads, too. */
+  static std::map<const FileName*, std::string> marked_paths;
+  static std::mutex marked_paths_mutex;
+  const std::lock_guard<std::mutex> lock(marked_paths_mutex);
+  auto it = marked_paths.find(this);
+  if (it == marked_paths.end()) {
+    it = marked_paths.emplace(this, std::string(kBaseDirMarker) + (name_ + len)).first;
+  }
+  return {it->second.c_str(), static_cast<uint32_t>(it->second.length())};
 }
 
-bool FileName::is_at_locations(const cstring_view_array* locations) const {
-  return is_path_at_locations(this->name_, this->length_, locations);
+const FileName* FileName::GetStored(const char * const path, size_t length) {
+  if (isStoredInBaseDir(path, length)) {
+    /* The fingerprints make sure that such entries are found only when base_dir is set. */
+    assert(!base_dir.empty());
+    return Get(std::string(base_dir).append(path + kBaseDirMarkerLen,
+                                            length - kBaseDirMarkerLen));
+  }
+  return Get(path, length);
+}
+
+std::string FileName::without_dirs() const {
+  return base_name(name_);
 }
 
 const FileName* FileName::GetCanonicalized(const char * name, size_t length,
@@ -19,18 +19,19 @@
 #ifndef FIREBUILD_FILE_NAME_H_
 #define FIREBUILD_FILE_NAME_H_
 
-#include <tsl/hopscotch_map.h>
+#include <tsl/hopscotch_set.h>
 #include <xxhash.h>
 
 #include <algorithm>
 #include <cstring>
 #include <string>
-#include <unordered_set>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "common/firebuild_common.h"
 #include "common/platform.h"
+#include "firebuild/cxx_lang_utils.h"
 #include "firebuild/debug.h"
 
 namespace firebuild {
@@ -40,51 +41,26 @@ class ExecedProcess;
 typedef uint32_t file_generation_t;
 
 struct FileNameHasher;
+struct FileNameEqual;
 class FileName {
  public:
-  FileName(const FileName& other)
-      : name_(reinterpret_cast<const char *>(malloc(other.length_ + 1))),
-        length_(other.length_), in_ignore_location_(other.in_ignore_location_),
-        in_read_only_location_(other.in_read_only_location_) {
-    memcpy(const_cast<char*>(name_), other.name_, other.length_ + 1);
-  }
   const char * c_str() const {return name_;}
   std::string to_string() const {return std::string(name_);}
   uint32_t length() const {return length_;}
-  const FileName* parent_dir() const {return GetParentDir(name_, length_);}
+  const FileName* parent_dir() const {return parent_;}
   size_t hash() const {return XXH3_64bits(name_, length_);}
-  const XXH128_hash_t& hash_XXH128() const {
-    auto it = hash_db_->find(this);
-    if (it != hash_db_->end()) {
-      return it->second;
-    } else {
-      /* Not found, add a copy to the set. */
-      return (hash_db_->insert({this,  XXH3_128bits(name_, length_)}).first)->second;
-    }
-  }
   int writers_count() const {
     /* Files in ignored locations should not even be queried. */
     assert(!is_in_ignore_location());
-    auto it = write_ofds_db_->find(this);
-    if (it != write_ofds_db_->end()) {
-      assert(it->second.first > 0);
-      return it->second.first;
-    } else {
-      return 0;
-    }
+    return writers_count_;
   }
   void open_for_writing(ExecedProcess* proc) const;
   void close_for_writing() const;
   file_generation_t generation() const {
-    auto it = generation_db_->find(this);
-    if (it != generation_db_->end()) {
-      assert(it->second > 0);
-      return it->second;
-    } else {
-      return 0;
-    }
+    return generation_;
   }
   static bool isDbEmpty();
+  static size_t db_size();
   static const FileName* Get(const char * const name, ssize_t length);
   static const FileName* Get(const std::string& name) {
     return Get(name.c_str(), name.size());
@@ -99,45 +75,74 @@ class FileName {
   bool is_in_ignore_location() const {return in_ignore_location_;}
   bool is_in_read_only_location() const {return in_read_only_location_;}
 
+  /**
+   * Placeholder of base_dir in the fingerprints and in the paths stored in the cache entries.
+   * It can't be mistaken for a stored path, which is otherwise always absolute.
+   */
+  static constexpr char kBaseDirMarker[] = "<base_dir>";
+  static constexpr size_t kBaseDirMarkerLen = sizeof(kBaseDirMarker) - 1;
+  /**
+   * The path to store in the cache entries, with base_dir replaced by kBaseDirMarker when the
+   * file is in base_dir. The returned string is valid as long as the FileName.
+   */
+  cstring_view stored_path() const;
+  /** Whether the path stored in a cache entry is relative to base_dir. */
+  static bool isStoredInBaseDir(const char * const path, size_t length) {
+    return length >= kBaseDirMarkerLen && memcmp(path, kBaseDirMarker, kBaseDirMarkerLen) == 0;
+  }
+  /** The FileName of a path stored in a cache entry, the reverse of stored_path(). */
+  static const FileName* GetStored(const char * const path, size_t length);
+
   std::string without_dirs() const;
   static const FileName* default_tmpdir;
 
  private:
-  FileName(const char * const name, size_t length, bool copy_name)
-      : name_(copy_name ? reinterpret_cast<const char *>(malloc(length + 1)) : name),
-        length_(length) {
-    if (copy_name) {
-      memcpy(const_cast<char*>(name_), name, length);
-      const_cast<char*>(name_)[length] = '\0';
-    }
-  }
-
+  FileName(const char * const name, size_t length, const FileName* parent,
+           bool in_ignore_location, bool in_read_only_location)
+      : name_(name), parent_(parent), length_(length), in_ignore_location_(in_ignore_location),
+        in_read_only_location_(in_read_only_location) {}
+  /** Add a new entry to the db, copying the name to the arena. */
+  static const FileName* Insert(const char * const name, size_t length);
   /**
-   * Checks if a path semantically begins with one of the given sorted subpaths.
-   *
-   * Does string operations only, does not look at the file system.
+   * The db and the writers are updated by the main thread only. The worker threads of
+   * parallel_for() may read the FileNames they are passed, because the main thread waits for
+   * them in parallel_for(), but they must not intern new ones.
    */
-  bool is_at_locations(const cstring_view_array *locations) const;
+  static void assert_main_thread() {
+    assert(std::this_thread::get_id() == main_thread_);
+  }
 
+  /* The members are ordered to not leave padding between them. */
   const char * const name_;
+  /**
+   * The parent directory, set when the FileName is created, thus reading it is safe from the
+   * worker threads, too.
+   */
+  const FileName* const parent_;
+  /** The common exec ancestor of the processes having the file open for writing. */
+  mutable ExecedProcess* writer_ = nullptr;
   const uint32_t length_;
-  const bool in_ignore_location_ = false;
-  const bool in_read_only_location_ = false;
-  static std::unordered_set<FileName, FileNameHasher>* db_;
-  static tsl::hopscotch_map<const FileName*, XXH128_hash_t>* hash_db_;
-  /** Number of FileOFDs open for writing referencing this file. */
-  static tsl::hopscotch_map<const FileName*, std::pair<int, ExecedProcess*>>* write_ofds_db_;
   /**
    * A generation of the file is when it is kept open by a set of writers.
-   * Whenever all writers close the file and thus the refcount in write_ofds_db_ decreases to zero
+   * Whenever all writers close the file and thus writers_count_ decreases to zero
    * the generation is closed, but the generation number stays the same. When the new writer opens
    * the file a new generation is opened.
    * A file's generation number is 0 until it is opened for writing for the first time.
    */
-  static tsl::hopscotch_map<const FileName*, file_generation_t>* generation_db_;
+  mutable file_generation_t generation_ = 0;
+  /** Number of FileOFDs open for writing referencing this file. */
+  mutable int writers_count_ = 0;
+  const bool in_ignore_location_ = false;
+  const bool in_read_only_location_ = false;
+  /**
+   * The interned file names. They are allocated from an arena together with their names and are
+   * never freed.
+   */
+  static tsl::hopscotch_set<const FileName*, FileNameHasher, FileNameEqual>* db_;
+  /** The thread that initialized the db, i.e. the supervisor's main thread. */
+  static std::thread::id main_thread_;
 
-  /* Disable assignment. */
-  void operator=(const FileName&);
+  DISALLOW_COPY_AND_ASSIGN(FileName);
 
   /* This, along with the FileName::db_initializer_ definition in file_namedb.cc,
    * initializes the filename database once at startup. */
@@ -154,8 +159,14 @@ inline bool operator==(const FileName& lhs, const FileName& rhs) {
 }
 
 struct FileNameHasher {
-  std::size_t operator()(const FileName& s) const noexcept {
-    return s.hash();
+  std::size_t operator()(const FileName* s) const noexcept {
+    return s->hash();
+  }
+};
+
+struct FileNameEqual {
+  bool operator()(const FileName* lhs, const FileName* rhs) const noexcept {
+    return *lhs == *rhs;
   }
 };
 
@@ -170,20 +181,15 @@ extern cstring_view_array ignore_locations;
 extern cstring_view_array read_only_locations;
 
 inline const FileName* FileName::Get(const char * const name, ssize_t length) {
-  FileName tmp_file_name(name, (length == -1) ? strlen(name) : length, false);
+  FileName tmp_file_name(name, (length == -1) ? strlen(name) : length, nullptr, false, false);
 #ifdef FB_EXTRA_DEBUG
   assert(is_canonical(tmp_file_name.name_, tmp_file_name.length_));
 #endif
-  auto it = db_->find(tmp_file_name);
+  auto it = db_->find(&tmp_file_name);
   if (it != db_->end()) {
-    return &*it;
+    return *it;
   } else {
-    *const_cast<bool*>(&tmp_file_name.in_ignore_location_) =
-        tmp_file_name.is_at_locations(&ignore_locations);
-    *const_cast<bool*>(&tmp_file_name.in_read_only_location_) =
-        tmp_file_name.is_at_locations(&read_only_locations);
-    /* Not found, add a copy to the set. */
-    return &*db_->insert(tmp_file_name).first;
+    return Insert(name, tmp_file_name.length_);
   }
 }
 
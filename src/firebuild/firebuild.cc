@@ -40,20 +40,29 @@
 #include <libconfig.h++>
 
 #include "common/config.h"
+#include "firebuild/build_trace.h"
+#include "firebuild/caching_policy.h"
 #include "firebuild/debug.h"
 #include "firebuild/sigchild_callback.h"
 #include "firebuild/command_rewriter.h"
 #include "firebuild/config.h"
 #include "firebuild/connection_context.h"
+#include "firebuild/daemon.h"
+#include "firebuild/dir_hash_cache.h"
 #include "firebuild/epoll.h"
 #include "firebuild/file_name.h"
 #include "firebuild/hash_cache.h"
+#include "firebuild/input_match_cache.h"
+#include "firebuild/jobserver.h"
 #include "firebuild/options.h"
+#include "firebuild/message_log.h"
 #include "firebuild/message_processor.h"
+#include "firebuild/metrics.h"
 #include "firebuild/execed_process_cacher.h"
 #include "firebuild/process.h"
 #include "firebuild/process_tree.h"
 #include "firebuild/report.h"
+#include "firebuild/trace_events.h"
 #include "firebuild/utils.h"
 
 int sigchild_selfpipe[2];
@@ -154,6 +163,9 @@ static void accept_ic_conn(const struct epoll_event* event, void *arg) {
       fd = firebuild::epoll->remap_to_not_added_fd(fd);
     }
     firebuild::bump_fd_age(fd);
+    if (firebuild::message_log) {
+      firebuild::message_log->conn_accepted(fd);
+    }
     auto conn_ctx = new firebuild::ConnectionContext(fd);
     fcntl(fd, F_SETFL, O_NONBLOCK);
     firebuild::epoll->add_fd(fd, EPOLLIN, firebuild::MessageProcessor::ic_conn_readcb, conn_ctx);
@@ -186,20 +198,41 @@ int main(const int argc, char *argv[]) {
   setenv("POSIXLY_CORRECT", "1", true);
   firebuild::Options::parse(argc, argv);
 
+  if (firebuild::Options::build_cmd()) {
+    int exit_status;
+    if (firebuild::Daemon::run_build(argc, argv, &exit_status)) {
+      exit(exit_status);
+    }
+  }
+
   if (FB_DEBUGGING(firebuild::FB_DEBUG_TIME)) {
     clock_gettime(CLOCK_MONOTONIC, &start_time);
   }
 
+  firebuild::metrics = new firebuild::Metrics();
+
   firebuild::read_config(firebuild::cfg, firebuild::Options::config_file(),
                          firebuild::Options::config_strings());
 
   /* Initialize the cache */
   firebuild::ExecedProcessCacher::init(firebuild::cfg);
 
+  if (firebuild::Options::daemon()) {
+    firebuild::Daemon::serve(argv);
+    /* This is the supervisor of a build passed over by a client from now on. */
+    if (FB_DEBUGGING(firebuild::FB_DEBUG_TIME)) {
+      clock_gettime(CLOCK_MONOTONIC, &start_time);
+    }
+    firebuild::execed_process_cacher->init_build_trace();
+    /* Measure only this build. */
+    delete firebuild::metrics;
+    firebuild::metrics = new firebuild::Metrics();
+  }
+
   if (firebuild::Options::reset_stats()) {
     firebuild::execed_process_cacher->reset_stored_stats();
   }
-  if (!firebuild::Options::build_cmd()) {
+  if (!firebuild::Options::build_cmd() && !firebuild::Options::replay_messages_file()) {
     if (firebuild::Options::do_gc()) {
       firebuild::execed_process_cacher->gc();
       firebuild::execed_process_cacher->update_stored_bytes();
@@ -219,6 +252,22 @@ int main(const int argc, char *argv[]) {
   firebuild::detect_qemu_user(getenv("PATH"));
 #endif
 
+  firebuild::MessageLogReplayer* replayer = nullptr;
+  if (firebuild::Options::replay_messages_file()) {
+    replayer = firebuild::MessageLogReplayer::Open(firebuild::Options::replay_messages_file());
+    if (!replayer) {
+      exit(EXIT_FAILURE);
+    }
+  } else if (firebuild::Options::record_messages_file()) {
+    firebuild::message_log =
+        firebuild::MessageLog::Create(firebuild::Options::record_messages_file());
+  }
+
+  if (firebuild::Options::trace_events_file()) {
+    firebuild::trace_events =
+        firebuild::TraceEvents::Open(firebuild::Options::trace_events_file());
+  }
+
   {
     char *pattern;
     if (asprintf(&pattern, "%s/firebuild.XXXXXX", get_tmpdir()) < 0) {
@@ -271,13 +320,18 @@ int main(const int argc, char *argv[]) {
 
   firebuild::check_system_setup();
 
-  /* run command and handle interceptor messages */
-  if ((child_pid = fork()) == 0) {
+  /* run command and handle interceptor messages, or pretend to have run the recorded one */
+  if ((child_pid = replayer ? replayer->root_pid() : fork()) == 0) {
     /* intercepted process */
 
     /* we don't need that */
     close(listener);
 
+    if (firebuild::Daemon::is_serving()) {
+      /* Let the client signal the whole build. */
+      firebuild::Daemon::set_build_process_group(0);
+    }
+
     if (firebuild::Options::directory() && chdir(firebuild::Options::directory()) != 0) {
       firebuild::fb_perror("chdir");
       exit(EXIT_FAILURE);
@@ -342,11 +396,19 @@ int main(const int argc, char *argv[]) {
   } else {
     /* supervisor process */
 
+    if (firebuild::Daemon::is_serving()) {
+      firebuild::Daemon::set_build_process_group(child_pid);
+      firebuild::Daemon::report_build_started(child_pid);
+    }
+
     /* This creates some Pipe objects, so needs ev_base being set up. */
     firebuild::proc_tree = new firebuild::ProcessTree();
 
     /* Add a ForkedProcess for the supervisor's forked child we never directly saw. */
     firebuild::proc_tree->insert_root(child_pid, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    if (firebuild::message_log) {
+      firebuild::message_log->root_started(child_pid);
+    }
 
     bump_limits();
     /* no SIGPIPE if a supervised process we're writing to unexpectedly dies */
@@ -354,23 +416,47 @@ int main(const int argc, char *argv[]) {
 
     firebuild::epoll->add_fd(sigchild_selfpipe[0], EPOLLIN, firebuild::sigchild_cb, NULL);
 
-    /* Main loop for processing interceptor messages */
-    /* Runs until the only remaining epoll-monitored fd is the sigchild_selfpipe fd. */
-    while (firebuild::epoll->fds() > 1) {
-      /* This is where the process spends its idle time: waiting for an event over a fd, or a
-       * sigchild.
-       *
-       * If our immediate child exited (rather than some orphan descendant thereof, see
-       * prctl(PR_SET_CHILD_SUBREAPER) above) then the handler sigchild_cb() will set listener to
-       * -1, that's how we'll break out of this loop. */
-      firebuild::epoll->wait();
-
-      /* Process the reported events, if any. */
-      firebuild::epoll->process_all_events();
-
-      firebuild::proc_tree->GcProcesses();
+    /* Start prefetching only after forking the child to not fork a multi-threaded process. */
+    if (firebuild::build_trace) {
+      firebuild::build_trace->start_prefetching();
     }
 
+    if (!firebuild::metrics_file.empty() && firebuild::metrics_update_interval_ms > 0) {
+      firebuild::metrics->start_periodic_save(firebuild::metrics_file,
+                                              firebuild::metrics_update_interval_ms);
+    }
+
+    if (replayer) {
+      /* Feed the recorded messages instead of the build command's. */
+      replayer->replay();
+    } else {
+      /* Main loop for processing interceptor messages */
+      /* Runs until the only remaining epoll-monitored fd is the sigchild_selfpipe fd. */
+      while (firebuild::epoll->fds() > 1) {
+        /* This is where the process spends its idle time: waiting for an event over a fd, or a
+         * sigchild.
+         *
+         * If our immediate child exited (rather than some orphan descendant thereof, see
+         * prctl(PR_SET_CHILD_SUBREAPER) above) then the handler sigchild_cb() will set listener to
+         * -1, that's how we'll break out of this loop. */
+        const int64_t wait_start_ns = firebuild::Metrics::now_ns();
+        firebuild::epoll->wait();
+        firebuild::metrics->loop_iteration(firebuild::Metrics::now_ns() - wait_start_ns);
+
+        /* Process the reported events, if any. */
+        firebuild::epoll->process_all_events();
+
+        firebuild::proc_tree->GcProcesses();
+      }
+    }
+
+    firebuild::Jobserver::CloseAll();
+    if (firebuild::build_trace) {
+      firebuild::build_trace->stop_prefetching();
+    }
+    /* Write the files restored lazily that no process needed during the build. */
+    firebuild::hash_cache->materialize_all();
+
     /* Finish all top pipes */
     firebuild::proc_tree->FinishInheritedFdPipes();
     /* Close the self-pipe */
@@ -436,7 +522,23 @@ int main(const int argc, char *argv[]) {
               static_cast<double>(ru_myslf.ru_maxrss) / 1024);
     }
 
-    if (firebuild::execed_process_cacher->is_gc_needed()) {
+    /* Save the stores before checking the cache size, they are part of the cache. */
+    if (firebuild::build_trace && !replayer) {
+      firebuild::build_trace->save();
+    }
+    if (firebuild::caching_policy && !replayer) {
+      firebuild::caching_policy->save();
+    }
+    if (firebuild::dir_hash_cache && !replayer) {
+      firebuild::dir_hash_cache->save();
+    }
+    if (firebuild::input_match_cache && !replayer) {
+      firebuild::input_match_cache->flush();
+    }
+    if (replayer) {
+      /* The replay must not leave any trace in the cache or the persisted stores. */
+      stats_saved = true;
+    } else if (firebuild::execed_process_cacher->is_gc_needed()) {
       firebuild::execed_process_cacher->gc();
     }
     if (firebuild::Options::print_stats()) {
@@ -459,6 +561,28 @@ int main(const int argc, char *argv[]) {
   unlink(fb_conn_string);
   rmdir(fb_tmp_dir);
 
+  if (!firebuild::metrics_file.empty()) {
+    firebuild::metrics->save(firebuild::metrics_file);
+  }
+  if (replayer) {
+    replayer->print_summary(stderr);
+    firebuild::metrics->print_json(stdout);
+    delete replayer;
+  }
+  if (firebuild::message_log) {
+    delete firebuild::message_log;
+    firebuild::message_log = nullptr;
+  }
+  if (firebuild::trace_events) {
+    delete firebuild::trace_events;
+    firebuild::trace_events = nullptr;
+  }
+
+  if (firebuild::Daemon::is_serving()) {
+    firebuild::Daemon::report_build_exited(child_ret);
+  }
+  firebuild::Daemon::report_learned_state();
+
 #ifdef FB_EXTRA_DEBUG
   (void)running_under_valgrind;
   {
@@ -37,6 +37,9 @@ ForkedProcess::ForkedProcess(const int pid, const int ppid,
   if (parent) {
     exec_point_ = parent->exec_point();
     parent->fork_children().push_back(this);
+    if (!fds) {
+      parent->lend_fds(this);
+    }
   }
 }
 
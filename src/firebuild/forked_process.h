@@ -35,6 +35,7 @@ class ExecedProcess;
 
 class ForkedProcess : public Process {
  public:
+  /** Without fds the process borrows the parent's fd table, see Process::lend_fds(). */
   explicit ForkedProcess(const int pid, const int ppid, Process* parent,
                          std::vector<std::shared_ptr<FileFD>>* fds);
   virtual ~ForkedProcess();
@@ -27,21 +27,71 @@
 #include <xxhash.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <thread>
 #include <vector>
 
 #include "firebuild/base64.h"
 #include "firebuild/debug.h"
 #include "firebuild/file_name.h"
+#include "firebuild/metrics.h"
+#include "firebuild/trace_events.h"
 #include "firebuild/utils.h"
 
 namespace firebuild  {
 
 static const off_t kHashingBufSize = 4096;
+/* Data at least this big is hashed in chunks, in parallel. */
+static const off_t kTreeHashMinSize = 64 * 1024 * 1024;
+static const off_t kTreeHashChunkSize = 8 * 1024 * 1024;
+static const off_t kTreeHashReadBufSize = 256 * 1024;
+static const unsigned int kMaxHashingThreads = 8;
+/* Keeps the tree hashes apart from the hashes of the concatenated chunk hashes as plain data. */
+static const XXH64_hash_t kTreeHashSeed = 1;
+
+/**
+ * Compute the tree hash of size bytes, i.e. the hash of the hashes of the consecutive
+ * kTreeHashChunkSize long chunks.
+ *
+ * The chunks are hashed in parallel by hash_chunk(offset, length, hash_out), which is called from
+ * worker threads.
+ */
+template <typename F>
+static bool tree_hash(off_t size, F hash_chunk, XXH128_hash_t* out) {
+  const size_t chunks = (size + kTreeHashChunkSize - 1) / kTreeHashChunkSize;
+  std::vector<XXH128_canonical_t> chunk_hashes(chunks);
+  std::atomic<bool> failed {false};
+  parallel_for(chunks, std::min(kMaxHashingThreads, std::thread::hardware_concurrency()),
+               [&](size_t i) {
+                 const off_t offset = i * kTreeHashChunkSize;
+                 XXH128_hash_t chunk_hash;
+                 if (failed
+                     || !hash_chunk(offset, std::min(kTreeHashChunkSize, size - offset),
+                                    &chunk_hash)) {
+                   failed = true;
+                   return;
+                 }
+                 XXH128_canonicalFromHash(&chunk_hashes[i], chunk_hash);
+               });
+  if (failed) {
+    return false;
+  }
+  *out = XXH3_128bits_withSeed(chunk_hashes.data(), chunks * sizeof(XXH128_canonical_t),
+                               kTreeHashSeed);
+  return true;
+}
 
 void Hash::set_from_data(const void *data, ssize_t size) {
   TRACKX(FB_DEBUG_HASH, 0, 1, Hash, this, "");
 
+  if (size >= kTreeHashMinSize) {
+    tree_hash(size, [data](off_t offset, off_t length, XXH128_hash_t* chunk_hash) {
+      *chunk_hash = XXH3_128bits(static_cast<const char*>(data) + offset, length);
+      return true;
+    }, &hash_);
+    return;
+  }
   /* xxhash's doc says:
    * "Streaming functions [...] is slower than single-call functions, due to state management."
    * Let's take the faster path. */
@@ -63,10 +113,52 @@ static ssize_t pread_checked_eof(int fd, char* buf, const off_t count, const off
   }
 }
 
+/**
+ * Hash a chunk of a tree hashed file with read operations, failing if the file got shorter.
+ */
+static bool hash_chunk_pread(int fd, off_t offset, off_t length, XXH128_hash_t* chunk_hash) {
+#ifdef XXH_INLINE_ALL
+  XXH3_state_t state_struct;
+  XXH3_state_t* state = &state_struct;
+#else
+  XXH3_state_t* state = XXH3_createState();
+#endif
+  if (XXH3_128bits_reset(state) == XXH_ERROR) {
+    abort();
+  }
+  std::vector<char> buf(kTreeHashReadBufSize);
+  bool success = true;
+  for (off_t pos = 0; pos < length; ) {
+    const off_t to_read = std::min(kTreeHashReadBufSize, length - pos);
+    ssize_t read_bytes = TEMP_FAILURE_RETRY(pread(fd, buf.data(), to_read, offset + pos));
+    if (read_bytes <= 0 || XXH3_128bits_update(state, buf.data(), read_bytes) == XXH_ERROR) {
+      success = false;
+      break;
+    }
+    pos += read_bytes;
+  }
+  if (success) {
+    *chunk_hash = XXH3_128bits_digest(state);
+  }
+#ifndef XXH_INLINE_ALL
+  XXH3_freeState(state);
+#endif
+  return success;
+}
+
 bool Hash::set_from_fd_pread(int fd, off_t* const size) {
   TRACKX(FB_DEBUG_HASH, 0, 1, Hash, this, "fd=%d, size=%" PRIoff, fd, *size);
   char buf[kHashingBufSize];
-  if (*size <= kHashingBufSize) {
+  if (*size >= kTreeHashMinSize) {
+    /* Hash it the same way as set_from_data() would. */
+    if (!tree_hash(*size, [fd](off_t offset, off_t length, XXH128_hash_t* chunk_hash) {
+          return hash_chunk_pread(fd, offset, length, chunk_hash);
+        }, &hash_)) {
+      FB_DEBUG(FB_DEBUG_HASH, "Cannot compute hash of regular file: pread failed");
+      return false;
+    }
+    return true;
+  } else if (*size <= kHashingBufSize) {
     ssize_t read_bytes = pread_checked_eof(fd, buf, *size, 0);
     if (read_bytes == -1) {
       FB_DEBUG(FB_DEBUG_HASH, "Cannot compute hash of regular file: pread failed");
@@ -117,6 +209,8 @@ bool Hash::set_from_fd_pread(int fd, off_t* const size) {
 
 bool Hash::set_from_fd(int fd, const struct stat64 *stat_ptr, bool *is_dir_out, off_t *size_out) {
   TRACKX(FB_DEBUG_HASH, 0, 1, Hash, this, "fd=%d, stat=%s", fd, D(stat_ptr));
+  TraceSpan span("hash");
+  OpTimer timer(Metrics::OP_HASH);
 
   struct stat64 st_local;
   if (!stat_ptr && fstat64(fd, &st_local) == -1) {
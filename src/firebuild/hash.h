@@ -71,6 +71,10 @@ class Hash {
 
   /**
    * Set the hash from the given buffer.
+   *
+   * Big buffers are split to chunks and the hash of the chunks' hashes is used, computing the
+   * chunks' hashes in parallel. Files are hashed the same way, keeping the hash of a file equal
+   * to the hash of its contents.
    */
   void set_from_data(const void *data, ssize_t size);
   /**
@@ -141,4 +145,16 @@ std::string d(const Hash& hash, const int level = 0);
 std::string d(const Hash *hash, const int level = 0);
 
 }  /* namespace firebuild */
+
+namespace std {
+template <>
+class hash<firebuild::Hash> {
+ public:
+  size_t operator()(const firebuild::Hash &h) const {
+    /* The hash is already well distributed. */
+    return h.get().low64;
+  }
+};
+}
+
 #endif  // FIREBUILD_HASH_H_
@@ -18,9 +18,19 @@
 
 #include "firebuild/hash_cache.h"
 
+#include <fcntl.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+
 #include "firebuild/debug.h"
 #include "firebuild/blob_cache.h"
 #include "firebuild/config.h"
+#include "firebuild/dir_hash_cache.h"
 #include "firebuild/file_info.h"
 #include "firebuild/file_name.h"
 #include "firebuild/utils.h"
@@ -30,16 +40,20 @@ namespace firebuild {
 /* singleton */
 HashCache *hash_cache;
 
+static const size_t kMinFilesForParallelMaterialization = 4;
+static const unsigned int kMaxMaterializationThreads = 8;
+
 /* Update the stat information in the cache. Forget the hash if the stat info changed. */
 static bool update_statinfo(const FileName* path, int fd, const struct stat64 *stat_ptr,
                             HashCacheEntry *entry) {
   TRACKX(FB_DEBUG_HASH, 1, 1, HashCacheEntry, entry,
          "path=%s, fd=%d, stat=%s", D(path), fd, D(stat_ptr));
 
-  if (path->is_in_read_only_location() && entry->info.type() != DONTKNOW) {
+  if (path->is_in_read_only_location() && entry->info.type() != DONTKNOW && !entry->needs_stat) {
     /* Assume that for system locations the statinfo never changes. */
     return true;
   }
+  entry->needs_stat = false;
 
   if (!path->is_in_read_only_location()) {
     /* For system locations, as per the previous condition, we're updating a brand new record, i.e.
@@ -76,10 +90,14 @@ static bool update_statinfo(const FileName* path, int fd, const struct stat64 *s
 
   /* Metadata changed. Update entry, remove hash. */
   entry->mtime = st->st_mtim;
+  entry->ctime = st->st_ctim;
+  entry->device = st->st_dev;
   entry->inode = st->st_ino;
   entry->is_stored = false;
   entry->is_static = false;
   entry->is_static_checked = false;
+  entry->refers_to_base_dir = false;
+  entry->refers_to_base_dir_checked = false;
   if (S_ISREG(st->st_mode)) {
     entry->info.set_type(ISREG);
     entry->info.set_mode_bits(st->st_mode & 07777, 07777 /* we know all the mode bits */);
@@ -148,6 +166,12 @@ static bool update_hash(const FileName* path, int fd, const struct stat64 *stat_
     Hash hash;
     bool is_dir;
     bool ret;
+    if (entry->info.type() == ISDIR && dir_hash_cache
+        && dir_hash_cache->get(entry->device, entry->inode, entry->mtime, entry->ctime,
+                               &hash)) {
+      entry->info.set_hash(hash);
+      return true;
+    }
     /* In order to save an fstat64() call in set_from_fd(), create a "fake" stat result here. We
      * know that it's a regular file, we know its size, and the rest are irrelevant. */
     struct stat64 st;
@@ -162,6 +186,9 @@ static bool update_hash(const FileName* path, int fd, const struct stat64 *stat_
     // FIXME verify that is_dir matches entry->info.type()
     if (ret) {
       entry->info.set_hash(hash);
+      if (is_dir && entry->info.type() == ISDIR && dir_hash_cache) {
+        dir_hash_cache->add(entry->device, entry->inode, entry->mtime, entry->ctime, hash);
+      }
       if (store) {
         /* The entry would be stored if it was not already in the cache. */
         *stored_bytes = entry->info.size();
@@ -175,6 +202,12 @@ const HashCacheEntry* HashCache::get_entry_with_statinfo(const FileName* path, i
                                                          const struct stat64 *stat_ptr) {
   TRACK(FB_DEBUG_HASH, "path=%s, fd=%d, stat=%s", D(path), fd, D(stat_ptr));
 
+  if (fd < 0 && !stat_ptr && !virtual_files_.empty()) {
+    auto it = virtual_files_.find(path);
+    if (it != virtual_files_.end()) {
+      return &it->second.entry;
+    }
+  }
   if (db_.count(path) > 0) {
     HashCacheEntry& entry = db_[path];
     if (!update_statinfo(path, fd, stat_ptr, &entry)) {
@@ -215,6 +248,16 @@ const HashCacheEntry* HashCache::get_entry_with_statinfo_and_hash(const FileName
     return &dontknow_;
   }
 
+  if (fd < 0 && !stat_ptr && !virtual_files_.empty()) {
+    auto it = virtual_files_.find(path);
+    if (it != virtual_files_.end()) {
+      /* The blob is already stored and the entry contains the hash. */
+      if (store) {
+        *stored_bytes = it->second.entry.info.size();
+      }
+      return &it->second.entry;
+    }
+  }
   if (db_.count(path) > 0) {
     HashCacheEntry& entry = db_[path];
     if (!update_hash(path, fd, stat_ptr, &entry, store, stored_bytes, skip_statinfo_update)) {
@@ -263,6 +306,18 @@ bool HashCache::get_statinfo(const FileName* path, bool *is_dir, ssize_t *size)
     /* For non-system files just stat() the file, completely bypassing the cache. Looking up and
      * updating the cache entry would just be a waste of CPU time since next time (when we do care
      * about the checksum) we'll have to update it anyway. */
+    if (!virtual_files_.empty()) {
+      auto it = virtual_files_.find(path);
+      if (it != virtual_files_.end()) {
+        if (is_dir) {
+          *is_dir = false;
+        }
+        if (size) {
+          *size = it->second.entry.info.size();
+        }
+        return true;
+      }
+    }
     struct stat64 st;
     if (stat64(path->c_str(), &st) == -1 ||
         (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
@@ -325,6 +380,37 @@ bool HashCache::get_is_static(const FileName* path, bool *is_static) {
 }
 #endif
 
+bool HashCache::get_refers_to_base_dir(const FileName* path, bool *refers) {
+  TRACK(FB_DEBUG_HASH, "path=%s", D(path));
+
+  if (path->is_in_ignore_location()) {
+    return false;
+  }
+  if (!virtual_files_.empty() && virtual_files_.count(path) > 0) {
+    /* Restored from a cache entry, which was stored only because it did not refer to base_dir. */
+    *refers = false;
+    return true;
+  }
+  const HashCacheEntry *entry = get_entry_with_statinfo(path, -1, nullptr);
+  if (entry->info.type() != ISREG) {
+    return false;
+  }
+
+  if (!entry->refers_to_base_dir_checked) {
+    int fd = open(path->c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+    const bool found = file_contains_dir(fd, base_dir, 0, entry->info.size());
+    close(fd);
+    const_cast<HashCacheEntry*>(entry)->refers_to_base_dir = found;
+    const_cast<HashCacheEntry*>(entry)->refers_to_base_dir_checked = true;
+  }
+
+  *refers = entry->refers_to_base_dir;
+  return true;
+}
+
 bool HashCache::store_and_get_hash(const FileName* path, int max_writers, Hash *hash,
                                    off_t* stored_bytes, int fd, const struct stat64 *stat_ptr,
                                    char **inline_data, size_t *inline_data_len) {
@@ -341,6 +427,8 @@ bool HashCache::store_and_get_hash(const FileName* path, int max_writers, Hash *
   if (path->is_in_ignore_location()) {
     return false;
   }
+  /* The file's data may be inlined and be read back from the file system. */
+  materialize(path);
   const HashCacheEntry *entry = get_entry_with_statinfo_and_hash(path, max_writers, fd, stat_ptr,
                                                                  true, stored_bytes);
   if (!entry) {
@@ -475,6 +563,14 @@ bool HashCache::file_info_matches(const FileName *path, const FileInfo& query) {
   return entry->info.hash() == query.hash();
 }
 
+bool HashCache::known_hash_matches(const FileName *path, const Hash& hash, off_t size) {
+  TRACK(FB_DEBUG_HASH, "path=%s, hash=%s, size=%" PRIoff, D(path), D(hash), size);
+
+  const HashCacheEntry* entry = get_entry_with_statinfo(path, -1, nullptr);
+  return entry->info.type() == ISREG && entry->info.size() == size && entry->info.hash_known()
+      && entry->info.hash() == hash;
+}
+
 const FileName* HashCache::resolve_command(const char* cmd, size_t cmd_len,
                                           const char* path, size_t path_len, const FileName* wd,
                                           std::vector<const FileName*>* paths_checked,
@@ -558,6 +654,188 @@ const FileName* HashCache::resolve_command(const char* cmd, size_t cmd_len,
   return nullptr;
 }
 
+void HashCache::add_virtual_file(const FileName* path, const FileInfo& info, int blob_fd,
+                                 bool compressed, bool set_mode) {
+  TRACK(FB_DEBUG_HASH, "path=%s, info=%s, blob_fd=%d", D(path), D(info), blob_fd);
+
+  assert(info.type() == ISREG && info.hash_known());
+  forget_virtual_file(path);
+  db_.erase(path);
+  VirtualFile file;
+  file.entry.info = info;
+  file.entry.is_stored = true;
+  file.blob_fd = blob_fd;
+  file.compressed = compressed;
+  file.set_mode = set_mode;
+  /* The files written later, e.g. the executables linked from this file, must not look older than
+   * this one to make. The kernel sets the files' modification time from the coarse clock. */
+#ifdef CLOCK_REALTIME_COARSE
+  clock_gettime(CLOCK_REALTIME_COARSE, &file.mtime);
+#else
+  clock_gettime(CLOCK_REALTIME, &file.mtime);
+#endif
+  virtual_files_[path] = file;
+}
+
+void HashCache::forget_virtual_file(const FileName* path) {
+  auto it = virtual_files_.find(path);
+  if (it != virtual_files_.end()) {
+    close(it->second.blob_fd);
+    virtual_files_.erase(it);
+  }
+}
+
+/**
+ * Write a virtual file to the file system.
+ *
+ * Called from worker threads, thus it must not touch the FileName db or the hash cache's maps.
+ */
+static bool write_virtual_file(const FileName* path, const VirtualFile& file) {
+  if (!blob_cache->retrieve_file(file.blob_fd, path, false, file.compressed)) {
+    fb_perror(std::string("Failed creating file from cache: " + d(path)).c_str());
+    return false;
+  }
+  if (file.set_mode) {
+    chmod(path->c_str(), file.entry.info.mode() & 0777);
+  }
+  const struct timespec times[2] = {{0, UTIME_OMIT}, file.mtime};
+  if (utimensat(AT_FDCWD, path->c_str(), times, 0) != 0) {
+    fb_perror(std::string("Failed setting the modification time of " + d(path)).c_str());
+  }
+  return true;
+}
+
+void HashCache::update_written_file(const FileName* path, const Hash& hash, off_t size,
+                                    bool is_stored) {
+  TRACK(FB_DEBUG_HASH, "path=%s, hash=%s, size=%" PRIoff ", is_stored=%s",
+        D(path), D(hash), size, D(is_stored));
+
+  HashCacheEntry entry {FileInfo(DONTKNOW)};
+  update_statinfo(path, -1, nullptr, &entry);
+  if (entry.info.type() == ISREG && entry.info.size() == size) {
+    entry.info.set_hash(hash);
+    entry.is_stored = is_stored;
+    db_[path] = entry;
+  } else {
+    db_.erase(path);
+  }
+}
+
+void HashCache::materialize(const FileName* path) {
+  auto it = virtual_files_.find(path);
+  if (it == virtual_files_.end()) {
+    return;
+  }
+  TRACK(FB_DEBUG_HASH, "path=%s", D(path));
+
+  const VirtualFile file = it->second;
+  virtual_files_.erase(it);
+  FB_DEBUG(FB_DEBUG_SHORTCUT, "Materializing file: " + d(path));
+  if (write_virtual_file(path, file)) {
+    update_written_file(path, file.entry.info.hash(), file.entry.info.size(), true);
+  }
+  close(file.blob_fd);
+}
+
+void HashCache::materialize_all() {
+  if (virtual_files_.empty()) {
+    return;
+  }
+  FB_DEBUG(FB_DEBUG_SHORTCUT, "Materializing " + d(virtual_files_.size()) + " files");
+  std::vector<std::pair<const FileName*, VirtualFile>> files(virtual_files_.begin(),
+                                                             virtual_files_.end());
+  virtual_files_.clear();
+  std::vector<char> written(files.size());
+  /* Keep the method tracker's output in order when debugging. */
+  const unsigned int threads =
+      (files.size() < kMinFilesForParallelMaterialization || FB_DEBUGGING(FB_DEBUG_FUNC)) ? 1
+      : std::min(kMaxMaterializationThreads, std::thread::hardware_concurrency());
+  parallel_for(files.size(), threads, [&](size_t i) {
+    written[i] = write_virtual_file(files[i].first, files[i].second);
+  });
+  for (size_t i = 0; i < files.size(); i++) {
+    if (written[i]) {
+      const FileInfo& info = files[i].second.entry.info;
+      update_written_file(files[i].first, info.hash(), info.size(), true);
+    }
+    close(files[i].second.blob_fd);
+  }
+}
+
+/** The fixed size part of an exported entry, followed by the path. */
+struct ExportedEntry {
+  XXH128_hash_t hash;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t ctime_sec;
+  int64_t ctime_nsec;
+  uint64_t device;
+  uint64_t inode;
+  uint32_t mode;
+  uint8_t type;
+  uint8_t is_static;
+  uint8_t is_static_checked;
+  uint8_t padding;
+  uint32_t path_len;
+  uint32_t padding2;
+};
+
+void HashCache::export_entries(std::string* out) const {
+  for (const auto& [path, entry] : db_) {
+    if ((entry.info.type() != ISREG && entry.info.type() != ISDIR) || !entry.info.hash_known()) {
+      continue;
+    }
+    ExportedEntry exported {};
+    exported.hash = entry.info.hash().get();
+    exported.size = entry.info.size();
+    exported.mtime_sec = entry.mtime.tv_sec;
+    exported.mtime_nsec = entry.mtime.tv_nsec;
+    exported.ctime_sec = entry.ctime.tv_sec;
+    exported.ctime_nsec = entry.ctime.tv_nsec;
+    exported.device = entry.device;
+    exported.inode = entry.inode;
+    exported.mode = entry.info.mode();
+    exported.type = entry.info.type();
+    exported.is_static = entry.is_static;
+    exported.is_static_checked = entry.is_static_checked;
+    exported.path_len = path->length();
+    out->append(reinterpret_cast<const char*>(&exported), sizeof(exported));
+    out->append(path->c_str(), path->length());
+  }
+}
+
+void HashCache::import_entries(const char* data, size_t len) {
+  TRACK(FB_DEBUG_HASH, "len=%zu", len);
+
+  size_t offset = 0;
+  while (offset + sizeof(ExportedEntry) <= len) {
+    ExportedEntry exported;
+    memcpy(&exported, data + offset, sizeof(exported));
+    offset += sizeof(exported);
+    if (exported.path_len == 0 || exported.path_len > len - offset
+        || (exported.type != ISREG && exported.type != ISDIR)) {
+      break;
+    }
+    const FileName* path = FileName::Get(data + offset, exported.path_len);
+    offset += exported.path_len;
+    const Hash hash(exported.hash);
+    HashCacheEntry entry {FileInfo(FileInfo::int_to_file_type(exported.type), exported.size,
+                                   &hash)};
+    entry.info.set_mode_bits(exported.mode, 07777);
+    entry.mtime.tv_sec = exported.mtime_sec;
+    entry.mtime.tv_nsec = exported.mtime_nsec;
+    entry.ctime.tv_sec = exported.ctime_sec;
+    entry.ctime.tv_nsec = exported.ctime_nsec;
+    entry.device = exported.device;
+    entry.inode = exported.inode;
+    entry.is_static = exported.is_static;
+    entry.is_static_checked = exported.is_static_checked;
+    entry.needs_stat = true;
+    db_[path] = entry;
+  }
+}
+
 const HashCacheEntry HashCache::notexist_ {FileInfo(NOTEXIST)};
 const HashCacheEntry HashCache::dontknow_ {FileInfo(DONTKNOW)};
 
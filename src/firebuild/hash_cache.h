@@ -37,10 +37,30 @@ namespace firebuild {
 struct HashCacheEntry {
   FileInfo info {};
   struct timespec mtime {};
-  ino_t inode {};  /* skip device, it's unlikely to change */
+  /* ctime and device are only used for looking up the directories' persisted hashes */
+  struct timespec ctime {};
+  dev_t device {};
+  ino_t inode {};  /* device is not compared, it's unlikely to change */
   bool is_stored {};  /* it's known to be present in the blob cache because we stored it earlier */
   bool is_static {}; /* it's a static binary detected to be run via qemu-user */
   bool is_static_checked {}; /* whether we checked if it's a static binary */
+  bool refers_to_base_dir {}; /* base_dir occurs in the regular file as a directory */
+  bool refers_to_base_dir_checked {}; /* whether we checked if it refers to base_dir */
+  /* imported from another process, stat() it once even in a read-only location */
+  bool needs_stat {};
+};
+
+/**
+ * A regular file restored from the blob cache only in the hash cache's records, not yet written to
+ * the file system.
+ */
+struct VirtualFile {
+  HashCacheEntry entry {};
+  int blob_fd {-1};  /* owned by the VirtualFile */
+  bool compressed {};  /* the blob is compressed */
+  bool set_mode {};  /* the mode has to be applied explicitly */
+  /* When the file would have been written, to be set as its modification time when writing it. */
+  struct timespec mtime {};
 };
 
 /**
@@ -124,6 +144,17 @@ class HashCache {
    */
   bool file_info_matches(const FileName *path, const FileInfo& query);
 
+  /**
+   * Check if a regular file's hash is already known and matches without hashing the file.
+   *
+   * @param path  file's path
+   * @param hash  the expected hash
+   * @param size  the expected size
+   * @return      whether the file's stat info is unchanged since its hash was recorded and the
+   *              hash matches
+   */
+  bool known_hash_matches(const FileName *path, const Hash& hash, off_t size);
+
   /** Resolve a command on the PATH.
    *  Optionally populates paths_checked with the paths that were chhecked before the executable
    *  was found (i.e., paths where the executable was NOT found). */
@@ -137,8 +168,63 @@ class HashCache {
   bool get_is_static(const FileName* path, bool *is_static);
 #endif
 
+  /**
+   * Check if base_dir occurs in a regular file as a directory. The file is scanned only once
+   * until it changes.
+   *
+   * @param path          file's path
+   * @param[out] refers   whether the file refers to base_dir
+   * @return              false if not a regular file
+   */
+  bool get_refers_to_base_dir(const FileName* path, bool *refers);
+
+  /**
+   * Record a regular file to be restored from the blob cache without writing it yet.
+   *
+   * Until the file is materialized the hash cache reports the file as if it was already written,
+   * thus shortcut processes can use it as an input while it is never written if no other process
+   * needs it.
+   *
+   * @param path        file's path
+   * @param info        the file's type, size, hash and mode
+   * @param blob_fd     fd of the blob to restore the file from, the hash cache takes ownership
+   * @param compressed  whether the blob is compressed
+   * @param set_mode    whether info's mode has to be applied after writing the file
+   */
+  void add_virtual_file(const FileName* path, const FileInfo& info, int blob_fd, bool compressed,
+                        bool set_mode);
+  size_t virtual_files_count() const {return virtual_files_.size();}
+  /** Forget the virtual file at path, if any, because the path is about to be overwritten. */
+  void forget_virtual_file(const FileName* path);
+  /** Write the file at path to the file system if it is virtual. */
+  void materialize(const FileName* path);
+  /** Write all the virtual files to the file system. */
+  void materialize_all();
+
+  /**
+   * Record the known hash of a regular file the supervisor has just written or touched, to save
+   * hashing it again.
+   *
+   * @param path       file's path
+   * @param hash       the hash of the expected content
+   * @param size       the expected size, the hash is not recorded if the file's size differs
+   * @param is_stored  whether the content is known to be present in the blob cache
+   */
+  void update_written_file(const FileName* path, const Hash& hash, off_t size, bool is_stored);
+
+  /** Serialize the entries with a known hash, to be imported by import_entries(). */
+  void export_entries(std::string* out) const;
+  /**
+   * Add the entries exported by another process, overriding the known ones.
+   *
+   * The files may have changed since they were exported, thus the imported entries are checked
+   * once before being used, even in read-only locations.
+   */
+  void import_entries(const char* data, size_t len);
+
  private:
   tsl::hopscotch_map<const FileName*, HashCacheEntry> db_ = {};
+  tsl::hopscotch_map<const FileName*, VirtualFile> virtual_files_ = {};
 
   /**
    * Returns an up-to-date HashCacheEntry corresponding to the given file.
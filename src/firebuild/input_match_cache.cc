@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/input_match_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/firebuild_common.h"
+#include "firebuild/change_journal.h"
+#include "firebuild/debug.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/file_name.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+InputMatchCache *input_match_cache = nullptr;
+
+static const char kMatchMagic[8] = {'F', 'B', 'M', 'A', 'T', 'C', 'H', '2'};
+/* Syncing with the change journal is not cheaper than checking a few inputs. */
+static const size_t kMinInputsForJournal = 16;
+
+InputMatchCache::InputMatchCache(const std::string &base_dir) : base_dir_(base_dir) {
+  mkdir(base_dir_.c_str(), 0700);
+}
+
+/* /x/<ascii fingerprint>_<subkey> */
+std::string InputMatchCache::path(const Hash &fingerprint, const char * const subkey) const {
+  const std::string ascii = fingerprint.to_ascii();
+  return base_dir_ + "/" + ascii[0] + "/" + ascii + "_" + subkey;
+}
+
+/**
+ * Call fn(name, name_len, is_dir) for each input until it returns false.
+ * The names are absolute, even the ones stored relative to base_dir.
+ * @return whether fn returned true for all inputs
+ */
+template <typename F>
+static bool for_each_input(const FBBSTORE_Serialized_process_inputs *inputs, F fn) {
+  for (size_t i = 0; i < inputs->get_path_count(); i++) {
+    auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(inputs->get_path_at(i));
+    const FileName* name = FileName::GetStored(file->get_path(), file->get_path_len());
+    if (!fn(name->c_str(), name->length(), file->get_type() == ISDIR)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < inputs->get_path_notexist_count(); i++) {
+    const FileName* name = FileName::GetStored(inputs->get_path_notexist_at(i),
+                                               inputs->get_path_notexist_len_at(i));
+    if (!fn(name->c_str(), name->length(), false)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t input_count(const FBBSTORE_Serialized_process_inputs *inputs) {
+  return inputs->get_path_count() + inputs->get_path_notexist_count();
+}
+
+static bool may_skip_full_check(const char * const name, size_t name_len) {
+  const FileName* file_name = FileName::Get(name, name_len);
+  return !file_name->is_in_ignore_location() && file_name->writers_count() == 0;
+}
+
+bool InputMatchCache::collect_records(const FBBSTORE_Serialized_process_inputs *inputs,
+                                      std::vector<Record> *records, int64_t *newest_change) {
+  records->clear();
+  records->reserve(input_count(inputs));
+  *newest_change = 0;
+  return for_each_input(inputs, [&](const char *name, size_t name_len, bool is_dir) {
+    (void)is_dir;
+    if (!may_skip_full_check(name, name_len)) {
+      return false;
+    }
+    Record record {};
+    struct stat64 st;
+    if (stat64(name, &st) == -1) {
+      if (errno != ENOENT && errno != ENOTDIR) {
+        return false;
+      }
+    } else {
+      record.ino = st.st_ino;
+      record.size = st.st_size;
+      record.mtime_sec = st.st_mtim.tv_sec;
+      record.mtime_nsec = st.st_mtim.tv_nsec;
+      record.ctime_sec = st.st_ctim.tv_sec;
+      record.ctime_nsec = st.st_ctim.tv_nsec;
+      record.mode = st.st_mode;
+    }
+    *newest_change = std::max(*newest_change, std::max(record.mtime_sec, record.ctime_sec));
+    records->push_back(record);
+    return true;
+  });
+}
+
+bool InputMatchCache::matches(const Hash &fingerprint, const char * const subkey,
+                              const FBBSTORE_Serialized_process_inputs *inputs) {
+  const size_t count = input_count(inputs);
+  const size_t len = count * sizeof(Record);
+  const std::string match_path = path(fingerprint, subkey);
+  JournalStamp stamp;
+  std::vector<Record> saved;
+  auto pending_it = pending_.find(match_path);
+  if (pending_it != pending_.end()) {
+    /* Stored in this run, not written yet. */
+    if (pending_it->second.records.size() != count) {
+      return false;
+    }
+    stamp = pending_it->second.stamp;
+    saved = pending_it->second.records;
+  } else {
+    int fd = open(match_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+    char magic[sizeof(kMatchMagic)];
+    saved.resize(count + 1);
+    const bool valid = fb_read(fd, magic, sizeof(magic)) == static_cast<ssize_t>(sizeof(magic))
+        && memcmp(magic, kMatchMagic, sizeof(magic)) == 0
+        && fb_read(fd, &stamp, sizeof(stamp)) == static_cast<ssize_t>(sizeof(stamp))
+        /* Try reading one more record to detect a longer file. */
+        && fb_read(fd, saved.data(), len + sizeof(Record)) == static_cast<ssize_t>(len);
+    close(fd);
+    if (!valid) {
+      return false;
+    }
+  }
+
+  const bool use_journal = change_journal && count >= kMinInputsForJournal;
+  uint64_t seq;
+  if (use_journal && stamp.journal_id == change_journal->instance_id()
+      && change_journal->sync(&seq)) {
+    if (for_each_input(inputs, [&](const char *name, size_t name_len, bool is_dir) {
+          return may_skip_full_check(name, name_len)
+              && change_journal->unchanged_since(name, name_len, is_dir, stamp.journal_seq);
+        })) {
+      FB_DEBUG(FB_DEBUG_SHORTCUT, std::string("│   ") + subkey
+               + "'s inputs' directories did not change since they last matched");
+      return true;
+    }
+  }
+
+  std::vector<Record> current;
+  int64_t newest_change;
+  const bool ret = collect_records(inputs, &current, &newest_change)
+      && memcmp(saved.data(), current.data(), len) == 0;
+  FB_DEBUG(FB_DEBUG_SHORTCUT, std::string("│   ") + subkey + "'s inputs "
+           + (ret ? "did not change since they last matched" : "may have changed"));
+  if (ret && use_journal) {
+    /* Let the next check rely on the journal. */
+    store(fingerprint, subkey, inputs);
+  }
+  return ret;
+}
+
+void InputMatchCache::store(const Hash &fingerprint, const char * const subkey,
+                            const FBBSTORE_Serialized_process_inputs *inputs) {
+  JournalStamp stamp {0, 0};
+  if (change_journal && input_count(inputs) >= kMinInputsForJournal) {
+    for_each_input(inputs, [&](const char *name, size_t name_len, bool is_dir) {
+      change_journal->watch(name, name_len, is_dir);
+      return true;
+    });
+    /* The changes after the sync are in the journal, the inputs are checked only after that. */
+    if (change_journal->sync(&stamp.journal_seq)) {
+      stamp.journal_id = change_journal->instance_id();
+    }
+  }
+  std::vector<Record> records;
+  int64_t newest_change;
+  if (!collect_records(inputs, &records, &newest_change)) {
+    return;
+  }
+  /* A file modified in the same second after the check could keep all the recorded stat
+   * information on file systems with coarse timestamps. Remember only inputs that settled. */
+  if (newest_change >= time(nullptr) - 1) {
+    return;
+  }
+  pending_[path(fingerprint, subkey)] = {stamp, std::move(records)};
+}
+
+bool InputMatchCache::write_records(const std::string& final_path, const Pending& pending) {
+  const std::string tmp_path = final_path + "." + std::to_string(getpid());
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    return false;
+  }
+  const size_t len = pending.records.size() * sizeof(Record);
+  const bool written =
+      fb_write(fd, kMatchMagic, sizeof(kMatchMagic)) == static_cast<ssize_t>(sizeof(kMatchMagic))
+      && fb_write(fd, &pending.stamp, sizeof(pending.stamp))
+      == static_cast<ssize_t>(sizeof(pending.stamp))
+      && fb_write(fd, pending.records.data(), len) == static_cast<ssize_t>(len);
+  close(fd);
+  if (!written || !execed_process_cacher->replace_metadata_file(tmp_path, final_path)) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void InputMatchCache::flush() {
+  for (const auto& pair : pending_) {
+    mkdir(pair.first.substr(0, pair.first.rfind('/')).c_str(), 0700);
+    if (!write_records(pair.first, pair.second)) {
+      fb_perror("Failed storing input match");
+    }
+  }
+  pending_.clear();
+}
+
+}  /* namespace firebuild */
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_INPUT_MATCH_CACHE_H_
+#define FIREBUILD_INPUT_MATCH_CACHE_H_
+
+#include <stdint.h>
+#include <tsl/hopscotch_map.h>
+
+#include <string>
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/fbbstore.h"
+#include "firebuild/hash.h"
+
+namespace firebuild {
+
+/**
+ * Remembers the cache entries whose inputs matched the file system in a previous run.
+ *
+ * Checking a cache entry's inputs may need hashing every input file. When the inputs matched,
+ * their stat information is saved for the (fingerprint, subkey) pair and in the next run the
+ * inputs are accepted as matching if none of them changed since then according to stat(), or
+ * according to the change journal when running in a supervisor forked by the daemon.
+ *
+ * The records are stored in the "matches" directory of the cache. They are collected during the
+ * build and written by flush() at its end.
+ */
+class InputMatchCache {
+ public:
+  explicit InputMatchCache(const std::string &base_dir);
+  /**
+   * Check if all the inputs are unchanged since they were last found to match the file system.
+   */
+  bool matches(const Hash &fingerprint, const char * const subkey,
+               const FBBSTORE_Serialized_process_inputs *inputs);
+  /** Remember the inputs' current stat information after they have been found to match. */
+  void store(const Hash &fingerprint, const char * const subkey,
+             const FBBSTORE_Serialized_process_inputs *inputs);
+  /** Write the records collected in this run. */
+  void flush();
+
+ private:
+  struct Record {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    /* 0 for missing paths */
+    uint32_t mode;
+    uint32_t padding;
+  };
+  /** The change journal's state when the records were collected, 0 when not available. */
+  struct JournalStamp {
+    uint64_t journal_id;
+    uint64_t journal_seq;
+  };
+  struct Pending {
+    JournalStamp stamp {0, 0};
+    std::vector<Record> records {};
+  };
+  static bool collect_records(const FBBSTORE_Serialized_process_inputs *inputs,
+                              std::vector<Record> *records, int64_t *newest_change);
+  std::string path(const Hash &fingerprint, const char * const subkey) const;
+
+  static bool write_records(const std::string& final_path, const Pending& pending);
+
+  std::string base_dir_;
+  /** The records to be written by flush(), by their path. */
+  tsl::hopscotch_map<std::string, Pending> pending_ {};
+  DISALLOW_COPY_AND_ASSIGN(InputMatchCache);
+};
+
+/* singleton */
+extern InputMatchCache *input_match_cache;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_INPUT_MATCH_CACHE_H_
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "firebuild/jobserver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "firebuild/config.h"
+#include "firebuild/debug.h"
+#include "firebuild/epoll.h"
+#include "firebuild/execed_process.h"
+#include "firebuild/options.h"
+
+namespace firebuild {
+
+std::map<std::pair<dev_t, ino_t>, Jobserver*> Jobserver::jobservers_;
+bool Jobserver::closed_ = false;
+
+Jobserver* Jobserver::GetForFds(int fd_r, int fd_w) {
+  struct stat st, st_w;
+  if (fstat(fd_r, &st) != 0 || !S_ISFIFO(st.st_mode)
+      || (fd_w != fd_r && (fstat(fd_w, &st_w) != 0 || st_w.st_dev != st.st_dev
+                           || st_w.st_ino != st.st_ino))) {
+    /* Writing a token to anything else, e.g. to a pipe of a shell's pipeline, would corrupt it. */
+    close(fd_r);
+    if (fd_w != fd_r) {
+      close(fd_w);
+    }
+    return nullptr;
+  }
+  auto it = jobservers_.find({st.st_dev, st.st_ino});
+  if (it != jobservers_.end()) {
+    /* Already opened through an other process. */
+    close(fd_r);
+    if (fd_w != fd_r) {
+      close(fd_w);
+    }
+    return it->second;
+  }
+  FB_DEBUG(FB_DEBUG_SHORTCUT, "Connected to jobserver " + d(st.st_ino));
+  Jobserver* jobserver = new Jobserver(fd_r, fd_w);
+  jobservers_[{st.st_dev, st.st_ino}] = jobserver;
+  return jobserver;
+}
+
+Jobserver* Jobserver::Get(const ExecedProcess* proc) {
+  /* The fifo and the /proc entries of replayed processes are not theirs. */
+  if (closed_ || Options::replay_messages_file()) {
+    return nullptr;
+  }
+  if (proc->jobserver()) {
+    return proc->jobserver();
+  }
+  if (proc->jobserver_fifo()) {
+    int fd = open(proc->jobserver_fifo()->c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    Jobserver* jobserver = fd == -1 ? nullptr : GetForFds(fd, fd);
+    proc->set_jobserver(jobserver);
+    return jobserver;
+  }
+  const int jobserver_fd_r = proc->jobserver_fd_r();
+  const int jobserver_fd_w = proc->jobserver_fd_w();
+  if (jobserver_fd_r < 0 || jobserver_fd_w < 0) {
+    return nullptr;
+  }
+  /* Make closes the jobserver fds in the jobs that are not recursive make invocations, but the
+   * make running the job still has them open. */
+  for (const ExecedProcess* p = proc; p; p = p->parent_exec_point()) {
+    if (p->jobserver()) {
+      return p->jobserver();
+    }
+    if (p->jobserver_fd_r() != jobserver_fd_r || p->jobserver_fd_w() != jobserver_fd_w) {
+      /* The fds may be used for something else in this process. */
+      continue;
+    }
+    const std::string fd_dir = "/proc/" + std::to_string(p->pid()) + "/fd/";
+    int fd_r = open((fd_dir + std::to_string(jobserver_fd_r)).c_str(),
+                    O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd_r == -1) {
+      continue;
+    }
+    int fd_w = open((fd_dir + std::to_string(jobserver_fd_w)).c_str(),
+                    O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd_w == -1) {
+      close(fd_r);
+      continue;
+    }
+    Jobserver* jobserver = GetForFds(fd_r, fd_w);
+    p->set_jobserver(jobserver);
+    return jobserver;
+  }
+  return nullptr;
+}
+
+Jobserver::~Jobserver() {
+  if (watching_) {
+    epoll->del_fd(fd_r_, EPOLLIN);
+  }
+  if (lent_ > 0) {
+    FB_DEBUG(FB_DEBUG_SHORTCUT, "Giving up " + d(lent_) + " lent jobserver tokens");
+  }
+  close(fd_r_);
+  if (fd_w_ != fd_r_) {
+    close(fd_w_);
+  }
+}
+
+void Jobserver::CloseAll() {
+  for (auto& [id, jobserver] : jobservers_) {
+    delete jobserver;
+  }
+  jobservers_.clear();
+  closed_ = true;
+}
+
+bool Jobserver::lend() {
+  if (lent_ >= max_lent_jobserver_tokens) {
+    return false;
+  }
+  const char token = '+';
+  if (write(fd_w_, &token, 1) == 1) {
+    lent_++;
+    return true;
+  }
+  return false;
+}
+
+void Jobserver::reclaim() {
+  assert_cmp(reclaiming_, <, lent_);
+  reclaiming_++;
+  take_back();
+}
+
+void Jobserver::take_back() {
+  char tokens[64];
+  while (reclaiming_ > 0) {
+    const ssize_t ret = read(fd_r_, tokens,
+                             std::min(reclaiming_, static_cast<int>(sizeof(tokens))));
+    if (ret > 0) {
+      reclaiming_ -= ret;
+      lent_ -= ret;
+    } else if (ret == -1 && errno == EINTR) {
+      continue;
+    } else {
+      /* Make is using all the tokens. The pipe can't reach EOF, because fd_w_ is kept open.
+       * The fd is watched until the tokens are taken back or CloseAll() is called. */
+      break;
+    }
+  }
+  if (reclaiming_ > 0 && !watching_) {
+    epoll->add_fd(fd_r_, EPOLLIN, reclaim_cb, this);
+    watching_ = true;
+  } else if (reclaiming_ == 0 && watching_) {
+    epoll->del_fd(fd_r_, EPOLLIN);
+    watching_ = false;
+  }
+}
+
+void Jobserver::reclaim_cb(const struct epoll_event* event, void *arg) {
+  (void)event;
+  reinterpret_cast<Jobserver*>(arg)->take_back();
+}
+
+}  /* namespace firebuild */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef FIREBUILD_JOBSERVER_H_
+#define FIREBUILD_JOBSERVER_H_
+
+#include <sys/types.h>
+
+#include <map>
+#include <utility>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/epoll.h"
+
+namespace firebuild {
+
+class ExecedProcess;
+
+/**
+ * The supervisor's connection to a GNU Make jobserver.
+ *
+ * A shortcut process keeps its job slot until it exits, but from the moment a cache entry is found
+ * for it, it does no work on its own. The supervisor lends a token to the jobserver for that time
+ * to let make start the next job, and takes a token back when the shortcut process exited, as soon
+ * as one becomes available. While the outputs are replayed the supervisor does not serve the new
+ * jobs, but they can get through starting up until they connect to the supervisor.
+ * When most of the jobs are shortcut make ends up running more jobs in parallel than its job
+ * slots, limited by max_lent_jobserver_tokens.
+ *
+ * Both the fifo (--jobserver-auth=fifo:PATH) and the inherited pipe (--jobserver-auth=R,W)
+ * jobservers are supported. The latter is opened through /proc using the fds of the process or
+ * of the closest ancestor still holding them, since make hides the jobserver from the jobs that
+ * are not recursive make invocations. Only the fds of the processes whose own MAKEFLAGS names them
+ * are used, and only if they are the two ends of the same pipe.
+ */
+class Jobserver {
+ public:
+  /**
+   * The jobserver used by proc, or nullptr when the process uses none or it can't be opened.
+   *
+   * The jobserver is remembered in the process it is opened through, to not open it again for
+   * the next jobs.
+   */
+  static Jobserver* Get(const ExecedProcess* proc);
+  /**
+   * Stop watching and close all the jobservers, giving up the tokens not taken back yet.
+   *
+   * Called when all the build's processes exited, thus nobody could return the tokens anymore.
+   */
+  static void CloseAll();
+
+  /**
+   * Lend a token if the limit allows it.
+   * @return whether a token was lent, to be taken back by reclaim()
+   */
+  bool lend();
+  /** Take back a lent token, now or later when one becomes available. */
+  void reclaim();
+
+ private:
+  Jobserver(int fd_r, int fd_w) : fd_r_(fd_r), fd_w_(fd_w) {}
+  ~Jobserver();
+  static Jobserver* GetForFds(int fd_r, int fd_w);
+  /** Take back the tokens to be reclaimed, watching fd_r_ for the ones not available yet. */
+  void take_back();
+  static void reclaim_cb(const struct epoll_event* event, void *arg);
+
+  /** Read end of the jobserver in non-blocking mode, may be the same as fd_w_. */
+  int fd_r_;
+  /** Write end of the jobserver in non-blocking mode. */
+  int fd_w_;
+  /** Tokens lent to make and not taken back yet. */
+  int lent_ {0};
+  /** Lent tokens to be taken back as soon as they are available. */
+  int reclaiming_ {0};
+  /** Whether fd_r_ is watched for taking back the tokens. */
+  bool watching_ {false};
+
+  /** The opened jobservers by the device and inode of their pipe or fifo. */
+  static std::map<std::pair<dev_t, ino_t>, Jobserver*> jobservers_;
+  /** Whether CloseAll() has been called, the processes' cached jobservers are gone then. */
+  static bool closed_;
+  DISALLOW_COPY_AND_ASSIGN(Jobserver);
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_JOBSERVER_H_
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "firebuild/message_log.h"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __APPLE__
+#include <sys/un.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "common/firebuild_common.h"
+#include "firebuild/connection_context.h"
+#include "firebuild/debug.h"
+#include "firebuild/epoll.h"
+#include "firebuild/message_processor.h"
+#include "firebuild/metrics.h"
+#include "firebuild/process_tree.h"
+#include "firebuild/sigchild_callback.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+MessageLog *message_log = nullptr;
+
+static const char kMessageLogMagic[8] = {'F', 'B', 'M', 'S', 'G', 'L', 'O', 'G'};
+
+static int64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+MessageLog::MessageLog(FILE* stream) : stream_(stream), start_ns_(now_ns()) {
+  fwrite(kMessageLogMagic, sizeof(kMessageLogMagic), 1, stream_);
+  /* Don't let the forked build command flush the same buffer if it fails to exec(). */
+  fflush(stream_);
+}
+
+MessageLog* MessageLog::Create(const std::string& path) {
+  FILE* stream = fopen(path.c_str(), "w");
+  if (!stream) {
+    fb_perror(("Creating message log " + path).c_str());
+    return nullptr;
+  }
+  return new MessageLog(stream);
+}
+
+MessageLog::~MessageLog() {
+  if (fclose(stream_) != 0) {
+    fb_perror("Writing message log");
+  }
+}
+
+void MessageLog::write_record(uint32_t type, uint32_t conn_id, pid_t pid, int status,
+                              const char* data, uint32_t len) {
+  RecordHeader header = {now_ns() - start_ns_, type, conn_id, pid, status, len, 0};
+  fwrite(&header, sizeof(header), 1, stream_);
+  if (len > 0) {
+    fwrite(data, len, 1, stream_);
+  }
+}
+
+void MessageLog::root_started(pid_t pid) {
+  write_record(RECORD_ROOT, 0, pid, 0, nullptr, 0);
+}
+
+void MessageLog::conn_accepted(int fd) {
+  const uint32_t conn_id = next_conn_id_++;
+  conn_ids_[fd] = conn_id;
+  pid_t peer_pid = 0;
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+    peer_pid = cred.pid;
+  }
+#else
+  socklen_t len = sizeof(peer_pid);
+  if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &peer_pid, &len) != 0) {
+    peer_pid = 0;
+  }
+#endif
+  write_record(RECORD_ACCEPT, conn_id, peer_pid, fd, nullptr, 0);
+}
+
+void MessageLog::message(int fd, const char* data, uint32_t len) {
+  auto it = conn_ids_.find(fd);
+  assert(it != conn_ids_.end());
+  write_record(RECORD_MESSAGE, it->second, 0, 0, data, len);
+}
+
+void MessageLog::conn_closed(int fd) {
+  auto it = conn_ids_.find(fd);
+  if (it != conn_ids_.end()) {
+    write_record(RECORD_CLOSE, it->second, 0, 0, nullptr, 0);
+    conn_ids_.erase(it);
+  }
+}
+
+void MessageLog::child_exited(pid_t pid, int status) {
+  write_record(RECORD_CHILD_EXIT, 0, pid, status, nullptr, 0);
+}
+
+void MessageLog::fds_sent(int fd, const int* fds, int fd_count) {
+  auto it = conn_ids_.find(fd);
+  if (it == conn_ids_.end()) {
+    return;
+  }
+  std::vector<uint32_t> types(fd_count);
+  for (int i = 0; i < fd_count; i++) {
+    struct stat st;
+    types[i] = fstat(fds[i], &st) == 0 ? (st.st_mode & S_IFMT) : 0;
+  }
+  write_record(RECORD_FDS_SENT, it->second, 0, fd_count,
+               reinterpret_cast<const char*>(types.data()),
+               static_cast<uint32_t>(fd_count * sizeof(uint32_t)));
+}
+
+MessageLogReplayer::MessageLogReplayer(FILE* stream, pid_t root_pid)
+    : stream_(stream), root_pid_(root_pid) {}
+
+MessageLogReplayer* MessageLogReplayer::Open(const std::string& path) {
+  FILE* stream = fopen(path.c_str(), "r");
+  if (!stream) {
+    fb_perror(("Opening message log " + path).c_str());
+    return nullptr;
+  }
+  char magic[sizeof(kMessageLogMagic)];
+  MessageLog::RecordHeader header;
+  if (fread(magic, sizeof(magic), 1, stream) != 1
+      || memcmp(magic, kMessageLogMagic, sizeof(magic)) != 0
+      || fread(&header, sizeof(header), 1, stream) != 1
+      || header.type != MessageLog::RECORD_ROOT) {
+    fb_error("Invalid message log: " + path);
+    fclose(stream);
+    return nullptr;
+  }
+  return new MessageLogReplayer(stream, header.pid);
+}
+
+MessageLogReplayer::~MessageLogReplayer() {
+  fclose(stream_);
+}
+
+bool MessageLogReplayer::next(MessageLog::RecordHeader* header, std::vector<char>* data) {
+  if (fread(header, sizeof(*header), 1, stream_) != 1) {
+    return false;
+  }
+  data->resize(header->len);
+  return header->len == 0 || fread(data->data(), header->len, 1, stream_) == 1;
+}
+
+void MessageLogReplayer::run_event_loop_once() {
+  const int64_t wait_start_ns = Metrics::now_ns();
+  epoll->wait();
+  metrics->loop_iteration(Metrics::now_ns() - wait_start_ns);
+  epoll->process_all_events();
+  proc_tree->GcProcesses();
+}
+
+bool MessageLogReplayer::drain_replies(int peer_fd) {
+  char buf[4096];
+  char anc_buf[CMSG_SPACE(64 * sizeof(int))];
+  while (true) {
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msgh = {};
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = anc_buf;
+    msgh.msg_controllen = sizeof(anc_buf);
+    ssize_t ret = TEMP_FAILURE_RETRY(recvmsg(peer_fd, &msgh, 0));
+    if (ret <= 0) {
+      return ret == 0;
+    }
+    /* Close the fds the supervisor passed to the process. */
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        const size_t fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < fd_count; i++) {
+          int fd;
+          memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+          close(fd);
+        }
+        replayed_fds_ += fd_count;
+      }
+    }
+  }
+}
+
+void MessageLogReplayer::send_message(uint32_t conn_id, const std::vector<char>& data) {
+  auto it = conns_.find(conn_id);
+  if (it == conns_.end()) {
+    /* The recorded process connected to the supervisor, accept it like accept_ic_conn() does. */
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      fb_perror("socketpair");
+      return;
+    }
+    for (int fd : fds) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+    if (epoll->is_added_fd(fds[0])) {
+      fds[0] = epoll->remap_to_not_added_fd(fds[0]);
+    }
+    bump_fd_age(fds[0]);
+    auto conn_ctx = new ConnectionContext(fds[0]);
+    epoll->add_fd(fds[0], EPOLLIN, MessageProcessor::ic_conn_readcb, conn_ctx);
+    it = conns_.insert({conn_id, {fds[0], fds[1]}}).first;
+    conns_count_++;
+  }
+  const int conn_fd = it->second.first, peer_fd = it->second.second;
+  drain_replies(peer_fd);
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t ret = TEMP_FAILURE_RETRY(write(peer_fd, data.data() + written,
+                                           data.size() - written));
+    if (ret > 0) {
+      written += ret;
+    } else if (ret == -1 && errno == EAGAIN) {
+      /* The socket buffer is full, let the supervisor read from it. */
+      run_event_loop_once();
+    } else {
+      fb_perror("write");
+      return;
+    }
+  }
+  /* Let the supervisor process the message before sending the next one, like the ACK-ed
+   * messages are processed before the intercepted process could continue. */
+  int pending;
+  while (epoll->is_added_fd(conn_fd) && ioctl(conn_fd, FIONREAD, &pending) == 0 && pending > 0) {
+    run_event_loop_once();
+  }
+  drain_replies(peer_fd);
+  messages_++;
+}
+
+void MessageLogReplayer::close_conn(uint32_t conn_id) {
+  auto it = conns_.find(conn_id);
+  if (it == conns_.end()) {
+    return;
+  }
+  const int peer_fd = it->second.second;
+  conns_.erase(it);
+  shutdown(peer_fd, SHUT_WR);
+  /* Wait for the supervisor to notice the hangup and close its end. */
+  while (!drain_replies(peer_fd)) {
+    run_event_loop_once();
+  }
+  close(peer_fd);
+}
+
+void MessageLogReplayer::replay() {
+  const int64_t start_ns = now_ns();
+  MessageLog::RecordHeader header;
+  std::vector<char> data;
+  while (next(&header, &data)) {
+    switch (header.type) {
+      case MessageLog::RECORD_MESSAGE:
+        send_message(header.conn_id, data);
+        break;
+      case MessageLog::RECORD_CLOSE:
+        close_conn(header.conn_id);
+        break;
+      case MessageLog::RECORD_CHILD_EXIT:
+        child_exited(header.pid, header.status);
+        break;
+      case MessageLog::RECORD_ACCEPT:
+        /* The connection is set up lazily when its first message is replayed. */
+        has_fd_metadata_ = true;
+        break;
+      case MessageLog::RECORD_FDS_SENT:
+        recorded_fds_ += header.status;
+        break;
+      default:
+        fb_error("Unexpected record in message log: " + d(header.type));
+        return;
+    }
+  }
+  /* The recording may have been cut short, close the remaining connections, too. */
+  while (!conns_.empty()) {
+    close_conn(conns_.begin()->first);
+  }
+  replay_ns_ = now_ns() - start_ns;
+}
+
+void MessageLogReplayer::print_summary(FILE* stream) const {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  const double replay_s = replay_ns_ / 1e9;
+  fprintf(stream, "Replayed %zu messages of %zu connections in %.3f seconds, "
+          "%.0f messages/second\n", messages_, conns_count_, replay_s,
+          replay_s > 0 ? messages_ / replay_s : 0.0);
+  if (has_fd_metadata_ && replayed_fds_ != recorded_fds_) {
+    fprintf(stream, "Passed %zu fds to the replayed processes instead of the recorded %zu, "
+            "the replay diverged from the recording\n", replayed_fds_, recorded_fds_);
+  }
+#ifdef __APPLE__
+  fprintf(stream, "Max. resident set size: %.3f MiB\n", ru.ru_maxrss / 1024.0 / 1024.0);
+#else
+  fprintf(stream, "Max. resident set size: %.3f MiB\n", ru.ru_maxrss / 1024.0);
+#endif
+}
+
+}  /* namespace firebuild */
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef FIREBUILD_MESSAGE_LOG_H_
+#define FIREBUILD_MESSAGE_LOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <tsl/hopscotch_map.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+
+namespace firebuild {
+
+/**
+ * Recording of the interceptor message streams of a build, to benchmark the supervisor by
+ * replaying them without running the build's processes.
+ *
+ * The file starts with a magic followed by records, each one made of a fixed size header and
+ * the record's data:
+ * - RECORD_ROOT: the pid of the build command started by the supervisor.
+ * - RECORD_ACCEPT: a connection got accepted, with the supervisor's fd number of it and the
+ *   pid of the connecting process, when the platform tells it.
+ * - RECORD_MESSAGE: a complete message, including its msg_header, received on a connection.
+ * - RECORD_CLOSE: a connection got closed by the intercepted process.
+ * - RECORD_CHILD_EXIT: the supervisor collected the exit status of a child or an orphan.
+ * - RECORD_FDS_SENT: the supervisor passed fds to the process along a reply, the data is the
+ *   file type (the S_IFMT bits of st_mode) of each fd as uint32_t.
+ *
+ * Connections are identified by their order of being accepted, the timestamps are in nanoseconds
+ * since the start of the recording.
+ */
+class MessageLog {
+ public:
+  enum RecordType : uint32_t {
+    RECORD_ROOT = 1,
+    RECORD_MESSAGE,
+    RECORD_CLOSE,
+    RECORD_CHILD_EXIT,
+    RECORD_ACCEPT,
+    RECORD_FDS_SENT
+  };
+  struct RecordHeader {
+    int64_t ts_ns;
+    uint32_t type;
+    uint32_t conn_id;
+    int32_t pid;
+    int32_t status;
+    uint32_t len;
+    uint32_t padding;
+  };
+
+  explicit MessageLog(FILE* stream);
+  ~MessageLog();
+  /** Create the file to record to, or return nullptr on failure. */
+  static MessageLog* Create(const std::string& path);
+
+  void root_started(pid_t pid);
+  void conn_accepted(int fd);
+  void message(int fd, const char* data, uint32_t len);
+  void conn_closed(int fd);
+  void child_exited(pid_t pid, int status);
+  void fds_sent(int fd, const int* fds, int fd_count);
+
+ private:
+  void write_record(uint32_t type, uint32_t conn_id, pid_t pid, int status, const char* data,
+                    uint32_t len);
+  FILE* stream_;
+  int64_t start_ns_;
+  uint32_t next_conn_id_ = 0;
+  /** The ids of the open connections by their file descriptor. */
+  tsl::hopscotch_map<int, uint32_t> conn_ids_ {};
+  DISALLOW_COPY_AND_ASSIGN(MessageLog);
+};
+
+/* singleton, or nullptr when not recording */
+extern MessageLog *message_log;
+
+/**
+ * Replayer of a recording made by MessageLog.
+ *
+ * Each recorded connection is replaced by a socket pair, the supervisor's end is processed by
+ * the usual event loop while the messages are written to the other end in the recorded order,
+ * as fast as the supervisor can consume them. The replies are read and dropped.
+ *
+ * The replay is meaningful only with the files being in the same state as they were during the
+ * recording, otherwise the supervisor's decisions may differ, for example about a process'
+ * cacheability.
+ *
+ * The replay neither fetches from nor stores to the cache, to not modify the files or the cache.
+ * Thus the processes shortcut during the recording are not shortcut in the replay, and neither
+ * shortcutting nor storing the processes is measured.
+ */
+class MessageLogReplayer {
+ public:
+  /** Open a recording, or return nullptr on failure. */
+  static MessageLogReplayer* Open(const std::string& path);
+  ~MessageLogReplayer();
+  /** The pid of the recorded build command. */
+  pid_t root_pid() const {return root_pid_;}
+  /** Feed all the recorded events to the supervisor. */
+  void replay();
+  /**
+   * Print the replay's throughput and memory usage, and whether the supervisor passed the same
+   * number of fds as during the recording, a sign of it having made the same decisions.
+   */
+  void print_summary(FILE* stream) const;
+
+ private:
+  MessageLogReplayer(FILE* stream, pid_t root_pid);
+  bool next(MessageLog::RecordHeader* header, std::vector<char>* data);
+  /** Process the events that are ready, waiting if there are none. */
+  void run_event_loop_once();
+  /**
+   * Read and drop the replies sent to the replayed process, closing and counting the received
+   * fds.
+   * @return whether the supervisor closed its end
+   */
+  bool drain_replies(int peer_fd);
+  void send_message(uint32_t conn_id, const std::vector<char>& data);
+  void close_conn(uint32_t conn_id);
+
+  FILE* stream_;
+  pid_t root_pid_;
+  /** The supervisor's and the replayed process' end of the socket pair by connection id. */
+  tsl::hopscotch_map<uint32_t, std::pair<int, int>> conns_ {};
+  size_t messages_ = 0;
+  size_t conns_count_ = 0;
+  /** The number of fds passed to the processes during the recording and during the replay. */
+  size_t recorded_fds_ = 0;
+  size_t replayed_fds_ = 0;
+  /** Older recordings have no RECORD_ACCEPT and RECORD_FDS_SENT records. */
+  bool has_fd_metadata_ = false;
+  int64_t replay_ns_ = 0;
+  DISALLOW_COPY_AND_ASSIGN(MessageLogReplayer);
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_MESSAGE_LOG_H_
@@ -18,6 +18,7 @@
 
 #include "firebuild/message_processor.h"
 
+#include <fcntl.h>
 #include <sys/random.h>
 #if defined (__APPLE__)
 #include <sys/spawn.h>
@@ -25,6 +26,8 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <algorithm>
+#include <cstdlib>
 #include <memory>
 #include <string>
 #include <unordered_set>
@@ -33,6 +36,7 @@
 
 #include "common/config.h"
 #include "common/firebuild_common.h"
+#include "firebuild/caching_policy.h"
 #include "firebuild/command_rewriter.h"
 #include "firebuild/config.h"
 #include "firebuild/debug.h"
@@ -45,6 +49,8 @@
 #include "firebuild/execed_process.h"
 #include "firebuild/execed_process_cacher.h"
 #include "firebuild/hash_cache.h"
+#include "firebuild/message_log.h"
+#include "firebuild/metrics.h"
 #include "firebuild/pipe.h"
 #include "firebuild/pipe_recorder.h"
 #include "firebuild/process.h"
@@ -52,6 +58,7 @@
 #include "firebuild/process_debug_suppressor.h"
 #include "firebuild/process_tree.h"
 #include "firebuild/process_fbb_adaptor.h"
+#include "firebuild/trace_events.h"
 #include "firebuild/utils.h"
 #include "./fbbcomm.h"
 #include "firebuild/fbbfp.h"
@@ -64,6 +71,7 @@ static void reject_exec_child(int fd_conn) {
     sv_msg.set_dont_intercept(true);
     sv_msg.set_shortcut(false);
 
+    hash_cache->materialize_all();
     send_fbb(fd_conn, 0, reinterpret_cast<FBBCOMM_Builder *>(&sv_msg));
 }
 
@@ -101,6 +109,15 @@ void MessageProcessor::accept_exec_child(ExecedProcess* proc, int fd_conn,
     proc_tree->insert(proc);
     proc->initialize();
 
+    /* Remember the libraries for shortcutting the same executable before exec() next time. */
+#ifdef __APPLE__
+    if (pre_exec_shortcutting) {
+#else
+    if (pre_exec_shortcutting && !proc->qemu_user_used()) {
+#endif
+      execed_process_cacher->learn_libs(proc);
+    }
+
     if (shortcut_allow_list_matcher && !shortcut_allow_list_matcher->match(proc)) {
       proc->disable_shortcutting_only_this("Executable is not allowed to be shortcut");
       execed_process_cacher->not_shortcutting();
@@ -129,9 +146,25 @@ void MessageProcessor::accept_exec_child(ExecedProcess* proc, int fd_conn,
       execed_process_cacher->not_shortcutting();
     }
 
+    /* Skip fingerprinting and recording the processes that could not be cached the last times
+     * anyway. If they do the same again, that still disables shortcutting their ancestors. */
+    if (proc->can_shortcut()) {
+      const char* uncacheable_reason = execed_process_cacher->uncacheable_reason(proc);
+      if (uncacheable_reason) {
+        proc->disable_shortcutting_only_this(uncacheable_reason);
+        execed_process_cacher->not_shortcutting();
+      }
+    }
+
+    if (proc->can_shortcut() && caching_policy && !caching_policy->worth_shortcutting(proc)) {
+      /* Just run it. It is still fingerprinted and stored to keep its parent cacheable. */
+      proc->set_skip_cache_lookup(true);
+    }
+
     /* If we still potentially can, and prefer to cache / shortcut this process,
      * register the cacher object and calculate the process's fingerprint. */
     if (proc->can_shortcut()) {
+      TraceSpan span(proc->fb_pid(), "fingerprint");
       if (!execed_process_cacher->fingerprint(proc)) {
         proc->disable_shortcutting_bubble_up("Could not fingerprint the process");
       }
@@ -201,7 +234,7 @@ void MessageProcessor::accept_exec_child(ExecedProcess* proc, int fd_conn,
            * firebuild, across an exec they no longer share the same "open file description" and thus
            * the fcntl flags. Perform this unduping from the exec parent, i.e. modify the FileFDs to
            * point to a new FileOFD. */
-          auto fds = proc->fds();
+          auto fds = proc->mutable_fds();
           int fd = inherited_file.fds[0];
           auto file_fd = std::make_shared<FileFD>(file_fd_old->flags(), pipe,
                                                   file_fd_old->opened_by());
@@ -270,6 +303,11 @@ void MessageProcessor::accept_exec_child(ExecedProcess* proc, int fd_conn,
       }
     }
 
+    if (!shortcutting_succeeded) {
+      /* The process may read any of the files restored lazily. */
+      hash_cache->materialize_all();
+    }
+
     /* Send "scproc_resp", possibly with attached fds to reopen. */
     send_fbb(fd_conn, 0, reinterpret_cast<FBBCOMM_Builder *>(&sv_msg),
              fifo_fds.data(), fifo_fds.size());
@@ -796,9 +834,242 @@ static const FileName* resolve_command_from_msg(const T* ic_msg, const char* com
   }
 }
 
+/**
+ * Find out the path exec*() passes to execve(), i.e. what the new program sees as AT_EXECFN.
+ */
+static bool exec_path_as_passed(const FBBCOMM_Serialized_exec *ic_msg, const FileName* file,
+                                const Process* proc, std::string* path) {
+  const char* file_arg = ic_msg->has_original_file() ? ic_msg->get_original_file()
+      : ic_msg->get_file();
+  if (!ic_msg->get_with_p() || strchr(file_arg, '/')) {
+    *path = file_arg;
+    return true;
+  }
+  if (!ic_msg->has_path()) {
+    return false;
+  }
+  /* exec*p() tries "<entry>/<file>" for the PATH entries in order, or just "<file>" for an empty
+   * entry. */
+  const std::string search_path(ic_msg->get_path(), ic_msg->get_path_len());
+  size_t begin = 0;
+  while (begin <= search_path.size()) {
+    size_t end = search_path.find(':', begin);
+    if (end == std::string::npos) {
+      end = search_path.size();
+    }
+    const std::string candidate = end == begin ? std::string(file_arg)
+        : search_path.substr(begin, end - begin) + "/" + file_arg;
+    if (FileName::GetCanonicalized(candidate.c_str(), candidate.size(), proc->wd()) == file) {
+      *path = candidate;
+      return true;
+    }
+    begin = end + 1;
+  }
+  return false;
+}
+
+static const char kElfMagic[] = {0x7f, 'E', 'L', 'F'};
+
+static bool is_elf(const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  char magic[sizeof(kElfMagic)];
+  const bool ret = read(fd, magic, sizeof(magic)) == sizeof(magic)
+      && memcmp(magic, kElfMagic, sizeof(kElfMagic)) == 0;
+  close(fd);
+  return ret;
+}
+
+/**
+ * Find out the program execve()-ing path would start, following the "#!" line of scripts like
+ * the kernel does.
+ * @param[out] executable the started program in canonical form, without symlinks
+ * @param[out] args the arguments the program is started with
+ * @return whether the started program is an ELF binary that could be found out
+ */
+static bool program_to_be_started(const FileName* file, const std::string& path,
+                                  const std::vector<std::string>& argv,
+                                  const FileName** executable, std::vector<std::string>* args) {
+  /* The kernel looks at the first 256 bytes (BINPRM_BUF_SIZE) for the "#!" line. */
+  char buf[256];
+  int fd = open(file->c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  /* A single read() is enough for regular files, fb_read() would not report short reads. */
+  const ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len < 0) {
+    return false;
+  }
+  buf[len] = '\0';
+
+  std::string interpreter;
+  if (len >= static_cast<ssize_t>(sizeof(kElfMagic))
+      && memcmp(buf, kElfMagic, sizeof(kElfMagic)) == 0) {
+    interpreter = file->c_str();
+    *args = argv;
+  } else if (len >= 2 && buf[0] == '#' && buf[1] == '!') {
+    char* line_end = strchr(buf, '\n');
+    if (!line_end) {
+      return false;
+    }
+    /* The interpreter is followed by at most one argument, which may contain spaces. */
+    while (line_end > buf + 2 && (line_end[-1] == ' ' || line_end[-1] == '\t')) {
+      line_end--;
+    }
+    *line_end = '\0';
+    const char* interp_begin = buf + 2 + strspn(buf + 2, " \t");
+    const char* interp_end = interp_begin + strcspn(interp_begin, " \t");
+    const char* opt_arg = interp_end + strspn(interp_end, " \t");
+    interpreter = std::string(interp_begin, interp_end - interp_begin);
+    if (interpreter.empty() || interpreter[0] != '/' || !is_elf(interpreter.c_str())) {
+      /* Nested interpreters and relative interpreter paths are not predicted. */
+      return false;
+    }
+    args->clear();
+    args->push_back(interpreter);
+    if (*opt_arg != '\0') {
+      args->push_back(opt_arg);
+    }
+    args->push_back(path);
+    if (argv.size() > 1) {
+      args->insert(args->end(), argv.begin() + 1, argv.end());
+    }
+  } else {
+    return false;
+  }
+
+  char* real_path = realpath(interpreter.c_str(), nullptr);
+  if (!real_path) {
+    return false;
+  }
+  *executable = FileName::Get(real_path);
+  free(real_path);
+  return true;
+}
+
+/**
+ * Try shortcutting the program to be started by an exec*() call before the exec*() takes place.
+ *
+ * The new process is set up as the interceptor would report it in "scproc_query", using the
+ * shared libraries the same executable loaded the last time. It is linked into the process tree
+ * only when a matching cache entry is found, then the exec*()-ing process is finished as if the
+ * exec*() succeeded and the new process is shortcut. The interceptor exits with the cached exit
+ * status without ever starting the program.
+ *
+ * @param[in,out] conn_proc the process of the connection, replaced by the new process when it
+ *                is linked into the process tree
+ * @return whether the response to the "exec" message has been sent
+ */
+static bool try_pre_exec_shortcut(const FBBCOMM_Serialized_exec *ic_msg, const FileName* file,
+                                  const std::vector<std::string>& argv, int fd_conn,
+                                  Process** conn_proc) {
+  Process* proc = *conn_proc;
+  TRACKX(FB_DEBUG_PROC, 1, 1, Process, proc, "fd_conn=%s", D_FD(fd_conn));
+
+  if (ic_msg->has_fd() || ic_msg->has_dirfd() || !file || proc->is_qemu()) {
+    return false;
+  }
+  std::string path;
+  const FileName* executable = nullptr;
+  std::vector<std::string> args;
+  if (!exec_path_as_passed(ic_msg, file, proc, &path)
+      || !program_to_be_started(file, path, argv, &executable, &args)) {
+    return false;
+  }
+#ifndef __APPLE__
+  if (executable == qemu_user) {
+    return false;
+  }
+#endif
+
+  /* The interceptor of the new process would report the environment without its own variables,
+   * sorted. */
+  std::vector<std::string> env_vars;
+  for (std::string& env : ic_msg->get_env_as_vector()) {
+    if (!env.starts_with("FB_SOCKET=") && !env.starts_with("FB_READ_ONLY_LOCATIONS=")
+        && !env.starts_with("FB_IGNORE_LOCATIONS=")) {
+      env_vars.push_back(std::move(env));
+    }
+  }
+  std::sort(env_vars.begin(), env_vars.end());
+
+  std::vector<const FileName*> libs;
+  if (!execed_process_cacher->predict_libs(executable, env_vars, &libs)) {
+    return false;
+  }
+
+  const FileName* executed_path = FileName::GetCanonicalized(path.c_str(), path.size(),
+                                                             proc->wd());
+  ExecedProcess* child = ProcessFactory::getPreExecedProcess(proc, executable, executed_path,
+                                                             path, args, env_vars, libs);
+  /* Look for a matching cache entry without touching the process tree. */
+  child->initialize();
+  bool found = false;
+  if (child->can_shortcut()
+      && (!shortcut_allow_list_matcher || shortcut_allow_list_matcher->match(child))
+      && !dont_intercept_matcher->match(child) && !dont_shortcut_matcher->match(child)
+      && !skip_cache_matcher->match(child) && !execed_process_cacher->uncacheable_reason(child)
+      && execed_process_cacher->fingerprint(child)) {
+    uint8_t *inouts_buf;
+    size_t inouts_buf_len;
+    bool munmap_entry = false;
+    Subkey subkey;
+    if (execed_process_cacher->find_shortcut(child, &inouts_buf, &inouts_buf_len, &munmap_entry,
+                                             &subkey)) {
+      ObjCache::free_entry(inouts_buf, inouts_buf_len, munmap_entry);
+      found = true;
+    }
+  }
+  if (!found) {
+    FB_DEBUG(FB_DEBUG_SHORTCUT, "Not shortcutting " + d(executable) + " before exec()");
+    delete child;
+    return false;
+  }
+
+  /* Act as if the exec*() succeeded. */
+  child->set_parent(proc);
+  proc->set_exec_pending(false);
+  proc->reset_file_fd_pipe_refs();
+  proc->set_exec_child(child);
+  proc->finish();
+  *conn_proc = child;
+  ProcessFactory::traceExecedProcess(child);
+  proc_tree->insert(child);
+  /* Now propagate the executable and the libraries to the parent, too. */
+  child->initialize();
+
+  for (const inherited_file_t& inherited_file : child->inherited_files()) {
+    if (inherited_file.type == FD_PIPE_OUT) {
+      /* There may be incoming data from the (transitive) parent(s), drain it. */
+      auto pipe = child->get_fd(inherited_file.fds[0])->pipe();
+      assert(pipe);
+      pipe->drain();
+    }
+  }
+
+  FBBCOMM_Builder_rewritten_args sv_msg;
+  std::vector<int> fds_appended_to;
+  if (child->shortcut(&fds_appended_to)) {
+    sv_msg.set_exit_status(child->fork_point()->exit_status());
+    sv_msg.set_fds_appended_to(fds_appended_to);
+  } else {
+    /* Let the exec*() take place, the started program will show up as the exec child of this
+     * placeholder. */
+    child->disable_shortcutting_bubble_up("Could not shortcut the program before exec()");
+    child->set_exec_pending(true);
+  }
+  send_fbb(fd_conn, 0, reinterpret_cast<FBBCOMM_Builder *>(&sv_msg));
+  return true;
+}
+
 
 static void proc_ic_msg(const FBBCOMM_Serialized *fbbcomm_buf, uint16_t ack_num,
-                        int fd_conn, Process* proc) {
+                        int fd_conn, Process** conn_proc) {
+  Process* proc = *conn_proc;
   TRACKX(FB_DEBUG_COMM, 1, 1, Process, proc, "fd_conn=%s, tag=%s, ack_num=%d",
          D_FD(fd_conn), fbbcomm_tag_to_string(fbbcomm_buf->get_tag()), ack_num);
 
@@ -1116,6 +1387,18 @@ static void proc_ic_msg(const FBBCOMM_Serialized *fbbcomm_buf, uint16_t ack_num,
                                               proc);
       }
       std::vector<std::string> args = ic_msg->get_arg_as_vector();
+      if (pre_exec_shortcutting) {
+        const FileName* rewritten_executable = executable;
+        std::vector<std::string> rewritten_args = args;
+        bool executable_changed = false, args_changed = false;
+        CommandRewriter::maybe_rewrite(&rewritten_executable, &rewritten_args, &executable_changed,
+                                       &args_changed);
+        /* Rewritten commands are always executed. */
+        if (!executable_changed && !args_changed
+            && try_pre_exec_shortcut(ic_msg, executable, args, fd_conn, conn_proc)) {
+          return;
+        }
+      }
       send_maybe_rewritten_cmd(fd_conn, executable, &args);
       return;
     }
@@ -1512,9 +1795,19 @@ void MessageProcessor::ic_conn_readcb(const struct epoll_event* event, void *ctx
       }
     }
 
+    if (message_log) {
+      message_log->message(Epoll::event_fd(event), buf.data(), full_length);
+    }
+
     /* Process the messaage. */
+    const int64_t start_ns = Metrics::now_ns();
+    const int tag = fbbcomm_msg->get_tag();
+    if (header->ack_id) {
+      metrics->ack_expected(Epoll::event_fd(event), header->ack_id, start_ns);
+    }
     if (proc) {
-      proc_ic_msg(fbbcomm_msg, header->ack_id, Epoll::event_fd(event), proc);
+      proc_ic_msg(fbbcomm_msg, header->ack_id, Epoll::event_fd(event), &conn_ctx->proc);
+      proc = conn_ctx->proc;
     } else {
       /* Fist interceptor message */
       proc_new_process_msg(
@@ -1522,6 +1815,7 @@ void MessageProcessor::ic_conn_readcb(const struct epoll_event* event, void *ctx
       /* Reset suppression which was set peeking at the message. */
       debug_suppressed = false;
     }
+    metrics->message_processed(tag, start_ns);
     buf.discard(full_length);
   } while (buf.length() > 0);
 }
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "firebuild/metrics.h"
+
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <string>
+
+#include "firebuild/epoll.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+Metrics *metrics = nullptr;
+
+static const char* op_name(Metrics::Op op) {
+  switch (op) {
+    case Metrics::OP_HASH:
+      return "hash";
+    case Metrics::OP_BLOB_STORE:
+      return "blob_store";
+    case Metrics::OP_BLOB_RETRIEVE:
+      return "blob_retrieve";
+    default:
+      assert(0 && "unknown operation");
+      return "unknown";
+  }
+}
+
+void LatencyHistogram::add(int64_t ns) {
+  const uint64_t value = ns > 0 ? ns : 0;
+  int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+  if (bucket >= kBuckets) {
+    bucket = kBuckets - 1;
+  }
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  total_ns_.fetch_add(value, std::memory_order_relaxed);
+  uint64_t max = max_ns_.load(std::memory_order_relaxed);
+  while (value > max && !max_ns_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t LatencyHistogram::percentile_ns(double p) const {
+  const uint64_t count = count_.load(std::memory_order_relaxed);
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= p * count) {
+      return i == kBuckets - 1 ? max_ns_.load(std::memory_order_relaxed)
+          : static_cast<uint64_t>(1) << i;
+    }
+  }
+  return max_ns_.load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::print_json(FILE* stream) const {
+  fprintf(stream, "{\"count\": %" PRIu64 ", \"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64
+          ", \"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+          ", \"buckets\": {",
+          count_.load(std::memory_order_relaxed), total_ns_.load(std::memory_order_relaxed),
+          max_ns_.load(std::memory_order_relaxed),
+          percentile_ns(0.5), percentile_ns(0.9), percentile_ns(0.99));
+  /* Print the non-empty buckets keyed by their upper bound. */
+  bool first = true;
+  for (int i = 0; i < kBuckets; i++) {
+    uint64_t n = buckets_[i].load(std::memory_order_relaxed);
+    if (n > 0) {
+      fprintf(stream, "%s\"%s%" PRIu64 "\": %" PRIu64, first ? "" : ", ",
+              i == kBuckets - 1 ? ">=" : "<",
+              static_cast<uint64_t>(1) << (i == kBuckets - 1 ? i - 1 : i), n);
+      first = false;
+    }
+  }
+  fprintf(stream, "}}");
+}
+
+Metrics::Metrics() : start_ns_(now_ns()) {}
+
+int64_t Metrics::now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+void Metrics::ack_sent(int conn, uint16_t ack_num) {
+  auto it = pending_acks_.find(ack_key(conn, ack_num));
+  if (it != pending_acks_.end()) {
+    acks_.add(now_ns() - it->second);
+    pending_acks_.erase(it);
+  }
+}
+
+void Metrics::conn_closed(int conn) {
+  if (pending_acks_.empty()) {
+    return;
+  }
+  for (auto it = pending_acks_.begin(); it != pending_acks_.end();) {
+    if (static_cast<int>(it->first >> 16) == conn) {
+      it = pending_acks_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void Metrics::print_json(FILE* stream) const {
+  const int64_t wall_ns = now_ns() - start_ns_;
+  const int64_t busy_ns = wall_ns - loop_wait_ns_;
+  uint64_t messages_count = 0;
+  for (int tag = 0; tag < FBBCOMM_TAG_NEXT; tag++) {
+    messages_count += messages_[tag].count();
+  }
+  fprintf(stream, "{\n  \"wall_time_ns\": %" PRId64 ",\n", wall_ns);
+  fprintf(stream, "  \"event_loop\": {\"iterations\": %" PRIu64 ", \"wait_ns\": %" PRId64
+          ", \"busy_ns\": %" PRId64 ", \"utilization\": %.4f},\n",
+          loop_iterations_, loop_wait_ns_, busy_ns,
+          wall_ns > 0 ? static_cast<double>(busy_ns) / wall_ns : 0.0);
+  fprintf(stream, "  \"messages_per_sec\": %.1f,\n",
+          wall_ns > 0 ? messages_count * 1e9 / wall_ns : 0.0);
+  fprintf(stream, "  \"messages\": {");
+  bool first = true;
+  for (int tag = 1; tag < FBBCOMM_TAG_NEXT; tag++) {
+    if (messages_[tag].count() > 0) {
+      fprintf(stream, "%s\n    \"%s\": ", first ? "" : ",", fbbcomm_tag_to_string(tag));
+      messages_[tag].print_json(stream);
+      first = false;
+    }
+  }
+  fprintf(stream, "\n  },\n  \"acks\": ");
+  acks_.print_json(stream);
+  fprintf(stream, ",\n  \"operations\": {");
+  for (int op = 0; op < OP_NEXT; op++) {
+    fprintf(stream, "%s\n    \"%s\": ", op == 0 ? "" : ",", op_name(static_cast<Op>(op)));
+    ops_[op].print_json(stream);
+  }
+  fprintf(stream, "\n  }\n}\n");
+}
+
+void Metrics::save(const std::string& path) const {
+  const std::string tmp_path = path + "." + std::to_string(getpid());
+  FILE* f = fopen(tmp_path.c_str(), "w");
+  if (!f) {
+    fb_perror("Failed saving metrics");
+    return;
+  }
+  print_json(f);
+  if (fclose(f) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    fb_perror("Failed saving metrics");
+    unlink(tmp_path.c_str());
+  }
+}
+
+void Metrics::periodic_save_cb(void* data) {
+  auto self = reinterpret_cast<Metrics*>(data);
+  self->save(self->periodic_save_path_);
+  epoll->add_timer(self->periodic_save_interval_ms_, periodic_save_cb, self);
+}
+
+void Metrics::start_periodic_save(const std::string& path, int interval_ms) {
+  periodic_save_path_ = path;
+  periodic_save_interval_ms_ = interval_ms;
+  epoll->add_timer(interval_ms, periodic_save_cb, this);
+}
+
+}  /* namespace firebuild */
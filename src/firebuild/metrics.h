@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef FIREBUILD_METRICS_H_
+#define FIREBUILD_METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <tsl/hopscotch_map.h>
+
+#include <atomic>
+#include <string>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "./fbbcomm.h"
+
+namespace firebuild {
+
+/**
+ * Latency histogram with power of two buckets, safe to update from multiple threads.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() {}
+  void add(int64_t ns);
+  uint64_t count() const {return count_.load(std::memory_order_relaxed);}
+  /** Print as a JSON object. */
+  void print_json(FILE* stream) const;
+
+ private:
+  /* Bucket i counts the samples in [2^(i-1), 2^i) ns, the last one counts all the longer ones. */
+  static const int kBuckets = 40;
+  /** Upper bound of the bucket holding the given percentile of the samples. */
+  uint64_t percentile_ns(double p) const;
+  std::atomic<uint64_t> count_ {0};
+  std::atomic<uint64_t> total_ns_ {0};
+  std::atomic<uint64_t> max_ns_ {0};
+  std::atomic<uint64_t> buckets_[kBuckets] {};
+  DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+};
+
+/**
+ * Counters and latency histograms of the supervisor's own work, to tell how much firebuild
+ * itself contributes to the build's duration.
+ *
+ * They are always collected, and are saved as JSON at the end of the build if metrics_file is
+ * set in the configuration, also periodically during the build if metrics_update_interval is set.
+ */
+class Metrics {
+ public:
+  enum Op {
+    OP_HASH,
+    OP_BLOB_STORE,
+    OP_BLOB_RETRIEVE,
+    OP_NEXT
+  };
+
+  Metrics();
+  static int64_t now_ns();
+
+  /** Record processing an interceptor message with the given tag. */
+  void message_processed(int tag, int64_t start_ns) {
+    messages_[tag].add(now_ns() - start_ns);
+  }
+  /** Record that a message expecting an ACK arrived on conn. */
+  void ack_expected(int conn, uint16_t ack_num, int64_t arrival_ns) {
+    pending_acks_[ack_key(conn, ack_num)] = arrival_ns;
+  }
+  /** Record that an ACK is sent, closing the round-trip started by ack_expected(). */
+  void ack_sent(int conn, uint16_t ack_num);
+  /** Forget the ACKs still expected on conn when it is closed. */
+  void conn_closed(int conn);
+  void op_done(Op op, int64_t start_ns) {
+    ops_[op].add(now_ns() - start_ns);
+  }
+  /** Record an iteration of the main loop that waited for events for waited_ns. */
+  void loop_iteration(int64_t waited_ns) {
+    loop_iterations_++;
+    loop_wait_ns_ += waited_ns;
+  }
+
+  void print_json(FILE* stream) const;
+  /** Replace path with the current metrics. */
+  void save(const std::string& path) const;
+  /** Save the metrics to path every interval_ms during the build. */
+  void start_periodic_save(const std::string& path, int interval_ms);
+
+ private:
+  static uint64_t ack_key(int conn, uint16_t ack_num) {
+    return (static_cast<uint64_t>(conn) << 16) | ack_num;
+  }
+  static void periodic_save_cb(void* data);
+
+  int64_t start_ns_;
+  LatencyHistogram messages_[FBBCOMM_TAG_NEXT] {};
+  LatencyHistogram acks_ {};
+  LatencyHistogram ops_[OP_NEXT] {};
+  /** Arrival times of the messages waiting for an ACK, by connection and ack number. */
+  tsl::hopscotch_map<uint64_t, int64_t> pending_acks_ {};
+  uint64_t loop_iterations_ = 0;
+  int64_t loop_wait_ns_ = 0;
+  std::string periodic_save_path_ {};
+  int periodic_save_interval_ms_ = 0;
+  DISALLOW_COPY_AND_ASSIGN(Metrics);
+};
+
+/* singleton */
+extern Metrics *metrics;
+
+/**
+ * Record the duration of an operation for the lifetime of the object.
+ */
+class OpTimer {
+ public:
+  explicit OpTimer(Metrics::Op op) : op_(op), start_ns_(Metrics::now_ns()) {}
+  ~OpTimer() {
+    if (metrics) {
+      metrics->op_done(op_, start_ns_);
+    }
+  }
+
+ private:
+  Metrics::Op op_;
+  int64_t start_ns_;
+  DISALLOW_COPY_AND_ASSIGN(OpTimer);
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_METRICS_H_
@@ -115,7 +115,8 @@ static void construct_cached_file_name(const std::string &base,
 bool ObjCache::store(const Hash &key,
                      const FBBSTORE_Builder * const entry,
                      off_t stored_blob_bytes,
-                     const FBBFP_Serialized * const debug_key) {
+                     const FBBFP_Serialized * const debug_key,
+                     Subkey* subkey_out) {
   TRACK(FB_DEBUG_CACHING, "key=%s, stored_blob_bytes=%" PRIoff, D(key), stored_blob_bytes);
 
   if (FB_DEBUGGING(FB_DEBUG_CACHING)) {
@@ -216,6 +217,9 @@ bool ObjCache::store(const Hash &key,
 
   construct_cached_file_name(base_dir_, key, subkey.c_str(), true, path_dst);
   free(entry_serial);
+  if (subkey_out) {
+    *subkey_out = subkey;
+  }
 
   if (fb_renameat2(AT_FDCWD, tmpfile, AT_FDCWD, path_dst, RENAME_NOREPLACE) == -1) {
     if (errno == EEXIST) {
@@ -284,7 +288,26 @@ bool ObjCache::retrieve(const char* path, uint8_t ** entry, size_t * entry_len,
     assert(0);
     return false;
   }
+  return retrieve_from_fd(fd, path, entry, entry_len, compressed_len, munmap_entry);
+}
+
+bool ObjCache::prefetch(const Hash &key, const char* const subkey, uint8_t ** entry,
+                        size_t * entry_len, bool* munmap_entry) {
+  char* path = reinterpret_cast<char*>(alloca(base_dir_.length() + kObjCachePathLength + 1));
+  construct_cached_file_name(base_dir_, key, subkey, false, path);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    /* The entry may have been removed by a gc run since. */
+    return false;
+  }
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+  return retrieve_from_fd(fd, path, entry, entry_len, nullptr, munmap_entry);
+}
 
+bool ObjCache::retrieve_from_fd(int fd, const char* path, uint8_t ** entry, size_t * entry_len,
+                                size_t * compressed_len, bool* munmap_entry) {
   struct stat64 st;
   if (fstat64(fd, &st) == -1) {
     fb_perror("Failed fstat retrieving cache object");
@@ -374,6 +397,18 @@ void ObjCache::mark_as_used(const Hash &key,
   utimensat(AT_FDCWD, path, times, 0);
 }
 
+bool ObjCache::contains(const Hash &key, const char* const subkey) const {
+  char* path = reinterpret_cast<char*>(alloca(base_dir_.length() + kObjCachePathLength + 1));
+  construct_cached_file_name(base_dir_, key, subkey, false, path);
+  return access(path, F_OK) == 0;
+}
+
+bool ObjCache::contains(const char* const ascii_key, const char* const subkey) const {
+  const std::string path = base_dir_ + "/" + ascii_key[0] + "/" + ascii_key[0] + ascii_key[1] + "/"
+      + ascii_key + "/" + subkey;
+  return access(path.c_str(), F_OK) == 0;
+}
+
 /**
  * Return the list of subkeys for the given key in the order to be tried for shortcutting.
  *
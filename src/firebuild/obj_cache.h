@@ -71,12 +71,14 @@ class ObjCache {
    * @param entry The entry to serialize and store
    * @param stored_blob_bytes Total size of blobs referenced by this obj
    * @param debug_key Optionally the key as pb for debugging purposes
+   * @param[out] subkey_out Optionally store the subkey of the entry here
    * @return Whether succeeded
    */
   bool store(const Hash &key,
              const FBBSTORE_Builder * const entry,
              off_t stored_blob_bytes,
-             const FBBFP_Serialized * const debug_key);
+             const FBBFP_Serialized * const debug_key,
+             Subkey* subkey_out = nullptr);
   /**
    * Retrieve an entry from the obj-cache.
    *
@@ -99,6 +101,23 @@ class ObjCache {
                 size_t * entry_len,
                 size_t * compressed_len,
                 bool* munmap_entry);
+  /**
+   * Read an entry ahead of its use, making the subsequent retrieve() calls fast.
+   *
+   * Unlike retrieve() this does not complain about missing entries and it is thread safe.
+   *
+   * @param key The key
+   * @param subkey The subkey
+   * @param[out] entry the entry like retrieve() returns it, to be freed with free_entry()
+   * @param[out] entry_len entry's length in bytes
+   * @param[out] munmap_entry whether the entry must be freed using munmap()
+   * @return Whether succeeded
+   */
+  bool prefetch(const Hash &key,
+                const char * const subkey,
+                uint8_t ** entry,
+                size_t * entry_len,
+                bool* munmap_entry);
   /**
    * Free or munmap an entry previously retrieved from the obj-cache that was allocated
    * using malloc() or mmap().
@@ -111,6 +130,10 @@ class ObjCache {
    */
   static void free_entry(uint8_t *entry, size_t entry_len, bool munmap_entry);
   void mark_as_used(const Hash &key, const char * const subkey);
+  /** Whether the entry is present in the cache. */
+  bool contains(const Hash &key, const char * const subkey) const;
+  /** Whether the entry is present in the cache, with the key in its ASCII representation. */
+  bool contains(const char * const ascii_key, const char * const subkey) const;
   std::vector<Subkey> list_subkeys(const Hash &key);
   /**
    * Garbage collect the object cache
@@ -143,6 +166,9 @@ class ObjCache {
                         tsl::hopscotch_set<AsciiHash>* referenced_blobs, off_t* cache_bytes,
                         off_t* debug_bytes, off_t* unexpected_file_bytes);
 
+  static bool retrieve_from_fd(int fd, const char* path, uint8_t ** entry, size_t * entry_len,
+                               size_t * compressed_len, bool* munmap_entry);
+
   /* Including the "objs" subdir. */
   std::string base_dir_;
   static constexpr char kDebugPostfix[] = "_debug.json";
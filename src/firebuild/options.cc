@@ -28,6 +28,9 @@ namespace firebuild {
 char* Options::config_file_ = nullptr;
 char* Options::directory_ = nullptr;
 const char* Options::report_file_ = "firebuild-build-report.html";
+const char* Options::trace_events_file_ = nullptr;
+const char* Options::record_messages_file_ = nullptr;
+const char* Options::replay_messages_file_ = nullptr;
 const char* const * Options::build_cmd_ = nullptr;
 size_t Options::build_cmd_argc_ = 0;
 std::list<std::string>* Options::config_strings_ = nullptr;
@@ -37,6 +40,7 @@ bool Options::insert_trace_markers_ = false;
 bool Options::do_gc_ = false;
 bool Options::print_stats_ = false;
 bool Options::reset_stats_ = false;
+bool Options::daemon_ = false;
 
 void Options::usage() {
   printf(
@@ -60,6 +64,13 @@ void Options::usage() {
       "  -r, --generate-report[=HTML] generate a report on the build command execution.\n"
       "                               the report's filename can be specified \n"
       "                               (firebuild-build-report.html by default). \n"
+      "      --trace-events=FILE      write the timeline of the build to FILE in the\n"
+      "                               Trace Event Format, for Perfetto or chrome://tracing.\n"
+      "      --record-messages=FILE   record the messages of the intercepted processes to FILE.\n"
+      "      --replay-messages=FILE   benchmark the supervisor replaying the messages recorded\n"
+      "                               to FILE, without running the build command.\n"
+      "                               The cache is not used, thus neither shortcutting nor\n"
+      "                               storing the processes is measured.\n"
       "  -h, --help                   show this help\n"
       "  -o, --option=key=val         Add or replace a scalar in the config\n"
       "  -o, --option=key=[]          Clear an array in the config\n"
@@ -72,6 +83,10 @@ void Options::usage() {
       "  -i, --insert-trace-markers   perform open(\"/FIREBUILD <debug_msg>\", 0) calls\n"
       "                               to let users find unintercepted calls using\n"
       "                               strace or ltrace. This works in debug builds only.\n"
+      "      --daemon                 Stay in the foreground serving the builds started by\n"
+      "                               firebuild later, keeping the configuration and the\n"
+      "                               caches initialized. Builds using different\n"
+      "                               configuration are not passed to the daemon.\n"
       "      --version                output version information and exit\n"
       "Exit status:\n"
       " exit status of the BUILD COMMAND\n"
@@ -89,12 +104,16 @@ void Options::parse(const int argc, char *argv[]) {
       {"debug-flags",          required_argument, 0, 'd' },
       {"debug-filter",         required_argument, 0, 'D' },
       {"generate-report",      optional_argument, 0, 'r' },
+      {"trace-events",         required_argument, 0, 'T' },
+      {"record-messages",      required_argument, 0, 'M' },
+      {"replay-messages",      required_argument, 0, 'P' },
       {"help",                 no_argument,       0, 'h' },
       {"option",               required_argument, 0, 'o' },
       {"quiet",                no_argument,       0, 'q' },
       {"show-stats",           no_argument,       0, 's' },
       {"zero-stats",           no_argument,       0, 'z' },
       {"insert-trace-markers", no_argument,       0, 'i' },
+      {"daemon",               no_argument,       0, 'S' },
       {"version",              no_argument,       0, 'v' },
       {0,                                0,       0,  0  }
     };
@@ -157,6 +176,18 @@ void Options::parse(const int argc, char *argv[]) {
         }
         break;
 
+      case 'T':
+        trace_events_file_ = optarg;
+        break;
+
+      case 'M':
+        record_messages_file_ = optarg;
+        break;
+
+      case 'P':
+        replay_messages_file_ = optarg;
+        break;
+
       case 's':
         print_stats_ = true;
         break;
@@ -182,6 +213,10 @@ void Options::parse(const int argc, char *argv[]) {
         reset_stats_ = true;
         break;
 
+      case 'S':
+        daemon_ = true;
+        break;
+
       default:
         usage();
         exit(EXIT_FAILURE);
@@ -189,7 +224,7 @@ void Options::parse(const int argc, char *argv[]) {
   }
 
   if (optind >= argc) {
-    if (!do_gc_ && !print_stats_ && !reset_stats_) {
+    if (!do_gc_ && !print_stats_ && !reset_stats_ && !daemon_ && !replay_messages_file_) {
       usage();
       exit(EXIT_FAILURE);
     }
@@ -198,6 +233,14 @@ void Options::parse(const int argc, char *argv[]) {
       printf("The --gc (or -g) option can be used only without a BUILD COMMAND.");
       exit(EXIT_FAILURE);
     }
+    if (daemon_) {
+      printf("The --daemon option can be used only without a BUILD COMMAND.");
+      exit(EXIT_FAILURE);
+    }
+    if (replay_messages_file_) {
+      printf("The --replay-messages option can be used only without a BUILD COMMAND.");
+      exit(EXIT_FAILURE);
+    }
   }
 
   if (argc > optind) {
@@ -206,6 +249,33 @@ void Options::parse(const int argc, char *argv[]) {
   }
 }
 
+void Options::reparse(const int argc, char *argv[]) {
+  delete(config_strings_);
+  config_file_ = nullptr;
+  directory_ = nullptr;
+  report_file_ = "firebuild-build-report.html";
+  trace_events_file_ = nullptr;
+  record_messages_file_ = nullptr;
+  replay_messages_file_ = nullptr;
+  build_cmd_ = nullptr;
+  build_cmd_argc_ = 0;
+  quiet_ = false;
+  generate_report_ = false;
+  insert_trace_markers_ = false;
+  do_gc_ = false;
+  print_stats_ = false;
+  reset_stats_ = false;
+  daemon_ = false;
+  /* Restart scanning the arguments. */
+#ifdef __APPLE__
+  optreset = 1;
+  optind = 1;
+#else
+  optind = 0;
+#endif
+  parse(argc, argv);
+}
+
 void Options::free() {
   delete(config_strings_);
 }
@@ -32,6 +32,8 @@ namespace firebuild {
 class Options {
  public:
   static void parse(const int argc, char *argv[]);
+  /** Parse the options of a client the daemon supervises a build for, forgetting its own. */
+  static void reparse(const int argc, char *argv[]);
   static void usage();
   static void free();
   static const char* config_file() {
@@ -43,6 +45,15 @@ class Options {
   static const char* report_file() {
     return report_file_;
   }
+  static const char* trace_events_file() {
+    return trace_events_file_;
+  }
+  static const char* record_messages_file() {
+    return record_messages_file_;
+  }
+  static const char* replay_messages_file() {
+    return replay_messages_file_;
+  }
   static const char* const * build_cmd() {
     return build_cmd_;
   }
@@ -71,11 +82,17 @@ class Options {
   static bool reset_stats() {
     return reset_stats_;
   }
+  static bool daemon() {
+    return daemon_;
+  }
 
  private:
   static char* config_file_;
   static char* directory_;
   static const char* report_file_;
+  static const char* trace_events_file_;
+  static const char* record_messages_file_;
+  static const char* replay_messages_file_;
   static const char * const * build_cmd_;
   static size_t build_cmd_argc_;
   static std::list<std::string>* config_strings_;
@@ -85,6 +102,7 @@ class Options {
   static bool do_gc_;
   static bool print_stats_;
   static bool reset_stats_;
+  static bool daemon_;
 };
 
 }  /* namespace firebuild */
@@ -175,6 +175,19 @@ class PipeRecorder {
    */
   bool store(bool *is_empty_out, Hash *key_out, off_t* stored_bytes,
              char **inline_data_out, size_t *inline_data_len_out);
+  /**
+   * The data recorded so far when it is kept in memory, or an empty view.
+   *
+   * The data is in the backing file, accessible via recorded_fd(), if it is not kept in memory.
+   */
+  std::string_view recorded_buffer() const {
+    return use_memory_buffer_ && mem_buffer_ ? std::string_view(mem_buffer_, offset_)
+        : std::string_view();
+  }
+  /** The backing file of the data recorded so far, or -1. */
+  int recorded_fd() const {return fd_;}
+  /** The amount of data recorded so far. */
+  loff_t recorded_size() const {return offset_;}
   /** Close the backing fd, drop the data that was written so far. Set to deactivated state. */
   void deactivate();
   /** Close the backing fd, drop the data that was written so far. Set to abandoned state. */
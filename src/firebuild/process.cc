@@ -50,6 +50,7 @@
 #include "firebuild/execed_process_env.h"
 #include "firebuild/process_tree.h"
 #include "firebuild/debug.h"
+#include "firebuild/options.h"
 #include "firebuild/utils.h"
 
 namespace firebuild {
@@ -126,7 +127,76 @@ std::shared_ptr<FileFD>
 Process::add_filefd(const int fd, std::shared_ptr<FileFD> ffd) {
   TRACK(FB_DEBUG_PROC, "fd=%d", fd);
 
-  return Process::add_filefd(fds_, fd, ffd);
+  return Process::add_filefd(mutable_fds(), fd, ffd);
+}
+
+void Process::lend_fds(Process* fork_child) {
+  assert(!fork_child->fds_ && !fork_child->fds_lender_);
+  fork_child->fds_lender_ = this;
+  fds_borrowers_.push_back(fork_child);
+}
+
+void Process::stop_borrowing_fds() {
+  std::vector<Process*>& borrowers = fds_lender_->fds_borrowers_;
+  borrowers.erase(std::find(borrowers.begin(), borrowers.end(), this));
+  fds_lender_ = nullptr;
+}
+
+void Process::take_own_fds() {
+  TRACKX(FB_DEBUG_PROC, 1, 1, Process, this, "");
+
+  assert(fds_lender_ && !fds_);
+  /* Make the same copy that the fork child would have got at the fork(). */
+  fds_ = fds_lender_->pass_on_fds(false);
+  stop_borrowing_fds();
+}
+
+void Process::unshare_fds() {
+  /* The borrowers see the current state of the table, they copy it before it changes. */
+  while (!fds_borrowers_.empty()) {
+    fds_borrowers_.back()->take_own_fds();
+  }
+  if (fds_lender_) {
+    take_own_fds();
+  }
+}
+
+/* The borrowed FileFDs are the lender's ones and they are not registered in the Pipes as this
+ * process's ends, thus there is nothing to close or drain. The table is only dropped before the
+ * process exec()-s or terminates. */
+void Process::drop_borrowed_fds() {
+  while (!fds_borrowers_.empty()) {
+    fds_borrowers_.back()->take_own_fds();
+  }
+  stop_borrowing_fds();
+  fds_ = new std::vector<std::shared_ptr<FileFD>>();
+}
+
+void Process::close_fds() {
+  if (fds_lender_) {
+    drop_borrowed_fds();
+    return;
+  }
+  std::vector<std::shared_ptr<FileFD>>* fds = mutable_fds();
+  for (int i = fds->size() - 1; i >= 0; i--) {
+    FileFD* file_fd = (*fds)[i].get();
+    if (file_fd) {
+      handle_close(file_fd, i);
+    }
+  }
+}
+
+void Process::reset_file_fd_pipe_refs() {
+  if (fds_lender_) {
+    drop_borrowed_fds();
+    return;
+  }
+  for (auto& file_fd : *mutable_fds()) {
+    if (file_fd && file_fd->pipe()) {
+      file_fd->pipe()->drain_fd1_end(file_fd.get());
+      file_fd->set_pipe(nullptr);
+    }
+  }
 }
 
 void Process::add_pipe(std::shared_ptr<Pipe> pipe) {
@@ -138,7 +208,7 @@ void Process::add_pipe(std::shared_ptr<Pipe> pipe) {
 void Process::drain_all_pipes() {
   TRACKX(FB_DEBUG_PROC, 1, 1, Process, this, "");
 
-  for (auto file_fd : *fds_) {
+  for (auto file_fd : *mutable_fds()) {
     if (!file_fd || !is_wronly(file_fd->flags())) {
       continue;
     }
@@ -152,11 +222,12 @@ void Process::drain_all_pipes() {
 std::vector<std::shared_ptr<FileFD>>* Process::pass_on_fds(const bool execed) const {
   TRACKX(FB_DEBUG_PROC, 1, 1, Process, this, "execed=%s", D(execed));
 
-  const int fds_size = fds_->size();
+  const std::vector<std::shared_ptr<FileFD>>* fds = this->fds();
+  const int fds_size = fds->size();
   auto ret_fds = new std::vector<std::shared_ptr<FileFD>>(fds_size);
   int last_fd = -1;
   for (int i = 0; i < fds_size; i++) {
-    const FileFD* const raw_file_fd = (*fds_)[i].get();
+    const FileFD* const raw_file_fd = (*fds)[i].get();
     if (raw_file_fd != nullptr) {
       if (!(execed && raw_file_fd->cloexec())
 #ifdef __APPLE__
@@ -311,7 +382,7 @@ int Process::handle_freopen(const char * const ar_name, const size_t ar_len,
     /* Without a name pre_open should not have been sent. */
     assert(!pre_open_sent);
     /* Find oldfd. */
-    FileFD *file_fd = get_fd(oldfd);
+    const FileFD *file_fd = get_fd(oldfd);
     if (!file_fd || file_fd->filename() == nullptr) {
       /* Can't find oldfd, or wasn't opened by filename. Don't know what to do. */
       exec_point()->disable_shortcutting_bubble_up(
@@ -371,7 +442,7 @@ int Process::handle_close(const int fd, const int error) {
     assert(!get_fd(fd));
     return 0;
   } else {
-    FileFD* file_fd = get_fd(fd);
+    FileFD* file_fd = get_mutable_fd(fd);
     if (!file_fd) {
       if (error == 0) {
         exec_point()->disable_shortcutting_bubble_up(
@@ -405,10 +476,11 @@ int Process::handle_close_range(const unsigned int first, const unsigned int las
   (void)flags;  /* might be unused */
 
   if (!error) {
-    unsigned int fds_size = fds_->size();
+    std::vector<std::shared_ptr<FileFD>>* fds = mutable_fds();
+    unsigned int fds_size = fds->size();
     const int range_max = std::min(last, fds_size - 1);
     for (int fd = first; fd <= range_max; fd++) {
-      FileFD* file_fd = (*fds_)[fd].get();
+      FileFD* file_fd = (*fds)[fd].get();
       if (!file_fd) {
         continue;
       }
@@ -604,7 +676,7 @@ int Process::handle_fstatat(const int fd, const char * const ar_name, const size
 #endif
       ) {
     /* Operating on an opened fd, i.e. fstat() or fstatat("", AT_EMPTY_PATH). */
-    FileFD *file_fd = get_fd(fd);
+    const FileFD *file_fd = get_fd(fd);
     if (!file_fd) {
       if (error == 0) {
         exec_point()->disable_shortcutting_bubble_up(
@@ -839,7 +911,7 @@ int Process::handle_fchmodat(const int fd, const char * const ar_name, const siz
 #endif
       ) {
     /* Operating on an opened fd, i.e. fchmod() or fchmodat("", AT_EMPTY_PATH). */
-    FileFD *file_fd = get_fd(fd);
+    const FileFD *file_fd = get_fd(fd);
     if (!file_fd) {
       if (error == 0) {
         exec_point()->disable_shortcutting_bubble_up(
@@ -1319,7 +1391,7 @@ int Process::handle_dup3(const int oldfd, const int newfd, const int flags,
 
   handle_force_close(newfd);
 
-  add_filefd(newfd, std::make_shared<FileFD>((*fds_)[oldfd], flags & O_CLOEXEC));
+  add_filefd(newfd, std::make_shared<FileFD>(get_shared_fd(oldfd), flags & O_CLOEXEC));
   return 0;
 }
 
@@ -1443,7 +1515,7 @@ int Process::handle_clear_cloexec(const int fd) {
         "which means interception missed at least one open()", fd);
     return -1;
   }
-  (*fds_)[fd]->set_cloexec(false);
+  get_mutable_fd(fd)->set_cloexec(false);
   return 0;
 }
 
@@ -1465,13 +1537,13 @@ int Process::handle_fcntl(const int fd, const int cmd, const int arg,
               "which means interception missed at least one open()", fd);
           return -1;
         }
-        (*fds_)[fd]->set_cloexec(arg & FD_CLOEXEC);
+        get_mutable_fd(fd)->set_cloexec(arg & FD_CLOEXEC);
       }
       return 0;
 #ifdef F_GETPATH
     case F_GETPATH:
       if (error == 0) {
-        FileFD *file_fd = get_fd(fd);
+        const FileFD *file_fd = get_fd(fd);
         if (!file_fd) {
           exec_point()->disable_shortcutting_bubble_up(
               "Process successfully fcntl'ed on fd which is known to be closed, "
@@ -1509,7 +1581,7 @@ int Process::handle_ioctl(const int fd, const int cmd,
               "which means interception missed at least one open()", fd);
           return -1;
         }
-        (*fds_)[fd]->set_cloexec(true);
+        get_mutable_fd(fd)->set_cloexec(true);
       }
       return 0;
     case FIONCLEX:
@@ -1520,7 +1592,7 @@ int Process::handle_ioctl(const int fd, const int cmd,
               "which means interception missed at least one open()", fd);
           return -1;
         }
-        (*fds_)[fd]->set_cloexec(false);
+        get_mutable_fd(fd)->set_cloexec(false);
       }
       return 0;
     default:
@@ -1535,7 +1607,7 @@ void Process::handle_read_from_inherited(const int fd, const bool is_pread) {
 
   (void)is_pread;  /* unused */
 
-  FileFD *file_fd = get_fd(fd);
+  const FileFD *file_fd = get_fd(fd);
   if (!file_fd) {
     exec_point()->disable_shortcutting_bubble_up(
         "Process successfully read from fd which is known to be closed, which means interception"
@@ -1569,7 +1641,7 @@ void Process::handle_read_from_inherited(const int fd, const bool is_pread) {
 void Process::handle_write_to_inherited(const int fd, const bool is_pwrite) {
   TRACKX(FB_DEBUG_PROC, 1, 1, Process, this, "fd=%d, is_pwrite=%s", fd, D(is_pwrite));
 
-  FileFD *file_fd = get_fd(fd);
+  const FileFD *file_fd = get_fd(fd);
   if (!file_fd) {
     exec_point()->disable_shortcutting_bubble_up(
         "Process successfully wrote to fd which is known to be closed, which means interception"
@@ -1611,7 +1683,7 @@ void Process::handle_write_to_inherited(const int fd, const bool is_pwrite) {
 void Process::handle_seek_in_inherited(const int fd, const bool modify_offset) {
   TRACKX(FB_DEBUG_PROC, 1, 1, Process, this, "fd=%d, modify_offset=%s", fd, D(modify_offset));
 
-  FileFD *file_fd = get_fd(fd);
+  const FileFD *file_fd = get_fd(fd);
   if (!file_fd) {
     exec_point()->disable_shortcutting_bubble_up(
         "Process successfully seeked in an fd which is known to be closed, which means interception"
@@ -1642,7 +1714,7 @@ void Process::handle_seek_in_inherited(const int fd, const bool modify_offset) {
 
 void Process::handle_inherited_fd_offset(const int fd, const int64_t offset) {
   TRACKX(FB_DEBUG_PROC, 1, 1, Process, this, "fd=%d, offset==%" PRId64, fd, offset);
-  FileFD *file_fd = exec_point()->get_fd(fd);
+  const FileFD *file_fd = exec_point()->get_fd(fd);
   if (!file_fd) {
     exec_point()->disable_shortcutting_bubble_up(
         "Process reported offset for an intercepted seekable fd which is no known to be open", fd);
@@ -1665,7 +1737,7 @@ void Process::handle_recvmsg_scm_rights(const bool cloexec, const std::vector<in
   TRACKX(FB_DEBUG_PROC, 1, 1, Process, this, "cloexec=%s fds=%s", D(cloexec), D(fds));
 
   for (int fd : fds) {
-    FileFD *file_fd = get_fd(fd);
+    const FileFD *file_fd = get_fd(fd);
     if (file_fd) {
       exec_point()->disable_shortcutting_bubble_up(
         "Process successfully received fd via SCM_RIGHTS which is known to be open, which means"
@@ -1962,8 +2034,13 @@ void Process::terminate_top_orphans() const {
     /* If the supervisor is a subreaper and there is no subreaper among the supervised processes,
      * then it is safe to assume that all orphans are still running or are zombies waiting for being
      * reaped, thus they can be kill()-ed by pid. */
-    FB_DEBUG(FB_DEBUG_PROC, "Killing top orphan process " + d(this));
-    kill(pid(), SIGTERM);
+    if (Options::replay_messages_file()) {
+      /* The pid belongs to a process of the recorded build, not to one of ours. */
+      FB_DEBUG(FB_DEBUG_PROC, "Not killing replayed top orphan process " + d(this));
+    } else {
+      FB_DEBUG(FB_DEBUG_PROC, "Killing top orphan process " + d(this));
+      kill(pid(), SIGTERM);
+    }
     /* Continue with all fork children of this exec chain. The processes of this exec chain are
      * not kill()-ed again. */
     const Process* curr = this;
@@ -2123,6 +2200,11 @@ Process::~Process() {
   TRACKX(FB_DEBUG_PROC, 1, 0, Process, this, "");
 
   delete(expected_child_);
+  if (fds_lender_) {
+    drop_borrowed_fds();
+  } else {
+    unshare_fds();
+  }
   delete(fds_);
 }
 
@@ -199,33 +199,46 @@ class Process {
   virtual Process*  exec_proc() const = 0;
   void update_rusage(int64_t utime_u, int64_t stime_u);
   virtual void resource_usage(int64_t utime_u, int64_t stime_u);
-  FileFD* get_fd(int fd) const {
-    assert(fds_);
-    if (fd < 0 || static_cast<unsigned int>(fd) >= fds_->size()) {
+  const FileFD* get_fd(int fd) const {
+    const std::vector<std::shared_ptr<FileFD>>* fds = this->fds();
+    if (fd < 0 || static_cast<unsigned int>(fd) >= fds->size()) {
       return nullptr;
     } else {
-      return (*fds_)[fd].get();
+      return (*fds)[fd].get();
     }
   }
+  /** Get the fd to modify it or to use its identity, e.g. in Pipe. */
+  FileFD* get_mutable_fd(int fd) {
+    return get_shared_fd(fd).get();
+  }
   std::shared_ptr<FileFD> get_shared_fd(int fd) {
-    assert(fds_);
-    if (fd < 0 || static_cast<unsigned int>(fd) >= fds_->size()) {
+    std::vector<std::shared_ptr<FileFD>>* fds = mutable_fds();
+    if (fd < 0 || static_cast<unsigned int>(fd) >= fds->size()) {
       return nullptr;
     } else {
-      return (*fds_)[fd];
+      return (*fds)[fd];
     }
   }
-  void close_fds() {
-    for (int i = fds_->size() - 1; i >= 0; i--) {
-      FileFD* file_fd = get_fd(i);
-      if (file_fd) {
-        handle_close(file_fd, i);
-      }
-    }
+  void close_fds();
+  /** The fd table, possibly the one borrowed from the fork parent. Only for reading. */
+  const std::vector<std::shared_ptr<FileFD>>* fds() const {
+    assert(fds_ || fds_lender_);
+    return fds_ ? fds_ : fds_lender_->fds();
+  }
+  /** The process's own fd table, to modify it or the FileFDs in it. */
+  std::vector<std::shared_ptr<FileFD>>* mutable_fds() {
+    unshare_fds();
+    return fds_;
+  }
+  void set_fds(std::vector<std::shared_ptr<FileFD>>* fds) {
+    assert(!fds_lender_);
+    fds_ = fds;
   }
-  std::vector<std::shared_ptr<FileFD>>* fds() {return fds_;}
-  const std::vector<std::shared_ptr<FileFD>>* fds() const {return fds_;}
-  void set_fds(std::vector<std::shared_ptr<FileFD>>* fds) {fds_ = fds;}
+  /**
+   * Let the new fork child use this process's fd table instead of a copy of it. The child copies
+   * the table when either of them is about to modify it.
+   */
+  void lend_fds(Process* fork_child);
   /** Add add ffd FileFD* to open fds */
   static std::shared_ptr<FileFD> add_filefd(std::vector<std::shared_ptr<FileFD>>* fds,
                                             const int fd, std::shared_ptr<FileFD> ffd);
@@ -236,14 +249,7 @@ class Process {
    *  as available on each fd1 end of each pipe */
   // TODO(rbalint) forward only fd0 pipe ends coming from this process
   void drain_all_pipes();
-  void reset_file_fd_pipe_refs() {
-    for (auto& file_fd : *fds_) {
-      if (file_fd && file_fd->pipe()) {
-        file_fd->pipe()->drain_fd1_end(file_fd.get());
-        file_fd->set_pipe(nullptr);
-      }
-    }
-  }
+  void reset_file_fd_pipe_refs();
 
   void AddPopenedProcess(int fd, ExecedProcess *proc);
 
@@ -699,7 +705,11 @@ class Process {
   int exec_count_;
   const FileName* wd_;  ///< Current working directory
   mode_t umask_;  ///< Current umask
-  std::vector<std::shared_ptr<FileFD>>* fds_;  ///< Active file descriptors
+  std::vector<std::shared_ptr<FileFD>>* fds_;  ///< Active file descriptors, NULL when borrowed
+  /** The process whose fd table is used while this process has not modified it, see lend_fds() */
+  Process* fds_lender_ {nullptr};
+  /** Fork children using this process's fd table */
+  std::vector<Process*> fds_borrowers_ {};
   std::vector<ForkedProcess*> fork_children_;  ///< children of the process
   /** the latest system() child */
   ExecedProcess *system_child_ {NULL};
@@ -731,6 +741,10 @@ class Process {
                      TimespecPairHash> mtime_to_file_ {};
   const FileName* get_fd_filename(int fd) const;
   bool any_child_not_finalized();
+  void unshare_fds();
+  void take_own_fds();
+  void stop_borrowing_fds();
+  void drop_borrowed_fds();
   DISALLOW_COPY_AND_ASSIGN(Process);
 };
 
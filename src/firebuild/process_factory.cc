@@ -25,6 +25,8 @@
 #include "firebuild/config.h"
 #include "firebuild/exe_matcher.h"
 #include "firebuild/file_name.h"
+#include "firebuild/trace_events.h"
+#include "firebuild/utils.h"
 
 namespace firebuild {
 
@@ -32,7 +34,13 @@ ForkedProcess*
 ProcessFactory::getForkedProcess(const int pid, Process * const parent) {
   TRACK(FB_DEBUG_PROC, "pid=%d, parent=%s", pid, D(parent));
 
+#ifdef __APPLE__
+  /* The child's table differs in the fds closed on fork. */
   return new ForkedProcess(pid, parent->pid(), parent, parent->pass_on_fds(false));
+#else
+  /* Most children don't touch the fds before exec()-ing, copy the table only when needed. */
+  return new ForkedProcess(pid, parent->pid(), parent, nullptr);
+#endif
 }
 
 ExecedProcess*
@@ -85,6 +93,8 @@ ProcessFactory::getExecedProcess(const FBBCOMM_Serialized_scproc_query *const ms
                              debug_suppressed,
                              fds);
 
+  traceExecedProcess(e);
+
   /* Debug the full command line, env vars etc. */
   FB_DEBUG(FB_DEBUG_PROC, "Created ExecedProcess " + d(e, 1) + " with:");
   FB_DEBUG(FB_DEBUG_PROC, "- exe = " + d(e->executable()));
@@ -112,6 +122,50 @@ ProcessFactory::getExecedProcess(const FBBCOMM_Serialized_scproc_query *const ms
   return e;
 }
 
+ExecedProcess*
+ProcessFactory::getPreExecedProcess(Process * const parent,
+                                    const FileName* executable,
+                                    const FileName* executed_path,
+                                    const std::string& original_executed_path,
+                                    const std::vector<std::string>& args,
+                                    const std::vector<std::string>& env_vars,
+                                    const std::vector<const FileName*>& libs) {
+  TRACK(FB_DEBUG_PROC, "parent=%s", D(parent));
+
+  char* original_executed_path_ptr = original_executed_path == executed_path->c_str()
+      ? const_cast<char*>(executed_path->c_str()) : strdup(original_executed_path.c_str());
+  auto e = new ExecedProcess(parent->pid(),
+                             parent->ppid(),
+                             parent->wd(),
+                             executable, executed_path, original_executed_path_ptr,
+                             args,
+                             env_vars,
+                             libs,
+                             parent->umask(),
+                             nullptr,
+                             debug_suppressed,
+                             parent->pass_on_fds());
+
+  FB_DEBUG(FB_DEBUG_PROC, "Created ExecedProcess " + d(e, 1) + " before exec() with:");
+  FB_DEBUG(FB_DEBUG_PROC, "- exe = " + d(e->executable()));
+  FB_DEBUG(FB_DEBUG_PROC, "- arg = " + d(e->args()));
+  FB_DEBUG(FB_DEBUG_PROC, "- cwd = " + d(e->initial_wd()));
+  FB_DEBUG(FB_DEBUG_PROC, "- env = " + d(e->env_vars()));
+  FB_DEBUG(FB_DEBUG_PROC, "- lib = " + d(e->libs()));
+  FB_DEBUG(FB_DEBUG_PROC, "- umask = " + d(e->umask()));
+  return e;
+}
+
+void ProcessFactory::traceExecedProcess(const ExecedProcess* e) {
+  if (trace_events) {
+    const std::string track =
+        (e->args().empty() ? std::string("?") : base_name(e->args()[0].c_str()))
+        + " [" + std::to_string(e->fb_pid()) + "]";
+    trace_events->track_name(e->fb_pid(), track.c_str());
+    trace_events->begin(e->fb_pid(), "exec");
+  }
+}
+
 bool ProcessFactory::peekProcessDebuggingSuppressed(const FBBCOMM_Serialized *fbbcomm_buf) {
   if (!debug_filter) {
     return false;
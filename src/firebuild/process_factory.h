@@ -20,6 +20,7 @@
 #define FIREBUILD_PROCESS_FACTORY_H_
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "./fbbcomm.h"
@@ -43,6 +44,19 @@ class ProcessFactory {
   static ExecedProcess* getExecedProcess(const FBBCOMM_Serialized_scproc_query *const msg,
                                          Process * const parent,
                                          std::vector<std::shared_ptr<FileFD>>* fds);
+  /**
+   * Create the process to be started by parent's pending exec*() call, as predicted by the
+   * supervisor. The process is not linked to the parent yet, see ExecedProcess::set_parent().
+   */
+  static ExecedProcess* getPreExecedProcess(Process * const parent,
+                                            const FileName* executable,
+                                            const FileName* executed_path,
+                                            const std::string& original_executed_path,
+                                            const std::vector<std::string>& args,
+                                            const std::vector<std::string>& env_vars,
+                                            const std::vector<const FileName*>& libs);
+  /** Start the new process's track in the trace events. */
+  static void traceExecedProcess(const ExecedProcess* e);
   static bool peekProcessDebuggingSuppressed(const FBBCOMM_Serialized *fbbcomm_buf);
 
  private:
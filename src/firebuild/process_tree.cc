@@ -24,6 +24,7 @@
 #include "common/platform.h"
 #include "firebuild/debug.h"
 #include "firebuild/options.h"
+#include "firebuild/report.h"
 
 namespace firebuild {
 
@@ -97,7 +98,7 @@ void ProcessTree::insert_root(pid_t root_pid, int stdin_fd, int stdout_fd, int s
     if (fd == stderr_fd && stdout_stderr_match) {
       /* stdout and stderr point to the same location (changing one's flags did change the
        * other's). Reuse the Pipe object that we created in the loop's first iteration. */
-      root_->add_filefd(fd, std::make_shared<FileFD>((*root_->fds())[stdout_fd], false));
+      root_->add_filefd(fd, std::make_shared<FileFD>(root_->get_shared_fd(stdout_fd), false));
     } else {
       /* Create a new Pipe for this file descriptor.
        * The fd keeps blocking/non-blocking behaviour, it seems to be ok with epoll.
@@ -138,6 +139,7 @@ void ProcessTree::GcProcesses() {
       }
     } else {
       proc->inherited_files().clear();
+      Report::spill(proc);
     }
     proc_gc_queue_.pop();
   }
@@ -19,6 +19,7 @@
 #include "firebuild/report.h"
 
 #include <libgen.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cinttypes>
@@ -29,6 +30,7 @@
 #include <vector>
 
 #include "firebuild/debug.h"
+#include "firebuild/options.h"
 #include "firebuild/process_tree.h"
 
 namespace firebuild {
@@ -44,70 +46,70 @@ tsl::hopscotch_map<std::string, cmd_prof> cmd_profs {};
  * Index of each used file in the JavaScript files[] array.
  */
 tsl::hopscotch_map<const FileName*, int> used_files_index_map {};
-
-
-struct string_vector_ptr_hash {
-  size_t operator()(const std::vector<std::string>* v) const {
-    std::hash<std::string> hasher;
-    std::size_t seed = 0;
-    for (auto const & s : *v) {
-      seed ^= hasher(s) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-    }
-    return seed;
-  }
-};
-
-struct string_vector_ptr_eq {
-  bool operator() (const std::vector<std::string>* a, const std::vector<std::string>* b) const {
-    return *a == *b;
-  }
-};
+std::vector<const FileName*> used_files {};
 
 /**
- * Index of each used environment in the JavaScript envs[] array.
+ * Index of each used environment in the JavaScript envs[] array, keyed by the environment already
+ * rendered as a JavaScript array.
  */
-tsl::hopscotch_map<const std::vector<std::string>*, int, struct string_vector_ptr_hash,
-                   struct string_vector_ptr_eq> used_envs_index_map {};
+tsl::hopscotch_map<std::string, int> used_envs_index_map {};
+std::vector<const std::string*> used_envs {};
 
 /**
- * Escape std::string for JavaScript
- * from http://stackoverflow.com/questions/7724448/simple-json-string-escape-for-c
- * TODO: use JSONCpp instead to handle all cases
+ * The already rendered report data of the finalized processes that got garbage collected.
+ *
+ * The spill file is created next to the report and is unlinked right away. For each spilled
+ * process the offset and length of its rendered fields are kept, to let the report be
+ * assembled in the order of the process tree at the end of the build.
  */
-static std::string escapeJsonString(const std::string& input) {
-  std::ostringstream ss;
-  for (auto iter = input.cbegin(); iter != input.cend(); iter++) {
-    switch (*iter) {
-      case '\\': ss << "\\\\"; break;
-      case '"': ss << "\\\""; break;
-      case '\b': ss << "\\b"; break;
-      case '\f': ss << "\\f"; break;
-      case '\n': ss << "\\n"; break;
-      case '\r': ss << "\\r"; break;
-      case '\t': ss << "\\t"; break;
-      default: ss << *iter; break;
-    }
-  }
-  return ss.str();
-}
+static FILE* spill_file = nullptr;
+static off_t spill_file_end = 0;
+tsl::hopscotch_map<const ExecedProcess*, std::pair<off_t, size_t>> spilled_procs {};
 
 static const char* full_relative_path_or_basename(const char *name) {
   const char* name_last_slash = strrchr(name, '/');
   return name_last_slash && path_is_absolute(name) ? name_last_slash + 1 : name;
 }
 
+static int file_index(const FileName* file) {
+  auto it = used_files_index_map.find(file);
+  if (it != used_files_index_map.end()) {
+    return it->second;
+  }
+  used_files_index_map.insert({file, used_files.size()});
+  used_files.push_back(file);
+  return used_files.size() - 1;
+}
+
+static int env_index(const std::vector<std::string>& env) {
+  std::string env_js("[");
+  for (const std::string& env_var : env) {
+    env_js.append("\"" + escape_json_string(env_var) + "\",");
+  }
+  env_js.append("]");
+  auto it = used_envs_index_map.find(env_js);
+  if (it != used_envs_index_map.end()) {
+    return it->second;
+  }
+  it = used_envs_index_map.insert({env_js, used_envs.size()}).first;
+  used_envs.push_back(&it->first);
+  return used_envs.size() - 1;
+}
+
 static void fprintf_ffu_file(FILE* stream, const file_file_usage& ffu) {
-  fprintf(stream, "files[%d],", used_files_index_map[ffu.file]);
+  fprintf(stream, "files[%d],", file_index(ffu.file));
 }
 
-static void export2js(const ExecedProcess* proc, const unsigned int level,
-                      FILE* stream, unsigned int * nodeid) {
+/**
+ * Print the fields of the process' node except the id and the children.
+ */
+static void export2js(const ExecedProcess* proc, const unsigned int level, FILE* stream) {
   // TODO(rbalint): escape all strings properly
   auto indent_str = std::string(2 * level, ' ');
   const char* indent = indent_str.c_str();
 
-  fprintf(stream, "name:\"%s\",\n", full_relative_path_or_basename(proc->args()[0].c_str()));
-  fprintf(stream, "%s id: %u,\n", indent, (*nodeid)++);
+  fprintf(stream, "%s name:\"%s\",\n", indent,
+          full_relative_path_or_basename(proc->args()[0].c_str()));
   fprintf(stream, "%s pid: %u,\n", indent, proc->pid());
   fprintf(stream, "%s ppid: %u,\n", indent, proc->ppid());
   fprintf(stream, "%s fb_pid: %u,\n", indent, proc->fb_pid());
@@ -119,11 +121,11 @@ static void export2js(const ExecedProcess* proc, const unsigned int level,
   }
   if (proc->shortcut_result()) {
     fprintf(stream, "%s sc_result: \"%s\",\n",
-            indent, escapeJsonString(proc->shortcut_result()).c_str());
+            indent, escape_json_string(proc->shortcut_result()).c_str());
   }
   if (!proc->can_shortcut()) {
     fprintf(stream, "%s cant_sc_reason: \"%s\",\n",
-            indent, escapeJsonString(proc->cant_shortcut_reason()).c_str());
+            indent, escape_json_string(proc->cant_shortcut_reason()).c_str());
     if (proc->cant_shortcut_proc()->exec_proc()->fb_pid() != proc->fb_pid()) {
       fprintf(stream, "%s cant_sc_fb_pid: \"%u\",\n",
               indent, proc->cant_shortcut_proc()->exec_proc()->fb_pid());
@@ -131,15 +133,15 @@ static void export2js(const ExecedProcess* proc, const unsigned int level,
   }
   fprintf(stream, "%s args: [", indent);
   for (auto& arg : proc->args()) {
-    fprintf(stream, "\"%s\",", escapeJsonString(arg).c_str());
+    fprintf(stream, "\"%s\",", escape_json_string(arg).c_str());
   }
   fprintf(stream, "],\n");
 
-  fprintf(stream, "%s env: envs[%d],\n", indent, used_envs_index_map[&proc->env_vars()]);
+  fprintf(stream, "%s env: envs[%d],\n", indent, env_index(proc->env_vars()));
 
   fprintf(stream, "%s libs: [", indent);
   for (auto& lib : proc->libs()) {
-    fprintf(stream, "files[%d],", used_files_index_map[lib]);
+    fprintf(stream, "files[%d],", file_index(lib));
   }
   fprintf(stream, "],\n");
 
@@ -228,9 +230,22 @@ static void export2js_recurse_ep(const ExecedProcess* proc, const unsigned int l
   if (level > 0) {
     fprintf(stream, "\n");
   }
-  fprintf(stream, "%s{", std::string(2 * level, ' ').c_str());
+  fprintf(stream, "%s{id: %u,\n", std::string(2 * level, ' ').c_str(), (*nodeid)++);
 
-  export2js(proc, level, stream, nodeid);
+  auto it = spilled_procs.find(proc);
+  if (it == spilled_procs.end()) {
+    export2js(proc, level, stream);
+  } else {
+    /* Copy the node's fields rendered at garbage collection time. */
+    std::vector<char> buf(it->second.second);
+    if (pread(fileno(spill_file), buf.data(), buf.size(), it->second.first)
+        != static_cast<ssize_t>(buf.size())) {
+      fb_perror("pread");
+      fb_error("Reading back report data of " + d(proc) + " failed.");
+    } else {
+      fwrite(buf.data(), 1, buf.size(), stream);
+    }
+  }
   fprintf(stream, "%s children: [", std::string(2 * level, ' ').c_str());
   export2js_recurse_p(proc, level, stream, nodeid);
   if (level == 0) {
@@ -251,57 +266,83 @@ static void export2js(ProcessTree* proc_tree, FILE * stream) {
   }
 }
 
-static void collect_used_files_and_envs(const Process &p,
-                                        tsl::hopscotch_set<const FileName*> *used_files,
-                                        tsl::hopscotch_set<const std::vector<std::string>*,
-                                        string_vector_ptr_hash,
-                                        string_vector_ptr_eq> *envs) {
+/**
+ * Assign the files[] and envs[] indexes to the files and environments of the processes that are
+ * not spilled yet, before printing the arrays.
+ */
+static void collect_used_files_and_envs(const Process &p) {
   if (p.exec_child() != NULL) {
     ExecedProcess *exec_child = static_cast<ExecedProcess*>(p.exec_child());
-    for (const auto& pair : exec_child->file_usages()) {
-      if (!pair.second->propagated()) { /* Save time by not processing propagated ones. */
-        used_files->insert(pair.first);
+    if (spilled_procs.count(exec_child) == 0) {
+      for (const auto& pair : exec_child->file_usages()) {
+        if (!pair.second->propagated()) { /* Save time by not processing propagated ones. */
+          file_index(pair.first);
+        }
       }
+      for (const FileName* lib : exec_child->libs()) {
+        file_index(lib);
+      }
+      env_index(exec_child->env_vars());
     }
-    for (const FileName* lib : exec_child->libs()) {
-      used_files->insert(lib);
-    }
-    envs->insert(&exec_child->env_vars());
-    collect_used_files_and_envs(*exec_child, used_files, envs);
+    collect_used_files_and_envs(*exec_child);
   }
   for (auto& fork_child : p.fork_children()) {
-    collect_used_files_and_envs(*fork_child, used_files, envs);
+    collect_used_files_and_envs(*fork_child);
   }
 }
 
-void fprint_collected_files(FILE* stream,
-                            const tsl::hopscotch_set<const FileName*>& used_files_set) {
-  int index = 0;
+static void fprint_collected_files(FILE* stream) {
   fprintf(stream, "files = [\n");
-  for (const FileName* filename : used_files_set) {
-    fprintf(stream, "  \"%s\", // files[%d]\n",
-            escapeJsonString(filename->to_string()).c_str(), index);
-    used_files_index_map.insert({filename, index++});
+  for (size_t index = 0; index < used_files.size(); index++) {
+    fprintf(stream, "  \"%s\", // files[%zu]\n",
+            escape_json_string(used_files[index]->to_string()).c_str(), index);
   }
   fprintf(stream, "];\n");
 }
 
-void fprint_collected_envs(
-    FILE* stream, const tsl::hopscotch_set<const std::vector<std::string>*, string_vector_ptr_hash,
-    string_vector_ptr_eq>& used_envs_set) {
-  int index = 0;
+static void fprint_collected_envs(FILE* stream) {
   fprintf(stream, "envs = [\n");
-  for (const std::vector<std::string>* env : used_envs_set) {
-    fprintf(stream, "  [");
-    for (const std::string& env_var : *env) {
-      fprintf(stream, "\"%s\",", escapeJsonString(env_var).c_str());
-    }
-    fprintf(stream, "], // envs[%d]\n", index);
-    used_envs_index_map.insert({env, index++});
+  for (size_t index = 0; index < used_envs.size(); index++) {
+    fprintf(stream, "  %s, // envs[%zu]\n", used_envs[index]->c_str(), index);
   }
   fprintf(stream, "];\n");
 }
 
+void Report::spill(ExecedProcess* proc) {
+  if (!spill_file) {
+    std::string spill_template = std::string(Options::report_file()) + ".XXXXXX";
+    int fd = mkstemp(&spill_template[0]);
+    if (fd == -1 || !(spill_file = fdopen(fd, "w+"))) {
+      fb_perror("Creating report spill file");
+      if (fd != -1) {
+        close(fd);
+        unlink(spill_template.c_str());
+      }
+      return;
+    }
+    unlink(spill_template.c_str());
+  }
+  unsigned int level = 0;
+  for (const ExecedProcess* p = proc->parent_exec_point(); p; p = p->parent_exec_point()) {
+    level++;
+  }
+  export2js(proc, level, spill_file);
+  off_t end = ftello(spill_file);
+  if (end == -1) {
+    fb_perror("ftello");
+    return;
+  }
+  spilled_procs.insert({proc, {spill_file_end, end - spill_file_end}});
+  spill_file_end = end;
+
+  /* Only args[0] is needed later, for the profile. */
+  proc->args().resize(1);
+  proc->args().shrink_to_fit();
+  std::vector<std::string>().swap(proc->env_vars());
+  std::vector<const FileName*>().swap(proc->libs());
+  tsl::hopscotch_map<const FileName*, const FileUsage*>().swap(proc->file_usages());
+}
+
 static void profile_collect_cmds(const Process &p,
                                  tsl::hopscotch_map<std::string, subcmd_prof> *cmds,
                                  std::set<std::string> *ancestors) {
@@ -535,12 +576,12 @@ void Report::write(const std::string &html_filename, const std::string &datadir)
       fflush(dst_file);
     } else if (strstr(line, tree_filename) != NULL) {
       fprintf(dst_file, "    <script type=\"text/javascript\">\n");
-      tsl::hopscotch_set<const FileName*> used_files_set;
-      tsl::hopscotch_set<const std::vector<std::string>*, string_vector_ptr_hash,
-                         string_vector_ptr_eq> used_envs_set;
-      collect_used_files_and_envs(*proc_tree->root(), &used_files_set, &used_envs_set);
-      fprint_collected_files(dst_file, used_files_set);
-      fprint_collected_envs(dst_file, used_envs_set);
+      collect_used_files_and_envs(*proc_tree->root());
+      fprint_collected_files(dst_file);
+      fprint_collected_envs(dst_file);
+      if (spill_file && fflush(spill_file) != 0) {
+        fb_perror("fflush");
+      }
       export2js(proc_tree, dst_file);
       fprintf(dst_file, "    </script>\n");
     } else if (strstr(line, digraph_script) != NULL) {
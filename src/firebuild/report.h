@@ -23,8 +23,17 @@
 
 namespace firebuild {
 
+class ExecedProcess;
+
 class Report {
  public:
+  /**
+   * Render the report data of a finalized process to the spill file and free the data that is
+   * not needed anymore, to keep the supervisor's memory usage bounded in large builds.
+   *
+   * @param proc finalized process, its descendants are already finalized, too
+   */
+  static void spill(ExecedProcess* proc);
   /**
    * Write report to specified file
    *
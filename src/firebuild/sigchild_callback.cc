@@ -25,6 +25,8 @@
 
 #include "firebuild/debug.h"
 #include "firebuild/firebuild.h"
+#include "firebuild/jobserver.h"
+#include "firebuild/message_log.h"
 #include "firebuild/process_debug_suppressor.h"
 #include "firebuild/process_tree.h"
 
@@ -49,6 +51,28 @@ static void save_child_status(pid_t pid, int status, int * ret, bool orphan) {
   }
 }
 
+void child_exited(pid_t pid, int status) {
+  if (pid == child_pid) {
+    /* This is the top process the supervisor started. */
+    Process* proc = proc_tree->pid2proc(child_pid);
+    assert(proc);
+    ProcessDebugSuppressor debug_suppressor(proc);
+    save_child_status(pid, status, &child_ret, false);
+    proc->set_been_waited_for();
+  } else {
+    /* This is an orphan process. Its fork parent quit without wait()-ing for it
+     * and as a subreaper the supervisor received the SIGCHLD for it. */
+    Process* proc = proc_tree->pid2proc(pid);
+    if (proc) {
+      /* Since the parent of this orphan process did not wait() for it, it will not be stored in
+       * the cache even when finalizing it. */
+      assert(!proc->been_waited_for());
+    }
+    int ret = -1;
+    save_child_status(pid, status, &ret, true);
+  }
+}
+
 /* This is the actual business logic for SIGCHLD, called synchronously when processing the events
  * returned by epoll_wait(). */
 void sigchild_cb(const struct epoll_event* event, void *arg) {
@@ -67,24 +91,11 @@ void sigchild_cb(const struct epoll_event* event, void *arg) {
   /* Collect exiting children. */
   do {
     waitpid_ret = waitpid(-1, &status, WNOHANG);
-    if (waitpid_ret == child_pid) {
-      /* This is the top process the supervisor started. */
-      Process* proc = proc_tree->pid2proc(child_pid);
-      assert(proc);
-      ProcessDebugSuppressor debug_suppressor(proc);
-      save_child_status(waitpid_ret, status, &child_ret, false);
-      proc->set_been_waited_for();
-    } else if (waitpid_ret > 0) {
-      /* This is an orphan process. Its fork parent quit without wait()-ing for it
-       * and as a subreaper the supervisor received the SIGCHLD for it. */
-      Process* proc = proc_tree->pid2proc(waitpid_ret);
-      if (proc) {
-        /* Since the parent of this orphan process did not wait() for it, it will not be stored in
-         * the cache even when finalizing it. */
-        assert(!proc->been_waited_for());
+    if (waitpid_ret > 0) {
+      if (message_log) {
+        message_log->child_exited(waitpid_ret, status);
       }
-      int ret = -1;
-      save_child_status(waitpid_ret, status, &ret, true);
+      child_exited(waitpid_ret, status);
     }
   } while (waitpid_ret > 0);
 
@@ -96,6 +107,8 @@ void sigchild_cb(const struct epoll_event* event, void *arg) {
       close(listener);
       listener = -1;
     }
+    /* The jobservers' fds would keep the main epoll loop running. */
+    Jobserver::CloseAll();
   }
 }
 
@@ -19,10 +19,15 @@
 #ifndef FIREBUILD_SIGCHILD_CALLBACK_H_
 #define FIREBUILD_SIGCHILD_CALLBACK_H_
 
+#include <sys/types.h>
+
 #include "firebuild/epoll.h"
 
 namespace firebuild {
 
+/** Record the exit of a child collected by waitpid(). */
+void child_exited(pid_t pid, int status);
+
 void sigchild_cb(const struct epoll_event* event, void *arg);
 
 }  /* namespace firebuild */
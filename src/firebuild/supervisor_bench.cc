@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Microbenchmarks of the supervisor's caching primitives.
+ *
+ * The benchmarks run against a fresh cache in a temporary directory. The configuration is read
+ * like firebuild reads it, thus the effect of configuration choices can be measured, e.g.:
+ *
+ *   firebuild-bench -c etc/firebuild.conf -o 'compression_level = 3' \
+ *       --benchmark_filter=BlobCache
+ */
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libconfig.h++>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./fbbcomm.h"
+#include "firebuild/blob_cache.h"
+#include "firebuild/config.h"
+#include "firebuild/execed_process.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/fbbstore.h"
+#include "firebuild/file_name.h"
+#include "firebuild/hash.h"
+#include "firebuild/obj_cache.h"
+#include "firebuild/subkey.h"
+#include "firebuild/utils.h"
+
+/* Normally defined in firebuild.cc, which is not linked in. */
+int sigchild_selfpipe[2];
+int listener;
+int child_pid, child_ret = 1;
+
+namespace {
+
+std::string bench_dir;
+
+/** Create a file of the given size with incompressible-ish contents under bench_dir. */
+const firebuild::FileName* create_input_file(const std::string& name, size_t size) {
+  const std::string path = bench_dir + "/" + name;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    firebuild::fb_perror("open");
+    exit(EXIT_FAILURE);
+  }
+  std::vector<char> buf(64 * 1024);
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < buf.size(); i++) {
+    /* Half of the bytes are random, the rest is text to let compression do some work. */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    buf[i] = (i % 2) ? static_cast<char>(x) : "int main() { return 0; }\n"[i / 2 % 25];
+  }
+  for (size_t written = 0; written < size; ) {
+    const size_t len = std::min(buf.size(), size - written);
+    if (write(fd, buf.data(), len) != static_cast<ssize_t>(len)) {
+      firebuild::fb_perror("write");
+      exit(EXIT_FAILURE);
+    }
+    written += len;
+  }
+  close(fd);
+  return firebuild::FileName::Get(path);
+}
+
+/** A cache entry similar to the ones stored for compilers, with files_count outputs. */
+struct SampleEntry {
+  explicit SampleEntry(size_t files_count, size_t inline_data_size = 0)
+      : paths(), inline_data(inline_data_size, 'x'), files(files_count), outputs(), inouts() {
+    for (size_t i = 0; i < files_count; i++) {
+      paths.push_back(bench_dir + "/build/src/subdir/object_file_" + std::to_string(i) + ".o");
+      files[i].set_path_with_length(paths[i].c_str(), paths[i].length());
+      files[i].set_type(firebuild::ISREG);
+      files[i].set_size(4096 + i);
+      files[i].set_mode(0644);
+      files[i].set_mode_mask(0777);
+      if (inline_data_size > 0) {
+        files[i].set_inline_data(inline_data.data(), inline_data.size());
+      } else {
+        files[i].set_hash(XXH128_hash_t{i, ~i});
+      }
+    }
+    outputs.set_path_isreg_item_fn(files.size(), file_item_fn, &files);
+    outputs.set_exit_status(0);
+    inouts.set_inputs(reinterpret_cast<const FBBSTORE_Builder *>(&inputs));
+    inouts.set_outputs(reinterpret_cast<const FBBSTORE_Builder *>(&outputs));
+  }
+  const FBBSTORE_Builder* builder() const {
+    return reinterpret_cast<const FBBSTORE_Builder *>(&inouts);
+  }
+
+  std::vector<std::string> paths;
+  std::string inline_data;
+  std::vector<FBBSTORE_Builder_file> files;
+  FBBSTORE_Builder_process_inputs inputs {};
+  FBBSTORE_Builder_process_outputs outputs;
+  FBBSTORE_Builder_process_inputs_outputs inouts;
+
+ private:
+  static const FBBSTORE_Builder* file_item_fn(int idx, const void *user_data) {
+    auto files = reinterpret_cast<const std::vector<FBBSTORE_Builder_file> *>(user_data);
+    return reinterpret_cast<const FBBSTORE_Builder *>(&(*files)[idx]);
+  }
+};
+
+void BM_HashSetFromFd(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const firebuild::FileName* file = create_input_file("hash_input", size);
+  int fd = open(file->c_str(), O_RDONLY | O_CLOEXEC);
+  firebuild::Hash hash;
+  for (auto _ : state) {
+    if (!hash.set_from_fd(fd, nullptr, nullptr)) {
+      state.SkipWithError("set_from_fd() failed");
+      break;
+    }
+    benchmark::DoNotOptimize(hash);
+  }
+  close(fd);
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_HashSetFromFd)->RangeMultiplier(16)->Range(1 << 10, 1 << 28);
+
+void BM_FileNameGet(benchmark::State& state) {
+  std::vector<std::string> names;
+  for (int i = 0; i < 1024; i++) {
+    names.push_back("/usr/include/x86_64-linux-gnu/bits/header_" + std::to_string(i) + ".h");
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    const std::string& name = names[i++ % names.size()];
+    benchmark::DoNotOptimize(firebuild::FileName::Get(name.c_str(), name.length()));
+  }
+}
+BENCHMARK(BM_FileNameGet);
+
+void BM_FileNameGetCanonicalized(benchmark::State& state) {
+  const firebuild::FileName* wd = firebuild::FileName::Get(bench_dir + "/build/src/subdir");
+  std::vector<std::string> names;
+  for (int i = 0; i < 1024; i++) {
+    names.push_back("./../../include/./lib/../header_" + std::to_string(i) + ".h");
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    const std::string& name = names[i++ % names.size()];
+    benchmark::DoNotOptimize(
+        firebuild::FileName::GetCanonicalized(name.c_str(), name.length(), wd));
+  }
+}
+BENCHMARK(BM_FileNameGetCanonicalized);
+
+void BM_FbbStoreSerialize(benchmark::State& state) {
+  const SampleEntry entry(state.range(0));
+  std::vector<char> buf;
+  for (auto _ : state) {
+    buf.resize(entry.builder()->measure());
+    entry.builder()->serialize(buf.data());
+    benchmark::DoNotOptimize(buf.data());
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_FbbStoreSerialize)->RangeMultiplier(8)->Range(1, 4096);
+
+void BM_FbbStoreDecode(benchmark::State& state) {
+  const SampleEntry entry(state.range(0));
+  std::vector<char> buf(entry.builder()->measure());
+  entry.builder()->serialize(buf.data());
+  for (auto _ : state) {
+    auto inouts = reinterpret_cast<const FBBSTORE_Serialized_process_inputs_outputs *>(
+        buf.data());
+    auto outputs =
+        reinterpret_cast<const FBBSTORE_Serialized_process_outputs *>(inouts->get_outputs());
+    size_t sum = 0;
+    for (size_t i = 0; i < outputs->get_path_isreg_count(); i++) {
+      auto file =
+          reinterpret_cast<const FBBSTORE_Serialized_file *>(outputs->get_path_isreg_at(i));
+      sum += file->get_path_len() + file->get_size() + file->get_hash().low64;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_FbbStoreDecode)->RangeMultiplier(8)->Range(1, 4096);
+
+void BM_FbbCommSerializeDecode(benchmark::State& state) {
+  const std::string path = bench_dir + "/build/src/subdir/some_source_file.c";
+  std::vector<char> buf;
+  for (auto _ : state) {
+    FBBCOMM_Builder_open ic_msg;
+    ic_msg.set_dirfd(AT_FDCWD);
+    ic_msg.set_pathname_with_length(path.c_str(), path.length());
+    ic_msg.set_flags(O_RDONLY | O_CLOEXEC);
+    ic_msg.set_ret(3);
+    auto generic = reinterpret_cast<const FBBCOMM_Builder *>(&ic_msg);
+    buf.resize(generic->measure());
+    generic->serialize(buf.data());
+    auto decoded = reinterpret_cast<const FBBCOMM_Serialized_open *>(buf.data());
+    benchmark::DoNotOptimize(decoded->get_pathname_len() + decoded->get_flags());
+  }
+}
+BENCHMARK(BM_FbbCommSerializeDecode);
+
+/** Arguments: the size of inline data in each of the 64 files, and whether to compress. */
+void BM_ObjCacheStore(benchmark::State& state) {
+  const SampleEntry entry(64, state.range(0));
+  firebuild::compress_cache = state.range(1);
+  const firebuild::Hash key(XXH128_hash_t{1, static_cast<uint64_t>(state.range(0))});
+  for (auto _ : state) {
+    if (!firebuild::obj_cache->store(key, entry.builder(), 0, nullptr)) {
+      state.SkipWithError("store() failed");
+      break;
+    }
+  }
+}
+BENCHMARK(BM_ObjCacheStore)->ArgsProduct({{0, 256, 4096}, {0, 1}});
+
+void BM_ObjCacheRetrieve(benchmark::State& state) {
+  const SampleEntry entry(64, state.range(0));
+  firebuild::compress_cache = state.range(1);
+  const firebuild::Hash key(XXH128_hash_t{2, static_cast<uint64_t>(state.range(0))});
+  firebuild::Subkey subkey;
+  if (!firebuild::obj_cache->store(key, entry.builder(), 0, nullptr, &subkey)) {
+    state.SkipWithError("store() failed");
+    return;
+  }
+  for (auto _ : state) {
+    uint8_t* buf;
+    size_t len, compressed_len;
+    bool munmap_entry;
+    if (!firebuild::obj_cache->retrieve(key, subkey.c_str(), &buf, &len, &compressed_len,
+                                        &munmap_entry)) {
+      state.SkipWithError("retrieve() failed");
+      break;
+    }
+    firebuild::ObjCache::free_entry(buf, len, munmap_entry);
+  }
+}
+BENCHMARK(BM_ObjCacheRetrieve)->ArgsProduct({{0, 256, 4096}, {0, 1}});
+
+/** Arguments: the file size and whether to compress. */
+void BM_BlobCacheStoreFile(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const firebuild::FileName* file = create_input_file("blob_input", size);
+  firebuild::compress_cache = state.range(1);
+  for (auto _ : state) {
+    firebuild::Hash key;
+    if (!firebuild::blob_cache->store_file(file, 0, -1, 0, size, &key)) {
+      state.SkipWithError("store_file() failed");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_BlobCacheStoreFile)->ArgsProduct({{1 << 10, 1 << 16, 1 << 22, 1 << 26}, {0, 1}});
+
+void BM_BlobCacheRetrieveFile(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const firebuild::FileName* file = create_input_file("blob_input", size);
+  const firebuild::FileName* dst = firebuild::FileName::Get(bench_dir + "/blob_output");
+  firebuild::compress_cache = state.range(1);
+  firebuild::Hash key;
+  if (!firebuild::blob_cache->store_file(file, 0, -1, 0, size, &key)) {
+    state.SkipWithError("store_file() failed");
+    return;
+  }
+  for (auto _ : state) {
+    int blob_fd = firebuild::blob_cache->get_fd_for_file(key);
+    if (blob_fd == -1
+        || !firebuild::blob_cache->retrieve_file(blob_fd, dst, false, state.range(1))) {
+      state.SkipWithError("retrieve_file() failed");
+      break;
+    }
+    close(blob_fd);
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_BlobCacheRetrieveFile)->ArgsProduct({{1 << 10, 1 << 16, 1 << 22, 1 << 26}, {0, 1}});
+
+void BM_ExecedProcessCacherFingerprint(benchmark::State& state) {
+  const firebuild::FileName* wd = firebuild::FileName::Get(bench_dir + "/build");
+  const firebuild::FileName* exe =
+      firebuild::FileName::Get(std::filesystem::read_symlink("/proc/self/exe").string());
+  std::vector<std::string> args {"cc", "-c", "-O2", "-g", "-Wall", "-DHAVE_CONFIG_H", "-I.",
+                                 "-I../include", "-o", "src/subdir/object_file.o",
+                                 "src/subdir/object_file.c"};
+  std::vector<std::string> env_vars;
+  for (char **env = environ; *env; env++) {
+    env_vars.push_back(*env);
+  }
+  std::sort(env_vars.begin(), env_vars.end());
+  auto proc = std::make_unique<firebuild::ExecedProcess>(
+      1, 0, wd, exe, exe, const_cast<char*>(exe->c_str()), args, env_vars,
+      std::vector<const firebuild::FileName*>(), 022, nullptr, false,
+      new std::vector<std::shared_ptr<firebuild::FileFD>>());
+  for (auto _ : state) {
+    if (!firebuild::execed_process_cacher->fingerprint(proc.get())) {
+      state.SkipWithError("fingerprint() failed");
+      break;
+    }
+  }
+}
+BENCHMARK(BM_ExecedProcessCacherFingerprint);
+
+void usage(const char* name) {
+  printf("Usage: %s [-c FILE] [-o 'KEY = VALUE']... [benchmark options]\n", name);
+  printf("Options are interpreted as by firebuild, see firebuild --help.\n");
+}
+
+}  /* namespace */
+
+int main(int argc, char* argv[]) {
+  benchmark::Initialize(&argc, argv);
+
+  const char* config_file = nullptr;
+  std::list<std::string> config_strings;
+  int c;
+  while ((c = getopt(argc, argv, "c:o:h")) != -1) {
+    switch (c) {
+      case 'c':
+        config_file = optarg;
+        break;
+      case 'o':
+        config_strings.push_back(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  char bench_dir_template[] = "/tmp/firebuild-bench.XXXXXX";
+  if (!mkdtemp(bench_dir_template)) {
+    firebuild::fb_perror("mkdtemp");
+    exit(EXIT_FAILURE);
+  }
+  bench_dir = bench_dir_template;
+  setenv("FIREBUILD_CACHE_DIR", (bench_dir + "/cache").c_str(), true);
+
+  firebuild::cfg = new libconfig::Config();
+  firebuild::read_config(firebuild::cfg, config_file, config_strings);
+  firebuild::ExecedProcessCacher::init(firebuild::cfg);
+  firebuild::FileName::default_tmpdir = firebuild::FileName::Get("/tmp");
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  std::filesystem::remove_all(bench_dir);
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "firebuild/trace_events.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include <string>
+
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+TraceEvents *trace_events = nullptr;
+
+/* All tracks belong to the same process in the trace. */
+static const int kTracePid = 1;
+
+/* Tracks of the worker threads are numbered from here, not to collide with the fb_pids. */
+static const int kFirstWorkerTid = 1 << 30;
+
+TraceEvents::TraceEvents(FILE* stream)
+    : stream_(stream), main_thread_(std::this_thread::get_id()),
+      next_worker_tid_(kFirstWorkerTid) {
+  fprintf(stream_, "[\n");
+  track_name_locked(kSupervisorTid, "firebuild");
+  /* Don't let the forked build command flush the same buffer if it fails to exec(). */
+  fflush(stream_);
+}
+
+TraceEvents* TraceEvents::Open(const std::string& filename) {
+  FILE* stream = fopen(filename.c_str(), "w");
+  if (!stream) {
+    fb_perror(("Opening trace events file " + filename).c_str());
+    return nullptr;
+  }
+  return new TraceEvents(stream);
+}
+
+TraceEvents::~TraceEvents() {
+  /* The closing bracket is optional in the format, but let the file be valid JSON, too. */
+  fprintf(stream_, "\n]\n");
+  if (fclose(stream_) != 0) {
+    fb_perror("Writing trace events file");
+  }
+}
+
+int64_t TraceEvents::now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+/* Called with mutex_ held. */
+int TraceEvents::resolve_tid(int tid) {
+  if (tid != kCurrentThread) {
+    return tid;
+  } else if (std::this_thread::get_id() == main_thread_) {
+    return kSupervisorTid;
+  }
+  thread_local int worker_tid = 0;
+  if (worker_tid == 0) {
+    worker_tid = next_worker_tid_++;
+    track_name_locked(worker_tid,
+                      ("firebuild worker " + std::to_string(worker_tid - kFirstWorkerTid)).c_str());
+  }
+  return worker_tid;
+}
+
+/* Called with mutex_ held. */
+void TraceEvents::separate() {
+  if (!first_event_) {
+    fprintf(stream_, ",\n");
+  }
+  first_event_ = false;
+}
+
+void TraceEvents::print_ts(int64_t ns) {
+  /* Timestamps are in microseconds, keep the sub-microsecond precision for short spans. */
+  fprintf(stream_, "%" PRId64 ".%03d", ns / 1000, static_cast<int>(ns % 1000));
+}
+
+void TraceEvents::track_name_locked(int tid, const char* name) {
+  separate();
+  fprintf(stream_, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+          "\"args\":{\"name\":\"%s\"}}", kTracePid, tid, escape_json_string(name).c_str());
+}
+
+void TraceEvents::track_name(int tid, const char* name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  track_name_locked(tid, name);
+}
+
+void TraceEvents::complete(int tid, const char* name, int64_t start_ns) {
+  int64_t end_ns = now_ns();
+  std::lock_guard<std::mutex> lock(mutex_);
+  tid = resolve_tid(tid);
+  separate();
+  fprintf(stream_, "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":",
+          name, kTracePid, tid);
+  print_ts(start_ns);
+  fprintf(stream_, ",\"dur\":");
+  print_ts(end_ns - start_ns);
+  fprintf(stream_, "}");
+}
+
+void TraceEvents::begin(int tid, const char* name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tid = resolve_tid(tid);
+  separate();
+  fprintf(stream_, "{\"ph\":\"B\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":",
+          name, kTracePid, tid);
+  print_ts(now_ns());
+  fprintf(stream_, "}");
+}
+
+void TraceEvents::end(int tid) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tid = resolve_tid(tid);
+  separate();
+  fprintf(stream_, "{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,\"ts\":", kTracePid, tid);
+  print_ts(now_ns());
+  fprintf(stream_, "}");
+}
+
+}  /* namespace firebuild */
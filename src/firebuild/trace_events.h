@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef FIREBUILD_TRACE_EVENTS_H_
+#define FIREBUILD_TRACE_EVENTS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "firebuild/cxx_lang_utils.h"
+
+namespace firebuild {
+
+/**
+ * Timeline of the build in the Trace Event Format, loadable in Perfetto or chrome://tracing.
+ *
+ * Each intercepted process gets its own track, named after the process, showing its lifetime and
+ * the fingerprinting, shortcutting and storing done by the supervisor on its behalf. The
+ * supervisor's own track (tid 0) shows hashing and blob I/O.
+ *
+ * The events are appended to the file as they complete, to not keep them in memory in large
+ * builds. Spans of the supervisor's worker threads go to a separate track for each thread.
+ */
+class TraceEvents {
+ public:
+  /** Track of the supervisor's main thread. */
+  static const int kSupervisorTid = 0;
+  /** Pseudo tid selecting the track of the calling supervisor thread. */
+  static const int kCurrentThread = -1;
+
+  explicit TraceEvents(FILE* stream);
+  /** Open the trace file, or return nullptr on failure. */
+  static TraceEvents* Open(const std::string& filename);
+  ~TraceEvents();
+
+  /** Current time of CLOCK_MONOTONIC in nanoseconds. */
+  static int64_t now_ns();
+  /** Name the track of tid. */
+  void track_name(int tid, const char* name);
+  /** Span on track tid that started at start_ns and ends now. */
+  void complete(int tid, const char* name, int64_t start_ns);
+  /** Start a span on track tid, to be closed by end(). */
+  void begin(int tid, const char* name);
+  void end(int tid);
+
+ private:
+  int resolve_tid(int tid);
+  void track_name_locked(int tid, const char* name);
+  void separate();
+  void print_ts(int64_t ns);
+  FILE* stream_;
+  bool first_event_ = true;
+  std::thread::id main_thread_;
+  std::atomic<int> next_worker_tid_;
+  std::mutex mutex_ {};
+  DISALLOW_COPY_AND_ASSIGN(TraceEvents);
+};
+
+/* singleton, or nullptr when tracing is disabled */
+extern TraceEvents *trace_events;
+
+/**
+ * Emit a span on the given track for the lifetime of the object if tracing is enabled.
+ */
+class TraceSpan {
+ public:
+  TraceSpan(int tid, const char* name)
+      : tid_(tid), name_(name), start_ns_(trace_events ? TraceEvents::now_ns() : 0) {}
+  /** Span on the calling supervisor thread's track. */
+  explicit TraceSpan(const char* name) : TraceSpan(TraceEvents::kCurrentThread, name) {}
+  ~TraceSpan() {
+    if (trace_events) {
+      trace_events->complete(tid_, name_, start_ns_);
+    }
+  }
+
+ private:
+  int tid_;
+  const char* name_;
+  int64_t start_ns_;
+  DISALLOW_COPY_AND_ASSIGN(TraceSpan);
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_TRACE_EVENTS_H_
@@ -39,15 +39,25 @@
 #include <unistd.h>
 #include <zstd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <cstdlib>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 
 #include "./fbbcomm.h"
 #include "common/firebuild_common.h"
 #include "common/platform.h"
+#include "firebuild/cxx_lang_utils.h"
 #include "firebuild/debug.h"
+#include "firebuild/message_log.h"
+#include "firebuild/metrics.h"
 
 #ifdef __APPLE__
 /* Interesting CSR configuration flags. */
@@ -275,6 +285,49 @@ bool is_statically_linked(const char *filename) {
     close(fd);
     return true;
 }
+
+bool get_elf_search_path(const char *filename, std::string *search_path) {
+  search_path->clear();
+  if (elf_version(EV_CURRENT) == EV_NONE) return false;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+
+  Elf *e = elf_begin(fd, ELF_C_READ, NULL);
+  if (!e) {
+    close(fd);
+    return false;
+  }
+
+  bool found_runpath = false;
+  Elf_Scn *scn = nullptr;
+  while (!found_runpath && (scn = elf_nextscn(e, scn)) != nullptr) {
+    GElf_Shdr shdr;
+    if (gelf_getshdr(scn, &shdr) == nullptr || shdr.sh_type != SHT_DYNAMIC) {
+      continue;
+    }
+    Elf_Data *data = elf_getdata(scn, nullptr);
+    if (!data || shdr.sh_entsize == 0) {
+      break;
+    }
+    for (size_t i = 0; i < shdr.sh_size / shdr.sh_entsize; i++) {
+      GElf_Dyn dyn;
+      if (gelf_getdyn(data, i, &dyn) == nullptr) {
+        break;
+      }
+      if (dyn.d_tag == DT_RUNPATH || dyn.d_tag == DT_RPATH) {
+        const char *str = elf_strptr(e, shdr.sh_link, dyn.d_un.d_val);
+        if (str) {
+          /* DT_RUNPATH makes the dynamic linker ignore DT_RPATH. */
+          *search_path = str;
+          found_runpath = dyn.d_tag == DT_RUNPATH;
+        }
+      }
+    }
+  }
+  elf_end(e);
+  close(fd);
+  return true;
+}
 #endif
 
 namespace firebuild {
@@ -286,6 +339,9 @@ void ack_msg(const int conn, const uint16_t ack_num) {
   msg_header msg = {};
   msg.ack_id = ack_num;
   fb_write(conn, &msg, sizeof(msg));
+  if (metrics) {
+    metrics->ack_sent(conn, ack_num);
+  }
   FB_DEBUG(firebuild::FB_DEBUG_COMM, "ACK sent");
 }
 
@@ -347,6 +403,12 @@ void send_fbb(int conn, int ack_num, const FBBCOMM_Builder *msg, int *fds, int f
      * safely expect sendmsg() to fully succeed, no short write, if the message is reasonably sized.
      * FIXME implement fb_sendmsg() which retries, just to be even safer. */
     sendmsg(conn, &msgh, 0);
+    if (message_log) {
+      message_log->fds_sent(conn, fds, fd_count);
+    }
+  }
+  if (ack_num != 0 && metrics) {
+    metrics->ack_sent(conn, ack_num);
   }
 }
 
@@ -443,6 +505,35 @@ bool check_system_setup() {
   return system_ok;
 }
 
+/*
+ * From http://stackoverflow.com/questions/7724448/simple-json-string-escape-for-c
+ * TODO: use JSONCpp instead to handle all cases
+ */
+std::string escape_json_string(const std::string& input) {
+  std::ostringstream ss;
+  for (auto iter = input.cbegin(); iter != input.cend(); iter++) {
+    switch (*iter) {
+      case '\\': ss << "\\\\"; break;
+      case '"': ss << "\\\""; break;
+      case '\b': ss << "\\b"; break;
+      case '\f': ss << "\\f"; break;
+      case '\n': ss << "\\n"; break;
+      case '\r': ss << "\\r"; break;
+      case '\t': ss << "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(*iter) < 0x20) {
+          char escaped[7];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(*iter));
+          ss << escaped;
+        } else {
+          ss << *iter;
+        }
+        break;
+    }
+  }
+  return ss.str();
+}
+
 std::string base_name(const char* path) {
   assert(path);
   const char* last_slash = strrchr(path, '/');
@@ -453,6 +544,40 @@ std::string base_name(const char* path) {
   }
 }
 
+bool contains_dir(std::string_view data, std::string_view dir, bool more_data) {
+  size_t pos = 0, found;
+  while ((found = data.find(dir, pos)) != std::string_view::npos) {
+    const size_t end = found + dir.length();
+    if (end == data.length() ? !more_data : !continues_file_name(data[end])) {
+      return true;
+    }
+    pos = end;
+  }
+  return false;
+}
+
+bool file_contains_dir(int fd, std::string_view dir, off_t offset, off_t end) {
+  static const size_t kChunkSize = 1024 * 1024;
+  const size_t overlap = dir.length();
+  std::vector<char> buf(kChunkSize + overlap);
+  size_t kept = 0;
+  while (offset < end) {
+    const size_t to_read = std::min(static_cast<off_t>(kChunkSize), end - offset);
+    const ssize_t read_bytes = TEMP_FAILURE_RETRY(pread(fd, buf.data() + kept, to_read, offset));
+    if (read_bytes <= 0) {
+      break;
+    }
+    offset += read_bytes;
+    const size_t len = kept + read_bytes;
+    if (contains_dir(std::string_view(buf.data(), len), dir, offset < end)) {
+      return true;
+    }
+    kept = std::min(overlap, len);
+    memmove(buf.data(), buf.data() + len - kept, kept);
+  }
+  return false;
+}
+
 uint8_t* decompress_zstd(const uint8_t* compressed_data, size_t compressed_size,
                          size_t* decompressed_size_out) {
   assert(compressed_data);
@@ -724,4 +849,109 @@ bool decompress_file(int fd_src, int fd_dst) {
   return success;
 }
 
+/** A parallel_for() call's work, shared with the worker threads helping with it. */
+struct ParallelJob {
+  void (*fn)(void*, size_t);
+  void* ctx;
+  size_t count;
+  std::atomic<size_t> next;
+  /** The workers reserved for the job that have not joined it yet. Guarded by the pool's mutex. */
+  unsigned int waiting_helpers;
+  /** The workers working on the job. Guarded by the pool's mutex. */
+  unsigned int active_helpers;
+
+  void run() {
+    size_t i;
+    while ((i = next.fetch_add(1, std::memory_order_relaxed)) < count) {
+      fn(ctx, i);
+    }
+  }
+};
+
+/**
+ * The worker threads of parallel_for(). They are kept for the life of the process, thus the trace
+ * events have a track for each of them instead of one for each call's threads.
+ */
+class WorkerPool {
+ public:
+  explicit WorkerPool(unsigned int size) : size_(size) {}
+  void run(ParallelJob* job, unsigned int helpers);
+
+ private:
+  void work();
+  std::mutex mutex_ {};
+  std::condition_variable work_cv_ {};
+  std::condition_variable done_cv_ {};
+  std::deque<ParallelJob*> jobs_ {};
+  const unsigned int size_;
+  unsigned int started_ {0};
+  /** The started workers not reserved for any job. */
+  unsigned int idle_ {0};
+  DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
+void WorkerPool::run(ParallelJob* job, unsigned int helpers) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (idle_ < helpers && started_ < size_) {
+      std::thread(&WorkerPool::work, this).detach();
+      started_++;
+      idle_++;
+    }
+    job->waiting_helpers = std::min(helpers, idle_);
+    if (job->waiting_helpers > 0) {
+      idle_ -= job->waiting_helpers;
+      jobs_.push_back(job);
+      work_cv_.notify_all();
+    }
+  }
+  job->run();
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (job->waiting_helpers > 0) {
+    /* All the work is taken, the workers that did not join are not needed anymore. */
+    jobs_.erase(std::find(jobs_.begin(), jobs_.end(), job));
+    idle_ += job->waiting_helpers;
+    job->waiting_helpers = 0;
+  }
+  done_cv_.wait(lock, [job] {return job->active_helpers == 0;});
+}
+
+void WorkerPool::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this] {return !jobs_.empty();});
+    ParallelJob* job = jobs_.front();
+    if (--job->waiting_helpers == 0) {
+      jobs_.pop_front();
+    }
+    job->active_helpers++;
+    lock.unlock();
+    job->run();
+    lock.lock();
+    idle_++;
+    if (--job->active_helpers == 0) {
+      done_cv_.notify_all();
+    }
+  }
+}
+
+void parallel_for_impl(size_t count, unsigned int helpers, void (*fn)(void*, size_t), void* ctx) {
+  static std::mutex pool_mutex;
+  static WorkerPool* pool = nullptr;
+  static pid_t pool_pid = 0;
+  WorkerPool* current_pool;
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!pool || pool_pid != getpid()) {
+      /* The workers are not inherited by forked children, they start their own pool. The parent's
+       * pool is leaked in the child, its state may be inconsistent. */
+      pool = new WorkerPool(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+      pool_pid = getpid();
+    }
+    current_pool = pool;
+  }
+  ParallelJob job {fn, ctx, count, {0}, 0, 0};
+  current_pool->run(&job, helpers);
+}
+
 }  /* namespace firebuild */
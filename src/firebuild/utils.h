@@ -23,7 +23,13 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include "common/platform.h"
 #include "./fbbcomm.h"
@@ -82,6 +88,14 @@ void bump_limits();
 #ifndef __APPLE__
 /** Check if a binary is statically linked */
 bool is_statically_linked(const char *filename);
+/**
+ * Get the library search path of an ELF binary, DT_RUNPATH or if that's missing then DT_RPATH.
+ *
+ * @param filename        the binary's path
+ * @param[out] search_path  the colon separated directories as in the binary, may be empty
+ * @return                false if the binary could not be parsed
+ */
+bool get_elf_search_path(const char *filename, std::string *search_path);
 #endif
 namespace firebuild {
 
@@ -128,9 +142,36 @@ const std::string& deduplicated_string(std::string);
  */
 bool check_system_setup();
 
+/** Escape a string to be placed between double quotes in JSON or JavaScript */
+std::string escape_json_string(const std::string& input);
+
 /** Return the filename part of a path (after the last '/') */
 std::string base_name(const char* path);
 
+/** Whether the character can continue a file's name, i.e. a directory is not followed by it. */
+inline bool continues_file_name(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '_' || c == '-' || c == '+'
+      || c == '~';
+}
+
+/**
+ * Whether dir occurs in data as a directory, i.e. not followed by a character continuing its name.
+ *
+ * @param data       the data to search in
+ * @param dir        the directory to look for
+ * @param more_data  whether data is followed by more, thus an occurrence at its end is not
+ *                   known to be a directory
+ */
+bool contains_dir(std::string_view data, std::string_view dir, bool more_data = false);
+
+/**
+ * Whether dir occurs as a directory in the file's [offset, end) range.
+ *
+ * The file is read in chunks overlapping by the length of dir, to find the occurrences spanning
+ * chunks, too.
+ */
+bool file_contains_dir(int fd, std::string_view dir, off_t offset, off_t end);
+
 /**
  * Decompress Zstd-compressed data from a buffer into a malloc()-allocated output buffer.
  *
@@ -154,5 +195,36 @@ bool compress_file(int fd_src, int fd_dst, loff_t size_src, int compression_leve
 
 bool decompress_file(int fd_src, int fd_dst);
 
+/**
+ * Call fn(ctx, i) for each i in [0, count) using the calling thread and up to helpers idle worker
+ * threads of the pool, and wait for all the calls to finish. See parallel_for().
+ */
+void parallel_for_impl(size_t count, unsigned int helpers, void (*fn)(void*, size_t), void* ctx);
+
+/**
+ * Call fn(i) for each i in [0, count) using at most max_threads threads, including the calling
+ * thread, and wait for all the calls to finish.
+ *
+ * The worker threads are kept in a pool shared by all the calls and are started only when they are
+ * first needed. Only the idle workers help, thus nested calls, like hashing a big file while
+ * restoring outputs in parallel, don't multiply the number of threads. The calling thread works on
+ * its own call, too, thus the call finishes even if there are no idle workers.
+ *
+ * fn must not touch the supervisor's data structures that are not thread safe, like the FileName
+ * database or the process tree.
+ */
+template <typename F>
+void parallel_for(size_t count, unsigned int max_threads, F fn) {
+  const size_t wanted = std::min<size_t>(std::max(max_threads, 1u), count);
+  if (wanted <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      fn(i);
+    }
+    return;
+  }
+  parallel_for_impl(count, static_cast<unsigned int>(wanted - 1),
+                    [](void* ctx, size_t i) {(*static_cast<F*>(ctx))(i);}, &fn);
+}
+
 }  /* namespace firebuild */
 #endif  // FIREBUILD_UTILS_H_
@@ -82,7 +82,16 @@ struct rusage initial_rusage;
 
 pthread_mutex_t ic_system_popen_lock = PTHREAD_MUTEX_INITIALIZER;
 
-pthread_mutex_t ic_global_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef __GLIBC__
+/* Let the threads waiting for the exclusive lock in, even when the other threads keep the lock
+ * held in shared mode all the time. */
+pthread_rwlock_t ic_global_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+pthread_rwlock_t ic_global_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+/** Serializing the messages of the threads holding ic_global_lock in shared mode. */
+static pthread_mutex_t ic_send_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Lock for serializing psfas array accesses(). */
 pthread_mutex_t ic_psfas_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -120,9 +129,9 @@ static char **ic_argv;
 
 int ic_pid;
 
-__thread thread_data fb_thread_data = {NULL, 0, 0, 0, false};
+__thread thread_data fb_thread_data = {NULL, 0, 0, 0, false, false};
 #if !defined(FB_ALWAYS_USE_THREAD_LOCAL)
-thread_data fb_global_thread_data = {NULL, 0, 0, 0, false};
+thread_data fb_global_thread_data = {NULL, 0, 0, 0, false, false};
 bool thread_locals_usable = false;
 /* Optimization is disabled because when the function is optimized it tries to resolve
  * the address of fb_thread_data, which causes _tlv_bootstrap aborting until
@@ -238,7 +247,21 @@ int ic_pthread_sigmask(int how, const sigset_t *set, sigset_t *oldset) {
 #endif
 }
 
-void grab_global_lock(bool *i_locked, const char * const function_name) {
+static void reinit_global_lock() {
+#ifdef __GLIBC__
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&ic_global_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+#else
+  pthread_rwlock_init(&ic_global_lock, NULL);
+#endif
+  pthread_mutex_init(&ic_send_lock, NULL);
+}
+
+static void grab_global_lock_internal(bool *i_locked, const char * const function_name,
+                                      bool shared) {
   thread_signal_danger_zone_enter();
 
   /* Some internal integrity assertions */
@@ -264,8 +287,13 @@ void grab_global_lock(bool *i_locked, const char * const function_name) {
   }
 
   if (!FB_THREAD_LOCAL(has_global_lock)) {
-    pthread_mutex_lock(&ic_global_lock);
+    if (shared) {
+      pthread_rwlock_rdlock(&ic_global_lock);
+    } else {
+      pthread_rwlock_wrlock(&ic_global_lock);
+    }
     FB_THREAD_LOCAL(has_global_lock) = true;
+    FB_THREAD_LOCAL(has_global_lock_shared) = shared;
     FB_THREAD_LOCAL(intercept_on) = function_name;
     *i_locked = true;
   }
@@ -273,10 +301,19 @@ void grab_global_lock(bool *i_locked, const char * const function_name) {
   assert(FB_THREAD_LOCAL(signal_danger_zone_depth) == 0);
 }
 
+void grab_global_lock(bool *i_locked, const char * const function_name) {
+  grab_global_lock_internal(i_locked, function_name, false);
+}
+
+void grab_global_lock_shared(bool *i_locked, const char * const function_name) {
+  grab_global_lock_internal(i_locked, function_name, true);
+}
+
 void release_global_lock() {
   thread_signal_danger_zone_enter();
-  pthread_mutex_unlock(&ic_global_lock);
+  pthread_rwlock_unlock(&ic_global_lock);
   FB_THREAD_LOCAL(has_global_lock) = false;
+  FB_THREAD_LOCAL(has_global_lock_shared) = false;
   FB_THREAD_LOCAL(intercept_on) = NULL;
   thread_signal_danger_zone_leave();
   assert(FB_THREAD_LOCAL(signal_danger_zone_depth) == 0);
@@ -370,7 +407,15 @@ static void fb_send_msg(int fd, const void /*FBBCOMM_Builder*/ *ic_msg, uint16_t
   ((msg_header *)buf)->ack_id = ack_num;
   ((msg_header *)buf)->msg_size = len;
 #pragma GCC diagnostic pop
+  /* The threads holding the global lock exclusively have the connection for themselves. */
+  const bool shared = FB_THREAD_LOCAL(has_global_lock) && FB_THREAD_LOCAL(has_global_lock_shared);
+  if (shared) {
+    pthread_mutex_lock(&ic_send_lock);
+  }
   fb_write(fd, buf, sizeof(msg_header) + len);
+  if (shared) {
+    pthread_mutex_unlock(&ic_send_lock);
+  }
 }
 
 void fb_fbbcomm_send_msg(const void /*FBBCOMM_Builder*/ *ic_msg, int fd) {
@@ -477,6 +522,29 @@ void reset_rusage() {
   timerclear(&initial_rusage.ru_utime);
 }
 
+void exit_shortcut_process(const int *fds_appended_to, size_t fds_appended_to_count,
+                           int exit_status) {
+  for (size_t i = 0; i < fds_appended_to_count; i++) {
+    insert_debug_msg("seeking forward in fd");
+#ifdef __APPLE__
+    get_ic_orig_lseek()(
+#else
+    get_ic_orig_lseek64()(
+#endif
+        fds_appended_to[i], 0, SEEK_END);
+  }
+
+  insert_debug_msg("exiting");
+#ifdef __APPLE__
+  _exit(exit_status);
+#else
+  void(*orig_underscore_exit)(int) = (void(*)(int)) dlsym(RTLD_NEXT, "_exit");
+  (*orig_underscore_exit)(exit_status);
+#endif
+  assert(0 && "_exit() did not exit");
+  abort();
+}
+
 int clone_trampoline(void *arg) {
   clone_trampoline_arg *trampoline_arg = (clone_trampoline_arg *)arg;
   thread_signal_danger_zone_leave();
@@ -667,7 +735,7 @@ void atfork_child_handler(void) {
    * to unlock if it grabbed the lock, which will silently fail, that's
    * okay. */
   if (intercepting_enabled) {
-    pthread_mutex_init(&ic_global_lock, NULL);
+    reinit_global_lock();
 
     /* Add a useful trace marker */
     if (insert_trace_markers) {
@@ -713,8 +781,9 @@ void handle_exit() {
     bool i_locked = false;
     thread_signal_danger_zone_enter();
     if (!FB_THREAD_LOCAL(has_global_lock)) {
-      pthread_mutex_lock(&ic_global_lock);
+      pthread_rwlock_wrlock(&ic_global_lock);
       FB_THREAD_LOCAL(has_global_lock) = true;
+      FB_THREAD_LOCAL(has_global_lock_shared) = false;
       FB_THREAD_LOCAL(intercept_on) = "handle_exit";
       i_locked = true;
     }
@@ -736,7 +805,7 @@ void handle_exit() {
 
     if (i_locked) {
       thread_signal_danger_zone_enter();
-      pthread_mutex_unlock(&ic_global_lock);
+      pthread_rwlock_unlock(&ic_global_lock);
       FB_THREAD_LOCAL(has_global_lock) = false;
       FB_THREAD_LOCAL(intercept_on) = NULL;
       thread_signal_danger_zone_leave();
@@ -1135,27 +1204,9 @@ void fb_ic_init() {
   /* we may return immediately if supervisor decides that way */
   if (fbbcomm_serialized_scproc_resp_get_shortcut(sv_msg)) {
     insert_debug_msg("this process was shortcut by the supervisor");
-
-    for (fbb_size_t i = 0; i < fbbcomm_serialized_scproc_resp_get_fds_appended_to_count(sv_msg);
-         i++) {
-      int fd = fbbcomm_serialized_scproc_resp_get_fds_appended_to_at(sv_msg, i);
-      insert_debug_msg("seeking forward in fd");
-#ifdef __APPLE__
-      get_ic_orig_lseek()(
-#else
-      get_ic_orig_lseek64()(
-#endif
-          fd, 0, SEEK_END);
-    }
-
-    insert_debug_msg("exiting");
-#ifdef __APPLE__
-    _exit(fbbcomm_serialized_scproc_resp_get_exit_status(sv_msg));
-#else
-    void(*orig_underscore_exit)(int) = (void(*)(int)) dlsym(RTLD_NEXT, "_exit");
-    (*orig_underscore_exit)(fbbcomm_serialized_scproc_resp_get_exit_status(sv_msg));
-#endif
-    assert(0 && "_exit() did not exit");
+    exit_shortcut_process(fbbcomm_serialized_scproc_resp_get_fds_appended_to(sv_msg),
+                          fbbcomm_serialized_scproc_resp_get_fds_appended_to_count(sv_msg),
+                          fbbcomm_serialized_scproc_resp_get_exit_status(sv_msg));
   }
 
   if (fbbcomm_serialized_scproc_resp_has_dont_intercept(sv_msg)) {
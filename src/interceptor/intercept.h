@@ -109,8 +109,14 @@ extern int fb_connect_supervisor();
 /** Set up main supervisor connection */
 extern void fb_init_supervisor_conn();
 
-/** Global lock for serializing critical interceptor actions */
-extern pthread_mutex_t ic_global_lock;
+/**
+ * Global lock for serializing critical interceptor actions.
+ *
+ * Actions changing the file descriptor table or the process tree, or depending on their state, take
+ * it exclusively. Actions only querying the file system take it in shared mode to let other threads
+ * perform the same in parallel, serializing only the sending of their messages.
+ */
+extern pthread_rwlock_t ic_global_lock;
 
 /** Send message, delaying all signals in the current thread.
  *  The caller has to take care of thread locking. */
@@ -149,6 +155,13 @@ void rusage_since_exec(struct rusage *ru);
 /** Reset rusage timers used for reporting rusage to the supervisor. */
 void reset_rusage();
 
+/**
+ * Exit like the shortcut process would have, after seeking forward in the inherited fds the
+ * supervisor appended to.
+ */
+void exit_shortcut_process(const int *fds_appended_to, size_t fds_appended_to_count,
+                           int exit_status) __attribute__((noreturn));
+
 /** Connection string to supervisor */
 extern char fb_conn_string[FB_PATH_BUFSIZE];
 
@@ -425,6 +438,9 @@ typedef struct {
    *  If FB_THREAD_LOCAL(signal_danger_zone_depth) > 0, the contents are undefined and must not
    *  be relied on. */
   bool has_global_lock;
+
+  /** Whether ic_global_lock is held in shared mode, valid only when has_global_lock is set. */
+  bool has_global_lock_shared;
 } thread_data;
 
 extern __thread thread_data fb_thread_data;
@@ -507,6 +523,11 @@ static inline void thread_signal_danger_zone_leave() {
 
 /** Take the global lock if the thread does not hold it already */
 void grab_global_lock(bool *i_locked, const char * const function_name);
+/**
+ * Take the global lock in shared mode if the thread does not hold it already.
+ * Only for actions sending messages without waiting for an ACK.
+ */
+void grab_global_lock_shared(bool *i_locked, const char * const function_name);
 void release_global_lock();
 
 /**
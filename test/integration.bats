@@ -640,3 +640,159 @@ SCRIPT
   
   unset FIREBUILD_CACHE_DIR
 }
+
+@test "daemon" {
+  export XDG_RUNTIME_DIR=$(mktemp -d)
+  # The clients can't pass -c or -o to the daemon, let them find the configuration
+  export XDG_CONFIG_HOME=$(mktemp -d)
+  mkdir $XDG_CONFIG_HOME/firebuild
+  cp ../etc/firebuild.conf $XDG_CONFIG_HOME/firebuild/firebuild.conf
+  $FIREBUILD_CMD --daemon 2>daemon-stderr 3>&- &
+  daemon_pid=$!
+  for i in $(seq 50); do
+    [ -S $XDG_RUNTIME_DIR/firebuild.sock ] && break
+    sleep 0.1
+  done
+  for i in 1 2; do
+    result=$($FIREBUILD_CMD -- bash -c "ls integration.bats" 2>stderr 3>&-)
+    assert_streq "$result" "integration.bats"
+    assert_streq "$(strip_stderr stderr)" ""
+  done
+
+  # The daemon refuses the build after the configuration changed and restarts itself
+  echo "// changed" >> $XDG_CONFIG_HOME/firebuild/firebuild.conf
+  result=$($FIREBUILD_CMD -- bash -c "ls integration.bats" 2>stderr 3>&-)
+  assert_streq "$result" "integration.bats"
+  assert_streq "$(strip_stderr stderr)" ""
+  for i in $(seq 50); do
+    [ -S $XDG_RUNTIME_DIR/firebuild.sock ] && break
+    sleep 0.1
+  done
+  result=$($FIREBUILD_CMD -- bash -c "ls integration.bats" 2>stderr 3>&-)
+  assert_streq "$result" "integration.bats"
+  assert_streq "$(strip_stderr stderr)" ""
+
+  kill $daemon_pid
+  wait $daemon_pid || true
+  assert_streq "$(grep -c 'Daemon is listening' daemon-stderr)" "2"
+  assert_streq "$(grep -c 'Configuration changed, restarting the daemon' daemon-stderr)" "1"
+  # The socket is removed at exit
+  [ ! -e $XDG_RUNTIME_DIR/firebuild.sock ]
+  rm -rf $XDG_RUNTIME_DIR $XDG_CONFIG_HOME
+}
+
+@test "record and replay messages" {
+  for i in 1 2; do
+    rm -f test_messages.log
+    result=$(./run-firebuild --record-messages=test_messages.log -- bash -c "ls integration.bats")
+    assert_streq "$result" "integration.bats"
+    assert_streq "$(strip_stderr stderr)" ""
+    stats=$(./run-firebuild -s)
+    ./run-firebuild --replay-messages=test_messages.log
+    strip_stderr stderr | grep -q "^Replayed [1-9][0-9]* messages of [1-9][0-9]* connections"
+    assert_streq "$(strip_stderr stderr | grep diverged)" ""
+    # The replay leaves the cache and the statistics intact
+    assert_streq "$(./run-firebuild -s)" "$stats"
+  done
+  rm -f test_messages.log
+}
+
+@test "trace events" {
+  for i in 1 2; do
+    rm -f test_trace.json
+    result=$(./run-firebuild --trace-events=test_trace.json -- bash -c "ls integration.bats")
+    assert_streq "$result" "integration.bats"
+    assert_streq "$(strip_stderr stderr)" ""
+    assert_streq "$(head -n 1 test_trace.json)" "["
+    assert_streq "$(tail -n 1 test_trace.json)" "]"
+    grep -q '"ph":"M","name":"thread_name",.*"args":{"name":"bash \[' test_trace.json
+    grep -q '"ph":"B","name":"exec"' test_trace.json
+    # Every process' span is closed
+    assert_streq "$(grep -c '"ph":"E"' test_trace.json)" "$(grep -c '"ph":"B"' test_trace.json)"
+  done
+  rm -f test_trace.json
+}
+
+@test "pre-exec shortcutting" {
+  for i in 1 2; do
+    # Keep test_exec running to let it exec() echo, which is cached even if it takes no CPU time
+    result=$(./run-firebuild -o 'pre_exec_shortcutting = true' -o 'processes.skip_cache -= "echo"' -o 'processes.dont_shortcut += "test_exec"' -o 'min_cpu_time = -1.0' -d proc,shortcut -- ./test_exec)
+    assert_streq "$result" "ok"
+    if [ $i = 1 ]; then
+      # The libraries of echo are not known yet
+      assert_streq "$(strip_stderr stderr | grep -c 'before exec() with:')" "0"
+    else
+      assert_streq "$(strip_stderr stderr | grep -c 'before exec() with:')" "1"
+      assert_streq "$(strip_stderr stderr | grep 'Not shortcutting .* before exec()')" ""
+    fi
+  done
+}
+
+@test "matching inputs by their alternate hash" {
+  (cat ../etc/firebuild.conf; echo 'alt_hash_normalizers = { c_source = [".c"]; };') > test_alt_hash.conf
+  for i in 1 2; do
+    printf '/* version %s */\nint f() {\n  return 1;  /* one */\n}\n' $i > test_alt_hash.c
+    result=$(./run-firebuild -c test_alt_hash.conf -d shortcut -- gcc -c test_alt_hash.c -o test_alt_hash.o)
+    assert_streq "$result" ""
+    [ -f test_alt_hash.o ]
+    if [ $i = 2 ]; then
+      # Only the comment changed, the compilation is shortcut
+      strip_stderr stderr | grep -q "Shortcutting:"
+    fi
+  done
+  # The code changed, too
+  printf 'int f() {\n  return 2;\n}\n' > test_alt_hash.c
+  result=$(./run-firebuild -c test_alt_hash.conf -d shortcut -- gcc -c test_alt_hash.c -o test_alt_hash.o)
+  assert_streq "$result" ""
+  assert_streq "$(strip_stderr stderr | grep 'Shortcutting:')" ""
+  rm -f test_alt_hash.conf test_alt_hash.c test_alt_hash.o
+}
+
+@test "base_dir" {
+  rm -rf test_base_dir_a test_base_dir_b
+  mkdir test_base_dir_a test_base_dir_b
+  echo foo > test_base_dir_a/input.txt
+  echo foo > test_base_dir_b/input.txt
+  for dir in test_base_dir_a test_base_dir_b; do
+    result=$(./run-firebuild -o "base_dir = \"$PWD/$dir\"" -d shortcut -C $dir -- bash -c "cat input.txt; cat input.txt > output.txt")
+    assert_streq "$result" "foo"
+    assert_streq "$(cat $dir/output.txt)" "foo"
+    if [ $dir = test_base_dir_b ]; then
+      # The entry stored in the other checkout is used
+      strip_stderr stderr | grep -q "Shortcutting:"
+    fi
+  done
+  # The outputs referring to the checkout directory are not stored
+  for dir in test_base_dir_a test_base_dir_b; do
+    result=$(./run-firebuild -o "base_dir = \"$PWD/$dir\"" -d caching -C $dir -- bash -c "pwd")
+    assert_streq "$result" "$PWD/$dir"
+    strip_stderr stderr | grep -q "refers to base_dir"
+  done
+  rm -rf test_base_dir_a test_base_dir_b
+}
+
+@test "lazy outputs" {
+  for i in 1 2; do
+    rm -f test_lazy_1.txt test_lazy_2.txt
+    # cat is not shortcut, the output of the shortcut child shell has to be written before it starts
+    result=$(./run-firebuild -o 'lazy_outputs = true' -o 'processes.dont_shortcut += "cat"' -d shortcut -- bash -c "bash -c 'echo foo > test_lazy_1.txt; echo bar > test_lazy_2.txt'; cat test_lazy_1.txt")
+    assert_streq "$result" "foo"
+    # The outputs nobody read are written by the end of the build
+    assert_streq "$(cat test_lazy_2.txt)" "bar"
+    if [ $i = 2 ]; then
+      strip_stderr stderr | grep -q "Shortcutting:"
+    fi
+  done
+  rm -f test_lazy_1.txt test_lazy_2.txt
+}
+
+@test "parallel make lending jobserver tokens" {
+  for i in 1 2; do
+    make -s -f test_parallel_make.Makefile clean
+    result=$(./run-firebuild -o 'max_lent_jobserver_tokens = 4' -- make -s -j8 -f test_parallel_make.Makefile)
+    assert_streq "$result" "ok"
+    # All lent tokens are taken back, make does not warn about them
+    assert_streq "$(strip_stderr stderr | grep -i jobserver)" ""
+  done
+  make -s -f test_parallel_make.Makefile clean
+}